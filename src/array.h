@@ -10,6 +10,7 @@
 #endif
 
 #include "buffer.h"
+#include "ewma.h"
 
 #include <stdlib.h>
 
@@ -155,6 +156,8 @@ typedef struct {
 
 	int usage; /* fair-balancing needs the no. of connections active on this host */
 	int last_used_ndx; /* round robin */
+
+	ewma_t ewma; /* peak-ewma balancing */
 } data_fastcgi;
 
 data_fastcgi *data_fastcgi_init(void);
@@ -224,7 +224,10 @@ typedef struct {
 	int    dir_version;
 #endif
 
-	buffer *content_type;
+	buffer *content_type; /* not alloced: points into mimetype.assign or to xattr_content_type */
+#ifdef HAVE_XATTR
+	buffer *xattr_content_type;
+#endif
 } stat_cache_entry;
 
 typedef struct {
@@ -238,10 +241,21 @@ typedef struct {
 	int    fam_fcce_ndx;
 #endif
 	buffer *hash_key;  /* temp-store for the hash-key */
+	buffer *empty_content_type; /* content_type of entries without a mimetype, always empty */
 } stat_cache;
 
+/* suffix -> content-type lookup for mimetype.assign, built once per config context */
+typedef struct {
+	data_string **ptr; /* open addressing, size is a power of 2 */
+	size_t size;
+
+	size_t *key_lens;  /* distinct suffix lengths, longest first */
+	size_t key_lens_used;
+} mimetype_index;
+
 typedef struct {
 	array *mimetypes;
+	mimetype_index *mimetype_index;
 
 	/* virtual-servers */
 	buffer *document_root;
@@ -351,8 +365,32 @@ typedef struct {
 	buffer *comp_value; /* just a pointer */
 	
 	comp_key_t comp_type;
+
+	size_t stamp; /* cond_match.stamp when the result was set */
 } cond_cache_t;
 
+typedef struct {
+	size_t *slot;           /* indexed by context_ndx: position in ptr + 1, 0 if not true */
+	size_t size;
+
+	size_t *ptr;            /* the true conditions, unordered */
+	size_t used;
+
+	size_t *cand;           /* conditions the condition index found */
+	size_t cand_used;
+	size_t cand_size;
+
+	size_t *group_stamp;    /* stamp at which a group of the condition index was decided */
+	size_t groups;
+
+	size_t stamp;                    /* counts the resets */
+	size_t reset[COMP_LAST_ELEMENT]; /* stamp of the last reset of a component */
+
+	uint32_t hash;          /* over the true conditions, follows each change */
+	int key;                /* the key for the merged-config caches */
+	unsigned int dirty;     /* (1 << comp) of the components whose conditions might have changed */
+} cond_match_t;
+
 typedef struct {
 	connection_state_t state;
 
@@ -387,6 +425,12 @@ typedef struct {
 	int file_started;
 	int file_finished;
 
+	/* rewrites the response body before it is framed, see http_chunk.c
+	 * returns the output for mem (NULL: end of the body), NULL on error */
+	buffer *(* response_filter)(void *ctx, const char *mem, size_t len);
+	void *response_filter_ctx;
+	int response_filter_checked; /* handle_response_start was called for this response */
+
 	chunkqueue *write_queue;      /* a large queue for low-level write ( HTTP response ) [ file, mem ] */
 	chunkqueue *read_queue;       /* a small queue for low-level read ( HTTP request ) [ mem ] */
 	chunkqueue *request_content_queue; /* takes request-content into tempfile if necessary [ tempfile, mem ]*/
@@ -427,6 +471,7 @@ typedef struct {
 
 	specific_config conf;        /* global connection specific config */
 	cond_cache_t *cond_cache;
+	cond_match_t cond_match;
 
 	buffer *server_name;
 
@@ -597,6 +642,9 @@ typedef struct server {
 
 	array *split_vals;
 
+	array *cgi_header_keys; /* see http_cgi.c */
+	array *cgi_env_keys;
+
 	/* Timestamps */
 	time_t cur_ts;
 	time_t last_generated_date_ts;
@@ -616,6 +664,10 @@ typedef struct server {
 	array *config_context;
 	specific_config **config_storage;
 
+	struct config_cond_index *cond_index; /* equality conditions grouped by component */
+	splay_tree **config_patch_caches;     /* merged configs per set of true conditions, by plugin-id (0 is the core) */
+	size_t config_patch_caches_size;
+
 	server_config  srvconf;
 
 	short int config_deprecated;
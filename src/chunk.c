@@ -148,6 +148,7 @@ void chunkqueue_reset(chunkqueue *cq) {
 			c->offset = c->mem->used - 1;
 			break;
 		case FILE_CHUNK:
+		case PIPE_CHUNK:
 			c->offset = c->file.length;
 			break;
 		default:
@@ -179,6 +180,26 @@ int chunkqueue_append_file(chunkqueue *cq, buffer *fn, off_t offset, off_t len)
 	return 0;
 }
 
+/* len octets in the pipe, they are spliced to the socket */
+int chunkqueue_append_pipe(chunkqueue *cq, int fd, off_t len) {
+	chunk *c;
+
+	if (len == 0) return 0;
+
+	c = chunkqueue_get_unused_chunk(cq);
+
+	c->type = PIPE_CHUNK;
+
+	c->file.fd = fd;
+	c->file.start = 0;
+	c->file.length = len;
+	c->offset = 0;
+
+	chunkqueue_append_chunk(cq, c);
+
+	return 0;
+}
+
 int chunkqueue_append_buffer(chunkqueue *cq, buffer *mem) {
 	chunk *c;
 
@@ -330,6 +351,7 @@ off_t chunkqueue_length(chunkqueue *cq) {
 			len += c->mem->used ? c->mem->used - 1 : 0;
 			break;
 		case FILE_CHUNK:
+		case PIPE_CHUNK:
 			len += c->file.length;
 			break;
 		default:
@@ -348,6 +370,7 @@ off_t chunkqueue_written(chunkqueue *cq) {
 		switch (c->type) {
 		case MEM_CHUNK:
 		case FILE_CHUNK:
+		case PIPE_CHUNK:
 			len += c->offset;
 			break;
 		default:
@@ -373,6 +396,7 @@ int chunkqueue_remove_finished_chunks(chunkqueue *cq) {
 			if (c->mem->used == 0 || (c->offset == (off_t)c->mem->used - 1)) is_finished = 1;
 			break;
 		case FILE_CHUNK:
+		case PIPE_CHUNK:
 			if (c->offset == c->file.length) is_finished = 1;
 			break;
 		default:
@@ -6,7 +6,7 @@
 #include "sys-mmap.h"
 
 typedef struct chunk {
-	enum { UNUSED_CHUNK, MEM_CHUNK, FILE_CHUNK } type;
+	enum { UNUSED_CHUNK, MEM_CHUNK, FILE_CHUNK, PIPE_CHUNK } type;
 
 	buffer *mem; /* either the storage of the mem-chunk or the read-ahead buffer */
 
@@ -24,7 +24,7 @@ typedef struct chunk {
 		} mmap;
 
 		int is_temp; /* file is temporary and will be deleted if on cleanup */
-	} file;
+	} file; /* a pipe-chunk uses fd (the read end) and length */
 
 	off_t  offset; /* octets sent from this chunk
 			  the size of the chunk is either
@@ -52,6 +52,7 @@ int chunkqueue_set_tempdirs(chunkqueue *c, array *tempdirs);
 int chunkqueue_append_file(chunkqueue *c, buffer *fn, off_t offset, off_t len);
 int chunkqueue_append_mem(chunkqueue *c, const char *mem, size_t len);
 int chunkqueue_append_buffer(chunkqueue *c, buffer *mem);
+int chunkqueue_append_pipe(chunkqueue *c, int fd, off_t len); /* takes over fd */
 int chunkqueue_append_buffer_weak(chunkqueue *c, buffer *mem);
 int chunkqueue_prepend_buffer(chunkqueue *c, buffer *mem);
 
@@ -0,0 +1,261 @@
+#include "base.h"
+#include "collapse.h"
+#include "array.h"
+#include "crc32.h"
+#include "http_chunk.h"
+#include "joblist.h"
+#include "response.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+/*
+ * request collapsing
+ *
+ * the first request for a method + host + uri becomes the leader of a
+ * group and goes to the backend. requests for the same key which come in
+ * while it runs wait in the group as followers. when the leader has the
+ * complete response it is copied to every follower; if the leader fails,
+ * the response can't be shared or the group runs longer than its timeout
+ * the followers send their own requests.
+ *
+ * a group is only reachable from the index while it is running, it is
+ * freed when the leader and all followers left it.
+ */
+
+collapse_table *collapse_init(void) {
+	return calloc(1, sizeof(collapse_table));
+}
+
+static void collapse_group_free(collapse_group *g) {
+	buffer_free(g->key);
+	array_free(g->headers);
+	buffer_free(g->body);
+	free(g->followers);
+
+	free(g);
+}
+
+void collapse_free(collapse_table *t) {
+	if (!t) return;
+
+	while (t->first) {
+		collapse_group *g = t->first;
+
+		t->first = g->next;
+		t->index = splaytree_delete(t->index, g->hash);
+
+		collapse_group_free(g);
+	}
+
+	free(t);
+}
+
+int collapse_key(connection *con, buffer *key) {
+	if (con->request.http_method != HTTP_METHOD_GET &&
+	    con->request.http_method != HTTP_METHOD_HEAD) return -1;
+
+	/* the response might depend on who asks */
+	if (NULL != array_get_element(con->request.headers, "Authorization") ||
+	    NULL != array_get_element(con->request.headers, "Cookie") ||
+	    NULL != array_get_element(con->request.headers, "Range")) return -1;
+
+	buffer_copy_string(key, get_http_method_name(con->request.http_method));
+	buffer_append_string_len(key, CONST_STR_LEN(" "));
+	buffer_append_string_buffer(key, con->uri.authority);
+	buffer_append_string_buffer(key, con->request.uri);
+
+	return 0;
+}
+
+/* no new requests join */
+static void collapse_unindex(collapse_table *t, collapse_group *g) {
+	if (!g->indexed) return;
+
+	t->index = splaytree_splay(t->index, g->hash);
+	if (t->index && t->index->key == g->hash && t->index->data == g) {
+		t->index = splaytree_delete(t->index, g->hash);
+	}
+
+	if (g->prev) g->prev->next = g->next; else t->first = g->next;
+	if (g->next) g->next->prev = g->prev;
+	g->prev = g->next = NULL;
+
+	g->indexed = 0;
+}
+
+static void collapse_wakeup(server *srv, collapse_group *g) {
+	size_t i;
+
+	for (i = 0; i < g->used; i++) {
+		joblist_append(srv, g->followers[i]);
+	}
+}
+
+static void collapse_fail(server *srv, collapse_table *t, collapse_group *g) {
+	collapse_unindex(t, g);
+
+	if (g->state != COLLAPSE_RUNNING) return;
+
+	g->state = COLLAPSE_FAILED;
+	collapse_wakeup(srv, g);
+}
+
+collapse_group *collapse_join(server *srv, collapse_table *t, connection *con, buffer *key, time_t timeout, int *leader) {
+	collapse_group *g;
+	int hash = generate_crc32c(CONST_BUF_LEN(key));
+
+	t->index = splaytree_splay(t->index, hash);
+
+	if (t->index && t->index->key == hash) {
+		g = t->index->data;
+
+		/* another key with the same hash, go alone */
+		if (!buffer_is_equal(g->key, key)) return NULL;
+
+		if (g->used == g->size_followers) {
+			g->size_followers += 16;
+			g->followers = realloc(g->followers, g->size_followers * sizeof(*g->followers));
+		}
+		g->followers[g->used++] = con;
+		g->refs++;
+
+		*leader = 0;
+
+		return g;
+	}
+
+	g = calloc(1, sizeof(*g));
+	g->key = buffer_init_buffer(key);
+	g->hash = hash;
+	g->state = COLLAPSE_RUNNING;
+	g->started = srv->cur_ts;
+	g->timeout = timeout;
+	g->headers = array_init();
+	g->body = buffer_init();
+	g->refs = 1;
+	g->indexed = 1;
+
+	t->index = splaytree_insert(t->index, hash, g);
+
+	g->next = t->first;
+	if (t->first) t->first->prev = g;
+	t->first = g;
+
+	*leader = 1;
+
+	return g;
+}
+
+void collapse_append(collapse_group *g, const char *s, size_t len) {
+	if (g->state != COLLAPSE_RUNNING || g->size < 0) return;
+
+	if (g->size + (off_t)len > COLLAPSE_MAX_SIZE) {
+		/* too large, collapse_done() fails the group */
+		g->size = -1;
+		buffer_reset(g->body);
+		return;
+	}
+
+	buffer_append_string_len(g->body, s, len);
+	g->size += len;
+}
+
+void collapse_done(server *srv, collapse_table *t, collapse_group *g, connection *con) {
+	data_string *ds;
+	size_t i;
+	int status = con->http_status ? con->http_status : 200; /* as the core sends it */
+
+	if (g->state != COLLAPSE_RUNNING) return;
+
+	/* private responses, errors which might go away and too large ones */
+	if (g->size < 0 || status >= 500 || status < 200 ||
+	    NULL != array_get_element(con->response.headers, "Set-Cookie") ||
+	    NULL != array_get_element(con->response.headers, "Vary")) {
+		collapse_fail(srv, t, g);
+		return;
+	}
+
+	if (NULL != (ds = (data_string *)array_get_element(con->response.headers, "Cache-Control")) &&
+	    (strstr(ds->value->ptr, "private") || strstr(ds->value->ptr, "no-store"))) {
+		collapse_fail(srv, t, g);
+		return;
+	}
+
+	collapse_unindex(t, g);
+
+	g->status = status;
+
+	for (i = 0; i < con->response.headers->used; i++) {
+		data_string *dh = (data_string *)con->response.headers->data[i];
+
+		if (buffer_is_empty(dh->value)) continue;
+
+		/* the core sets them for every connection, a HEAD keeps the length of the backend */
+		if ((con->request.http_method != HTTP_METHOD_HEAD &&
+		     buffer_is_equal_string(dh->key, CONST_STR_LEN("Content-Length"))) ||
+		    buffer_is_equal_string(dh->key, CONST_STR_LEN("Transfer-Encoding")) ||
+		    buffer_is_equal_string(dh->key, CONST_STR_LEN("Connection")) ||
+		    buffer_is_equal_string(dh->key, CONST_STR_LEN("Date"))) continue;
+
+		array_insert_unique(g->headers, dh->copy((data_unset *)dh));
+	}
+
+	g->state = COLLAPSE_DONE;
+	collapse_wakeup(srv, g);
+}
+
+void collapse_leave(server *srv, collapse_table *t, collapse_group *g, connection *con) {
+	size_t i;
+
+	for (i = 0; i < g->used && g->followers[i] != con; i++);
+
+	if (i < g->used) {
+		g->followers[i] = g->followers[--g->used];
+	} else {
+		/* the leader, the followers can't wait for it any longer */
+		collapse_fail(srv, t, g);
+	}
+
+	if (--g->refs > 0) return;
+
+	collapse_unindex(t, g);
+	collapse_group_free(g);
+}
+
+void collapse_serve(server *srv, connection *con, collapse_group *g) {
+	size_t i;
+
+	for (i = 0; i < g->headers->used; i++) {
+		data_string *ds = (data_string *)g->headers->data[i];
+
+		response_header_insert(srv, con, CONST_BUF_LEN(ds->key), CONST_BUF_LEN(ds->value));
+	}
+
+	con->http_status = g->status;
+
+	if (con->request.http_method != HTTP_METHOD_HEAD) {
+		char buf[32];
+
+		LI_ltostr(buf, g->size);
+		response_header_overwrite(srv, con, CONST_STR_LEN("Content-Length"), buf, strlen(buf));
+		con->parsed_response |= HTTP_CONTENT_LENGTH;
+		con->response.content_length = g->size;
+
+		if (g->size) http_chunk_append_mem(srv, con, g->body->ptr, g->size + 1);
+	}
+
+	con->file_started = 1;
+	con->file_finished = 1;
+}
+
+void collapse_timeout(server *srv, collapse_table *t) {
+	collapse_group *g, *next;
+
+	for (g = t->first; g; g = next) {
+		next = g->next;
+
+		if (srv->cur_ts - g->started >= g->timeout) collapse_fail(srv, t, g);
+	}
+}
@@ -0,0 +1,70 @@
+#ifndef _COLLAPSE_H_
+#define _COLLAPSE_H_
+
+#include "base.h"
+#include "splaytree.h"
+
+/* larger responses are not shared, the followers ask the backend themselves */
+#define COLLAPSE_MAX_SIZE (1024 * 1024)
+
+typedef enum {
+	COLLAPSE_RUNNING, /* the leader waits for the backend */
+	COLLAPSE_DONE,    /* the response is in the group */
+	COLLAPSE_FAILED   /* the followers have to send their own requests */
+} collapse_state_t;
+
+/* the requests for one method + host + uri while the first one (the leader) runs */
+typedef struct collapse_group {
+	buffer *key;
+	int hash;
+
+	collapse_state_t state;
+	time_t started;
+	time_t timeout;
+
+	int status;
+	array *headers;
+	buffer *body;
+	off_t size;
+
+	connection **followers; /* woken up when the state changes */
+	size_t used;
+	size_t size_followers;
+
+	int refs;    /* the leader and the followers */
+	int indexed; /* new requests can still join */
+
+	struct collapse_group *prev, *next;
+} collapse_group;
+
+typedef struct {
+	splay_tree *index; /* hash of the key -> running group */
+	collapse_group *first;
+} collapse_table;
+
+collapse_table *collapse_init(void);
+void collapse_free(collapse_table *t);
+
+/* method + host + uri, -1 if the request can't be shared (body, credentials) */
+int collapse_key(connection *con, buffer *key);
+
+/* the running group of key, *leader is set if con starts it,
+ * NULL if the slot is taken by another key */
+collapse_group *collapse_join(server *srv, collapse_table *t, connection *con, buffer *key, time_t timeout, int *leader);
+
+/* the leader got a part of the body */
+void collapse_append(collapse_group *g, const char *s, size_t len);
+
+/* the leader has the complete response in con */
+void collapse_done(server *srv, collapse_table *t, collapse_group *g, connection *con);
+
+/* the leader or a follower is finished with the group */
+void collapse_leave(server *srv, collapse_table *t, collapse_group *g, connection *con);
+
+/* copy the response of the group to a follower */
+void collapse_serve(server *srv, connection *con, collapse_group *g);
+
+/* fail the groups which ran longer than their timeout */
+void collapse_timeout(server *srv, collapse_table *t);
+
+#endif
@@ -50,6 +50,14 @@
 #cmakedefine  HAVE_BZLIB_H
 #cmakedefine  HAVE_LIBBZ2
 
+/* Brotli */
+#cmakedefine  HAVE_BROTLI_ENCODE_H
+#cmakedefine  HAVE_LIBBROTLIENC
+
+/* Zstandard */
+#cmakedefine  HAVE_ZSTD_H
+#cmakedefine  HAVE_LIBZSTD
+
 /* FAM */
 #cmakedefine  HAVE_FAM_H
 #cmakedefine  HAVE_FAMNOEXISTS
@@ -135,6 +143,8 @@
 #cmakedefine  HAVE_PRCTL
 #cmakedefine  HAVE_PREAD
 #cmakedefine  HAVE_POSIX_FADVISE
+#cmakedefine  HAVE_POSIX_SPAWN
+#cmakedefine  HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
 #cmakedefine  HAVE_SELECT
 #cmakedefine  HAVE_SENDFILE
 #cmakedefine  HAVE_SEND_FILE
@@ -143,6 +153,7 @@
 #cmakedefine  HAVE_SIGACTION
 #cmakedefine  HAVE_SIGNAL
 #cmakedefine  HAVE_SIGTIMEDWAIT
+#cmakedefine  HAVE_SPLICE
 #cmakedefine  HAVE_STRPTIME
 #cmakedefine  HAVE_SYSLOG
 #cmakedefine  HAVE_WRITEV
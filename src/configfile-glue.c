@@ -8,6 +8,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <assert.h>
 
 /**
  * like all glue code this file contains functions which
@@ -218,11 +219,134 @@ static unsigned short sock_addr_get_port(sock_addr *addr) {
 #endif
 }
 
+/**
+ * get the value of a component the conditions compare against
+ *
+ * for COMP_HTTP_HOST the port is appended (with_port = 1) or stripped
+ * (with_port = 0) to match the form of the condition, -1 leaves it as is
+ *
+ * returns NULL if the component is unknown
+ */
+static buffer *config_cond_get_value(server *srv, connection *con, comp_key_t comp, int with_port) {
+	buffer *l;
+	server_socket *srv_sock = con->srv_socket;
+
+	switch (comp) {
+	case COMP_HTTP_HOST: {
+		char *val_colon = NULL;
+
+		if (!buffer_is_empty(con->uri.authority)) {
+
+			/*
+			 * append server-port to the HTTP_POST if necessary
+			 */
+
+			l = con->uri.authority;
+
+			if (-1 != with_port) {
+				val_colon = strchr(l->ptr, ':');
+
+				if (with_port && NULL == val_colon) {
+					/* condition "host:port" but client send "host" */
+					buffer_copy_string_buffer(srv->cond_check_buf, l);
+					buffer_append_string_len(srv->cond_check_buf, CONST_STR_LEN(":"));
+					buffer_append_long(srv->cond_check_buf, sock_addr_get_port(&(srv_sock->addr)));
+					l = srv->cond_check_buf;
+				} else if (NULL != val_colon && !with_port) {
+					/* condition "host" but client send "host:port" */
+					buffer_copy_string_len(srv->cond_check_buf, l->ptr, val_colon - l->ptr);
+					l = srv->cond_check_buf;
+				}
+			}
+#if defined USE_OPENSSL && ! defined OPENSSL_NO_TLSEXT
+		} else if (!buffer_is_empty(con->tlsext_server_name)) {
+			l = con->tlsext_server_name;
+#endif
+		} else {
+			l = srv->empty_string;
+		}
+		break;
+	}
+	case COMP_HTTP_REMOTE_IP:
+		l = con->dst_addr_buf;
+		break;
+
+	case COMP_HTTP_SCHEME:
+		l = con->uri.scheme;
+		break;
+
+	case COMP_HTTP_URL:
+		l = con->uri.path;
+		break;
+
+	case COMP_HTTP_QUERY_STRING:
+		l = con->uri.query;
+		break;
+
+	case COMP_SERVER_SOCKET:
+		l = srv_sock->srv_token;
+		break;
+
+	case COMP_HTTP_REFERER: {
+		data_string *ds;
+
+		if (NULL != (ds = (data_string *)array_get_element(con->request.headers, "Referer"))) {
+			l = ds->value;
+		} else {
+			l = srv->empty_string;
+		}
+		break;
+	}
+	case COMP_HTTP_COOKIE: {
+		data_string *ds;
+		if (NULL != (ds = (data_string *)array_get_element(con->request.headers, "Cookie"))) {
+			l = ds->value;
+		} else {
+			l = srv->empty_string;
+		}
+		break;
+	}
+	case COMP_HTTP_USER_AGENT: {
+		data_string *ds;
+		if (NULL != (ds = (data_string *)array_get_element(con->request.headers, "User-Agent"))) {
+			l = ds->value;
+		} else {
+			l = srv->empty_string;
+		}
+		break;
+	}
+	case COMP_HTTP_REQUEST_METHOD: {
+		const char *method = get_http_method_name(con->request.http_method);
+
+		/* we only have the request method as const char but we need a buffer for comparing */
+
+		buffer_copy_string(srv->tmp_buf, method);
+
+		l = srv->tmp_buf;
+
+		break;
+	}
+	case COMP_HTTP_LANGUAGE: {
+		data_string *ds;
+		if (NULL != (ds = (data_string *)array_get_element(con->request.headers, "Accept-Language"))) {
+			l = ds->value;
+		} else {
+			l = srv->empty_string;
+		}
+		break;
+	}
+	default:
+		l = NULL;
+		break;
+	}
+
+	return l;
+}
+
 static cond_result_t config_check_cond_cached(server *srv, connection *con, data_config *dc);
 
 static cond_result_t config_check_cond_nocache(server *srv, connection *con, data_config *dc) {
 	buffer *l;
-	server_socket *srv_sock = con->srv_socket;
 
 	/* check parent first */
 	if (dc->parent && dc->parent->context_ndx) {
@@ -246,6 +370,8 @@ static cond_result_t config_check_cond_nocache(server *srv, connection *con, dat
 	}
 
 	if (dc->prev) {
+		data_config *c;
+
 		/**
 		 * a else branch
 		 *
@@ -266,6 +392,11 @@ static cond_result_t config_check_cond_nocache(server *srv, connection *con, dat
 		default:
 			break;
 		}
+
+		/* a true one which kept its cached result didn't set me */
+		for (c = dc->prev; c; c = c->prev) {
+			if (con->cond_cache[c->context_ndx].result == COND_RESULT_TRUE) return COND_RESULT_FALSE;
+		}
 	}
 
 	if (!con->conditional_is_valid[dc->comp]) {
@@ -282,47 +413,17 @@ static cond_result_t config_check_cond_nocache(server *srv, connection *con, dat
 	/* pass the rules */
 
 	switch (dc->comp) {
-	case COMP_HTTP_HOST: {
-		char *ck_colon = NULL, *val_colon = NULL;
-
-		if (!buffer_is_empty(con->uri.authority)) {
-
-			/*
-			 * append server-port to the HTTP_POST if necessary
-			 */
-
-			l = con->uri.authority;
-
-			switch(dc->cond) {
-			case CONFIG_COND_NE:
-			case CONFIG_COND_EQ:
-				ck_colon = strchr(dc->string->ptr, ':');
-				val_colon = strchr(l->ptr, ':');
-
-				if (NULL != ck_colon && NULL == val_colon) {
-					/* condition "host:port" but client send "host" */
-					buffer_copy_string_buffer(srv->cond_check_buf, l);
-					buffer_append_string_len(srv->cond_check_buf, CONST_STR_LEN(":"));
-					buffer_append_long(srv->cond_check_buf, sock_addr_get_port(&(srv_sock->addr)));
-					l = srv->cond_check_buf;
-				} else if (NULL != val_colon && NULL == ck_colon) {
-					/* condition "host" but client send "host:port" */
-					buffer_copy_string_len(srv->cond_check_buf, l->ptr, val_colon - l->ptr);
-					l = srv->cond_check_buf;
-				}
-				break;
-			default:
-				break;
-			}
-#if defined USE_OPENSSL && ! defined OPENSSL_NO_TLSEXT
-		} else if (!buffer_is_empty(con->tlsext_server_name)) {
-			l = con->tlsext_server_name;
-#endif
-		} else {
-			l = srv->empty_string;
+	case COMP_HTTP_HOST:
+		switch(dc->cond) {
+		case CONFIG_COND_NE:
+		case CONFIG_COND_EQ:
+			l = config_cond_get_value(srv, con, dc->comp, NULL != strchr(dc->string->ptr, ':'));
+			break;
+		default:
+			l = config_cond_get_value(srv, con, dc->comp, -1);
+			break;
 		}
 		break;
-	}
 	case COMP_HTTP_REMOTE_IP: {
 		char *nm_slash;
 		/* handle remoteip limitations
@@ -387,72 +488,9 @@ static cond_result_t config_check_cond_nocache(server *srv, connection *con, dat
 		}
 		break;
 	}
-	case COMP_HTTP_SCHEME:
-		l = con->uri.scheme;
-		break;
-
-	case COMP_HTTP_URL:
-		l = con->uri.path;
-		break;
-
-	case COMP_HTTP_QUERY_STRING:
-		l = con->uri.query;
-		break;
-
-	case COMP_SERVER_SOCKET:
-		l = srv_sock->srv_token;
-		break;
-
-	case COMP_HTTP_REFERER: {
-		data_string *ds;
-
-		if (NULL != (ds = (data_string *)array_get_element(con->request.headers, "Referer"))) {
-			l = ds->value;
-		} else {
-			l = srv->empty_string;
-		}
-		break;
-	}
-	case COMP_HTTP_COOKIE: {
-		data_string *ds;
-		if (NULL != (ds = (data_string *)array_get_element(con->request.headers, "Cookie"))) {
-			l = ds->value;
-		} else {
-			l = srv->empty_string;
-		}
-		break;
-	}
-	case COMP_HTTP_USER_AGENT: {
-		data_string *ds;
-		if (NULL != (ds = (data_string *)array_get_element(con->request.headers, "User-Agent"))) {
-			l = ds->value;
-		} else {
-			l = srv->empty_string;
-		}
-		break;
-	}
-	case COMP_HTTP_REQUEST_METHOD: {
-		const char *method = get_http_method_name(con->request.http_method);
-
-		/* we only have the request method as const char but we need a buffer for comparing */
-
-		buffer_copy_string(srv->tmp_buf, method);
-
-		l = srv->tmp_buf;
-
-		break;
-	}
-	case COMP_HTTP_LANGUAGE: {
-		data_string *ds;
-		if (NULL != (ds = (data_string *)array_get_element(con->request.headers, "Accept-Language"))) {
-			l = ds->value;
-		} else {
-			l = srv->empty_string;
-		}
-		break;
-	}
 	default:
-		return COND_RESULT_FALSE;
+		l = config_cond_get_value(srv, con, dc->comp, -1);
+		break;
 	}
 
 	if (NULL == l) {
@@ -508,19 +546,39 @@ static cond_result_t config_check_cond_nocache(server *srv, connection *con, dat
 	return COND_RESULT_FALSE;
 }
 
+static int config_cond_cache_is_current(server *srv, connection *con, size_t ndx);
+static int config_cond_index_decided(server *srv, connection *con, size_t ndx);
+
+
+static void config_cond_cache_set(connection *con, size_t ndx, cond_result_t result) {
+	cond_cache_t *cache = &con->cond_cache[ndx];
+
+	cache->result = result;
+	cache->patterncount = 0;
+	cache->comp_value = NULL;
+	cache->stamp = con->cond_match.stamp;
+}
+
 static cond_result_t config_check_cond_cached(server *srv, connection *con, data_config *dc) {
 	cond_cache_t *caches = con->cond_cache;
 
-	if (COND_RESULT_UNSET == caches[dc->context_ndx].result) {
-		if (COND_RESULT_TRUE == (caches[dc->context_ndx].result = config_check_cond_nocache(srv, con, dc))) {
-			if (dc->next) {
-				data_config *c;
-				if (con->conf.log_condition_handling) {
-					log_error_write(srv, __FILE__, __LINE__, "s",
-							"setting remains of chaining to false");
-				}
-				for (c = dc->next; c; c = c->next) {
-					caches[c->context_ndx].result = COND_RESULT_FALSE;
+	if (!config_cond_cache_is_current(srv, con, dc->context_ndx)) {
+		if (config_cond_index_decided(srv, con, dc->context_ndx)) {
+			/* the index set the ones it found, this one wasn't */
+			config_cond_cache_set(con, dc->context_ndx, COND_RESULT_FALSE);
+		} else {
+			config_cond_cache_set(con, dc->context_ndx, COND_RESULT_UNSET);
+
+			if (COND_RESULT_TRUE == (caches[dc->context_ndx].result = config_check_cond_nocache(srv, con, dc))) {
+				if (dc->next) {
+					data_config *c;
+					if (con->conf.log_condition_handling) {
+						log_error_write(srv, __FILE__, __LINE__, "s",
+								"setting remains of chaining to false");
+					}
+					for (c = dc->next; c; c = c->next) {
+						config_cond_cache_set(con, c->context_ndx, COND_RESULT_FALSE);
+					}
 				}
 			}
 		}
@@ -547,18 +605,23 @@ static cond_result_t config_check_cond_cached(server *srv, connection *con, data
  * reset the config-cache for a named item
  *
  * if the item is COND_LAST_ELEMENT we reset all items
+ *
+ * the results aren't touched, a result older than the last reset of one
+ * of the components it depends on is out of date.
  */
 void config_cond_cache_reset_item(server *srv, connection *con, comp_key_t item) {
+	cond_match_t *cm = &con->cond_match;
 	size_t i;
 
-	for (i = 0; i < srv->config_context->used; i++) {
-		if (item == COMP_LAST_ELEMENT || 
-		    con->cond_cache[i].comp_type == item) {
-			con->cond_cache[i].result = COND_RESULT_UNSET;
-			con->cond_cache[i].patterncount = 0;
-			con->cond_cache[i].comp_value = NULL;
-		}
+	UNUSED(srv);
+
+	cm->stamp++;
+
+	for (i = 0; i < COMP_LAST_ELEMENT; i++) {
+		if (item == COMP_LAST_ELEMENT || item == i) cm->reset[i] = cm->stamp;
 	}
+
+	cm->dirty |= (item == COMP_LAST_ELEMENT) ? ~0U : 1U << item;
 }
 
 /**
@@ -574,6 +637,32 @@ void config_cond_cache_reset(server *srv, connection *con) {
 	}
 }
 
+/**
+ * reset the components a new request brings along
+ *
+ * the server socket stays, the remote address is reset by
+ * mod_extforward itself if it changes it
+ */
+void config_cond_cache_reset_request(server *srv, connection *con) {
+	static const comp_key_t comps[] = {
+		COMP_HTTP_URL,
+		COMP_HTTP_HOST,
+		COMP_HTTP_REFERER,
+		COMP_HTTP_USER_AGENT,
+		COMP_HTTP_LANGUAGE,
+		COMP_HTTP_COOKIE,
+		COMP_HTTP_QUERY_STRING,
+		COMP_HTTP_SCHEME,
+		COMP_HTTP_REQUEST_METHOD
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(comps) / sizeof(comps[0]); i++) {
+		config_cond_cache_reset_item(srv, con, comps[i]);
+		con->conditional_is_valid[comps[i]] = 0;
+	}
+}
+
 int config_check_cond(server *srv, connection *con, data_config *dc) {
 	if (con->conf.log_condition_handling) {
 		log_error_write(srv, __FILE__, __LINE__,  "s",  "=== start of condition block ===");
@@ -595,3 +684,681 @@ int config_append_cond_match_buffer(connection *con, data_config *dc, buffer *bu
 	return 1;
 }
 
+
+/**
+ * condition index
+ *
+ * top-level equality conditions on the same component, like a few
+ * thousand $HTTP["host"] == "..." blocks, are collected into a group at
+ * startup. Instead of comparing them one by one the value of the
+ * component is hashed once, the matching conditions are set to true and
+ * the rest of the group to false.
+ *
+ * host regexes which only match a literal name or a domain
+ *
+ *   $HTTP["host"] =~ "^www\.example\.org$"
+ *   $HTTP["host"] =~ "\.example\.org$"
+ *   $HTTP["host"] =~ "(^|\.)example\.org$"
+ *
+ * are grouped the same way: the host and each of its parent domains are
+ * looked up, only the conditions found are run through pcre (to get the
+ * captures), the rest of the group is false.
+ *
+ * conditions in an else-chain or nested conditions are not indexed and
+ * are checked one by one as before.
+ */
+
+typedef enum {
+	COND_INDEX_EQ,           /* == "name" */
+	COND_INDEX_REGEX_NAME,   /* =~ "^name$" */
+	COND_INDEX_REGEX_SUFFIX, /* =~ "\.name$" */
+	COND_INDEX_REGEX_DOMAIN  /* =~ "(^|\.)name$" */
+} cond_index_type_t;
+
+typedef struct {
+	data_config *dc;
+	buffer *key;        /* dc->string for COND_INDEX_EQ, the literal name for regexes */
+	cond_index_type_t type;
+} config_cond_entry;
+
+typedef struct {
+	comp_key_t comp;
+	int with_port;      /* COMP_HTTP_HOST: the conditions are "host:port", -1 for regexes */
+	int is_regex;
+
+	config_cond_entry *ptr;  /* open addressing over the hash of the key */
+	size_t size;
+
+	size_t *members;    /* context_ndx of all conditions in the group */
+	size_t used;
+} config_cond_group;
+
+struct config_cond_index {
+	config_cond_group **ptr;
+	size_t used;
+	size_t size;
+
+	/* per component the conditions outside of the groups and below them
+	 * whose result depends on it, ascending */
+	size_t *deps[COMP_LAST_ELEMENT];
+	size_t deps_used[COMP_LAST_ELEMENT];
+
+	/* per context_ndx */
+	unsigned int *mask; /* (1 << comp) of the components the result depends on */
+	int *group;         /* the group of a condition in the index, -1 otherwise */
+	size_t **sub;       /* the conditions nested in a condition of a group */
+	size_t *sub_used;
+};
+
+/* the result is set and none of the components it depends on was reset since */
+static int config_cond_cache_is_current(server *srv, connection *con, size_t ndx) {
+	struct config_cond_index *ci = srv->cond_index;
+	cond_match_t *cm = &con->cond_match;
+	cond_cache_t *cache = &con->cond_cache[ndx];
+	unsigned int mask = ci ? ci->mask[ndx] : ~0U;
+	size_t i;
+
+	if (COND_RESULT_UNSET == cache->result) return 0;
+
+	for (i = 0; i < COMP_LAST_ELEMENT; i++) {
+		if ((mask & (1U << i)) && cache->stamp < cm->reset[i]) return 0;
+	}
+
+	return 1;
+}
+
+/* the group of ndx was decided by the index after the last reset of its component */
+static int config_cond_index_decided(server *srv, connection *con, size_t ndx) {
+	struct config_cond_index *ci = srv->cond_index;
+	cond_match_t *cm = &con->cond_match;
+	int g;
+
+	if (!ci || -1 == (g = ci->group[ndx]) || (size_t)g >= cm->groups) return 0;
+
+	return 0 != cm->group_stamp[g] && cm->group_stamp[g] >= cm->reset[ci->ptr[g]->comp];
+}
+
+/* the famous DJB hash function for strings */
+static uint32_t config_cond_hash(const char *s, size_t len) {
+	uint32_t hash = 5381;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash = ((hash << 5) + hash) + (unsigned char)s[i];
+	}
+
+	return hash;
+}
+
+/* extract the name from the host regexes listed above */
+static int config_cond_regex_name(const char *s, buffer *name, cond_index_type_t *type) {
+	if (0 == strncmp(s, CONST_STR_LEN("(^|\\.)"))) {
+		*type = COND_INDEX_REGEX_DOMAIN;
+		s += sizeof("(^|\\.)") - 1;
+	} else if (0 == strncmp(s, CONST_STR_LEN("(?:^|\\.)"))) {
+		*type = COND_INDEX_REGEX_DOMAIN;
+		s += sizeof("(?:^|\\.)") - 1;
+	} else if (0 == strncmp(s, CONST_STR_LEN("\\."))) {
+		*type = COND_INDEX_REGEX_SUFFIX;
+		s += sizeof("\\.") - 1;
+	} else if (*s == '^') {
+		*type = COND_INDEX_REGEX_NAME;
+		s++;
+	} else {
+		return 0;
+	}
+
+	buffer_reset(name);
+
+	for (; *s && *s != '$'; s++) {
+		if (s[0] == '\\' && s[1] == '.') {
+			buffer_append_string_len(name, CONST_STR_LEN("."));
+			s++;
+		} else if (light_isalnum((unsigned char)*s) || *s == '-' || *s == '_') {
+			buffer_append_string_len(name, s, 1);
+		} else {
+			return 0;
+		}
+	}
+
+	/* the name has to be terminated by the final '$' */
+	if (s[0] != '$' || s[1] != '\0') return 0;
+
+	return !buffer_is_empty(name);
+}
+
+static int config_cond_is_indexable(data_config *dc) {
+	if (dc->cond != CONFIG_COND_EQ && dc->cond != CONFIG_COND_MATCH) return 0;
+	if (dc->comp == COMP_UNSET || dc->comp >= COMP_LAST_ELEMENT) return 0;
+	if (dc->parent && dc->parent->context_ndx) return 0;
+	if (dc->prev || dc->next) return 0;
+	if (buffer_is_empty(dc->string)) return 0;
+
+	if (dc->cond == CONFIG_COND_MATCH) return dc->comp == COMP_HTTP_HOST;
+
+	/* netmasks are no string compare */
+	if (dc->comp == COMP_HTTP_REMOTE_IP && NULL != strchr(dc->string->ptr, '/')) return 0;
+
+	return 1;
+}
+
+static config_cond_group *config_cond_index_get_group(struct config_cond_index *ci, comp_key_t comp, int with_port, int is_regex) {
+	config_cond_group *g;
+	size_t i;
+
+	for (i = 0; i < ci->used; i++) {
+		g = ci->ptr[i];
+
+		if (g->comp == comp && g->with_port == with_port && g->is_regex == is_regex) return g;
+	}
+
+	if (ci->size == ci->used) {
+		ci->size += 4;
+		ci->ptr = realloc(ci->ptr, ci->size * sizeof(*ci->ptr));
+		assert(ci->ptr);
+	}
+
+	g = calloc(1, sizeof(*g));
+	assert(g);
+	g->comp = comp;
+	g->with_port = with_port;
+	g->is_regex = is_regex;
+
+	ci->ptr[ci->used++] = g;
+
+	return g;
+}
+
+static void config_cond_group_insert(config_cond_group *g, data_config *dc, buffer *key, cond_index_type_t type) {
+	size_t ndx;
+
+	for (ndx = config_cond_hash(key->ptr, key->used - 1) & (g->size - 1);
+	     g->ptr[ndx].dc;
+	     ndx = (ndx + 1) & (g->size - 1));
+
+	g->ptr[ndx].dc = dc;
+	g->ptr[ndx].key = key;
+	g->ptr[ndx].type = type;
+}
+
+void config_cond_index_init(server *srv) {
+	struct config_cond_index *ci;
+	buffer *name = buffer_init();
+	size_t i, j;
+
+	ci = calloc(1, sizeof(*ci));
+	assert(ci);
+
+	/* collect the members of each group */
+	for (i = 1; i < srv->config_context->used; i++) {
+		data_config *dc = (data_config *)srv->config_context->data[i];
+		config_cond_group *g;
+		cond_index_type_t type;
+
+		if (!config_cond_is_indexable(dc)) continue;
+
+		if (dc->cond == CONFIG_COND_MATCH) {
+			if (!config_cond_regex_name(dc->string->ptr, name, &type)) continue;
+
+			g = config_cond_index_get_group(ci, dc->comp, -1, 1);
+		} else {
+			g = config_cond_index_get_group(ci, dc->comp,
+				dc->comp == COMP_HTTP_HOST && NULL != strchr(dc->string->ptr, ':'), 0);
+		}
+
+		g->members = realloc(g->members, (g->used + 1) * sizeof(*g->members));
+		assert(g->members);
+		g->members[g->used++] = i;
+	}
+
+	ci->group = malloc(srv->config_context->used * sizeof(*ci->group));
+	assert(ci->group);
+
+	for (i = 0; i < srv->config_context->used; i++) ci->group[i] = -1;
+
+	for (i = 0; i < ci->used; i++) {
+		for (j = 0; j < ci->ptr[i]->used; j++) ci->group[ci->ptr[i]->members[j]] = i;
+	}
+
+	/* build the hash-tables */
+	for (i = 0; i < ci->used; i++) {
+		config_cond_group *g = ci->ptr[i];
+
+		for (g->size = 16; g->size < 2 * g->used; g->size <<= 1);
+
+		g->ptr = calloc(g->size, sizeof(*g->ptr));
+		assert(g->ptr);
+
+		for (j = 0; j < g->used; j++) {
+			data_config *dc = (data_config *)srv->config_context->data[g->members[j]];
+
+			if (g->is_regex) {
+				buffer *key = buffer_init();
+				cond_index_type_t type;
+
+				config_cond_regex_name(dc->string->ptr, key, &type);
+				config_cond_group_insert(g, dc, key, type);
+			} else {
+				config_cond_group_insert(g, dc, dc->string, COND_INDEX_EQ);
+			}
+		}
+	}
+
+	buffer_free(name);
+
+	/* a condition depends on its own component, the ones of its parents
+	 * and the ones of the else-branches in front of it; parents and
+	 * previous branches have a lower context_ndx */
+	ci->mask = calloc(srv->config_context->used, sizeof(*ci->mask));
+	ci->sub = calloc(srv->config_context->used, sizeof(*ci->sub));
+	ci->sub_used = calloc(srv->config_context->used, sizeof(*ci->sub_used));
+	assert(ci->mask && ci->sub && ci->sub_used);
+
+	for (i = 1; i < srv->config_context->used; i++) {
+		data_config *dc = (data_config *)srv->config_context->data[i];
+		data_config *top;
+
+		ci->mask[i] = 1U << dc->comp;
+		if (dc->parent && dc->parent->context_ndx) ci->mask[i] |= ci->mask[dc->parent->context_ndx];
+		if (dc->prev) ci->mask[i] |= ci->mask[dc->prev->context_ndx];
+
+		if (-1 != ci->group[i]) continue;
+
+		for (top = dc; top->parent && top->parent->context_ndx; top = top->parent);
+
+		if (-1 != ci->group[top->context_ndx]) {
+			/* only checked while the condition of the group is true */
+			size_t t = top->context_ndx;
+
+			ci->sub[t] = realloc(ci->sub[t], (ci->sub_used[t] + 1) * sizeof(*ci->sub[t]));
+			assert(ci->sub[t]);
+			ci->sub[t][ci->sub_used[t]++] = i;
+
+			continue;
+		}
+
+		for (j = 0; j < COMP_LAST_ELEMENT; j++) {
+			if (!(ci->mask[i] & (1U << j))) continue;
+
+			ci->deps[j] = realloc(ci->deps[j], (ci->deps_used[j] + 1) * sizeof(*ci->deps[j]));
+			assert(ci->deps[j]);
+			ci->deps[j][ci->deps_used[j]++] = i;
+		}
+	}
+
+	srv->cond_index = ci;
+}
+
+void config_cond_index_free(server *srv) {
+	struct config_cond_index *ci = srv->cond_index;
+	size_t i, j;
+
+	if (!ci) return;
+
+	for (i = 0; i < ci->used; i++) {
+		config_cond_group *g = ci->ptr[i];
+
+		if (g->is_regex) {
+			for (j = 0; j < g->size; j++) {
+				if (g->ptr[j].dc) buffer_free(g->ptr[j].key);
+			}
+		}
+
+		free(g->ptr);
+		free(g->members);
+		free(g);
+	}
+
+	for (i = 0; i < COMP_LAST_ELEMENT; i++) {
+		free(ci->deps[i]);
+	}
+
+	for (i = 0; i < srv->config_context->used; i++) {
+		free(ci->sub[i]);
+	}
+
+	free(ci->sub);
+	free(ci->sub_used);
+	free(ci->mask);
+	free(ci->group);
+
+	free(ci->ptr);
+	free(ci);
+
+	srv->cond_index = NULL;
+}
+
+/* look up the entries for the name s (of length len) and handle the ones accepted by types */
+static void config_cond_group_lookup(server *srv, connection *con, config_cond_group *g, const char *s, size_t len, int types) {
+	cond_match_t *cm = &con->cond_match;
+	size_t ndx;
+
+	for (ndx = config_cond_hash(s, len) & (g->size - 1);
+	     g->ptr[ndx].dc;
+	     ndx = (ndx + 1) & (g->size - 1)) {
+		config_cond_entry *e = &g->ptr[ndx];
+
+		if (!(types & (1 << e->type))) continue;
+		if (e->key->used - 1 != len || 0 != memcmp(e->key->ptr, s, len)) continue;
+
+		if (con->conf.log_condition_handling) {
+			log_error_write(srv, __FILE__, __LINE__, "dsb", e->dc->context_ndx,
+					e->type == COND_INDEX_EQ ? "(indexed) result: true" : "(indexed) candidate:", e->dc->string);
+		}
+
+		if (cm->cand_used == cm->cand_size) {
+			cm->cand_size += 16;
+			cm->cand = realloc(cm->cand, cm->cand_size * sizeof(*cm->cand));
+			assert(cm->cand);
+		}
+		cm->cand[cm->cand_used++] = e->dc->context_ndx;
+
+		if (e->type == COND_INDEX_EQ) {
+			config_cond_cache_set(con, e->dc->context_ndx, COND_RESULT_TRUE);
+			con->cond_cache[e->dc->context_ndx].comp_type = g->comp;
+		} else {
+			/* let pcre decide and fill in the captures */
+			config_check_cond_cached(srv, con, e->dc);
+		}
+	}
+}
+
+/* decide all the conditions of the groups in one go */
+static void config_cond_index_check(server *srv, connection *con) {
+	struct config_cond_index *ci = srv->cond_index;
+	cond_match_t *cm = &con->cond_match;
+	size_t i;
+
+	if (!ci) return;
+
+	for (i = 0; i < ci->used; i++) {
+		config_cond_group *g = ci->ptr[i];
+		buffer *l;
+
+		if (!con->conditional_is_valid[g->comp]) continue;
+
+		/* already decided */
+		if (config_cond_index_decided(srv, con, g->members[0])) continue;
+
+		if (NULL == (l = config_cond_get_value(srv, con, g->comp, g->with_port))) continue;
+
+		/* '$' also matches in front of a trailing newline, leave that to pcre */
+		if (g->is_regex && l->used > 1 && l->ptr[l->used - 2] == '\n') continue;
+
+		if (con->conf.log_condition_handling) {
+			log_error_write(srv, __FILE__, __LINE__, "sdsbsd",
+					"lookup", g->comp, "(", l, ") in index of", (int)g->used);
+		}
+
+		if (l->used == 0) {
+			cm->group_stamp[i] = cm->stamp;
+			continue;
+		}
+
+		if (!g->is_regex) {
+			config_cond_group_lookup(srv, con, g, l->ptr, l->used - 1, 1 << COND_INDEX_EQ);
+		} else {
+			size_t k;
+
+			config_cond_group_lookup(srv, con, g, l->ptr, l->used - 1,
+				(1 << COND_INDEX_REGEX_NAME) | (1 << COND_INDEX_REGEX_DOMAIN));
+
+			/* the parent domains */
+			for (k = 0; k + 1 < l->used - 1; k++) {
+				if (l->ptr[k] != '.') continue;
+
+				config_cond_group_lookup(srv, con, g, l->ptr + k + 1, l->used - 1 - (k + 1),
+					(1 << COND_INDEX_REGEX_SUFFIX) | (1 << COND_INDEX_REGEX_DOMAIN));
+			}
+		}
+
+		/* the members which weren't found are false from now on */
+		cm->group_stamp[i] = cm->stamp;
+	}
+}
+
+/* re-check the condition ndx and follow a change in the set */
+static void config_cond_match_check(server *srv, connection *con, size_t ndx) {
+	cond_match_t *cm = &con->cond_match;
+	data_config *dc = (data_config *)srv->config_context->data[ndx];
+	int is_true = (COND_RESULT_TRUE == config_check_cond_cached(srv, con, dc));
+
+	if (is_true == (0 != cm->slot[ndx])) return;
+
+	/* a sum doesn't depend on the order of the changes */
+	if (is_true) {
+		cm->ptr[cm->used++] = ndx;
+		cm->slot[ndx] = cm->used;
+		cm->hash += ndx * 2654435761U;
+	} else {
+		size_t last = cm->ptr[--cm->used];
+
+		cm->ptr[cm->slot[ndx] - 1] = last;
+		cm->slot[last] = cm->slot[ndx];
+		cm->slot[ndx] = 0;
+		cm->hash -= ndx * 2654435761U;
+	}
+}
+
+/**
+ * keep track of the conditions which are true
+ *
+ * the result of a *_patch_connection() only depends on this set. It is
+ * the key for the merged-config caches.
+ *
+ * a reset or a newly valid component marks the component dirty. Only
+ * these conditions are checked again:
+ * - the true ones which depend on a dirty component
+ * - the ones the condition index found for a dirty component
+ * - the ones outside of the index which depend on a dirty component
+ * - the ones nested in a true condition of the index
+ *
+ * all the others keep their result, a request to one of a few thousand
+ * $HTTP["host"] blocks doesn't look at the others. A component which isn't
+ * valid yet stays dirty, its conditions can't be decided before.
+ */
+static void config_cond_match_update(server *srv, connection *con) {
+	struct config_cond_index *ci = srv->cond_index;
+	cond_match_t *cm = &con->cond_match;
+	unsigned int valid = 0, dirty;
+	size_t i, j;
+
+	if (cm->size < srv->config_context->used) {
+		cm->slot = realloc(cm->slot, srv->config_context->used * sizeof(*cm->slot));
+		cm->ptr = realloc(cm->ptr, srv->config_context->used * sizeof(*cm->ptr));
+		assert(cm->slot && cm->ptr);
+		memset(cm->slot + cm->size, 0, (srv->config_context->used - cm->size) * sizeof(*cm->slot));
+		cm->size = srv->config_context->used;
+		cm->dirty = ~0U;
+	}
+
+	if (ci && cm->groups < ci->used) {
+		cm->group_stamp = realloc(cm->group_stamp, ci->used * sizeof(*cm->group_stamp));
+		assert(cm->group_stamp);
+		memset(cm->group_stamp + cm->groups, 0, (ci->used - cm->groups) * sizeof(*cm->group_stamp));
+		cm->groups = ci->used;
+	}
+
+	if (0 == cm->dirty) return;
+
+	for (i = 0; i < COMP_LAST_ELEMENT; i++) {
+		if (con->conditional_is_valid[i]) valid |= 1U << i;
+	}
+	dirty = cm->dirty & valid;
+
+	if (NULL == ci) {
+		/* skip the first, the global context */
+		for (i = 1; i < srv->config_context->used; i++) {
+			config_cond_match_check(srv, con, i);
+		}
+	} else {
+		cm->cand_used = 0;
+		config_cond_index_check(srv, con);
+
+		/* a removal moves the last one to i, it was checked already */
+		for (i = cm->used; i-- > 0; ) {
+			if (ci->mask[cm->ptr[i]] & cm->dirty) config_cond_match_check(srv, con, cm->ptr[i]);
+		}
+
+		for (i = 0; i < cm->cand_used; i++) {
+			config_cond_match_check(srv, con, cm->cand[i]);
+		}
+
+		for (i = 0; i < ci->used; i++) {
+			config_cond_group *g = ci->ptr[i];
+
+			if (!(dirty & (1U << g->comp)) ||
+			    config_cond_index_decided(srv, con, g->members[0])) continue;
+
+			/* the index couldn't decide, check them one by one */
+			for (j = 0; j < g->used; j++) {
+				config_cond_match_check(srv, con, g->members[j]);
+			}
+		}
+
+		for (i = 0; i < COMP_LAST_ELEMENT; i++) {
+			if (!(dirty & (1U << i))) continue;
+
+			for (j = 0; j < ci->deps_used[i]; j++) {
+				config_cond_match_check(srv, con, ci->deps[i][j]);
+			}
+		}
+
+		/* cm->used grows while the nested ones are added, they have no nested ones of their own */
+		for (i = 0; i < cm->used; i++) {
+			size_t ndx = cm->ptr[i];
+
+			for (j = 0; j < ci->sub_used[ndx]; j++) {
+				if (ci->mask[ci->sub[ndx][j]] & dirty) config_cond_match_check(srv, con, ci->sub[ndx][j]);
+			}
+		}
+	}
+
+	cm->key = cm->hash & ~(1U << 31); /* strip the highest bit */
+	cm->dirty &= ~valid;
+}
+
+/**
+ * merged-config caches
+ *
+ * for each plugin (and the core with id 0) the merged config is kept per
+ * set of true conditions. On a hit the *_patch_connection() is a memcpy().
+ */
+
+#define CONFIG_PATCH_CACHE_MAX 1024
+
+typedef struct {
+	size_t *ndx;    /* the true conditions the config was merged for */
+	size_t used;
+
+	void *conf;
+} config_patch_cache_entry;
+
+static void config_patch_cache_entry_free(config_patch_cache_entry *pce) {
+	if (!pce) return;
+
+	free(pce->ndx);
+	free(pce->conf);
+	free(pce);
+}
+
+static splay_tree *config_patch_cache_flush(splay_tree *t) {
+	while (t) {
+		config_patch_cache_entry_free(t->data);
+		t = splaytree_delete(t, t->key);
+	}
+
+	return NULL;
+}
+
+int config_patch_cache_get(server *srv, connection *con, size_t id, void *conf, size_t conf_size) {
+	cond_match_t *cm = &con->cond_match;
+	config_patch_cache_entry *pce;
+	splay_tree **t;
+	size_t i;
+
+	config_cond_match_update(srv, con);
+
+	if (id >= srv->config_patch_caches_size) return 0;
+
+	t = &(srv->config_patch_caches[id]);
+
+	*t = splaytree_splay(*t, cm->key);
+
+	if (NULL == *t || (*t)->key != cm->key) return 0;
+
+	pce = (*t)->data;
+
+	/* a collision */
+	if (pce->used != cm->used) return 0;
+
+	for (i = 0; i < pce->used; i++) {
+		if (!cm->slot[pce->ndx[i]]) return 0;
+	}
+
+	memcpy(conf, pce->conf, conf_size);
+
+	return 1;
+}
+
+void config_patch_cache_set(server *srv, connection *con, size_t id, const void *conf, size_t conf_size) {
+	cond_match_t *cm = &con->cond_match;
+	config_patch_cache_entry *pce;
+	splay_tree **t;
+
+	config_cond_match_update(srv, con);
+
+	if (id >= srv->config_patch_caches_size) {
+		size_t i;
+
+		srv->config_patch_caches = realloc(srv->config_patch_caches, (id + 1) * sizeof(*srv->config_patch_caches));
+		assert(srv->config_patch_caches);
+
+		for (i = srv->config_patch_caches_size; i <= id; i++) {
+			srv->config_patch_caches[i] = NULL;
+		}
+		srv->config_patch_caches_size = id + 1;
+	}
+
+	t = &(srv->config_patch_caches[id]);
+
+	/* don't let the combinations grow without limits */
+	if (splaytree_size(*t) >= CONFIG_PATCH_CACHE_MAX) {
+		*t = config_patch_cache_flush(*t);
+	}
+
+	*t = splaytree_splay(*t, cm->key);
+
+	if (*t && (*t)->key == cm->key) {
+		/* a collision, the newer one wins */
+		config_patch_cache_entry_free((*t)->data);
+		*t = splaytree_delete(*t, cm->key);
+	}
+
+	pce = calloc(1, sizeof(*pce));
+	assert(pce);
+
+	pce->used = cm->used;
+	pce->ndx = malloc((cm->used ? cm->used : 1) * sizeof(*pce->ndx));
+	pce->conf = malloc(conf_size);
+	assert(pce->ndx);
+	assert(pce->conf);
+
+	memcpy(pce->ndx, cm->ptr, cm->used * sizeof(*cm->ptr));
+	memcpy(pce->conf, conf, conf_size);
+
+	*t = splaytree_insert(*t, cm->key, pce);
+}
+
+void config_patch_caches_free(server *srv) {
+	size_t i;
+
+	for (i = 0; i < srv->config_patch_caches_size; i++) {
+		srv->config_patch_caches[i] = config_patch_cache_flush(srv->config_patch_caches[i]);
+	}
+
+	free(srv->config_patch_caches);
+
+	srv->config_patch_caches = NULL;
+	srv->config_patch_caches_size = 0;
+}
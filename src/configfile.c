@@ -2,6 +2,7 @@
 #include "log.h"
 #include "stream.h"
 #include "plugin.h"
+#include "stat_cache.h"
 
 #include "configparser.h"
 #include "configfile.h"
@@ -271,6 +272,8 @@ static int config_insert(server *srv) {
 		if (0 != (ret = config_insert_values_global(srv, ((data_config *)srv->config_context->data[i])->value, cv))) {
 			break;
 		}
+
+		s->mimetype_index = stat_cache_mimetype_index_init(s->mimetypes);
 	}
 
 	if (buffer_is_empty(stat_cache_string)) {
@@ -306,6 +309,7 @@ int config_setup_connection(server *srv, connection *con) {
 
 	PATCH(allow_http11);
 	PATCH(mimetypes);
+	PATCH(mimetype_index);
 	PATCH(document_root);
 	PATCH(max_keep_alive_requests);
 	PATCH(max_keep_alive_idle);
@@ -367,10 +371,22 @@ int config_setup_connection(server *srv, connection *con) {
 	return 0;
 }
 
-int config_patch_connection(server *srv, connection *con, comp_key_t comp) {
+/* the merged core config as it is kept in the config_patch_cache */
+typedef struct {
+	specific_config conf;
+	buffer *server_name; /* not alloced */
+} config_patched_t;
+
+/**
+ * merge the config of all true conditions on top of the global one
+ *
+ * the result only depends on the set of true conditions
+ */
+static void config_patch_connection_merge(server *srv, connection *con, config_patched_t *patched) {
 	size_t i, j;
 
-	con->conditional_is_valid[comp] = 1;
+	config_setup_connection(srv, con);
+	patched->server_name = srv->config_storage[0]->server_name;
 
 	/* skip the first, the global context */
 	for (i = 1; i < srv->config_context->used; i++) {
@@ -394,6 +410,7 @@ int config_patch_connection(server *srv, connection *con, comp_key_t comp) {
 				PATCH(errorfile_prefix);
 			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("mimetype.assign"))) {
 				PATCH(mimetypes);
+				PATCH(mimetype_index);
 			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("server.max-keep-alive-requests"))) {
 				PATCH(max_keep_alive_requests);
 			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("server.max-keep-alive-idle"))) {
@@ -443,6 +460,7 @@ int config_patch_connection(server *srv, connection *con, comp_key_t comp) {
 #endif
 			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("server.name"))) {
 				buffer_copy_string_buffer(con->server_name, s->server_name);
+				patched->server_name = s->server_name;
 			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("server.tag"))) {
 				PATCH(server_tag);
 			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("connection.kbytes-per-second"))) {
@@ -485,13 +503,32 @@ int config_patch_connection(server *srv, connection *con, comp_key_t comp) {
 		}
 	}
 
-		con->etag_flags = (con->conf.etag_use_mtime ? ETAG_USE_MTIME : 0) |
-				  (con->conf.etag_use_inode ? ETAG_USE_INODE : 0) |
-				  (con->conf.etag_use_size  ? ETAG_USE_SIZE  : 0);
+	patched->conf = con->conf;
+}
+#undef PATCH
+
+int config_patch_connection(server *srv, connection *con, comp_key_t comp) {
+	config_patched_t patched;
+
+	if (!con->conditional_is_valid[comp]) {
+		con->conditional_is_valid[comp] = 1;
+		con->cond_match.dirty |= 1 << comp;
+	}
+
+	if (config_patch_cache_get(srv, con, 0, &patched, sizeof(patched))) {
+		con->conf = patched.conf;
+		buffer_copy_string_buffer(con->server_name, patched.server_name);
+	} else {
+		config_patch_connection_merge(srv, con, &patched);
+		config_patch_cache_set(srv, con, 0, &patched, sizeof(patched));
+	}
+
+	con->etag_flags = (con->conf.etag_use_mtime ? ETAG_USE_MTIME : 0) |
+			  (con->conf.etag_use_inode ? ETAG_USE_INODE : 0) |
+			  (con->conf.etag_use_size  ? ETAG_USE_SIZE  : 0);
 
 	return 0;
 }
-#undef PATCH
 
 typedef struct {
 	int foo;
@@ -1214,6 +1251,8 @@ int config_read(server *srv, const char *fn) {
 		return -1;
 	}
 
+	config_cond_index_init(srv);
+
 	return 0;
 }
 
@@ -23,6 +23,11 @@ data_unset *configparser_merge_data(data_unset *op1, const data_unset *op2);
 
 void config_cond_cache_reset(server *srv, connection *con);
 void config_cond_cache_reset_item(server *srv, connection *con, comp_key_t item);
+void config_cond_cache_reset_request(server *srv, connection *con);
+
+void config_cond_index_init(server *srv);
+void config_cond_index_free(server *srv);
+void config_patch_caches_free(server *srv);
 
 #define config_cond_cache_reset_all_items(srv, con) \
 	config_cond_cache_reset_item(srv, con, COMP_LAST_ELEMENT);
@@ -482,7 +482,7 @@ context ::= DOLLAR SRVVARNAME(B) LBRACKET stringop(C) RBRACKET cond(E) expressio
 
         ctx->ok = 0;
       } else if (NULL == (dc->regex_study =
-          pcre_study(dc->regex, 0, &errptr)) &&
+          li_pcre_study(dc->regex, &errptr)) &&
                  errptr != NULL) {
         fprintf(stderr, "studying regex failed: %s -> %s\n",
             rvalue->ptr, errptr);
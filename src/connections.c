@@ -14,6 +14,7 @@
 #include "plugin.h"
 
 #include "inet_ntop_cache.h"
+#include "configfile.h"
 
 #include <sys/stat.h>
 
@@ -527,6 +528,14 @@ static int connection_handle_write_prepare(server *srv, connection *con) {
 		break;
 	}
 
+	/* handlers like mod_ssi build the whole body before the headers are sent,
+	 * a filter installed now gets the complete write-queue */
+	if (con->file_finished && con->mode != DIRECT && !con->response_filter_checked &&
+	    (con->response.transfer_encoding & HTTP_TRANSFER_ENCODING_CHUNKED) == 0) {
+		http_response_body_start(srv, con);
+		http_chunk_filter_queue(srv, con);
+	}
+
 	if (con->file_finished) {
 		/* we have all the content and chunked encoding is not used, set a content-length */
 
@@ -685,6 +694,7 @@ connection *connection_init(server *srv) {
 
 #undef CLEAN
 	con->write_queue = chunkqueue_init();
+	chunkqueue_set_tempdirs(con->write_queue, srv->srvconf.upload_tempdirs);
 	con->read_queue = chunkqueue_init();
 	con->request_content_queue = chunkqueue_init();
 	chunkqueue_set_tempdirs(con->request_content_queue, srv->srvconf.upload_tempdirs);
@@ -751,6 +761,10 @@ void connections_free(server *srv) {
 #undef CLEAN
 		free(con->plugin_ctx);
 		free(con->cond_cache);
+		free(con->cond_match.slot);
+		free(con->cond_match.ptr);
+		free(con->cond_match.cand);
+		free(con->cond_match.group_stamp);
 
 		free(con);
 	}
@@ -771,6 +785,10 @@ int connection_reset(server *srv, connection *con) {
 	con->file_started = 0;
 	con->got_response = 0;
 
+	con->response_filter = NULL;
+	con->response_filter_ctx = NULL;
+	con->response_filter_checked = 0;
+
 	con->parsed_response = 0;
 
 	con->bytes_written = 0;
@@ -1325,6 +1343,9 @@ connection *connection_accept(server *srv, server_socket *srv_socket) {
 		buffer_copy_string(con->dst_addr_buf, inet_ntop_cache_get_ip(srv, &(con->dst_addr)));
 		con->srv_socket = srv_socket;
 
+		/* new socket and remote address, requests only reset their own components */
+		config_cond_cache_reset(srv, con);
+
 		if (-1 == (fdevent_fcntl_set(srv->ev, con->fd))) {
 			log_error_write(srv, __FILE__, __LINE__, "ss", "fcntl failed: ", strerror(errno));
 			return NULL;
@@ -1,4 +1,5 @@
 #include "array.h"
+#include "keyvalue.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -28,7 +29,7 @@ static void data_config_free(data_unset *d) {
 	if (ds->string) buffer_free(ds->string);
 #ifdef HAVE_PCRE_H
 	if (ds->regex) pcre_free(ds->regex);
-	if (ds->regex_study) pcre_free(ds->regex_study);
+	if (ds->regex_study) li_pcre_study_free(ds->regex_study);
 #endif
 
 	free(d);
@@ -0,0 +1,46 @@
+#include "ewma.h"
+
+#include <sys/time.h>
+
+#include <stdlib.h>
+
+/*
+ * peak-ewma balancing
+ *
+ * the latency of a backend is a moving average which follows a peak at
+ * once and decays slowly back. the cost of a backend is that latency
+ * times the requests which are in front of a new one.
+ */
+
+double ewma_now(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* the weight of the old average after dt seconds */
+static double ewma_weight(double dt) {
+	if (dt <= 0) return 1;
+
+	return EWMA_DECAY / (EWMA_DECAY + dt);
+}
+
+void ewma_update(ewma_t *e, double now, double rtt) {
+	if (rtt > e->ewma) {
+		e->ewma = rtt;
+	} else {
+		double w = ewma_weight(now - e->ts);
+
+		e->ewma = e->ewma * w + rtt * (1 - w);
+	}
+
+	e->ts = now;
+}
+
+/* the latency is decayed while the backend got no requests, so it is
+ * tried again */
+double ewma_cost(const ewma_t *e, double now, size_t load) {
+	return (e->ewma * ewma_weight(now - e->ts) + EWMA_MIN) * (load + 1);
+}
@@ -0,0 +1,27 @@
+#ifndef _EWMA_H_
+#define _EWMA_H_
+
+#include <stddef.h>
+
+/* seconds, the old latencies count half after EWMA_DECAY */
+#define EWMA_DECAY 10.0
+
+/* seconds, the latency of a backend which wasn't measured yet, so its
+ * requests still count */
+#define EWMA_MIN 0.001
+
+/* peak-ewma of the time to the first response byte of a backend */
+typedef struct {
+	double ewma; /* in seconds */
+	double ts;   /* last update of ewma */
+} ewma_t;
+
+double ewma_now(void);
+
+/* a new latency: peaks are taken at once, lower ones are averaged in */
+void ewma_update(ewma_t *e, double now, double rtt);
+
+/* the expected wait behind load requests */
+double ewma_cost(const ewma_t *e, double now, size_t load);
+
+#endif
@@ -0,0 +1,64 @@
+#include "base.h"
+#include "http_cgi.h"
+#include "array.h"
+
+#include <string.h>
+
+/*
+ * the env names of the request headers are the same for every request,
+ * the converted names are cached in srv->cgi_header_keys and
+ * srv->cgi_env_keys. the lookup is case-insensitive like the conversion.
+ */
+
+static void http_cgi_key_convert(buffer *b, buffer *key) {
+	size_t j;
+
+	buffer_prepare_append(b, key->used + 1);
+	for (j = 0; j < key->used - 1; j++) {
+		char c = '_';
+		if (light_isalpha(key->ptr[j])) {
+			/* upper-case */
+			c = key->ptr[j] & ~32;
+		} else if (light_isdigit(key->ptr[j])) {
+			/* copy */
+			c = key->ptr[j];
+		}
+		b->ptr[b->used++] = c;
+	}
+	b->ptr[b->used++] = '\0';
+}
+
+static buffer * http_cgi_key(server *srv, array *cache, buffer *key, int is_header) {
+	data_string *ds;
+
+	if (NULL != (ds = (data_string *)array_get_element(cache, key->ptr))) {
+		return ds->value;
+	}
+
+	buffer_reset(srv->tmp_buf);
+
+	if (is_header && 0 != strcasecmp(key->ptr, "CONTENT-TYPE")) {
+		buffer_copy_string_len(srv->tmp_buf, CONST_STR_LEN("HTTP_"));
+		srv->tmp_buf->used--;
+	}
+
+	http_cgi_key_convert(srv->tmp_buf, key);
+
+	/* clients can send as many different headers as they like */
+	if (cache->used >= HTTP_CGI_KEYS_MAX) return srv->tmp_buf;
+
+	ds = data_string_init();
+	buffer_copy_string_buffer(ds->key, key);
+	buffer_copy_string_buffer(ds->value, srv->tmp_buf);
+	array_insert_unique(cache, (data_unset *)ds);
+
+	return ds->value;
+}
+
+buffer * http_cgi_header_key(server *srv, buffer *key) {
+	return http_cgi_key(srv, srv->cgi_header_keys, key, 1);
+}
+
+buffer * http_cgi_env_key(server *srv, buffer *key) {
+	return http_cgi_key(srv, srv->cgi_env_keys, key, 0);
+}
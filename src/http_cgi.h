@@ -0,0 +1,13 @@
+#ifndef _HTTP_CGI_H_
+#define _HTTP_CGI_H_
+
+#include "base.h"
+
+/* at most that many names are kept per cache, the rest is converted each time */
+#define HTTP_CGI_KEYS_MAX 256
+
+/* CGI variable name of a request header (HTTP_*) or a setenv.add-environment key */
+buffer * http_cgi_header_key(server *srv, buffer *key);
+buffer * http_cgi_env_key(server *srv, buffer *key);
+
+#endif
@@ -20,11 +20,8 @@
 #include <errno.h>
 #include <string.h>
 
-static int http_chunk_append_len(server *srv, connection *con, size_t len) {
+static void http_chunk_len(buffer *b, size_t len) {
 	size_t i, olen = len, j;
-	buffer *b;
-
-	b = srv->tmp_chunk_len;
 
 	if (len == 0) {
 		buffer_copy_string_len(b, CONST_STR_LEN("0"));
@@ -45,17 +42,81 @@ static int http_chunk_append_len(server *srv, connection *con, size_t len) {
 	}
 
 	buffer_append_string_len(b, CONST_STR_LEN("\r\n"));
+}
+
+static int http_chunk_append_len(server *srv, connection *con, size_t len) {
+	buffer *b = srv->tmp_chunk_len;
+
+	http_chunk_len(b, len);
 	chunkqueue_append_buffer(con->write_queue, b);
 
 	return 0;
 }
 
+static int http_chunk_append_mem_raw(server *srv, connection *con, const char * mem, size_t len);
+
+/* len octets of mem through the response filter, mem == NULL ends the body */
+static int http_chunk_filter(server *srv, connection *con, const char *mem, size_t len) {
+	buffer *b;
+
+	if (NULL == (b = con->response_filter(con->response_filter_ctx, mem, len))) {
+		log_error_write(srv, __FILE__, __LINE__, "s", "filtering the response body failed");
+		return -1;
+	}
+
+	if (b->used > 1) return http_chunk_append_mem_raw(srv, con, b->ptr, b->used);
+
+	return 0;
+}
+
+/* the filter has to see the content, read the file in pieces */
+static int http_chunk_filter_file(server *srv, connection *con, buffer *fn, int fd, off_t offset, off_t len) {
+	char buf[16 * 1024];
+	int ifd = fd;
+	int ret = 0;
+
+	if (ifd == -1 && -1 == (ifd = open(fn->ptr, O_RDONLY))) {
+		log_error_write(srv, __FILE__, __LINE__, "sbs", "open failed:", fn, strerror(errno));
+		return -1;
+	}
+
+	if (-1 == lseek(ifd, offset, SEEK_SET)) {
+		log_error_write(srv, __FILE__, __LINE__, "sbs", "lseek failed:", fn, strerror(errno));
+		len = 0;
+		ret = -1;
+	}
+
+	while (len > 0) {
+		ssize_t r = read(ifd, buf, len < (off_t)sizeof(buf) ? (size_t)len : sizeof(buf));
+
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) {
+			log_error_write(srv, __FILE__, __LINE__, "sbs", "read failed:", fn, r < 0 ? strerror(errno) : "unexpected EOF");
+			ret = -1;
+			break;
+		}
+
+		if (0 != http_chunk_filter(srv, con, buf, r)) {
+			ret = -1;
+			break;
+		}
+
+		len -= r;
+	}
+
+	if (ifd != fd) close(ifd);
+
+	return ret;
+}
+
 
 int http_chunk_append_file(server *srv, connection *con, buffer *fn, off_t offset, off_t len) {
 	chunkqueue *cq;
 
 	if (!con) return -1;
 
+	if (con->response_filter) return http_chunk_filter_file(srv, con, fn, -1, offset, len);
+
 	cq = con->write_queue;
 
 	if (con->response.transfer_encoding & HTTP_TRANSFER_ENCODING_CHUNKED) {
@@ -71,11 +132,47 @@ int http_chunk_append_file(server *srv, connection *con, buffer *fn, off_t offse
 	return 0;
 }
 
+int http_chunk_append_pipe(server *srv, connection *con, int fd, off_t len) {
+	chunkqueue *cq;
+	int pfd;
+
+	if (!con) return -1;
+	if (len == 0) return 0;
+
+	/* the filter can't look into the pipe */
+	if (con->response_filter) return -1;
+
+	/* every chunk closes its own fd when it is sent */
+	if (-1 == (pfd = dup(fd))) {
+		log_error_write(srv, __FILE__, __LINE__, "ss", "dup failed:", strerror(errno));
+		return -1;
+	}
+	fcntl(pfd, F_SETFD, FD_CLOEXEC);
+
+	cq = con->write_queue;
+
+	if (con->response.transfer_encoding & HTTP_TRANSFER_ENCODING_CHUNKED) {
+		http_chunk_append_len(srv, con, len);
+	}
+
+	chunkqueue_append_pipe(cq, pfd, len);
+
+	if (con->response.transfer_encoding & HTTP_TRANSFER_ENCODING_CHUNKED) {
+		chunkqueue_append_mem(cq, "\r\n", 2 + 1);
+	}
+
+	return 0;
+}
+
 int http_chunk_append_buffer(server *srv, connection *con, buffer *mem) {
 	chunkqueue *cq;
 
 	if (!con) return -1;
 
+	if (con->response_filter) {
+		return mem->used > 1 ? http_chunk_filter(srv, con, mem->ptr, mem->used - 1) : 0;
+	}
+
 	cq = con->write_queue;
 
 	if (con->response.transfer_encoding & HTTP_TRANSFER_ENCODING_CHUNKED) {
@@ -92,10 +189,26 @@ int http_chunk_append_buffer(server *srv, connection *con, buffer *mem) {
 }
 
 int http_chunk_append_mem(server *srv, connection *con, const char * mem, size_t len) {
-	chunkqueue *cq;
-
 	if (!con) return -1;
 
+	if (con->response_filter) {
+		int ret;
+
+		if (len > 0) return http_chunk_filter(srv, con, mem, len - 1);
+
+		/* the rest of the filter output, the end of the body goes out as usual */
+		ret = http_chunk_filter(srv, con, NULL, 0);
+		con->response_filter = NULL;
+
+		if (0 != ret) return ret;
+	}
+
+	return http_chunk_append_mem_raw(srv, con, mem, len);
+}
+
+static int http_chunk_append_mem_raw(server *srv, connection *con, const char * mem, size_t len) {
+	chunkqueue *cq;
+
 	cq = con->write_queue;
 
 	if (len == 0) {
@@ -120,6 +233,140 @@ int http_chunk_append_mem(server *srv, connection *con, const char * mem, size_t
 	return 0;
 }
 
+static int http_chunk_write(int fd, const char *s, size_t len) {
+	while (len > 0) {
+		ssize_t r = write(fd, s, len);
+
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		s += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+int http_chunk_append_spool(server *srv, connection *con, const char *mem, size_t len) {
+	chunkqueue *cq;
+	chunk *c;
+	buffer *b;
+
+	if (!con) return -1;
+	if (len == 0) return 0;
+
+	/* the output of the filter is smaller, it stays in memory */
+	if (con->response_filter) return http_chunk_filter(srv, con, mem, len);
+
+	cq = con->write_queue;
+	c = cq->last;
+
+	/* the network backends don't expect a file to grow after they started on it */
+	if (c == NULL || c->type != FILE_CHUNK || !c->file.is_temp ||
+	    c->offset != 0 || c->file.length >= HTTP_CHUNK_SPOOL_FILE_SIZE) {
+		c = chunkqueue_get_append_tempfile(cq);
+
+		if (c->file.fd == -1) {
+			log_error_write(srv, __FILE__, __LINE__, "sbs",
+					"can't create a tempfile for the response:", c->file.name, strerror(errno));
+
+			/* leave an empty chunk behind, the network backends skip it */
+			c->type = MEM_CHUNK;
+			buffer_reset(c->mem);
+			buffer_reset(c->file.name);
+			return -1;
+		}
+
+		fcntl(c->file.fd, F_SETFD, FD_CLOEXEC);
+	}
+
+	b = srv->tmp_chunk_len;
+	buffer_reset(b);
+
+	if (con->response.transfer_encoding & HTTP_TRANSFER_ENCODING_CHUNKED) {
+		http_chunk_len(b, len);
+	}
+
+	if (0 != http_chunk_write(c->file.fd, b->ptr, b->used ? b->used - 1 : 0) ||
+	    0 != http_chunk_write(c->file.fd, mem, len) ||
+	    ((con->response.transfer_encoding & HTTP_TRANSFER_ENCODING_CHUNKED) &&
+	     0 != http_chunk_write(c->file.fd, CONST_STR_LEN("\r\n")))) {
+		log_error_write(srv, __FILE__, __LINE__, "sbs",
+				"writing the response to the tempfile failed:", c->file.name, strerror(errno));
+
+		/* cut off what we wrote, the data goes into memory instead */
+		if (0 != ftruncate(c->file.fd, c->file.length)) {
+			/* only c->file.length octets of it are sent anyway */
+		}
+		lseek(c->file.fd, c->file.length, SEEK_SET);
+
+		return -1;
+	}
+
+	c->file.length = lseek(c->file.fd, 0, SEEK_CUR);
+
+	return 0;
+}
+
+int http_chunk_filter_queue(server *srv, connection *con) {
+	chunkqueue *cq = con->write_queue;
+	chunk *c;
+	int ret = 0;
+
+	if (!con->response_filter) return 0;
+
+	con->write_queue = chunkqueue_init();
+
+	for (c = cq->first; c && 0 == ret; c = c->next) {
+		switch (c->type) {
+		case MEM_CHUNK:
+			if (c->mem->used > 1 + (size_t)c->offset) {
+				ret = http_chunk_filter(srv, con, c->mem->ptr + c->offset, c->mem->used - 1 - c->offset);
+			}
+			break;
+		case FILE_CHUNK:
+			ret = http_chunk_filter_file(srv, con, c->file.name, c->file.fd,
+					c->file.start + c->offset, c->file.length - c->offset);
+			break;
+		default:
+			ret = -1;
+			break;
+		}
+	}
+
+	chunkqueue_free(cq);
+
+	if (0 != ret) return ret;
+
+	return http_chunk_append_mem(srv, con, NULL, 0);
+}
+
+void http_chunk_backlog(connection *con, off_t *mem, off_t *spooled) {
+	chunk *c;
+
+	*mem = 0;
+	*spooled = 0;
+
+	for (c = con->write_queue->first; c; c = c->next) {
+		switch (c->type) {
+		case MEM_CHUNK:
+			if (c->mem->used) *mem += c->mem->used - 1 - c->offset;
+			break;
+		case PIPE_CHUNK:
+			/* in the kernel, but memory nevertheless */
+			*mem += c->file.length - c->offset;
+			break;
+		case FILE_CHUNK:
+			/* the size on disk, it is freed when the chunk is sent completely */
+			if (c->file.is_temp) *spooled += c->file.length;
+			break;
+		default:
+			break;
+		}
+	}
+}
 
 off_t http_chunkqueue_length(server *srv, connection *con) {
 	if (!con) {
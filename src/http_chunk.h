@@ -7,6 +7,19 @@
 int http_chunk_append_mem(server *srv, connection *con, const char * mem, size_t len);
 int http_chunk_append_buffer(server *srv, connection *con, buffer *mem);
 int http_chunk_append_file(server *srv, connection *con, buffer *fn, off_t offset, off_t len);
+/* len octets at the front of the pipe fd, only for the linux-sendfile backend */
+int http_chunk_append_pipe(server *srv, connection *con, int fd, off_t len);
+/* a tempfile of the write-queue gets no more data beyond this size */
+#define HTTP_CHUNK_SPOOL_FILE_SIZE (1024 * 1024)
+
+/* like http_chunk_append_mem() (len without the '\0'), but into a tempfile
+ * in server.upload-dirs at the end of the write-queue, -1 if it can't be written */
+int http_chunk_append_spool(server *srv, connection *con, const char *mem, size_t len);
+/* the unsent octets of the write-queue in memory and the size of its tempfiles */
+void http_chunk_backlog(connection *con, off_t *mem, off_t *spooled);
+/* the body is complete in the write-queue when the filter is installed,
+ * run it through the filter and end it */
+int http_chunk_filter_queue(server *srv, connection *con);
 off_t http_chunkqueue_length(server *srv, connection *con);
 
 #endif
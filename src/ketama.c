@@ -0,0 +1,200 @@
+#include "base.h"
+#include "ketama.h"
+#include "array.h"
+#include "crc32.h"
+#include "md5.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+/*
+ * consistent hashing over the backends of an extension
+ *
+ * every backend gets KETAMA_POINTS points on a 32bit ring, taken from
+ * md5("<name>-<n>"). a request goes to the first backend clockwise of the
+ * hash of its key. if a backend is down its points are skipped, which
+ * gives the same mapping as a ring built without it: only the keys of
+ * that backend move, and they are spread over the others.
+ */
+
+ketama_ring *ketama_init(void) {
+	return calloc(1, sizeof(ketama_ring));
+}
+
+void ketama_free(ketama_ring *ring) {
+	if (!ring) return;
+
+	free(ring->points);
+	free(ring);
+}
+
+void ketama_add(ketama_ring *ring, const char *name, size_t name_len, size_t ndx) {
+	size_t i, j;
+
+	if (ring->size < ring->used + KETAMA_POINTS) {
+		ring->size = ring->used + KETAMA_POINTS;
+		ring->points = realloc(ring->points, ring->size * sizeof(*ring->points));
+	}
+
+	for (i = 0; i < KETAMA_POINTS / 4; i++) {
+		li_MD5_CTX ctx;
+		unsigned char digest[16];
+		char suffix[16];
+		int suffix_len;
+
+		suffix_len = snprintf(suffix, sizeof(suffix), "-%u", (unsigned int)i);
+
+		li_MD5_Init(&ctx);
+		li_MD5_Update(&ctx, name, name_len);
+		li_MD5_Update(&ctx, suffix, suffix_len);
+		li_MD5_Final(digest, &ctx);
+
+		/* 4 points per digest */
+		for (j = 0; j < 4; j++) {
+			ketama_point *pt = &ring->points[ring->used++];
+
+			pt->point = ((uint32_t)digest[3 + j * 4] << 24) |
+				    ((uint32_t)digest[2 + j * 4] << 16) |
+				    ((uint32_t)digest[1 + j * 4] << 8) |
+				    ((uint32_t)digest[0 + j * 4]);
+			pt->ndx = ndx;
+		}
+	}
+}
+
+static int ketama_point_cmp(const void *a, const void *b) {
+	const ketama_point *pa = a, *pb = b;
+
+	if (pa->point != pb->point) return pa->point < pb->point ? -1 : 1;
+
+	/* keep the order stable for equal points */
+	if (pa->ndx != pb->ndx) return pa->ndx < pb->ndx ? -1 : 1;
+
+	return 0;
+}
+
+void ketama_sort(ketama_ring *ring) {
+	qsort(ring->points, ring->used, sizeof(*ring->points), ketama_point_cmp);
+}
+
+int ketama_get(ketama_ring *ring, uint32_t hash, int (*is_up)(void *ctx, size_t ndx), void *ctx) {
+	size_t lo = 0, hi = ring->used, i;
+
+	if (ring->used == 0) return -1;
+
+	/* first point >= hash */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (ring->points[mid].point < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	/* walk clockwise over the points of backends which are down */
+	for (i = 0; i < ring->used; i++) {
+		ketama_point *pt = &ring->points[(lo + i) % ring->used];
+
+		if (is_up(ctx, pt->ndx)) return pt->ndx;
+	}
+
+	return -1;
+}
+
+int ketama_key_parse(buffer *spec, ketama_key_t *key, buffer *cookie) {
+	if (buffer_is_empty(spec) ||
+	    buffer_is_equal_string(spec, CONST_STR_LEN("uri"))) {
+		*key = KETAMA_KEY_URI;
+	} else if (buffer_is_equal_string(spec, CONST_STR_LEN("host"))) {
+		*key = KETAMA_KEY_HOST;
+	} else if (buffer_is_equal_string(spec, CONST_STR_LEN("ip"))) {
+		*key = KETAMA_KEY_IP;
+	} else if (spec->used > sizeof("cookie:") &&
+		   0 == strncmp(spec->ptr, "cookie:", sizeof("cookie:") - 1)) {
+		*key = KETAMA_KEY_COOKIE;
+		buffer_copy_string_len(cookie, spec->ptr + sizeof("cookie:") - 1, spec->used - sizeof("cookie:"));
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* murmur3 finalizer, spreads the crc over the whole ring */
+static uint32_t ketama_mix(uint32_t h) {
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static uint32_t ketama_hash_ip(connection *con) {
+	switch (con->dst_addr.plain.sa_family) {
+#ifdef HAVE_IPV6
+	case AF_INET6:
+		return ketama_mix(generate_crc32c((char *)&con->dst_addr.ipv6.sin6_addr, sizeof(con->dst_addr.ipv6.sin6_addr)));
+#endif
+	case AF_INET:
+		return ketama_mix(generate_crc32c((char *)&con->dst_addr.ipv4.sin_addr, sizeof(con->dst_addr.ipv4.sin_addr)));
+	default:
+		return 0;
+	}
+}
+
+/* value of the cookie name=value in the Cookie header */
+static const char *ketama_cookie_get(connection *con, buffer *name, size_t *len) {
+	data_string *ds;
+	const char *s;
+
+	if (buffer_is_empty(name)) return NULL;
+
+	if (NULL == (ds = (data_string *)array_get_element(con->request.headers, "Cookie"))) return NULL;
+
+	for (s = ds->value->ptr; s && *s; ) {
+		const char *e;
+
+		while (*s == ' ' || *s == '\t' || *s == ';') s++;
+
+		if (0 == strncmp(s, name->ptr, name->used - 1) &&
+		    s[name->used - 1] == '=') {
+			s += name->used;
+
+			for (e = s; *e && *e != ';'; e++);
+
+			*len = e - s;
+			return s;
+		}
+
+		if (NULL != (s = strchr(s, ';'))) s++;
+	}
+
+	return NULL;
+}
+
+uint32_t ketama_hash_request(connection *con, ketama_key_t key, buffer *cookie) {
+	const char *v;
+	size_t len;
+
+	switch (key) {
+	case KETAMA_KEY_HOST:
+		return ketama_mix(generate_crc32c(CONST_BUF_LEN(con->uri.authority)));
+	case KETAMA_KEY_IP:
+		return ketama_hash_ip(con);
+	case KETAMA_KEY_COOKIE:
+		if (NULL != (v = ketama_cookie_get(con, cookie, &len))) {
+			return ketama_mix(generate_crc32c((char *)v, len));
+		}
+
+		return ketama_hash_ip(con);
+	case KETAMA_KEY_URI:
+	default:
+		return ketama_mix(generate_crc32c(CONST_BUF_LEN(con->uri.path)) ^
+				  generate_crc32c(CONST_BUF_LEN(con->uri.authority)));
+	}
+}
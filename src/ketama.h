@@ -0,0 +1,43 @@
+#ifndef _KETAMA_H_
+#define _KETAMA_H_
+
+#include "base.h"
+
+/* points on the ring per backend */
+#define KETAMA_POINTS 160
+
+typedef struct {
+	uint32_t point;
+	size_t ndx; /* of the backend */
+} ketama_point;
+
+typedef struct {
+	ketama_point *points;
+
+	size_t used;
+	size_t size;
+} ketama_ring;
+
+typedef enum {
+	KETAMA_KEY_URI,    /* uri.path + Host (default) */
+	KETAMA_KEY_HOST,   /* Host */
+	KETAMA_KEY_IP,     /* remote address */
+	KETAMA_KEY_COOKIE  /* value of a cookie, the remote address if it is missing */
+} ketama_key_t;
+
+ketama_ring *ketama_init(void);
+void ketama_free(ketama_ring *ring);
+
+/* add the points of a backend, call ketama_sort() when all are added */
+void ketama_add(ketama_ring *ring, const char *name, size_t name_len, size_t ndx);
+void ketama_sort(ketama_ring *ring);
+
+/* the first backend at or after hash on the ring which is_up(ctx, ndx),
+ * -1 if there is none */
+int ketama_get(ketama_ring *ring, uint32_t hash, int (*is_up)(void *ctx, size_t ndx), void *ctx);
+
+/* "uri", "host", "ip" or "cookie:<name>" */
+int ketama_key_parse(buffer *spec, ketama_key_t *key, buffer *cookie);
+uint32_t ketama_hash_request(connection *con, ketama_key_t key, buffer *cookie);
+
+#endif
@@ -325,6 +325,9 @@ pcre_keyvalue_buffer *pcre_keyvalue_buffer_init(void) {
 	pcre_keyvalue_buffer *kvb;
 
 	kvb = calloc(1, sizeof(*kvb));
+#ifdef HAVE_PCRE_H
+	kvb->prefilter = li_pcre_prefilter_init();
+#endif
 
 	return kvb;
 }
@@ -368,13 +371,15 @@ int pcre_keyvalue_buffer_append(server *srv, pcre_keyvalue_buffer *kvb, const ch
 		return -1;
 	}
 
-	if (NULL == (kv->key_extra = pcre_study(kv->key, 0, &errptr)) &&
+	if (NULL == (kv->key_extra = li_pcre_study(kv->key, &errptr)) &&
 			errptr != NULL) {
 		return -1;
 	}
 
 	kv->value = buffer_init_string(value);
 
+	li_pcre_prefilter_append(kvb->prefilter, kvb->used, key);
+
 	kvb->used++;
 
 	return 0;
@@ -394,13 +399,312 @@ void pcre_keyvalue_buffer_free(pcre_keyvalue_buffer *kvb) {
 	for (i = 0; i < kvb->size; i++) {
 		kv = kvb->kv[i];
 		if (kv->key) pcre_free(kv->key);
-		if (kv->key_extra) pcre_free(kv->key_extra);
+		if (kv->key_extra) li_pcre_study_free(kv->key_extra);
 		if (kv->value) buffer_free(kv->value);
 		free(kv);
 	}
 
 	if (kvb->kv) free(kvb->kv);
+
+	li_pcre_prefilter_free(kvb->prefilter);
 #endif
 
 	free(kvb);
 }
+
+#ifdef HAVE_PCRE_H
+#ifdef PCRE_CONFIG_JIT
+static int li_pcre_jit = -1;
+static pcre_jit_stack *li_pcre_jit_stack = NULL;
+#endif
+
+pcre_extra *li_pcre_study(pcre *regex, const char **errptr) {
+	pcre_extra *extra;
+	int options = 0;
+
+#ifdef PCRE_CONFIG_JIT
+	/* the library may be built without JIT support, fall back to the interpreter */
+	if (-1 == li_pcre_jit) {
+		if (0 != pcre_config(PCRE_CONFIG_JIT, &li_pcre_jit)) li_pcre_jit = 0;
+	}
+
+	if (li_pcre_jit) options |= PCRE_STUDY_JIT_COMPILE;
+#endif
+
+	*errptr = NULL;
+	if (NULL == (extra = pcre_study(regex, options, errptr))) return NULL;
+
+#ifdef PCRE_CONFIG_JIT
+	if (li_pcre_jit) {
+		int jit = 0;
+
+		/* JIT compilation can still fail for a single pattern, pcre_exec() interprets those */
+		if (0 == pcre_fullinfo(regex, extra, PCRE_INFO_JIT, &jit) && jit) {
+			if (NULL == li_pcre_jit_stack) {
+				li_pcre_jit_stack = pcre_jit_stack_alloc(32 * 1024, 512 * 1024);
+			}
+
+			if (NULL != li_pcre_jit_stack) {
+				pcre_assign_jit_stack(extra, NULL, li_pcre_jit_stack);
+			}
+		}
+	}
+#endif
+
+	return extra;
+}
+
+void li_pcre_study_free(pcre_extra *extra) {
+#ifdef PCRE_CONFIG_JIT
+	pcre_free_study(extra);
+#else
+	pcre_free(extra);
+#endif
+}
+
+void li_pcre_jit_stack_free(void) {
+#ifdef PCRE_CONFIG_JIT
+	if (NULL != li_pcre_jit_stack) {
+		pcre_jit_stack_free(li_pcre_jit_stack);
+		li_pcre_jit_stack = NULL;
+	}
+#endif
+}
+
+/* the prefilter is a trie over the literal prefixes of anchored patterns;
+ * walking it with the subject marks every pattern whose prefix matches.
+ * patterns without a usable prefix hang at the root and are always marked.
+ */
+
+typedef struct li_pcre_prefilter_node {
+	unsigned char *keys; /* sorted */
+	struct li_pcre_prefilter_node **childs;
+	size_t used;
+	size_t size;
+
+	size_t *ndx; /* patterns whose prefix ends here */
+	size_t ndx_used;
+	size_t ndx_size;
+} li_pcre_prefilter_node;
+
+#define PREFILTER_BITS (sizeof(unsigned long) * 8)
+
+struct li_pcre_prefilter {
+	li_pcre_prefilter_node root;
+
+	size_t used; /* number of patterns */
+
+	unsigned long *match; /* one bit per pattern */
+	size_t match_size;
+
+	buffer *prefix;
+};
+
+li_pcre_prefilter *li_pcre_prefilter_init(void) {
+	li_pcre_prefilter *pf;
+
+	pf = calloc(1, sizeof(*pf));
+	pf->prefix = buffer_init();
+
+	return pf;
+}
+
+static void li_pcre_prefilter_node_free(li_pcre_prefilter_node *node) {
+	size_t i;
+
+	for (i = 0; i < node->used; i++) {
+		li_pcre_prefilter_node_free(node->childs[i]);
+		free(node->childs[i]);
+	}
+
+	if (node->keys) free(node->keys);
+	if (node->childs) free(node->childs);
+	if (node->ndx) free(node->ndx);
+}
+
+void li_pcre_prefilter_free(li_pcre_prefilter *pf) {
+	if (!pf) return;
+
+	li_pcre_prefilter_node_free(&pf->root);
+	if (pf->match) free(pf->match);
+	buffer_free(pf->prefix);
+
+	free(pf);
+}
+
+/* literal text every match of the pattern has to start with;
+ * empty if the pattern isn't anchored or too complex to tell */
+static void li_pcre_literal_prefix(buffer *b, const char *pattern) {
+	const char *s;
+	int depth = 0;
+
+	buffer_copy_string_len(b, CONST_STR_LEN(""));
+
+	if (pattern[0] != '^') return;
+
+	/* the anchor only covers the first alternative of a top-level '|' */
+	for (s = pattern; *s; s++) {
+		switch (*s) {
+		case '\\':
+			/* \Q...\E quotes metacharacters */
+			if (s[1] == 'Q') return;
+			if (s[1] != '\0') s++;
+			break;
+		case '[':
+			/* skip the character class, "[]...]" and "[^]...]" contain a literal ']' */
+			s++;
+			if (*s == '^') s++;
+			if (*s == ']') s++;
+			for (; *s && *s != ']'; s++) {
+				if (*s == '\\' && s[1] != '\0') s++;
+			}
+			if (*s == '\0') return;
+			break;
+		case '(':
+			/* inline options and comments change how the rest is parsed */
+			if (s[1] == '?' && s[2] != ':' && s[2] != '=' && s[2] != '!' && s[2] != '<' && s[2] != '>' && s[2] != 'P') return;
+			if (s[1] == '*') return;
+			depth++;
+			break;
+		case ')':
+			depth--;
+			break;
+		case '|':
+			if (0 == depth) return;
+			break;
+		}
+	}
+
+	for (s = pattern + 1; *s; ) {
+		char c;
+
+		if (*s == '\\') {
+			/* \d, \w, \1, \x41, ... */
+			if (s[1] == '\0' || light_isalnum((unsigned char)s[1])) break;
+			c = s[1];
+			s += 2;
+		} else if (NULL != strchr("^$.[]|()?*+{}", *s)) {
+			break;
+		} else {
+			c = *s++;
+		}
+
+		/* a quantified char is optional or repeated */
+		if (*s == '?' || *s == '*' || *s == '+' || *s == '{') break;
+
+		buffer_append_string_len(b, &c, 1);
+	}
+}
+
+void li_pcre_prefilter_append(li_pcre_prefilter *pf, size_t ndx, const char *pattern) {
+	li_pcre_prefilter_node *node = &pf->root;
+	size_t i, k;
+
+	li_pcre_literal_prefix(pf->prefix, pattern);
+
+	for (i = 0; i + 1 < pf->prefix->used; i++) {
+		unsigned char c = (unsigned char)pf->prefix->ptr[i];
+
+		for (k = 0; k < node->used && node->keys[k] < c; k++) ;
+
+		if (k == node->used || node->keys[k] != c) {
+			if (node->size == 0) {
+				node->size = 4;
+				node->keys = malloc(node->size * sizeof(*node->keys));
+				node->childs = malloc(node->size * sizeof(*node->childs));
+			} else if (node->used == node->size) {
+				node->size += 4;
+				node->keys = realloc(node->keys, node->size * sizeof(*node->keys));
+				node->childs = realloc(node->childs, node->size * sizeof(*node->childs));
+			}
+
+			memmove(node->keys + k + 1, node->keys + k, (node->used - k) * sizeof(*node->keys));
+			memmove(node->childs + k + 1, node->childs + k, (node->used - k) * sizeof(*node->childs));
+
+			node->keys[k] = c;
+			node->childs[k] = calloc(1, sizeof(**node->childs));
+			node->used++;
+		}
+
+		node = node->childs[k];
+	}
+
+	if (node->ndx_size == 0) {
+		node->ndx_size = 4;
+		node->ndx = malloc(node->ndx_size * sizeof(*node->ndx));
+	} else if (node->ndx_used == node->ndx_size) {
+		node->ndx_size += 4;
+		node->ndx = realloc(node->ndx, node->ndx_size * sizeof(*node->ndx));
+	}
+	node->ndx[node->ndx_used++] = ndx;
+
+	if (ndx >= pf->used) pf->used = ndx + 1;
+
+	if (pf->used > pf->match_size * PREFILTER_BITS) {
+		size_t n = (pf->used + PREFILTER_BITS - 1) / PREFILTER_BITS;
+
+		pf->match = realloc(pf->match, n * sizeof(*pf->match));
+		memset(pf->match + pf->match_size, 0, (n - pf->match_size) * sizeof(*pf->match));
+		pf->match_size = n;
+	}
+}
+
+static void li_pcre_prefilter_mark(li_pcre_prefilter *pf, li_pcre_prefilter_node *node) {
+	size_t i;
+
+	for (i = 0; i < node->ndx_used; i++) {
+		pf->match[node->ndx[i] / PREFILTER_BITS] |= 1UL << (node->ndx[i] % PREFILTER_BITS);
+	}
+}
+
+void li_pcre_prefilter_match(li_pcre_prefilter *pf, const char *s, size_t slen) {
+	li_pcre_prefilter_node *node = &pf->root;
+	size_t i;
+
+	if (0 == pf->used) return;
+
+	memset(pf->match, 0, pf->match_size * sizeof(*pf->match));
+
+	li_pcre_prefilter_mark(pf, node);
+
+	for (i = 0; i < slen && node->used; i++) {
+		unsigned char c = (unsigned char)s[i];
+		size_t lo = 0, hi = node->used;
+
+		while (lo < hi) {
+			size_t mid = (lo + hi) / 2;
+
+			if (node->keys[mid] < c) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+
+		if (lo == node->used || node->keys[lo] != c) break;
+
+		node = node->childs[lo];
+		li_pcre_prefilter_mark(pf, node);
+	}
+}
+
+size_t li_pcre_prefilter_next(li_pcre_prefilter *pf, size_t ndx) {
+	while (ndx < pf->used) {
+		unsigned long w = pf->match[ndx / PREFILTER_BITS] >> (ndx % PREFILTER_BITS);
+
+		if (w) {
+			while (!(w & 1)) {
+				w >>= 1;
+				ndx++;
+			}
+			return ndx;
+		}
+
+		ndx = (ndx / PREFILTER_BITS + 1) * PREFILTER_BITS;
+	}
+
+	return pf->used;
+}
+
+#undef PREFILTER_BITS
+#endif
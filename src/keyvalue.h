@@ -105,7 +105,17 @@ typedef struct {\
 KVB(keyvalue);
 KVB(s_keyvalue);
 KVB(httpauth_keyvalue);
-KVB(pcre_keyvalue);
+
+/* literal-prefix index over a list of regular expressions */
+typedef struct li_pcre_prefilter li_pcre_prefilter;
+
+typedef struct {
+	pcre_keyvalue **kv;
+	size_t used;
+	size_t size;
+
+	li_pcre_prefilter *prefilter;
+} pcre_keyvalue_buffer;
 
 const char *get_http_status_name(int i);
 const char *get_http_version_name(int i);
@@ -133,4 +143,23 @@ pcre_keyvalue_buffer *pcre_keyvalue_buffer_init(void);
 int pcre_keyvalue_buffer_append(struct server *srv, pcre_keyvalue_buffer *kvb, const char *key, const char *value);
 void pcre_keyvalue_buffer_free(pcre_keyvalue_buffer *kvb);
 
+#ifdef HAVE_PCRE_H
+/* pcre_study() with JIT compilation when the pcre library supports it;
+ * JIT patterns share one JIT stack */
+pcre_extra *li_pcre_study(pcre *regex, const char **errptr);
+void li_pcre_study_free(pcre_extra *extra);
+void li_pcre_jit_stack_free(void);
+
+/* patterns have to be appended in order, ndx is their position in the list.
+ *
+ * li_pcre_prefilter_match() marks the patterns that can match the subject,
+ * li_pcre_prefilter_next() returns the first marked pattern >= ndx
+ * (or the number of patterns if there is none) */
+li_pcre_prefilter *li_pcre_prefilter_init(void);
+void li_pcre_prefilter_free(li_pcre_prefilter *pf);
+void li_pcre_prefilter_append(li_pcre_prefilter *pf, size_t ndx, const char *pattern);
+void li_pcre_prefilter_match(li_pcre_prefilter *pf, const char *s, size_t slen);
+size_t li_pcre_prefilter_next(li_pcre_prefilter *pf, size_t ndx);
+#endif
+
 #endif
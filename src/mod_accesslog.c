@@ -627,6 +627,8 @@ static int mod_accesslog_patch_connection(server *srv, connection *con, plugin_d
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(access_logfile);
 	PATCH(format);
 	PATCH(log_access_fd);
@@ -670,6 +672,8 @@ static int mod_accesslog_patch_connection(server *srv, connection *con, plugin_d
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
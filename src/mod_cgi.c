@@ -5,6 +5,8 @@
 #include "connections.h"
 #include "joblist.h"
 #include "http_chunk.h"
+#include "response.h"
+#include "http_cgi.h"
 
 #include "plugin.h"
 
@@ -38,6 +40,11 @@
 
 #include "version.h"
 
+#if defined(HAVE_POSIX_SPAWN) && defined(HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP)
+# define CGI_POSIX_SPAWN
+# include <spawn.h>
+#endif
+
 enum {EOL_UNSET, EOL_N, EOL_RN};
 
 typedef struct {
@@ -486,6 +493,8 @@ static int cgi_demux_response(server *srv, handler_ctx *hctx) {
 					/* parse the response header */
 					cgi_response_parse(srv, con, p, hctx->response_header);
 
+					http_response_body_start(srv, con);
+
 					/* enable chunked-transfer-encoding */
 					if (con->request.http_version == HTTP_VERSION_1_1 &&
 					    !(con->parsed_response & HTTP_CONTENT_LENGTH)) {
@@ -735,6 +744,98 @@ static int cgi_env_add(char_array *env, const char *key, size_t key_len, const c
 	return 0;
 }
 
+#ifndef __WIN32
+/* start the cgi with stdin and stdout on the pipes, in dir if it isn't NULL
+ *
+ * posix_spawn() doesn't copy the page tables of the server like fork()
+ * does, a server with a large memory footprint starts the cgis as fast
+ * as a small one
+ */
+static pid_t cgi_spawn(server *srv, char **args, char **envp, const char *dir, int to_cgi_fds[2], int from_cgi_fds[2]) {
+	pid_t pid;
+	int i;
+#ifdef CGI_POSIX_SPAWN
+	posix_spawn_file_actions_t actions;
+	int r;
+
+	posix_spawn_file_actions_init(&actions);
+
+	posix_spawn_file_actions_adddup2(&actions, from_cgi_fds[1], STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, to_cgi_fds[0], STDIN_FILENO);
+
+	/* the pipes might be above the range closed below, the cgi wouldn't see EOF on stdin */
+	posix_spawn_file_actions_addclose(&actions, from_cgi_fds[0]);
+	posix_spawn_file_actions_addclose(&actions, from_cgi_fds[1]);
+	posix_spawn_file_actions_addclose(&actions, to_cgi_fds[0]);
+	posix_spawn_file_actions_addclose(&actions, to_cgi_fds[1]);
+
+	if (dir) posix_spawn_file_actions_addchdir_np(&actions, dir);
+
+	/* we don't need the client socket, the pipes are on stdin and stdout now */
+	for (i = 3; i < 256; i++) {
+		if (i == srv->errorlog_fd ||
+		    i == from_cgi_fds[0] || i == from_cgi_fds[1] ||
+		    i == to_cgi_fds[0] || i == to_cgi_fds[1]) continue;
+
+		posix_spawn_file_actions_addclose(&actions, i);
+	}
+
+	r = posix_spawn(&pid, args[0], &actions, NULL, args, envp);
+
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (0 != r) {
+		log_error_write(srv, __FILE__, __LINE__, "sss", "spawning the cgi failed:", strerror(r), args[0]);
+		return -1;
+	}
+#else
+	switch (pid = fork()) {
+	case 0:
+		/* child */
+
+		/* move stdout to from_cgi_fd[1] */
+		close(STDOUT_FILENO);
+		dup2(from_cgi_fds[1], STDOUT_FILENO);
+		close(from_cgi_fds[1]);
+		/* not needed */
+		close(from_cgi_fds[0]);
+
+		/* move the stdin to to_cgi_fd[0] */
+		close(STDIN_FILENO);
+		dup2(to_cgi_fds[0], STDIN_FILENO);
+		close(to_cgi_fds[0]);
+		/* not needed */
+		close(to_cgi_fds[1]);
+
+		/* change to the physical directory */
+		if (dir && -1 == chdir(dir)) {
+			log_error_write(srv, __FILE__, __LINE__, "sss", "chdir failed:", strerror(errno), dir);
+		}
+
+		/* we don't need the client socket */
+		for (i = 3; i < 256; i++) {
+			if (i != srv->errorlog_fd) close(i);
+		}
+
+		/* exec the cgi */
+		execve(args[0], args, envp);
+
+		/* log_error_write(srv, __FILE__, __LINE__, "sss", "CGI failed:", strerror(errno), args[0]); */
+
+		/* */
+		SEGFAULT();
+		break;
+	case -1:
+		/* error */
+		log_error_write(srv, __FILE__, __LINE__, "ss", "fork failed:", strerror(errno));
+		break;
+	}
+#endif
+
+	return pid;
+}
+#endif
+
 static int cgi_create_env(server *srv, connection *con, plugin_data *p, buffer *cgi_handler) {
 	pid_t pid;
 
@@ -746,6 +847,16 @@ static int cgi_create_env(server *srv, connection *con, plugin_data *p, buffer *
 	int from_cgi_fds[2];
 	struct stat st;
 
+	char **args;
+	int argc;
+	int i = 0;
+	char buf[32];
+	size_t n;
+	char_array env;
+	char *slash;
+	const char *s;
+	server_socket *srv_sock = con->srv_socket;
+
 #ifndef __WIN32
 
 	if (cgi_handler->used > 1) {
@@ -770,289 +881,207 @@ static int cgi_create_env(server *srv, connection *con, plugin_data *p, buffer *
 		return -1;
 	}
 
-	/* fork, execve */
-	switch (pid = fork()) {
-	case 0: {
-		/* child */
-		char **args;
-		int argc;
-		int i = 0;
-		char buf[32];
-		size_t n;
-		char_array env;
-		char *c;
-		const char *s;
-		server_socket *srv_sock = con->srv_socket;
-
-		/* move stdout to from_cgi_fd[1] */
-		close(STDOUT_FILENO);
-		dup2(from_cgi_fds[1], STDOUT_FILENO);
-		close(from_cgi_fds[1]);
-		/* not needed */
-		close(from_cgi_fds[0]);
+	/* create environment */
+	env.ptr = NULL;
+	env.size = 0;
+	env.used = 0;
 
-		/* move the stdin to to_cgi_fd[0] */
-		close(STDIN_FILENO);
-		dup2(to_cgi_fds[0], STDIN_FILENO);
-		close(to_cgi_fds[0]);
-		/* not needed */
-		close(to_cgi_fds[1]);
+	if (buffer_is_empty(con->conf.server_tag)) {
+		cgi_env_add(&env, CONST_STR_LEN("SERVER_SOFTWARE"), CONST_STR_LEN(PACKAGE_DESC));
+	} else {
+		cgi_env_add(&env, CONST_STR_LEN("SERVER_SOFTWARE"), CONST_BUF_LEN(con->conf.server_tag));
+	}
 
-		/* create environment */
-		env.ptr = NULL;
-		env.size = 0;
-		env.used = 0;
+	if (!buffer_is_empty(con->server_name)) {
+		size_t len = con->server_name->used - 1;
 
-		if (buffer_is_empty(con->conf.server_tag)) {
-			cgi_env_add(&env, CONST_STR_LEN("SERVER_SOFTWARE"), CONST_STR_LEN(PACKAGE_DESC));
+		if (con->server_name->ptr[0] == '[') {
+			const char *colon = strstr(con->server_name->ptr, "]:");
+			if (colon) len = (colon + 1) - con->server_name->ptr;
 		} else {
-			cgi_env_add(&env, CONST_STR_LEN("SERVER_SOFTWARE"), CONST_BUF_LEN(con->conf.server_tag));
+			const char *colon = strchr(con->server_name->ptr, ':');
+			if (colon) len = colon - con->server_name->ptr;
 		}
 
-		if (!buffer_is_empty(con->server_name)) {
-			size_t len = con->server_name->used - 1;
-
-			if (con->server_name->ptr[0] == '[') {
-				const char *colon = strstr(con->server_name->ptr, "]:");
-				if (colon) len = (colon + 1) - con->server_name->ptr;
-			} else {
-				const char *colon = strchr(con->server_name->ptr, ':');
-				if (colon) len = colon - con->server_name->ptr;
-			}
-
-			cgi_env_add(&env, CONST_STR_LEN("SERVER_NAME"), con->server_name->ptr, len);
-		} else {
+		cgi_env_add(&env, CONST_STR_LEN("SERVER_NAME"), con->server_name->ptr, len);
+	} else {
 #ifdef HAVE_IPV6
-			s = inet_ntop(srv_sock->addr.plain.sa_family,
-				      srv_sock->addr.plain.sa_family == AF_INET6 ?
-				      (const void *) &(srv_sock->addr.ipv6.sin6_addr) :
-				      (const void *) &(srv_sock->addr.ipv4.sin_addr),
-				      b2, sizeof(b2)-1);
+		s = inet_ntop(srv_sock->addr.plain.sa_family,
+			      srv_sock->addr.plain.sa_family == AF_INET6 ?
+			      (const void *) &(srv_sock->addr.ipv6.sin6_addr) :
+			      (const void *) &(srv_sock->addr.ipv4.sin_addr),
+			      b2, sizeof(b2)-1);
 #else
-			s = inet_ntoa(srv_sock->addr.ipv4.sin_addr);
+		s = inet_ntoa(srv_sock->addr.ipv4.sin_addr);
 #endif
-			cgi_env_add(&env, CONST_STR_LEN("SERVER_NAME"), s, strlen(s));
-		}
-		cgi_env_add(&env, CONST_STR_LEN("GATEWAY_INTERFACE"), CONST_STR_LEN("CGI/1.1"));
+		cgi_env_add(&env, CONST_STR_LEN("SERVER_NAME"), s, strlen(s));
+	}
+	cgi_env_add(&env, CONST_STR_LEN("GATEWAY_INTERFACE"), CONST_STR_LEN("CGI/1.1"));
 
-		s = get_http_version_name(con->request.http_version);
+	s = get_http_version_name(con->request.http_version);
 
-		cgi_env_add(&env, CONST_STR_LEN("SERVER_PROTOCOL"), s, strlen(s));
+	cgi_env_add(&env, CONST_STR_LEN("SERVER_PROTOCOL"), s, strlen(s));
 
-		LI_ltostr(buf,
+	LI_ltostr(buf,
 #ifdef HAVE_IPV6
-			ntohs(srv_sock->addr.plain.sa_family == AF_INET6 ? srv_sock->addr.ipv6.sin6_port : srv_sock->addr.ipv4.sin_port)
+		ntohs(srv_sock->addr.plain.sa_family == AF_INET6 ? srv_sock->addr.ipv6.sin6_port : srv_sock->addr.ipv4.sin_port)
 #else
-			ntohs(srv_sock->addr.ipv4.sin_port)
+		ntohs(srv_sock->addr.ipv4.sin_port)
 #endif
-			);
-		cgi_env_add(&env, CONST_STR_LEN("SERVER_PORT"), buf, strlen(buf));
+		);
+	cgi_env_add(&env, CONST_STR_LEN("SERVER_PORT"), buf, strlen(buf));
 
-		switch (srv_sock->addr.plain.sa_family) {
+	switch (srv_sock->addr.plain.sa_family) {
 #ifdef HAVE_IPV6
-		case AF_INET6:
-			s = inet_ntop(srv_sock->addr.plain.sa_family,
-			              (const void *) &(srv_sock->addr.ipv6.sin6_addr),
-			              b2, sizeof(b2)-1);
-			break;
-		case AF_INET:
-			s = inet_ntop(srv_sock->addr.plain.sa_family,
-			              (const void *) &(srv_sock->addr.ipv4.sin_addr),
-			              b2, sizeof(b2)-1);
-			break;
+	case AF_INET6:
+		s = inet_ntop(srv_sock->addr.plain.sa_family,
+		              (const void *) &(srv_sock->addr.ipv6.sin6_addr),
+		              b2, sizeof(b2)-1);
+		break;
+	case AF_INET:
+		s = inet_ntop(srv_sock->addr.plain.sa_family,
+		              (const void *) &(srv_sock->addr.ipv4.sin_addr),
+		              b2, sizeof(b2)-1);
+		break;
 #else
-		case AF_INET:
-			s = inet_ntoa(srv_sock->addr.ipv4.sin_addr);
-			break;
+	case AF_INET:
+		s = inet_ntoa(srv_sock->addr.ipv4.sin_addr);
+		break;
 #endif
-		default:
-			s = "";
-			break;
-		}
-		cgi_env_add(&env, CONST_STR_LEN("SERVER_ADDR"), s, strlen(s));
+	default:
+		s = "";
+		break;
+	}
+	cgi_env_add(&env, CONST_STR_LEN("SERVER_ADDR"), s, strlen(s));
 
-		s = get_http_method_name(con->request.http_method);
-		cgi_env_add(&env, CONST_STR_LEN("REQUEST_METHOD"), s, strlen(s));
+	s = get_http_method_name(con->request.http_method);
+	cgi_env_add(&env, CONST_STR_LEN("REQUEST_METHOD"), s, strlen(s));
 
-		if (!buffer_is_empty(con->request.pathinfo)) {
-			cgi_env_add(&env, CONST_STR_LEN("PATH_INFO"), CONST_BUF_LEN(con->request.pathinfo));
-		}
-		cgi_env_add(&env, CONST_STR_LEN("REDIRECT_STATUS"), CONST_STR_LEN("200"));
-		if (!buffer_is_empty(con->uri.query)) {
-			cgi_env_add(&env, CONST_STR_LEN("QUERY_STRING"), CONST_BUF_LEN(con->uri.query));
-		}
-		if (!buffer_is_empty(con->request.orig_uri)) {
-			cgi_env_add(&env, CONST_STR_LEN("REQUEST_URI"), CONST_BUF_LEN(con->request.orig_uri));
-		}
+	if (!buffer_is_empty(con->request.pathinfo)) {
+		cgi_env_add(&env, CONST_STR_LEN("PATH_INFO"), CONST_BUF_LEN(con->request.pathinfo));
+	}
+	cgi_env_add(&env, CONST_STR_LEN("REDIRECT_STATUS"), CONST_STR_LEN("200"));
+	if (!buffer_is_empty(con->uri.query)) {
+		cgi_env_add(&env, CONST_STR_LEN("QUERY_STRING"), CONST_BUF_LEN(con->uri.query));
+	}
+	if (!buffer_is_empty(con->request.orig_uri)) {
+		cgi_env_add(&env, CONST_STR_LEN("REQUEST_URI"), CONST_BUF_LEN(con->request.orig_uri));
+	}
 
 
-		switch (con->dst_addr.plain.sa_family) {
+	switch (con->dst_addr.plain.sa_family) {
 #ifdef HAVE_IPV6
-		case AF_INET6:
-			s = inet_ntop(con->dst_addr.plain.sa_family,
-			              (const void *) &(con->dst_addr.ipv6.sin6_addr),
-			              b2, sizeof(b2)-1);
-			break;
-		case AF_INET:
-			s = inet_ntop(con->dst_addr.plain.sa_family,
-			              (const void *) &(con->dst_addr.ipv4.sin_addr),
-			              b2, sizeof(b2)-1);
-			break;
+	case AF_INET6:
+		s = inet_ntop(con->dst_addr.plain.sa_family,
+		              (const void *) &(con->dst_addr.ipv6.sin6_addr),
+		              b2, sizeof(b2)-1);
+		break;
+	case AF_INET:
+		s = inet_ntop(con->dst_addr.plain.sa_family,
+		              (const void *) &(con->dst_addr.ipv4.sin_addr),
+		              b2, sizeof(b2)-1);
+		break;
 #else
-		case AF_INET:
-			s = inet_ntoa(con->dst_addr.ipv4.sin_addr);
-			break;
+	case AF_INET:
+		s = inet_ntoa(con->dst_addr.ipv4.sin_addr);
+		break;
 #endif
-		default:
-			s = "";
-			break;
-		}
-		cgi_env_add(&env, CONST_STR_LEN("REMOTE_ADDR"), s, strlen(s));
+	default:
+		s = "";
+		break;
+	}
+	cgi_env_add(&env, CONST_STR_LEN("REMOTE_ADDR"), s, strlen(s));
 
-		LI_ltostr(buf,
+	LI_ltostr(buf,
 #ifdef HAVE_IPV6
-			ntohs(con->dst_addr.plain.sa_family == AF_INET6 ? con->dst_addr.ipv6.sin6_port : con->dst_addr.ipv4.sin_port)
+		ntohs(con->dst_addr.plain.sa_family == AF_INET6 ? con->dst_addr.ipv6.sin6_port : con->dst_addr.ipv4.sin_port)
 #else
-			ntohs(con->dst_addr.ipv4.sin_port)
+		ntohs(con->dst_addr.ipv4.sin_port)
 #endif
-			);
-		cgi_env_add(&env, CONST_STR_LEN("REMOTE_PORT"), buf, strlen(buf));
+		);
+	cgi_env_add(&env, CONST_STR_LEN("REMOTE_PORT"), buf, strlen(buf));
 
-		if (buffer_is_equal_caseless_string(con->uri.scheme, CONST_STR_LEN("https"))) {
-			cgi_env_add(&env, CONST_STR_LEN("HTTPS"), CONST_STR_LEN("on"));
-		}
+	if (buffer_is_equal_caseless_string(con->uri.scheme, CONST_STR_LEN("https"))) {
+		cgi_env_add(&env, CONST_STR_LEN("HTTPS"), CONST_STR_LEN("on"));
+	}
 
-		/* request.content_length < SSIZE_MAX, see request.c */
-		LI_ltostr(buf, con->request.content_length);
-		cgi_env_add(&env, CONST_STR_LEN("CONTENT_LENGTH"), buf, strlen(buf));
-		cgi_env_add(&env, CONST_STR_LEN("SCRIPT_FILENAME"), CONST_BUF_LEN(con->physical.path));
-		cgi_env_add(&env, CONST_STR_LEN("SCRIPT_NAME"), CONST_BUF_LEN(con->uri.path));
-		cgi_env_add(&env, CONST_STR_LEN("DOCUMENT_ROOT"), CONST_BUF_LEN(con->physical.basedir));
+	/* request.content_length < SSIZE_MAX, see request.c */
+	LI_ltostr(buf, con->request.content_length);
+	cgi_env_add(&env, CONST_STR_LEN("CONTENT_LENGTH"), buf, strlen(buf));
+	cgi_env_add(&env, CONST_STR_LEN("SCRIPT_FILENAME"), CONST_BUF_LEN(con->physical.path));
+	cgi_env_add(&env, CONST_STR_LEN("SCRIPT_NAME"), CONST_BUF_LEN(con->uri.path));
+	cgi_env_add(&env, CONST_STR_LEN("DOCUMENT_ROOT"), CONST_BUF_LEN(con->physical.basedir));
 
-		/* for valgrind */
-		if (NULL != (s = getenv("LD_PRELOAD"))) {
-			cgi_env_add(&env, CONST_STR_LEN("LD_PRELOAD"), s, strlen(s));
-		}
+	/* for valgrind */
+	if (NULL != (s = getenv("LD_PRELOAD"))) {
+		cgi_env_add(&env, CONST_STR_LEN("LD_PRELOAD"), s, strlen(s));
+	}
 
-		if (NULL != (s = getenv("LD_LIBRARY_PATH"))) {
-			cgi_env_add(&env, CONST_STR_LEN("LD_LIBRARY_PATH"), s, strlen(s));
-		}
+	if (NULL != (s = getenv("LD_LIBRARY_PATH"))) {
+		cgi_env_add(&env, CONST_STR_LEN("LD_LIBRARY_PATH"), s, strlen(s));
+	}
 #ifdef __CYGWIN__
-		/* CYGWIN needs SYSTEMROOT */
-		if (NULL != (s = getenv("SYSTEMROOT"))) {
-			cgi_env_add(&env, CONST_STR_LEN("SYSTEMROOT"), s, strlen(s));
-		}
+	/* CYGWIN needs SYSTEMROOT */
+	if (NULL != (s = getenv("SYSTEMROOT"))) {
+		cgi_env_add(&env, CONST_STR_LEN("SYSTEMROOT"), s, strlen(s));
+	}
 #endif
 
-		for (n = 0; n < con->request.headers->used; n++) {
-			data_string *ds;
-
-			ds = (data_string *)con->request.headers->data[n];
-
-			if (ds->value->used && ds->key->used) {
-				size_t j;
-
-				buffer_reset(p->tmp_buf);
-
-				if (0 != strcasecmp(ds->key->ptr, "CONTENT-TYPE")) {
-					buffer_copy_string_len(p->tmp_buf, CONST_STR_LEN("HTTP_"));
-					p->tmp_buf->used--; /* strip \0 after HTTP_ */
-				}
+	for (n = 0; n < con->request.headers->used; n++) {
+		data_string *ds;
 
-				buffer_prepare_append(p->tmp_buf, ds->key->used + 2);
+		ds = (data_string *)con->request.headers->data[n];
 
-				for (j = 0; j < ds->key->used - 1; j++) {
-					char cr = '_';
-					if (light_isalpha(ds->key->ptr[j])) {
-						/* upper-case */
-						cr = ds->key->ptr[j] & ~32;
-					} else if (light_isdigit(ds->key->ptr[j])) {
-						/* copy */
-						cr = ds->key->ptr[j];
-					}
-					p->tmp_buf->ptr[p->tmp_buf->used++] = cr;
-				}
-				p->tmp_buf->ptr[p->tmp_buf->used++] = '\0';
+		if (ds->value->used && ds->key->used) {
+			buffer *key = http_cgi_header_key(srv, ds->key);
 
-				cgi_env_add(&env, CONST_BUF_LEN(p->tmp_buf), CONST_BUF_LEN(ds->value));
-			}
+			cgi_env_add(&env, CONST_BUF_LEN(key), CONST_BUF_LEN(ds->value));
 		}
+	}
 
-		for (n = 0; n < con->environment->used; n++) {
-			data_string *ds;
-
-			ds = (data_string *)con->environment->data[n];
-
-			if (ds->value->used && ds->key->used) {
-				size_t j;
-
-				buffer_reset(p->tmp_buf);
-
-				buffer_prepare_append(p->tmp_buf, ds->key->used + 2);
+	for (n = 0; n < con->environment->used; n++) {
+		data_string *ds;
 
-				for (j = 0; j < ds->key->used - 1; j++) {
-					char cr = '_';
-					if (light_isalpha(ds->key->ptr[j])) {
-						/* upper-case */
-						cr = ds->key->ptr[j] & ~32;
-					} else if (light_isdigit(ds->key->ptr[j])) {
-						/* copy */
-						cr = ds->key->ptr[j];
-					}
-					p->tmp_buf->ptr[p->tmp_buf->used++] = cr;
-				}
-				p->tmp_buf->ptr[p->tmp_buf->used++] = '\0';
+		ds = (data_string *)con->environment->data[n];
 
-				cgi_env_add(&env, CONST_BUF_LEN(p->tmp_buf), CONST_BUF_LEN(ds->value));
-			}
-		}
+		if (ds->value->used && ds->key->used) {
+			buffer *key = http_cgi_env_key(srv, ds->key);
 
-		if (env.size == env.used) {
-			env.size += 16;
-			env.ptr = realloc(env.ptr, env.size * sizeof(*env.ptr));
+			cgi_env_add(&env, CONST_BUF_LEN(key), CONST_BUF_LEN(ds->value));
 		}
+	}
 
-		env.ptr[env.used] = NULL;
-
-		/* set up args */
-		argc = 3;
-		args = malloc(sizeof(*args) * argc);
-		i = 0;
+	if (env.size == env.used) {
+		env.size += 16;
+		env.ptr = realloc(env.ptr, env.size * sizeof(*env.ptr));
+	}
 
-		if (cgi_handler->used > 1) {
-			args[i++] = cgi_handler->ptr;
-		}
-		args[i++] = con->physical.path->ptr;
-		args[i  ] = NULL;
+	env.ptr[env.used] = NULL;
 
-		/* search for the last / */
-		if (NULL != (c = strrchr(con->physical.path->ptr, '/'))) {
-			*c = '\0';
+	/* set up args */
+	argc = 3;
+	args = malloc(sizeof(*args) * argc);
+	i = 0;
 
-			/* change to the physical directory */
-			if (-1 == chdir(con->physical.path->ptr)) {
-				log_error_write(srv, __FILE__, __LINE__, "ssb", "chdir failed:", strerror(errno), con->physical.path);
-			}
-			*c = '/';
-		}
+	if (cgi_handler->used > 1) {
+		args[i++] = cgi_handler->ptr;
+	}
+	args[i++] = con->physical.path->ptr;
+	args[i  ] = NULL;
 
-		/* we don't need the client socket */
-		for (i = 3; i < 256; i++) {
-			if (i != srv->errorlog_fd) close(i);
-		}
+	/* the cgi runs in the directory of the script */
+	buffer_copy_string_buffer(p->tmp_buf, con->physical.path);
+	if (NULL != (slash = strrchr(p->tmp_buf->ptr, '/'))) *slash = '\0';
 
-		/* exec the cgi */
-		execve(args[0], args, env.ptr);
+	pid = cgi_spawn(srv, args, env.ptr, slash ? p->tmp_buf->ptr : NULL, to_cgi_fds, from_cgi_fds);
 
-		/* log_error_write(srv, __FILE__, __LINE__, "sss", "CGI failed:", strerror(errno), args[0]); */
+	for (n = 0; n < env.used; n++) free(env.ptr[n]);
+	free(env.ptr);
+	free(args);
 
-		/* */
-		SEGFAULT();
-		break;
-	}
+	switch (pid) {
 	case -1:
 		/* error */
-		log_error_write(srv, __FILE__, __LINE__, "ss", "fork failed:", strerror(errno));
 		close(from_cgi_fds[0]);
 		close(from_cgi_fds[1]);
 		close(to_cgi_fds[0]);
@@ -1135,6 +1164,7 @@ static int cgi_create_env(server *srv, connection *con, plugin_data *p, buffer *
 					}
 					break;
 				case UNUSED_CHUNK:
+				case PIPE_CHUNK: /* only in responses */
 					break;
 				}
 
@@ -1202,6 +1232,8 @@ static int mod_cgi_patch_connection(server *srv, connection *con, plugin_data *p
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(cgi);
 	PATCH(execute_x_only);
 
@@ -1225,6 +1257,8 @@ static int mod_cgi_patch_connection(server *srv, connection *con, plugin_data *p
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
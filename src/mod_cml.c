@@ -141,6 +141,8 @@ static int mod_cml_patch_connection(server *srv, connection *con, plugin_data *p
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(ext);
 #if defined(HAVE_MEMCACHE_H)
 	PATCH(mc);
@@ -174,6 +176,8 @@ static int mod_cml_patch_connection(server *srv, connection *con, plugin_data *p
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
@@ -8,9 +8,15 @@
 
 #include "crc32.h"
 #include "etag.h"
+#include "http_chunk.h"
+#include "splaytree.h"
+#include "status_counter.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifndef __WIN32
+# include <sys/wait.h>
+#endif
 
 #include <assert.h>
 #include <fcntl.h>
@@ -33,6 +39,16 @@
 # include <bzlib.h>
 #endif
 
+#if defined HAVE_BROTLI_ENCODE_H && defined HAVE_LIBBROTLIENC
+# define USE_BROTLI
+# include <brotli/encode.h>
+#endif
+
+#if defined HAVE_ZSTD_H && defined HAVE_LIBZSTD
+# define USE_ZSTD
+# include <zstd.h>
+#endif
+
 #include "sys-mmap.h"
 
 /* request: accept-encoding */
@@ -43,33 +59,414 @@
 #define HTTP_ACCEPT_ENCODING_BZIP2    BV(4)
 #define HTTP_ACCEPT_ENCODING_X_GZIP   BV(5)
 #define HTTP_ACCEPT_ENCODING_X_BZIP2  BV(6)
+#define HTTP_ACCEPT_ENCODING_BR       BV(7)
+#define HTTP_ACCEPT_ENCODING_ZSTD     BV(8)
+
+/* the encodings we can produce, in the default order of preference */
+static const struct {
+	int type;
+	const char *name;
+} compress_encodings[] = {
+#ifdef USE_BROTLI
+	{ HTTP_ACCEPT_ENCODING_BR,      "br" },
+#endif
+#ifdef USE_ZSTD
+	{ HTTP_ACCEPT_ENCODING_ZSTD,    "zstd" },
+#endif
+#ifdef USE_ZLIB
+	{ HTTP_ACCEPT_ENCODING_GZIP,    "gzip" },
+	{ HTTP_ACCEPT_ENCODING_X_GZIP,  "x-gzip" },
+	{ HTTP_ACCEPT_ENCODING_DEFLATE, "deflate" },
+#endif
+#ifdef USE_BZ2LIB
+	{ HTTP_ACCEPT_ENCODING_BZIP2,   "bzip2" },
+	{ HTTP_ACCEPT_ENCODING_X_BZIP2, "x-bzip2" },
+#endif
+	{ 0,                            NULL }
+};
+
+/* brotli is slow at its default of 11 for compressing on each request */
+#define COMPRESS_BROTLI_QUALITY 5
 
 #ifdef __WIN32
 # define mkdir(x,y) mkdir(x)
 #endif
 
+/* a file in compress.cache-dir */
+typedef struct compress_cache_entry {
+	buffer *name;   /* the cache file */
+	size_t key_len; /* the part of name without the etag: the file and the encoding */
+	int hash;       /* of the key, a newer version of the file replaces the entry */
+	off_t size;
+	time_t used;
+
+	struct compress_cache_entry *prev, *next; /* the most recently used first */
+} compress_cache_entry;
+
+/* the index of a compress.cache-dir with limits */
+typedef struct {
+	buffer *dir;        /* as configured */
+	size_t dir_len;     /* with the slash, the names in the manifest are relative to it */
+	buffer *manifest;
+	buffer *statuskey;
+
+	off_t max_size;     /* 0: unlimited */
+	size_t max_entries; /* 0: unlimited */
+
+	splay_tree *index;  /* hash of the key -> entry */
+	compress_cache_entry *first, *last;
+	size_t entries;
+	off_t size;
+
+	int dirty;          /* the manifest is out of date */
+	time_t saved;
+
+	int hits, misses, evictions;
+} compress_cache;
+
 typedef struct {
 	buffer *compress_cache_dir;
+	compress_cache *cache; /* NULL if the cache-dir has no limits */
 	array  *compress;
 	off_t   compress_max_filesize; /** max filesize in kb */
 	int     allowed_encodings;
+	int    *encodings; /* the allowed encodings in the order of preference, 0 terminated */
+	unsigned short gzip_level;     /* 0: the default of the library */
+	unsigned short brotli_quality;
+	unsigned short zstd_level;
+	unsigned short compress_dynamic; /* responses of fastcgi, proxy, cgi, ... too */
+	unsigned short compress_dynamic_min_size;
+	array  *precompressed; /* encodings of file.ext.br, file.ext.gz, ... in the order of preference */
+	unsigned short cache_workers; /* server-wide, 0: compress cache misses in the request */
+	unsigned int cache_max_size; /* MBytes */
+	unsigned int cache_max_entries;
 } plugin_config;
 
+/* the sidecar files for compress.precompressed */
+static const struct {
+	const char *encoding;
+	const char *suffix;
+} precompressed_suffixes[] = {
+	{ "br",   ".br" },
+	{ "gzip", ".gz" },
+	{ "zstd", ".zst" },
+	{ NULL,   NULL }
+};
+
+#ifdef USE_ZLIB
+/* a response compressed while it is sent */
+typedef struct {
+	z_stream z;
+	buffer *out;
+} handler_ctx;
+#endif
+
+/* a process filling the cache in the background */
+typedef struct {
+	pid_t pid;
+	buffer *ofn; /* the cache file it writes */
+	compress_cache *cache;
+	size_t key_len;
+} compress_job;
+
+typedef struct {
+	compress_job **ptr;
+	size_t used;
+	size_t size;
+} compress_jobs;
+
 typedef struct {
 	PLUGIN_DATA;
 	buffer *ofn;
+	buffer *tmpfn;
 	buffer *b;
 
+	compress_jobs jobs;
+
+	compress_cache **caches;
+	size_t caches_used;
+
 	plugin_config **config_storage;
 	plugin_config conf;
 } plugin_data;
 
+/* the counters of the cache in mod_status */
+static void mod_compress_cache_status(server *srv, compress_cache *c) {
+	size_t len = c->statuskey->used - 1;
+
+#define COMPRESS_CACHE_STATUS(key, value) \
+	buffer_append_string_len(c->statuskey, CONST_STR_LEN(key)); \
+	status_counter_set(srv, CONST_BUF_LEN(c->statuskey), value); \
+	c->statuskey->used = len + 1; \
+	c->statuskey->ptr[len] = '\0';
+
+	COMPRESS_CACHE_STATUS(".entries", c->entries);
+	COMPRESS_CACHE_STATUS(".size-kbytes", c->size >> 10);
+	COMPRESS_CACHE_STATUS(".hits", c->hits);
+	COMPRESS_CACHE_STATUS(".misses", c->misses);
+	COMPRESS_CACHE_STATUS(".evictions", c->evictions);
+
+#undef COMPRESS_CACHE_STATUS
+}
+
+/* drop e from the index, the file is removed too if unlink_file is set */
+static void mod_compress_cache_remove(server *srv, compress_cache *c, compress_cache_entry *e, int unlink_file) {
+	c->index = splaytree_splay(c->index, e->hash);
+	if (c->index && c->index->key == e->hash && c->index->data == e) {
+		c->index = splaytree_delete(c->index, e->hash);
+	}
+
+	if (e->prev) e->prev->next = e->next; else c->first = e->next;
+	if (e->next) e->next->prev = e->prev; else c->last = e->prev;
+
+	c->entries--;
+	c->size -= e->size;
+	c->dirty = 1;
+
+	if (unlink_file && -1 == unlink(e->name->ptr) && errno != ENOENT) {
+		log_error_write(srv, __FILE__, __LINE__, "sbss", "unlinking cachefile", e->name, "failed:", strerror(errno));
+	}
+
+	buffer_free(e->name);
+	free(e);
+}
+
+/* name was used or written just now; it becomes the most recently used entry
+ * and the least recently used ones are removed until the cache fits its limits */
+static void mod_compress_cache_use(server *srv, compress_cache *c, buffer *name, size_t key_len, off_t size, time_t used) {
+	compress_cache_entry *e;
+	int hash = generate_crc32c(name->ptr, key_len);
+
+	c->index = splaytree_splay(c->index, hash);
+
+	if (c->index && c->index->key == hash) {
+		e = c->index->data;
+
+		if (buffer_is_equal(e->name, name)) {
+			if (e->prev) {
+				/* move to the front */
+				e->prev->next = e->next;
+				if (e->next) e->next->prev = e->prev; else c->last = e->prev;
+
+				e->prev = NULL;
+				e->next = c->first;
+				c->first->prev = e;
+				c->first = e;
+			}
+
+			c->size += size - e->size;
+			e->size = size;
+			e->used = used;
+			c->dirty = 1;
+
+			return;
+		}
+
+		/* an older version of the file (or another one with the same hash) */
+		mod_compress_cache_remove(srv, c, e, 1);
+		c->evictions++;
+	}
+
+	e = calloc(1, sizeof(*e));
+	e->name = buffer_init_buffer(name);
+	e->key_len = key_len;
+	e->hash = hash;
+	e->size = size;
+	e->used = used;
+
+	c->index = splaytree_insert(c->index, hash, e);
+
+	e->next = c->first;
+	if (c->first) c->first->prev = e; else c->last = e;
+	c->first = e;
+
+	c->entries++;
+	c->size += size;
+	c->dirty = 1;
+
+	/* the new entry stays, even if it is larger than the cache */
+	while (c->last != c->first &&
+	       ((c->max_entries && c->entries > c->max_entries) ||
+		(c->max_size && c->size > c->max_size))) {
+		mod_compress_cache_remove(srv, c, c->last, 1);
+		c->evictions++;
+	}
+}
+
+/* the manifest has a line per entry, the least recently used first:
+ * <size> <last used> <length of the key> <name relative to the cache-dir> */
+static int mod_compress_cache_save(server *srv, compress_cache *c) {
+	compress_cache_entry *e;
+	buffer *b, *tmp;
+	int fd, ret = 0;
+
+	b = buffer_init();
+
+	for (e = c->last; e; e = e->prev) {
+		/* can't be read back */
+		if (NULL != strchr(e->name->ptr, '\n')) continue;
+
+		buffer_append_off_t(b, e->size);
+		buffer_append_string_len(b, CONST_STR_LEN(" "));
+		buffer_append_long(b, e->used);
+		buffer_append_string_len(b, CONST_STR_LEN(" "));
+		buffer_append_long(b, e->key_len - c->dir_len);
+		buffer_append_string_len(b, CONST_STR_LEN(" "));
+		buffer_append_string(b, e->name->ptr + c->dir_len);
+		buffer_append_string_len(b, CONST_STR_LEN("\n"));
+	}
+
+	tmp = buffer_init_buffer(c->manifest);
+	buffer_append_string_len(tmp, CONST_STR_LEN(".tmp-"));
+	buffer_append_long(tmp, getpid());
+
+	if (-1 == (fd = open(tmp->ptr, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600))) {
+		log_error_write(srv, __FILE__, __LINE__, "sbss", "creating", tmp, "failed:", strerror(errno));
+		ret = -1;
+	} else {
+		size_t len = b->used ? b->used - 1 : 0;
+
+		if ((ssize_t)len != write(fd, b->ptr, len)) {
+			log_error_write(srv, __FILE__, __LINE__, "sbss", "writing", tmp, "failed:", strerror(errno));
+			ret = -1;
+		}
+
+		close(fd);
+
+		if (0 == ret && -1 == rename(tmp->ptr, c->manifest->ptr)) {
+			log_error_write(srv, __FILE__, __LINE__, "sbss", "renaming", tmp, "failed:", strerror(errno));
+			ret = -1;
+		}
+
+		if (0 != ret) unlink(tmp->ptr);
+	}
+
+	buffer_free(tmp);
+	buffer_free(b);
+
+	c->dirty = 0;
+	c->saved = srv->cur_ts;
+
+	return ret;
+}
+
+/* rebuild the index from the manifest, the files aren't checked: one which
+ * is gone is a miss of mod_compress_physical() and dropped when it is evicted */
+static void mod_compress_cache_load(server *srv, compress_cache *c) {
+	struct stat st;
+	buffer *b, *name;
+	char *s, *e;
+	int fd;
+
+	if (-1 == (fd = open(c->manifest->ptr, O_RDONLY | O_BINARY))) {
+		if (errno != ENOENT) {
+			log_error_write(srv, __FILE__, __LINE__, "sbss", "opening", c->manifest, "failed:", strerror(errno));
+		}
+		return;
+	}
+
+	if (-1 == fstat(fd, &st) || 0 == st.st_size) {
+		close(fd);
+		return;
+	}
+
+	b = buffer_init();
+	buffer_prepare_copy(b, st.st_size + 1);
+
+	if (st.st_size != read(fd, b->ptr, st.st_size)) {
+		log_error_write(srv, __FILE__, __LINE__, "sbss", "reading", c->manifest, "failed:", strerror(errno));
+		close(fd);
+		buffer_free(b);
+		return;
+	}
+	close(fd);
+
+	b->ptr[st.st_size] = '\0';
+	b->used = st.st_size + 1;
+
+	name = buffer_init();
+
+	for (s = b->ptr; *s; s = e + 1) {
+		off_t size;
+		time_t used;
+		long key_len;
+		char *n;
+
+		if (NULL == (e = strchr(s, '\n'))) break;
+		*e = '\0';
+
+		size = strtoll(s, &n, 10);
+		if (*n != ' ' || size < 0) continue;
+		used = strtol(n + 1, &n, 10);
+		if (*n != ' ') continue;
+		key_len = strtol(n + 1, &n, 10);
+		if (*n != ' ' || key_len <= 0 || (size_t)key_len > strlen(n + 1)) continue;
+
+		buffer_copy_string_buffer(name, c->dir);
+		BUFFER_APPEND_SLASH(name);
+		buffer_append_string(name, n + 1);
+
+		mod_compress_cache_use(srv, c, name, c->dir_len + key_len, size, used);
+	}
+
+	buffer_free(name);
+	buffer_free(b);
+
+	/* loaded in the same order */
+	c->dirty = 0;
+}
+
+static compress_cache *mod_compress_cache_get(server *srv, plugin_data *p, buffer *dir) {
+	compress_cache *c;
+	size_t i;
+
+	for (i = 0; i < p->caches_used; i++) {
+		if (buffer_is_equal(p->caches[i]->dir, dir)) return p->caches[i];
+	}
+
+	c = calloc(1, sizeof(*c));
+	c->dir = buffer_init_buffer(dir);
+	c->dir_len = dir->used - 1;
+	if (dir->ptr[c->dir_len - 1] != '/') c->dir_len++;
+
+	c->manifest = buffer_init_buffer(dir);
+	BUFFER_APPEND_SLASH(c->manifest);
+	buffer_append_string_len(c->manifest, CONST_STR_LEN(".manifest"));
+
+	c->statuskey = buffer_init_string("compress.cache.");
+	buffer_append_string_len(c->statuskey, dir->ptr, dir->ptr[dir->used - 2] == '/' ? dir->used - 2 : dir->used - 1);
+
+	c->saved = srv->cur_ts;
+
+	/* without limits yet, the next use applies them */
+	mod_compress_cache_load(srv, c);
+	mod_compress_cache_status(srv, c);
+
+	p->caches = realloc(p->caches, (p->caches_used + 1) * sizeof(*p->caches));
+	p->caches[p->caches_used++] = c;
+
+	return c;
+}
+
+static void mod_compress_cache_free(server *srv, compress_cache *c) {
+	if (c->dirty) mod_compress_cache_save(srv, c);
+
+	while (c->first) mod_compress_cache_remove(srv, c, c->first, 0);
+
+	buffer_free(c->dir);
+	buffer_free(c->manifest);
+	buffer_free(c->statuskey);
+
+	free(c);
+}
+
 INIT_FUNC(mod_compress_init) {
 	plugin_data *p;
 
 	p = calloc(1, sizeof(*p));
 
 	p->ofn = buffer_init();
+	p->tmpfn = buffer_init();
 	p->b = buffer_init();
 
 	return p;
@@ -78,13 +475,30 @@ INIT_FUNC(mod_compress_init) {
 FREE_FUNC(mod_compress_free) {
 	plugin_data *p = p_d;
 
-	UNUSED(srv);
-
 	if (!p) return HANDLER_GO_ON;
 
 	buffer_free(p->ofn);
+	buffer_free(p->tmpfn);
 	buffer_free(p->b);
 
+	if (p->caches) {
+		size_t i;
+		for (i = 0; i < p->caches_used; i++) {
+			mod_compress_cache_free(srv, p->caches[i]);
+		}
+		free(p->caches);
+	}
+
+	if (p->jobs.size) {
+		size_t i;
+		/* the running processes finish on their own */
+		for (i = 0; i < p->jobs.used; i++) {
+			buffer_free(p->jobs.ptr[i]->ofn);
+			free(p->jobs.ptr[i]);
+		}
+		free(p->jobs.ptr);
+	}
+
 	if (p->config_storage) {
 		size_t i;
 		for (i = 0; i < srv->config_context->used; i++) {
@@ -93,6 +507,8 @@ FREE_FUNC(mod_compress_free) {
 			if (!s) continue;
 
 			array_free(s->compress);
+			array_free(s->precompressed);
+			free(s->encodings);
 			buffer_free(s->compress_cache_dir);
 
 			free(s);
@@ -159,6 +575,15 @@ SETDEFAULTS_FUNC(mod_compress_setdefaults) {
 		{ "compress.filetype",              NULL, T_CONFIG_ARRAY, T_CONFIG_SCOPE_CONNECTION },
 		{ "compress.max-filesize",          NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },
 		{ "compress.allowed-encodings",     NULL, T_CONFIG_ARRAY, T_CONFIG_SCOPE_CONNECTION },
+		{ "compress.dynamic",               NULL, T_CONFIG_BOOLEAN, T_CONFIG_SCOPE_CONNECTION },
+		{ "compress.dynamic-min-size",      NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },
+		{ "compress.precompressed",         NULL, T_CONFIG_ARRAY, T_CONFIG_SCOPE_CONNECTION },
+		{ "compress.gzip-level",            NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },
+		{ "compress.brotli-quality",        NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },
+		{ "compress.zstd-level",            NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },
+		{ "compress.cache-workers",         NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_SERVER },
+		{ "compress.cache-max-size",        NULL, T_CONFIG_INT, T_CONFIG_SCOPE_CONNECTION },
+		{ "compress.cache-max-entries",     NULL, T_CONFIG_INT, T_CONFIG_SCOPE_CONNECTION },
 		{ NULL,                             NULL, T_CONFIG_UNSET, T_CONFIG_SCOPE_UNSET }
 	};
 
@@ -167,17 +592,30 @@ SETDEFAULTS_FUNC(mod_compress_setdefaults) {
 	for (i = 0; i < srv->config_context->used; i++) {
 		plugin_config *s;
 		array  *encodings_arr = array_init();
+		size_t m;
 
 		s = calloc(1, sizeof(plugin_config));
 		s->compress_cache_dir = buffer_init();
 		s->compress = array_init();
 		s->compress_max_filesize = 0;
 		s->allowed_encodings = 0;
+		s->compress_dynamic = 0;
+		s->compress_dynamic_min_size = 128;
+		s->precompressed = array_init();
 
 		cv[0].destination = s->compress_cache_dir;
 		cv[1].destination = s->compress;
 		cv[2].destination = &(s->compress_max_filesize);
 		cv[3].destination = encodings_arr; /* temp array for allowed encodings list */
+		cv[4].destination = &(s->compress_dynamic);
+		cv[5].destination = &(s->compress_dynamic_min_size);
+		cv[6].destination = s->precompressed;
+		cv[7].destination = &(s->gzip_level);
+		cv[8].destination = &(s->brotli_quality);
+		cv[9].destination = &(s->zstd_level);
+		cv[10].destination = &(s->cache_workers);
+		cv[11].destination = &(s->cache_max_size);
+		cv[12].destination = &(s->cache_max_entries);
 
 		p->config_storage[i] = s;
 
@@ -185,43 +623,76 @@ SETDEFAULTS_FUNC(mod_compress_setdefaults) {
 			return HANDLER_ERROR;
 		}
 
+		s->encodings = calloc(sizeof(compress_encodings) / sizeof(compress_encodings[0]), sizeof(int));
+
 		if (encodings_arr->used) {
-			size_t j = 0;
+			size_t j, k, n = 0;
+
+			/* the order of the list is the order of preference */
 			for (j = 0; j < encodings_arr->used; j++) {
 				data_string *ds = (data_string *)encodings_arr->data[j];
-#ifdef USE_ZLIB
-				if (NULL != strstr(ds->value->ptr, "gzip"))
-					s->allowed_encodings |= HTTP_ACCEPT_ENCODING_GZIP | HTTP_ACCEPT_ENCODING_X_GZIP;
-				if (NULL != strstr(ds->value->ptr, "x-gzip"))
-					s->allowed_encodings |= HTTP_ACCEPT_ENCODING_X_GZIP;
-				if (NULL != strstr(ds->value->ptr, "deflate"))
-					s->allowed_encodings |= HTTP_ACCEPT_ENCODING_DEFLATE;
-				/*
-				if (NULL != strstr(ds->value->ptr, "compress"))
-					s->allowed_encodings |= HTTP_ACCEPT_ENCODING_COMPRESS;
-				*/
-#endif
-#ifdef USE_BZ2LIB
-				if (NULL != strstr(ds->value->ptr, "bzip2"))
-					s->allowed_encodings |= HTTP_ACCEPT_ENCODING_BZIP2 | HTTP_ACCEPT_ENCODING_X_BZIP2;
-				if (NULL != strstr(ds->value->ptr, "x-bzip2"))
-					s->allowed_encodings |= HTTP_ACCEPT_ENCODING_X_BZIP2;
-#endif
+
+				for (k = 0; compress_encodings[k].name; k++) {
+					const char *name = compress_encodings[k].name;
+					int type = compress_encodings[k].type;
+
+					/* gzip and bzip2 include their x- variant */
+					if (!buffer_is_equal_string(ds->value, name, strlen(name)) &&
+					    !(type == HTTP_ACCEPT_ENCODING_X_GZIP && buffer_is_equal_string(ds->value, CONST_STR_LEN("gzip"))) &&
+					    !(type == HTTP_ACCEPT_ENCODING_X_BZIP2 && buffer_is_equal_string(ds->value, CONST_STR_LEN("bzip2")))) {
+						continue;
+					}
+
+					if (s->allowed_encodings & type) continue;
+
+					s->allowed_encodings |= type;
+					s->encodings[n++] = type;
+				}
 			}
 		} else {
 			/* default encodings */
-			s->allowed_encodings = 0
-#ifdef USE_ZLIB
-				| HTTP_ACCEPT_ENCODING_GZIP | HTTP_ACCEPT_ENCODING_X_GZIP | HTTP_ACCEPT_ENCODING_DEFLATE
-#endif
-#ifdef USE_BZ2LIB
-				| HTTP_ACCEPT_ENCODING_BZIP2 | HTTP_ACCEPT_ENCODING_X_BZIP2
-#endif
-				;
+			for (m = 0; compress_encodings[m].name; m++) {
+				s->allowed_encodings |= compress_encodings[m].type;
+				s->encodings[m] = compress_encodings[m].type;
+			}
+		}
+
+		if (s->gzip_level > 9) {
+			log_error_write(srv, __FILE__, __LINE__, "sd",
+					"compress.gzip-level has to be between 1 and 9, not:", s->gzip_level);
+			return HANDLER_ERROR;
+		}
+
+		if (s->brotli_quality > 11) {
+			log_error_write(srv, __FILE__, __LINE__, "sd",
+					"compress.brotli-quality has to be between 1 and 11, not:", s->brotli_quality);
+			return HANDLER_ERROR;
+		}
+
+		if (s->zstd_level > 22) {
+			log_error_write(srv, __FILE__, __LINE__, "sd",
+					"compress.zstd-level has to be between 1 and 22, not:", s->zstd_level);
+			return HANDLER_ERROR;
 		}
 
 		array_free(encodings_arr);
 
+		for (m = 0; m < s->precompressed->used; m++) {
+			data_string *ds = (data_string *)s->precompressed->data[m];
+			size_t k;
+
+			for (k = 0; precompressed_suffixes[k].encoding; k++) {
+				if (buffer_is_equal_string(ds->value, precompressed_suffixes[k].encoding, strlen(precompressed_suffixes[k].encoding))) break;
+			}
+
+			if (NULL == precompressed_suffixes[k].encoding) {
+				log_error_write(srv, __FILE__, __LINE__, "sb",
+						"compress.precompressed has to be one of: br, gzip, zstd, but not:", ds->value);
+
+				return HANDLER_ERROR;
+			}
+		}
+
 		if (!buffer_is_empty(s->compress_cache_dir)) {
 			struct stat st;
 			mkdir_recursive(s->compress_cache_dir->ptr);
@@ -232,6 +703,12 @@ SETDEFAULTS_FUNC(mod_compress_setdefaults) {
 
 				return HANDLER_ERROR;
 			}
+
+			if (s->cache_max_size || s->cache_max_entries) {
+				s->cache = mod_compress_cache_get(srv, p, s->compress_cache_dir);
+				s->cache->max_size = (off_t)s->cache_max_size << 20;
+				s->cache->max_entries = s->cache_max_entries;
+			}
 		}
 	}
 
@@ -253,7 +730,7 @@ static int deflate_file_to_buffer_gzip(server *srv, connection *con, plugin_data
 	z.opaque = Z_NULL;
 
 	if (Z_OK != deflateInit2(&z,
-				 Z_DEFAULT_COMPRESSION,
+				 p->conf.gzip_level ? p->conf.gzip_level : Z_DEFAULT_COMPRESSION,
 				 Z_DEFLATED,
 				 -MAX_WBITS,  /* supress zlib-header */
 				 8,
@@ -327,7 +804,7 @@ static int deflate_file_to_buffer_deflate(server *srv, connection *con, plugin_d
 	z.opaque = Z_NULL;
 
 	if (Z_OK != deflateInit2(&z,
-				 Z_DEFAULT_COMPRESSION,
+				 p->conf.gzip_level ? p->conf.gzip_level : Z_DEFAULT_COMPRESSION,
 				 Z_DEFLATED,
 				 -MAX_WBITS,  /* supress zlib-header */
 				 8,
@@ -411,84 +888,79 @@ static int deflate_file_to_buffer_bzip2(server *srv, connection *con, plugin_dat
 }
 #endif
 
-static int deflate_file_to_file(server *srv, connection *con, plugin_data *p, buffer *fn, stat_cache_entry *sce, int type) {
-	int ifd, ofd;
-	int ret = -1;
-	void *start;
-	const char *filename = fn->ptr;
-	ssize_t r;
-
-	/* overflow */
-	if ((off_t)(sce->st.st_size * 1.1) < sce->st.st_size) return -1;
-
-	/* don't mmap files > 128Mb
-	 *
-	 * we could use a sliding window, but currently there is no need for it
-	 */
+#ifdef USE_BROTLI
+static int deflate_file_to_buffer_brotli(server *srv, connection *con, plugin_data *p, unsigned char *start, off_t st_size) {
+	size_t out_size = BrotliEncoderMaxCompressedSize(st_size);
 
-	if (sce->st.st_size > 128 * 1024 * 1024) return -1;
+	UNUSED(srv);
+	UNUSED(con);
 
-	buffer_reset(p->ofn);
-	buffer_copy_string_buffer(p->ofn, p->conf.compress_cache_dir);
-	BUFFER_APPEND_SLASH(p->ofn);
+	if (0 == out_size) return -1;
 
-	if (0 == strncmp(con->physical.path->ptr, con->physical.doc_root->ptr, con->physical.doc_root->used-1)) {
-		buffer_append_string(p->ofn, con->physical.path->ptr + con->physical.doc_root->used - 1);
-		buffer_copy_string_buffer(p->b, p->ofn);
-	} else {
-		buffer_append_string_buffer(p->ofn, con->uri.path);
-	}
+	buffer_prepare_copy(p->b, out_size + 1);
 
-	switch(type) {
-	case HTTP_ACCEPT_ENCODING_GZIP:
-	case HTTP_ACCEPT_ENCODING_X_GZIP:
-		buffer_append_string_len(p->ofn, CONST_STR_LEN("-gzip-"));
-		break;
-	case HTTP_ACCEPT_ENCODING_DEFLATE:
-		buffer_append_string_len(p->ofn, CONST_STR_LEN("-deflate-"));
-		break;
-	case HTTP_ACCEPT_ENCODING_BZIP2:
-	case HTTP_ACCEPT_ENCODING_X_BZIP2:
-		buffer_append_string_len(p->ofn, CONST_STR_LEN("-bzip2-"));
-		break;
-	default:
-		log_error_write(srv, __FILE__, __LINE__, "sd", "unknown compression type", type);
+	if (BROTLI_FALSE == BrotliEncoderCompress(p->conf.brotli_quality ? p->conf.brotli_quality : COMPRESS_BROTLI_QUALITY,
+						  BROTLI_DEFAULT_WINDOW,
+						  BROTLI_MODE_GENERIC,
+						  st_size, start,
+						  &out_size, (uint8_t *)p->b->ptr)) {
 		return -1;
 	}
 
-	buffer_append_string_buffer(p->ofn, sce->etag);
+	p->b->used = out_size;
 
-	if (-1 == mkdir_for_file(p->ofn->ptr)) {
-		log_error_write(srv, __FILE__, __LINE__, "sb", "couldn't create directory for file", p->ofn);
-		return -1;
-	}
+	return 0;
+}
+#endif
+
+#ifdef USE_ZSTD
+static int deflate_file_to_buffer_zstd(server *srv, connection *con, plugin_data *p, unsigned char *start, off_t st_size) {
+	size_t out_size = ZSTD_compressBound(st_size);
+	size_t r;
+
+	UNUSED(srv);
+	UNUSED(con);
+
+	buffer_prepare_copy(p->b, out_size + 1);
+
+	r = ZSTD_compress(p->b->ptr, out_size, start, st_size,
+			  p->conf.zstd_level ? p->conf.zstd_level : ZSTD_CLEVEL_DEFAULT);
+	if (ZSTD_isError(r)) return -1;
+
+	p->b->used = r;
 
-	if (-1 == (ofd = open(p->ofn->ptr, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0600))) {
-		if (errno == EEXIST) {
-			/* cache-entry exists */
-#if 0
-			log_error_write(srv, __FILE__, __LINE__, "bs", p->ofn, "compress-cache hit");
+	return 0;
+}
 #endif
-			buffer_copy_string_buffer(con->physical.path, p->ofn);
 
-			return 0;
-		}
+/* compress fn into the cache file p->ofn */
+static int deflate_file_to_cache(server *srv, connection *con, plugin_data *p, buffer *fn, stat_cache_entry *sce, int type) {
+	int ifd, ofd;
+	int ret = -1;
+	void *start;
+	const char *filename = fn->ptr;
+	ssize_t r;
 
-		log_error_write(srv, __FILE__, __LINE__, "sbss", "creating cachefile", p->ofn, "failed", strerror(errno));
+	/* written under a name of its own and renamed when it is complete,
+	 * nobody sees a half-written cache file */
+	buffer_copy_string_buffer(p->tmpfn, p->ofn);
+	buffer_append_string_len(p->tmpfn, CONST_STR_LEN(".tmp-"));
+	buffer_append_long(p->tmpfn, getpid());
+
+	if (-1 == (ofd = open(p->tmpfn->ptr, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600))) {
+		log_error_write(srv, __FILE__, __LINE__, "sbss", "creating cachefile", p->tmpfn, "failed", strerror(errno));
 
 		return -1;
 	}
-#if 0
-	log_error_write(srv, __FILE__, __LINE__, "bs", p->ofn, "compress-cache miss");
-#endif
+
 	if (-1 == (ifd = open(filename, O_RDONLY | O_BINARY))) {
 		log_error_write(srv, __FILE__, __LINE__, "sbss", "opening plain-file", fn, "failed", strerror(errno));
 
 		close(ofd);
 
-		/* Remove the incomplete cache file, so that later hits aren't served from it */
-		if (-1 == unlink(p->ofn->ptr)) {
-			log_error_write(srv, __FILE__, __LINE__, "sbss", "unlinking incomplete cachefile", p->ofn, "failed:", strerror(errno));
+		/* Remove the incomplete cache file */
+		if (-1 == unlink(p->tmpfn->ptr)) {
+			log_error_write(srv, __FILE__, __LINE__, "sbss", "unlinking incomplete cachefile", p->tmpfn, "failed:", strerror(errno));
 		}
 
 		return -1;
@@ -501,9 +973,9 @@ static int deflate_file_to_file(server *srv, connection *con, plugin_data *p, bu
 		close(ofd);
 		close(ifd);
 
-		/* Remove the incomplete cache file, so that later hits aren't served from it */
-		if (-1 == unlink(p->ofn->ptr)) {
-			log_error_write(srv, __FILE__, __LINE__, "sbss", "unlinking incomplete cachefile", p->ofn, "failed:", strerror(errno));
+		/* Remove the incomplete cache file */
+		if (-1 == unlink(p->tmpfn->ptr)) {
+			log_error_write(srv, __FILE__, __LINE__, "sbss", "unlinking incomplete cachefile", p->tmpfn, "failed:", strerror(errno));
 		}
 
 		return -1;
@@ -517,9 +989,9 @@ static int deflate_file_to_file(server *srv, connection *con, plugin_data *p, bu
 		close(ifd);
 		free(start);
 
-		/* Remove the incomplete cache file, so that later hits aren't served from it */
-		if (-1 == unlink(p->ofn->ptr)) {
-			log_error_write(srv, __FILE__, __LINE__, "sbss", "unlinking incomplete cachefile", p->ofn, "failed:", strerror(errno));
+		/* Remove the incomplete cache file */
+		if (-1 == unlink(p->tmpfn->ptr)) {
+			log_error_write(srv, __FILE__, __LINE__, "sbss", "unlinking incomplete cachefile", p->tmpfn, "failed:", strerror(errno));
 		}
 
 		return -1;
@@ -541,6 +1013,16 @@ static int deflate_file_to_file(server *srv, connection *con, plugin_data *p, bu
 	case HTTP_ACCEPT_ENCODING_X_BZIP2:
 		ret = deflate_file_to_buffer_bzip2(srv, con, p, start, sce->st.st_size);
 		break;
+#endif
+#ifdef USE_BROTLI
+	case HTTP_ACCEPT_ENCODING_BR:
+		ret = deflate_file_to_buffer_brotli(srv, con, p, start, sce->st.st_size);
+		break;
+#endif
+#ifdef USE_ZSTD
+	case HTTP_ACCEPT_ENCODING_ZSTD:
+		ret = deflate_file_to_buffer_zstd(srv, con, p, start, sce->st.st_size);
+		break;
 #endif
 	default:
 		ret = -1;
@@ -550,10 +1032,10 @@ static int deflate_file_to_file(server *srv, connection *con, plugin_data *p, bu
 	if (ret == 0) {
 		r = write(ofd, p->b->ptr, p->b->used);
 		if (-1 == r) {
-			log_error_write(srv, __FILE__, __LINE__, "sbss", "writing cachefile", p->ofn, "failed:", strerror(errno));
+			log_error_write(srv, __FILE__, __LINE__, "sbss", "writing cachefile", p->tmpfn, "failed:", strerror(errno));
 			ret = -1;
 		} else if ((size_t)r != p->b->used) {
-			log_error_write(srv, __FILE__, __LINE__, "sbs", "writing cachefile", p->ofn, "failed: not enough bytes written");
+			log_error_write(srv, __FILE__, __LINE__, "sbs", "writing cachefile", p->tmpfn, "failed: not enough bytes written");
 			ret = -1;
 		}
 	}
@@ -568,14 +1050,183 @@ static int deflate_file_to_file(server *srv, connection *con, plugin_data *p, bu
 	close(ifd);
 
 	if (ret != 0) {
-		/* Remove the incomplete cache file, so that later hits aren't served from it */
-		if (-1 == unlink(p->ofn->ptr)) {
-			log_error_write(srv, __FILE__, __LINE__, "sbss", "unlinking incomplete cachefile", p->ofn, "failed:", strerror(errno));
+		/* Remove the incomplete cache file */
+		if (-1 == unlink(p->tmpfn->ptr)) {
+			log_error_write(srv, __FILE__, __LINE__, "sbss", "unlinking incomplete cachefile", p->tmpfn, "failed:", strerror(errno));
+		}
+
+		return -1;
+	}
+
+	if (-1 == rename(p->tmpfn->ptr, p->ofn->ptr)) {
+		log_error_write(srv, __FILE__, __LINE__, "sbsbs", "renaming", p->tmpfn, "to", p->ofn, strerror(errno));
+
+		unlink(p->tmpfn->ptr);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+static compress_job *mod_compress_job_find(plugin_data *p, buffer *ofn) {
+	size_t i;
+
+	for (i = 0; i < p->jobs.used; i++) {
+		if (buffer_is_equal(p->jobs.ptr[i]->ofn, ofn)) return p->jobs.ptr[i];
+	}
+
+	return NULL;
+}
+
+/* fill the cache file p->ofn in a process of its own, the event loop doesn't
+ * wait for the compression. a file which is compressed already or too many
+ * running jobs start nothing, a later request tries again */
+static void mod_compress_job_start(server *srv, connection *con, plugin_data *p, buffer *fn, stat_cache_entry *sce, int type, size_t key_len) {
+#ifndef __WIN32
+	compress_job *job;
+	pid_t pid;
+
+	if (NULL != mod_compress_job_find(p, p->ofn)) return;
+	if (p->jobs.used >= p->config_storage[0]->cache_workers) return;
+
+	switch (pid = fork()) {
+	case 0: {
+		/* child */
+		int i;
+
+		for (i = 3; i < 256; i++) {
+			if (i != srv->errorlog_fd) close(i);
+		}
+
+		_exit(0 == deflate_file_to_cache(srv, con, p, fn, sce, type) ? 0 : 1);
+	}
+	case -1:
+		log_error_write(srv, __FILE__, __LINE__, "ss", "fork failed:", strerror(errno));
+		return;
+	default:
+		break;
+	}
+
+	if (p->jobs.size == 0) {
+		p->jobs.size = 16;
+		p->jobs.ptr = malloc(sizeof(*p->jobs.ptr) * p->jobs.size);
+	} else if (p->jobs.used == p->jobs.size) {
+		p->jobs.size += 16;
+		p->jobs.ptr = realloc(p->jobs.ptr, sizeof(*p->jobs.ptr) * p->jobs.size);
+	}
+
+	job = calloc(1, sizeof(*job));
+	job->pid = pid;
+	job->ofn = buffer_init_buffer(p->ofn);
+	job->cache = p->conf.cache;
+	job->key_len = key_len;
+
+	p->jobs.ptr[p->jobs.used++] = job;
+
+	if (con->conf.log_request_handling) {
+		log_error_write(srv, __FILE__, __LINE__, "sbsd", "-- compressing", p->ofn, "in the background, pid:", pid);
+	}
+#else
+	UNUSED(srv);
+	UNUSED(con);
+	UNUSED(p);
+	UNUSED(fn);
+	UNUSED(sce);
+	UNUSED(type);
+	UNUSED(key_len);
+#endif
+}
+
+static int deflate_file_to_file(server *srv, connection *con, plugin_data *p, buffer *fn, stat_cache_entry *sce, int type) {
+	struct stat st;
+	size_t key_len;
+
+	/* overflow */
+	if ((off_t)(sce->st.st_size * 1.1) < sce->st.st_size) return -1;
+
+	/* don't mmap files > 128Mb
+	 *
+	 * we could use a sliding window, but currently there is no need for it
+	 */
+
+	if (sce->st.st_size > 128 * 1024 * 1024) return -1;
+
+	buffer_reset(p->ofn);
+	buffer_copy_string_buffer(p->ofn, p->conf.compress_cache_dir);
+	BUFFER_APPEND_SLASH(p->ofn);
+
+	if (0 == strncmp(con->physical.path->ptr, con->physical.doc_root->ptr, con->physical.doc_root->used-1)) {
+		buffer_append_string(p->ofn, con->physical.path->ptr + con->physical.doc_root->used - 1);
+		buffer_copy_string_buffer(p->b, p->ofn);
+	} else {
+		buffer_append_string_buffer(p->ofn, con->uri.path);
+	}
+
+	switch(type) {
+	case HTTP_ACCEPT_ENCODING_GZIP:
+	case HTTP_ACCEPT_ENCODING_X_GZIP:
+		buffer_append_string_len(p->ofn, CONST_STR_LEN("-gzip-"));
+		break;
+	case HTTP_ACCEPT_ENCODING_DEFLATE:
+		buffer_append_string_len(p->ofn, CONST_STR_LEN("-deflate-"));
+		break;
+	case HTTP_ACCEPT_ENCODING_BZIP2:
+	case HTTP_ACCEPT_ENCODING_X_BZIP2:
+		buffer_append_string_len(p->ofn, CONST_STR_LEN("-bzip2-"));
+		break;
+	case HTTP_ACCEPT_ENCODING_BR:
+		buffer_append_string_len(p->ofn, CONST_STR_LEN("-br-"));
+		break;
+	case HTTP_ACCEPT_ENCODING_ZSTD:
+		buffer_append_string_len(p->ofn, CONST_STR_LEN("-zstd-"));
+		break;
+	default:
+		log_error_write(srv, __FILE__, __LINE__, "sd", "unknown compression type", type);
+		return -1;
+	}
+
+	/* the versions of a file differ in the etag */
+	key_len = p->ofn->used - 1;
+
+	buffer_append_string_buffer(p->ofn, sce->etag);
+
+	if (-1 == mkdir_for_file(p->ofn->ptr)) {
+		log_error_write(srv, __FILE__, __LINE__, "sb", "couldn't create directory for file", p->ofn);
+		return -1;
+	}
+
+	/* cache-entry exists */
+	if (0 == stat(p->ofn->ptr, &st)) {
+		if (p->conf.cache) {
+			p->conf.cache->hits++;
+			mod_compress_cache_use(srv, p->conf.cache, p->ofn, key_len, st.st_size, srv->cur_ts);
+			mod_compress_cache_status(srv, p->conf.cache);
 		}
 
+		buffer_copy_string_buffer(con->physical.path, p->ofn);
+
+		return 0;
+	}
+
+	if (p->conf.cache) p->conf.cache->misses++;
+
+	if (p->config_storage[0]->cache_workers) {
+		/* served uncompressed until the cache file is there */
+		mod_compress_job_start(srv, con, p, fn, sce, type, key_len);
+
+		if (p->conf.cache) mod_compress_cache_status(srv, p->conf.cache);
+
 		return -1;
 	}
 
+	if (0 != deflate_file_to_cache(srv, con, p, fn, sce, type)) return -1;
+
+	if (p->conf.cache) {
+		mod_compress_cache_use(srv, p->conf.cache, p->ofn, key_len, p->b->used, srv->cur_ts);
+		mod_compress_cache_status(srv, p->conf.cache);
+	}
+
 	buffer_copy_string_buffer(con->physical.path, p->ofn);
 
 	return 0;
@@ -637,6 +1288,16 @@ static int deflate_file_to_buffer(server *srv, connection *con, plugin_data *p,
 	case HTTP_ACCEPT_ENCODING_X_BZIP2:
 		ret = deflate_file_to_buffer_bzip2(srv, con, p, start, sce->st.st_size);
 		break;
+#endif
+#ifdef USE_BROTLI
+	case HTTP_ACCEPT_ENCODING_BR:
+		ret = deflate_file_to_buffer_brotli(srv, con, p, start, sce->st.st_size);
+		break;
+#endif
+#ifdef USE_ZSTD
+	case HTTP_ACCEPT_ENCODING_ZSTD:
+		ret = deflate_file_to_buffer_zstd(srv, con, p, start, sce->st.st_size);
+		break;
 #endif
 	default:
 		ret = -1;
@@ -671,10 +1332,20 @@ static int mod_compress_patch_connection(server *srv, connection *con, plugin_da
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(compress_cache_dir);
+	PATCH(cache);
 	PATCH(compress);
 	PATCH(compress_max_filesize);
 	PATCH(allowed_encodings);
+	PATCH(compress_dynamic);
+	PATCH(compress_dynamic_min_size);
+	PATCH(precompressed);
+	PATCH(encodings);
+	PATCH(gzip_level);
+	PATCH(brotli_quality);
+	PATCH(zstd_level);
 
 	/* skip the first, the global context */
 	for (i = 1; i < srv->config_context->used; i++) {
@@ -690,32 +1361,193 @@ static int mod_compress_patch_connection(server *srv, connection *con, plugin_da
 
 			if (buffer_is_equal_string(du->key, CONST_STR_LEN("compress.cache-dir"))) {
 				PATCH(compress_cache_dir);
+				PATCH(cache);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("compress.cache-max-size")) ||
+				   buffer_is_equal_string(du->key, CONST_STR_LEN("compress.cache-max-entries"))) {
+				PATCH(cache);
 			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("compress.filetype"))) {
 				PATCH(compress);
 			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("compress.max-filesize"))) {
 				PATCH(compress_max_filesize);
 			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("compress.allowed-encodings"))) {
 				PATCH(allowed_encodings);
+				PATCH(encodings);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("compress.gzip-level"))) {
+				PATCH(gzip_level);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("compress.brotli-quality"))) {
+				PATCH(brotli_quality);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("compress.zstd-level"))) {
+				PATCH(zstd_level);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("compress.dynamic"))) {
+				PATCH(compress_dynamic);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("compress.dynamic-min-size"))) {
+				PATCH(compress_dynamic_min_size);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("compress.precompressed"))) {
+				PATCH(precompressed);
 			}
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
 
-static int mod_compress_contains_encoding(const char *headervalue, const char *encoding) {
-	const char *m;
-	for ( ;; ) {
-		m = strstr(headervalue, encoding);
-		if (NULL == m) return 0;
-		if (m == headervalue || m[-1] == ' ' || m[-1] == ',') return 1;
+/* the q-value (0 - 1000) of encoding in Accept-Encoding, -1 if it isn't listed */
+static int mod_compress_accept_q(const char *value, const char *encoding) {
+	size_t len = strlen(encoding);
+	const char *s = value;
+
+	while (*s) {
+		const char *name;
+		size_t name_len;
+		int q = 1000;
+
+		while (*s == ' ' || *s == '\t' || *s == ',') s++;
+
+		name = s;
+		while (*s && *s != ',' && *s != ';' && *s != ' ' && *s != '\t') s++;
+		name_len = s - name;
+
+		/* parameters, only q matters */
+		while (*s && *s != ',') {
+			if (*s++ != ';') continue;
+
+			while (*s == ' ' || *s == '\t') s++;
+			if ((s[0] == 'q' || s[0] == 'Q') && s[1] == '=') {
+				int scale = 1000;
+
+				s += 2;
+				for (q = 0; *s >= '0' && *s <= '9'; s++) q = q * 10 + (*s - '0');
+				q *= 1000;
+				if (*s == '.') {
+					for (s++; *s >= '0' && *s <= '9'; s++) {
+						if (scale > 1) q += (*s - '0') * (scale /= 10);
+					}
+				}
+				if (q > 1000) q = 1000;
+			}
+		}
 
-		/* only partial match, search for next value */
-		m = strchr(m, ',');
-		if (NULL == m) return 0;
-		headervalue = m + 1;
+		if (name_len == len && 0 == strncasecmp(name, encoding, len)) return q;
 	}
+
+	return -1;
+}
+
+/* the q-value of encoding, "*" counts for the ones which aren't listed */
+static int mod_compress_accept(const char *value, const char *encoding) {
+	int q = mod_compress_accept_q(value, encoding);
+
+	return q >= 0 ? q : mod_compress_accept_q(value, "*");
+}
+
+static const char *mod_compress_encoding_name(int type) {
+	size_t i;
+
+	for (i = 0; compress_encodings[i].name; i++) {
+		if (compress_encodings[i].type == type) return compress_encodings[i].name;
+	}
+
+	return NULL;
+}
+
+/* the encoding of mask the client prefers by q-value, the order of the
+ * server breaks ties; 0 if it accepts none of them or prefers identity */
+static int mod_compress_negotiate(const char *value, const int *order, int mask) {
+	int best = 0, best_q = 0, identity_q;
+
+	for (; *order; order++) {
+		int q;
+
+		if (!(*order & mask)) continue;
+
+		q = mod_compress_accept(value, mod_compress_encoding_name(*order));
+		if (q > best_q) {
+			best = *order;
+			best_q = q;
+		}
+	}
+
+	/* identity is acceptable unless it is refused explicitly */
+	if (-1 == (identity_q = mod_compress_accept(value, "identity"))) identity_q = 1000;
+
+	return best_q >= identity_q || identity_q == 0 ? best : 0;
+}
+
+/* the response might change according to Accept-Encoding */
+static void mod_compress_vary(server *srv, connection *con) {
+	data_string *ds = (data_string *)array_get_element(con->response.headers, "Vary");
+
+	if (ds && NULL != strstr(ds->value->ptr, "Accept-Encoding")) return;
+
+	response_header_insert(srv, con, CONST_STR_LEN("Vary"), CONST_STR_LEN("Accept-Encoding"));
+}
+
+/* file.ext.br, file.ext.gz, ... built ahead of time and at least as new as
+ * the file, the physical path is changed to it for mod_staticfile */
+static int mod_compress_precompressed(server *srv, connection *con, plugin_data *p, stat_cache_entry *sce) {
+	data_string *ds, *best = NULL;
+	buffer *content_type = sce->content_type;
+	time_t mtime = sce->st.st_mtime;
+	size_t i, k;
+	int best_q = 0;
+
+	ds = (data_string *)array_get_element(con->request.headers, "Accept-Encoding");
+
+	for (i = 0; i < p->conf.precompressed->used; i++) {
+		data_string *enc = (data_string *)p->conf.precompressed->data[i];
+		stat_cache_entry *sce_enc = NULL;
+		int q;
+
+		for (k = 0; precompressed_suffixes[k].encoding; k++) {
+			if (buffer_is_equal_string(enc->value, precompressed_suffixes[k].encoding, strlen(precompressed_suffixes[k].encoding))) break;
+		}
+		if (NULL == precompressed_suffixes[k].encoding) continue;
+
+		buffer_copy_string_buffer(p->ofn, con->physical.path);
+		buffer_append_string(p->ofn, precompressed_suffixes[k].suffix);
+
+		if (HANDLER_ERROR == stat_cache_get_entry(srv, con, p->ofn, &sce_enc)) continue;
+		if (!S_ISREG(sce_enc->st.st_mode) || sce_enc->st.st_mtime < mtime) continue;
+#ifdef HAVE_LSTAT
+		if (sce_enc->is_symlink && !con->conf.follow_symlink) continue;
+#endif
+
+		mod_compress_vary(srv, con);
+
+		if (NULL == ds) continue;
+
+		/* the highest q-value wins, ties go to the order of the list */
+		q = mod_compress_accept(ds->value->ptr, enc->value->ptr);
+		if (q > best_q) {
+			best = enc;
+			best_q = q;
+		}
+	}
+
+	if (NULL == best) return 0;
+
+	buffer_copy_string_buffer(p->ofn, con->physical.path);
+	for (k = 0; precompressed_suffixes[k].encoding; k++) {
+		if (buffer_is_equal_string(best->value, precompressed_suffixes[k].encoding, strlen(precompressed_suffixes[k].encoding))) break;
+	}
+	buffer_append_string(p->ofn, precompressed_suffixes[k].suffix);
+
+	if (con->conf.log_request_handling) {
+		log_error_write(srv, __FILE__, __LINE__, "sb", "-- sending precompressed file", p->ofn);
+	}
+
+	/* the type of the original, the ETag and Last-Modified of the sidecar */
+	response_header_overwrite(srv, con, CONST_STR_LEN("Content-Encoding"), CONST_BUF_LEN(best->value));
+	if (!buffer_is_empty(content_type)) {
+		response_header_overwrite(srv, con, CONST_STR_LEN("Content-Type"), CONST_BUF_LEN(content_type));
+	}
+
+	buffer_copy_string_buffer(con->physical.path, p->ofn);
+
+	return 1;
 }
 
 PHYSICALPATH_FUNC(mod_compress_physical) {
@@ -766,6 +1598,11 @@ PHYSICALPATH_FUNC(mod_compress_physical) {
 		return HANDLER_GO_ON;
 	}
 
+	/* let mod_staticfile send the precompressed file */
+	if (p->conf.precompressed->used && mod_compress_precompressed(srv, con, p, sce)) {
+		return HANDLER_GO_ON;
+	}
+
 	/* don't compress files that are too large as we need to much time to handle them */
 	if (max_fsize && (sce->st.st_size >> 10) > max_fsize) return HANDLER_GO_ON;
 
@@ -800,40 +1637,16 @@ PHYSICALPATH_FUNC(mod_compress_physical) {
 			/* mimetype found */
 			data_string *ds;
 
-			/* the response might change according to Accept-Encoding */
-			response_header_insert(srv, con, CONST_STR_LEN("Vary"), CONST_STR_LEN("Accept-Encoding"));
+			mod_compress_vary(srv, con);
 
 			if (NULL != (ds = (data_string *)array_get_element(con->request.headers, "Accept-Encoding"))) {
-				int accept_encoding = 0;
-				char *value = ds->value->ptr;
-				int matched_encodings = 0;
 				int use_etag = sce->etag != NULL && sce->etag->ptr != NULL;
 
-				/* get client side support encodings */
-#ifdef USE_ZLIB
-				if (mod_compress_contains_encoding(value, "gzip")) accept_encoding |= HTTP_ACCEPT_ENCODING_GZIP;
-				if (mod_compress_contains_encoding(value, "x-gzip")) accept_encoding |= HTTP_ACCEPT_ENCODING_X_GZIP;
-				if (mod_compress_contains_encoding(value, "deflate")) accept_encoding |= HTTP_ACCEPT_ENCODING_DEFLATE;
-				if (mod_compress_contains_encoding(value, "compress")) accept_encoding |= HTTP_ACCEPT_ENCODING_COMPRESS;
-#endif
-#ifdef USE_BZ2LIB
-				if (mod_compress_contains_encoding(value, "bzip2")) accept_encoding |= HTTP_ACCEPT_ENCODING_BZIP2;
-				if (mod_compress_contains_encoding(value, "x-bzip2")) accept_encoding |= HTTP_ACCEPT_ENCODING_X_BZIP2;
-#endif
-				if (mod_compress_contains_encoding(value, "identity")) accept_encoding |= HTTP_ACCEPT_ENCODING_IDENTITY;
+				/* the client's q-values first, then the order of compress.allowed-encodings */
+				int compression_type = mod_compress_negotiate(ds->value->ptr, p->conf.encodings, p->conf.allowed_encodings);
 
-				/* find matching entries */
-				matched_encodings = accept_encoding & p->conf.allowed_encodings;
-
-				if (matched_encodings) {
-					static const char dflt_gzip[] = "gzip";
-					static const char dflt_x_gzip[] = "x-gzip";
-					static const char dflt_deflate[] = "deflate";
-					static const char dflt_bzip2[] = "bzip2";
-					static const char dflt_x_bzip2[] = "x-bzip2";
-
-					const char *compression_name = NULL;
-					int compression_type = 0;
+				if (compression_type) {
+					const char *compression_name = mod_compress_encoding_name(compression_type);
 
 					mtime = strftime_cache_get(srv, sce->st.st_mtime);
 
@@ -848,25 +1661,6 @@ PHYSICALPATH_FUNC(mod_compress_physical) {
 						}
 					}
 
-					/* select best matching encoding */
-					if (matched_encodings & HTTP_ACCEPT_ENCODING_BZIP2) {
-						compression_type = HTTP_ACCEPT_ENCODING_BZIP2;
-						compression_name = dflt_bzip2;
-					} else if (matched_encodings & HTTP_ACCEPT_ENCODING_X_BZIP2) {
-						compression_type = HTTP_ACCEPT_ENCODING_X_BZIP2;
-						compression_name = dflt_x_bzip2;
-					} else if (matched_encodings & HTTP_ACCEPT_ENCODING_GZIP) {
-						compression_type = HTTP_ACCEPT_ENCODING_GZIP;
-						compression_name = dflt_gzip;
-					} else if (matched_encodings & HTTP_ACCEPT_ENCODING_X_GZIP) {
-						compression_type = HTTP_ACCEPT_ENCODING_X_GZIP;
-						compression_name = dflt_x_gzip;
-					} else {
-						assert(matched_encodings & HTTP_ACCEPT_ENCODING_DEFLATE);
-						compression_type = HTTP_ACCEPT_ENCODING_DEFLATE;
-						compression_name = dflt_deflate;
-					}
-
 					if (use_etag) {
 						/* try matching etag of compressed version */
 						buffer_copy_string_buffer(srv->tmp_buf, sce->etag);
@@ -909,6 +1703,242 @@ PHYSICALPATH_FUNC(mod_compress_physical) {
 	return HANDLER_GO_ON;
 }
 
+/* reap the processes of the finished cache jobs */
+TRIGGER_FUNC(mod_compress_trigger) {
+	plugin_data *p = p_d;
+	size_t i;
+
+#ifndef __WIN32
+	for (i = 0; i < p->jobs.used; i++) {
+		compress_job *job = p->jobs.ptr[i];
+		int status;
+
+		switch (waitpid(job->pid, &status, WNOHANG)) {
+		case 0:
+			/* not finished yet */
+			continue;
+		case -1:
+			if (errno == EINTR) continue;
+
+			/* someone else called waitpid, forget the job */
+			break;
+		default:
+			if (WIFSIGNALED(status)) {
+				log_error_write(srv, __FILE__, __LINE__, "sbsd", "compressing", job->ofn, "died with signal", WTERMSIG(status));
+			} else if (job->cache && WIFEXITED(status) && 0 == WEXITSTATUS(status)) {
+				struct stat st;
+
+				if (0 == stat(job->ofn->ptr, &st)) {
+					mod_compress_cache_use(srv, job->cache, job->ofn, job->key_len, st.st_size, srv->cur_ts);
+					mod_compress_cache_status(srv, job->cache);
+				}
+			}
+			break;
+		}
+
+		buffer_free(job->ofn);
+		free(job);
+
+		p->jobs.ptr[i--] = p->jobs.ptr[--p->jobs.used];
+	}
+#endif
+
+	/* a crash loses at most a minute of the index */
+	for (i = 0; i < p->caches_used; i++) {
+		compress_cache *c = p->caches[i];
+
+		if (c->dirty && srv->cur_ts - c->saved >= 60) mod_compress_cache_save(srv, c);
+	}
+
+	return HANDLER_GO_ON;
+}
+
+#ifdef USE_ZLIB
+static void mod_compress_stream_free(connection *con, plugin_data *p) {
+	handler_ctx *hctx = con->plugin_ctx[p->id];
+
+	if (!hctx) return;
+
+	deflateEnd(&hctx->z);
+	buffer_free(hctx->out);
+	free(hctx);
+
+	con->plugin_ctx[p->id] = NULL;
+	con->response_filter = NULL;
+	con->response_filter_ctx = NULL;
+}
+
+/* compress the next part of the body, mem == NULL ends the stream */
+static buffer *mod_compress_stream(void *ctx, const char *mem, size_t len) {
+	handler_ctx *hctx = ctx;
+	z_stream *z = &(hctx->z);
+	/* the client gets what the backend sent so far, long-polling and streamed
+	 * pages don't stall in the compressor */
+	int flush = mem ? Z_SYNC_FLUSH : Z_FINISH;
+	size_t used = 0;
+	int rc;
+
+	z->next_in = (unsigned char *)mem;
+	z->avail_in = len;
+
+	do {
+		if (hctx->out->size < used + 1024 + 1) {
+			hctx->out->used = used;
+			buffer_prepare_append(hctx->out, len + 16 * 1024);
+		}
+
+		z->next_out = (unsigned char *)hctx->out->ptr + used;
+		z->avail_out = hctx->out->size - used - 1;
+
+		rc = deflate(z, flush);
+		if (rc == Z_STREAM_ERROR) return NULL;
+
+		used = (char *)z->next_out - hctx->out->ptr;
+	} while (z->avail_out == 0 || (flush == Z_FINISH && rc != Z_STREAM_END));
+
+	hctx->out->ptr[used] = '\0';
+	hctx->out->used = used + 1;
+
+	return hctx->out;
+}
+
+static int mod_compress_stream_type(plugin_data *p, buffer *content_type) {
+	size_t m, len;
+	char *c;
+
+	/* without the parameters like charset */
+	len = (NULL != (c = strchr(content_type->ptr, ';'))) ? (size_t)(c - content_type->ptr) : content_type->used - 1;
+	while (len > 0 && content_type->ptr[len - 1] == ' ') len--;
+
+	for (m = 0; m < p->conf.compress->used; m++) {
+		data_string *compress_ds = (data_string *)p->conf.compress->data[m];
+
+		if (buffer_is_equal(compress_ds->value, content_type) ||
+		    (compress_ds->value->used == len + 1 && 0 == strncmp(compress_ds->value->ptr, content_type->ptr, len))) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* the handler has the response headers, compress the body while it is sent */
+CONNECTION_FUNC(mod_compress_response_start) {
+	plugin_data *p = p_d;
+	handler_ctx *hctx;
+	data_string *ds;
+	off_t size = -1;
+	int compression_type;
+	int wbits;
+	const char *compression_name;
+
+	if (con->http_status != 0 && con->http_status != 200) return HANDLER_GO_ON;
+
+	if (con->request.http_method != HTTP_METHOD_GET &&
+	    con->request.http_method != HTTP_METHOD_POST) {
+		return HANDLER_GO_ON;
+	}
+
+	mod_compress_patch_connection(srv, con, p);
+
+	if (!p->conf.compress_dynamic) return HANDLER_GO_ON;
+
+	/* compressed by the backend already */
+	if (NULL != (ds = (data_string *)array_get_element(con->response.headers, "Content-Encoding")) &&
+	    !buffer_is_empty(ds->value)) {
+		return HANDLER_GO_ON;
+	}
+
+	if (NULL == (ds = (data_string *)array_get_element(con->response.headers, "Content-Type")) ||
+	    buffer_is_empty(ds->value) ||
+	    !mod_compress_stream_type(p, ds->value)) {
+		return HANDLER_GO_ON;
+	}
+
+	mod_compress_vary(srv, con);
+
+	if (con->file_finished) {
+		size = chunkqueue_length(con->write_queue);
+	} else if (con->parsed_response & HTTP_CONTENT_LENGTH) {
+		size = con->response.content_length;
+	}
+
+	if (size >= 0) {
+		if (size < p->conf.compress_dynamic_min_size) return HANDLER_GO_ON;
+		if (p->conf.compress_max_filesize && (size >> 10) > p->conf.compress_max_filesize) return HANDLER_GO_ON;
+	}
+
+	if (NULL == (ds = (data_string *)array_get_element(con->request.headers, "Accept-Encoding"))) {
+		return HANDLER_GO_ON;
+	}
+
+	/* bzip2 needs its 900k blocks, it isn't streamed */
+	compression_type = mod_compress_negotiate(ds->value->ptr, p->conf.encodings,
+		p->conf.allowed_encodings & (HTTP_ACCEPT_ENCODING_GZIP | HTTP_ACCEPT_ENCODING_X_GZIP | HTTP_ACCEPT_ENCODING_DEFLATE));
+
+	switch (compression_type) {
+	case HTTP_ACCEPT_ENCODING_GZIP:
+	case HTTP_ACCEPT_ENCODING_X_GZIP:
+		wbits = MAX_WBITS + 16; /* gzip header and trailer */
+		break;
+	case HTTP_ACCEPT_ENCODING_DEFLATE:
+		wbits = -MAX_WBITS; /* as deflate_file_to_buffer_deflate() */
+		break;
+	default:
+		return HANDLER_GO_ON;
+	}
+
+	compression_name = mod_compress_encoding_name(compression_type);
+
+	hctx = calloc(1, sizeof(*hctx));
+
+	if (Z_OK != deflateInit2(&(hctx->z), p->conf.gzip_level ? p->conf.gzip_level : Z_DEFAULT_COMPRESSION,
+				 Z_DEFLATED, wbits, 8, Z_DEFAULT_STRATEGY)) {
+		log_error_write(srv, __FILE__, __LINE__, "s", "deflateInit2 failed");
+		free(hctx);
+		return HANDLER_GO_ON;
+	}
+
+	hctx->out = buffer_init();
+
+	con->plugin_ctx[p->id] = hctx;
+	con->response_filter = mod_compress_stream;
+	con->response_filter_ctx = hctx;
+
+	response_header_overwrite(srv, con, CONST_STR_LEN("Content-Encoding"), compression_name, strlen(compression_name));
+
+	/* another representation, another etag */
+	if (NULL != (ds = (data_string *)array_get_element(con->response.headers, "ETag")) &&
+	    ds->value->used > 2 && ds->value->ptr[ds->value->used - 2] == '"') {
+		ds->value->ptr[--ds->value->used - 1] = '\0';
+		buffer_append_string_len(ds->value, CONST_STR_LEN("-"));
+		buffer_append_string(ds->value, compression_name);
+		buffer_append_string_len(ds->value, CONST_STR_LEN("\""));
+	}
+
+	/* the length of the compressed body is known when it is finished */
+	if (NULL != (ds = (data_string *)array_get_element(con->response.headers, "Content-Length"))) {
+		buffer_reset(ds->value);
+	}
+	con->parsed_response &= ~HTTP_CONTENT_LENGTH;
+	con->response.content_length = -1;
+
+	if (!con->file_finished && con->request.http_version == HTTP_VERSION_1_1) {
+		con->response.transfer_encoding = HTTP_TRANSFER_ENCODING_CHUNKED;
+	}
+
+	return HANDLER_GO_ON;
+}
+
+static handler_t mod_compress_connection_reset(server *srv, connection *con, void *p_d) {
+	UNUSED(srv);
+
+	mod_compress_stream_free(con, p_d);
+
+	return HANDLER_GO_ON;
+}
+#endif
+
 int mod_compress_plugin_init(plugin *p);
 int mod_compress_plugin_init(plugin *p) {
 	p->version     = LIGHTTPD_VERSION_ID;
@@ -918,6 +1948,12 @@ int mod_compress_plugin_init(plugin *p) {
 	p->set_defaults = mod_compress_setdefaults;
 	p->handle_subrequest_start  = mod_compress_physical;
 	p->cleanup     = mod_compress_free;
+	p->handle_trigger = mod_compress_trigger;
+#ifdef USE_ZLIB
+	p->handle_response_start = mod_compress_response_start;
+	p->connection_reset = mod_compress_connection_reset;
+	p->handle_connection_close = mod_compress_connection_reset;
+#endif
 
 	p->data        = NULL;
 
@@ -38,6 +38,7 @@
 typedef struct {
 #ifdef HAVE_PCRE_H
 	pcre *regex;
+	pcre_extra *regex_extra;
 #endif
 	buffer *string;
 } excludes;
@@ -119,6 +120,11 @@ static int excludes_buffer_append(excludes_buffer *exb, buffer *string) {
 		return -1;
 	}
 
+	if (NULL == (exb->ptr[exb->used]->regex_extra = li_pcre_study(exb->ptr[exb->used]->regex, &errptr)) &&
+			errptr != NULL) {
+		return -1;
+	}
+
 	exb->ptr[exb->used]->string = buffer_init();
 	buffer_copy_string_buffer(exb->ptr[exb->used]->string, string);
 
@@ -139,6 +145,7 @@ static void excludes_buffer_free(excludes_buffer *exb) {
 
 	for (i = 0; i < exb->size; i++) {
 		if (exb->ptr[i]->regex) pcre_free(exb->ptr[i]->regex);
+		if (exb->ptr[i]->regex_extra) li_pcre_study_free(exb->ptr[i]->regex_extra);
 		if (exb->ptr[i]->string) buffer_free(exb->ptr[i]->string);
 		free(exb->ptr[i]);
 	}
@@ -334,6 +341,8 @@ static int mod_dirlisting_patch_connection(server *srv, connection *con, plugin_
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(dir_listing);
 	PATCH(external_css);
 	PATCH(hide_dot_files);
@@ -391,6 +400,8 @@ static int mod_dirlisting_patch_connection(server *srv, connection *con, plugin_
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
@@ -641,7 +652,6 @@ static int http_list_directory(server *srv, connection *con, plugin_data *p, buf
 	dirls_entry_t *tmp;
 	char sizebuf[sizeof("999.9K")];
 	char datebuf[sizeof("2005-Jan-01 22:23:24")];
-	size_t k;
 	const char *content_type;
 	long name_max;
 #ifdef HAVE_XATTR
@@ -723,8 +733,9 @@ static int http_list_directory(server *srv, connection *con, plugin_data *p, buf
 #define N 10
 			int ovec[N * 3];
 			pcre *regex = p->conf.excludes->ptr[i]->regex;
+			pcre_extra *regex_extra = p->conf.excludes->ptr[i]->regex_extra;
 
-			if ((n = pcre_exec(regex, NULL, dent->d_name,
+			if ((n = pcre_exec(regex, regex_extra, dent->d_name,
 				    strlen(dent->d_name), 0, 0, ovec, 3 * N)) < 0) {
 				if (n != PCRE_ERROR_NOMATCH) {
 					log_error_write(srv, __FILE__, __LINE__, "sd",
@@ -829,23 +840,9 @@ static int http_list_directory(server *srv, connection *con, plugin_data *p, buf
 #endif
 
 		if (content_type == NULL) {
-			content_type = "application/octet-stream";
-			for (k = 0; k < con->conf.mimetypes->used; k++) {
-				data_string *ds = (data_string *)con->conf.mimetypes->data[k];
-				size_t ct_len;
+			buffer *type = stat_cache_mimetype_by_ext(con->conf.mimetype_index, DIRLIST_ENT_NAME(tmp), tmp->namelen);
 
-				if (ds->key->used == 0)
-					continue;
-
-				ct_len = ds->key->used - 1;
-				if (tmp->namelen < ct_len)
-					continue;
-
-				if (0 == strncasecmp(DIRLIST_ENT_NAME(tmp) + tmp->namelen - ct_len, ds->key->ptr, ct_len)) {
-					content_type = ds->value->ptr;
-					break;
-				}
-			}
+			content_type = type ? type->ptr : "application/octet-stream";
 		}
 
 #ifdef HAVE_LOCALTIME_R
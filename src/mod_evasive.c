@@ -106,6 +106,8 @@ static int mod_evasive_patch_connection(server *srv, connection *con, plugin_dat
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(max_conns);
 	PATCH(silent);
 
@@ -129,6 +131,8 @@ static int mod_evasive_patch_connection(server *srv, connection *con, plugin_dat
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
@@ -193,6 +193,8 @@ static int mod_extforward_patch_connection(server *srv, connection *con, plugin_
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(forwarder);
 	PATCH(headers);
 
@@ -216,6 +218,8 @@ static int mod_extforward_patch_connection(server *srv, connection *con, plugin_
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
@@ -12,6 +12,7 @@
 #include "plugin.h"
 
 #include "inet_ntop_cache.h"
+#include "http_cgi.h"
 #include "stat_cache.h"
 #include "status_counter.h"
 
@@ -42,6 +43,8 @@
 #endif
 
 #include "sys-socket.h"
+#include "ketama.h"
+#include "collapse.h"
 
 #ifdef HAVE_SYS_UIO_H
 #include <sys/uio.h>
@@ -68,6 +71,20 @@
  *
  */
 
+struct fcgi_proc;
+struct fcgi_mpx_conn;
+
+/* a connection to a proc, kept open after FCGI_KEEP_CONN requests */
+typedef struct fcgi_idle_conn {
+	int fd;
+	int fde_ndx;
+
+	time_t idle_since;
+
+	struct fcgi_proc *proc;
+	struct fcgi_idle_conn *prev, *next;
+} fcgi_idle_conn;
+
 typedef struct fcgi_proc {
 	size_t id; /* id will be between 1 and max_procs */
 	buffer *unixsocket; /* config.socket + "-" + id */
@@ -83,10 +100,22 @@ typedef struct fcgi_proc {
 	size_t requests;  /* see max_requests */
 	struct fcgi_proc *prev, *next; /* see first */
 
+	time_t last_used; /* the last request was released, see idle_timeout */
+
+	size_t heap_ndx; /* position in host->heap */
+
+	ewma_t ewma; /* peak-ewma balancing */
+
 	time_t disabled_until; /* this proc is disabled until, use something else until then */
 
 	int is_local;
 
+	fcgi_idle_conn *idle; /* unused kept-alive connections, most recently used first */
+	size_t idle_used;
+
+	struct fcgi_mpx_conn *mpx; /* multiplexed connections */
+	size_t mpx_used;
+
 	enum {
 		PROC_STATE_UNSET,    /* init-phase */
 		PROC_STATE_RUNNING,  /* alive */
@@ -98,6 +127,19 @@ typedef struct fcgi_proc {
 	} state;
 } fcgi_proc;
 
+/*
+ * the variables of FCGI_PARAMS which are the same for every request
+ * of a host, encoded once per server socket and server.tag
+ */
+typedef struct fcgi_env_tpl {
+	server_socket *srv_sock;
+	buffer *server_tag;
+
+	buffer *env;
+
+	struct fcgi_env_tpl *next;
+} fcgi_env_tpl;
+
 typedef struct {
 	/* the key that is used to reference this value */
 	buffer *id;
@@ -115,14 +157,18 @@ typedef struct {
 	/*
 	 * spawn at least min_procs, at max_procs.
 	 *
-	 * as soon as the load of the first entry
-	 * is max_load_per_proc we spawn a new one
-	 * and add it to the first entry and give it
-	 * the load
+	 * as soon as the average load of the running procs
+	 * is above max_load_per_proc we spawn a new one
+	 * (one per second), local procs which had nothing
+	 * to do for idle_timeout seconds are killed again
+	 * until min_procs are left
 	 *
 	 */
 
+	unsigned short min_procs;
 	unsigned short max_procs;
+	unsigned short max_load_per_proc;
+	unsigned short idle_timeout;
 	size_t num_procs;    /* how many procs are started */
 	size_t active_procs; /* how many of them are really running, i.e. state = PROC_STATE_RUNNING */
 
@@ -255,6 +301,47 @@ typedef struct {
 				       applications prefer SIGUSR1 while the
 				       rest of the world would use SIGTERM
 				       *sigh* */
+
+	/*
+	 * keep-alive asks the backend to keep the connection open
+	 * (FCGI_KEEP_CONN) and reuses it for the next request.
+	 *
+	 * at most keep_alive_max_idle unused connections are kept per proc,
+	 * they are closed after keep_alive_idle_timeout seconds.
+	 *
+	 * PHP-FPM and libfcgi children stay bound to a kept connection, keep
+	 * max-idle below the number of children.
+	 */
+	unsigned short keep_alive;
+	unsigned short keep_alive_max_idle;
+	unsigned short keep_alive_idle_timeout;
+
+	/*
+	 * multiplex sends several requests over one connection if the
+	 * backend announces FCGI_MPXS_CONNS, at most multiplex_max_requests
+	 * (or FCGI_MAX_REQS) at a time.
+	 *
+	 * unused connections are kept like for keep-alive.
+	 */
+	unsigned short multiplex;
+	unsigned short multiplex_max_requests;
+
+	/*
+	 * the procs of host->first as a binary min-heap, running procs
+	 * with the lowest load on top. it is updated when the load or the
+	 * state of a proc changes, picking a proc is O(1).
+	 *
+	 * with balance = power-of-two two random procs are compared
+	 * instead of always taking the top, with peak-ewma they are
+	 * compared by load times latency.
+	 */
+	struct fcgi_proc **heap;
+	size_t heap_used;
+	size_t heap_size;
+
+	enum { FCGI_BALANCE_LEAST_LOADED, FCGI_BALANCE_POWER_OF_TWO, FCGI_BALANCE_PEAK_EWMA } balance;
+
+	fcgi_env_tpl *env_tpl;
 } fcgi_extension_host;
 
 /*
@@ -282,6 +369,8 @@ typedef struct {
 	int note_is_sent;
 	int last_used_ndx;
 
+	ketama_ring *ring; /* fastcgi.balance = "hash", built on first use */
+
 	fcgi_extension_host **hosts;
 
 	size_t used;
@@ -302,6 +391,19 @@ typedef struct {
 	array *ext_mapping;
 
 	unsigned int debug;
+
+	/* how a host of an extension is picked */
+	enum { FCGI_HOST_BALANCE_FAIR, FCGI_HOST_BALANCE_HASH } balance;
+	ketama_key_t hash_key;
+	buffer *hash_cookie;
+
+	/* concurrent GET/HEAD for the same uri wait for the first one */
+	unsigned short collapse;
+	unsigned short collapse_timeout;
+
+	/* kbyte of the response in memory, then in tempfiles, before we stop reading */
+	unsigned int response_buffer;
+	unsigned int response_spool;
 } plugin_config;
 
 typedef struct {
@@ -322,11 +424,43 @@ typedef struct {
 
 	buffer *statuskey;
 
+	collapse_table *collapse;
+	buffer *collapse_key;
+
 	plugin_config **config_storage;
 
 	plugin_config conf; /* this is only used as long as no handler_ctx is setup */
 } plugin_data;
 
+/* a connection to a proc, shared by several requests (FCGI_MPXS_CONNS) */
+typedef struct fcgi_mpx_conn {
+	int fd;
+	int fde_ndx;
+
+	chunkqueue *rb; /* read queue, demultiplexed by request-id */
+	chunkqueue *wb; /* management records */
+
+	/* the records of a request are written in one go, the others wait */
+	struct handler_ctx *wq_first, *wq_last;
+	chunkqueue *wcur;            /* the queue which is written right now */
+	struct handler_ctx *whctx;   /* owner of wcur */
+	chunkqueue *orphan;          /* rest of a request which was closed while it was written */
+	connection *orphan_con;
+
+	struct handler_ctx **reqs;   /* indexed by request-id */
+	unsigned char *orphaned;     /* request-id waits for the FCGI_END_REQUEST of a closed request */
+	size_t reqs_size;
+	size_t active;               /* request-ids in use */
+	size_t max_reqs;             /* 1 until the backend announced FCGI_MPXS_CONNS */
+
+	time_t idle_since;
+
+	fcgi_extension_host *host;
+	fcgi_proc *proc;
+	plugin_data *p;
+	struct fcgi_mpx_conn *prev, *next;
+} fcgi_mpx_conn;
+
 /* connection specific data */
 typedef enum {
 	FCGI_STATE_UNSET,
@@ -337,7 +471,7 @@ typedef enum {
 	FCGI_STATE_READ
 } fcgi_connection_state_t;
 
-typedef struct {
+typedef struct handler_ctx {
 	fcgi_proc *proc;
 	fcgi_extension_host *host;
 	fcgi_extension *ext;
@@ -359,8 +493,22 @@ typedef struct {
 	pid_t     pid;
 	int       got_proc;
 
+	int       keep_conn; /* the request ended cleanly, the connection can be reused */
+	int       reused;    /* the connection was taken from proc->idle */
+
+	fcgi_mpx_conn *mpx;  /* shared connection, fd is -1 then */
+	struct handler_ctx *mpx_wnext; /* write-queue of the mpx connection */
+
 	int       send_content_body;
 
+	double    ewma_start; /* request sent to the proc, 0 if it isn't measured */
+
+	collapse_group *collapse; /* the request shares the response with others */
+	int       collapse_leader; /* it is the one which asks the backend */
+	int       collapse_tried;
+
+	int       blocked; /* we don't read from the backend until the client catches up */
+
 	plugin_config conf;
 
 	connection *remote_conn;  /* dumb pointer */
@@ -370,6 +518,7 @@ typedef struct {
 
 /* ok, we need a prototype */
 static handler_t fcgi_handle_fdevent(server *srv, void *ctx, int revents);
+static handler_t fcgi_mpx_handle_fdevent(server *srv, void *ctx, int revents);
 
 static void reset_signals(void) {
 #ifdef SIGTTOU
@@ -395,9 +544,142 @@ static void fastcgi_status_copy_procname(buffer *b, fcgi_extension_host *host, f
 	}
 }
 
+/* running procs first, then the lower load */
+static int fcgi_proc_heap_less(fcgi_proc *a, fcgi_proc *b) {
+	int ra = (a->state == PROC_STATE_RUNNING), rb = (b->state == PROC_STATE_RUNNING);
+
+	if (ra != rb) return ra;
+
+	return a->load < b->load;
+}
+
+static void fcgi_proc_heap_swap(fcgi_extension_host *host, size_t i, size_t j) {
+	fcgi_proc *t = host->heap[i];
+
+	host->heap[i] = host->heap[j];
+	host->heap[j] = t;
+	host->heap[i]->heap_ndx = i;
+	host->heap[j]->heap_ndx = j;
+}
+
+static void fcgi_proc_heap_down(fcgi_extension_host *host, size_t ndx) {
+	for (;;) {
+		size_t l = 2 * ndx + 1, m = ndx;
+
+		if (l < host->heap_used && fcgi_proc_heap_less(host->heap[l], host->heap[m])) m = l;
+		if (l + 1 < host->heap_used && fcgi_proc_heap_less(host->heap[l + 1], host->heap[m])) m = l + 1;
+
+		if (m == ndx) break;
+
+		fcgi_proc_heap_swap(host, ndx, m);
+		ndx = m;
+	}
+}
+
+static void fcgi_proc_heap_up(fcgi_extension_host *host, size_t ndx) {
+	while (ndx > 0 && fcgi_proc_heap_less(host->heap[ndx], host->heap[(ndx - 1) / 2])) {
+		fcgi_proc_heap_swap(host, ndx, (ndx - 1) / 2);
+		ndx = (ndx - 1) / 2;
+	}
+}
+
+static int fcgi_proc_heap_contains(fcgi_extension_host *host, fcgi_proc *proc) {
+	return proc->heap_ndx < host->heap_used && host->heap[proc->heap_ndx] == proc;
+}
+
+static void fcgi_proc_heap_insert(fcgi_extension_host *host, fcgi_proc *proc) {
+	if (host->heap_size == host->heap_used) {
+		host->heap_size += 16;
+		host->heap = realloc(host->heap, host->heap_size * sizeof(*host->heap));
+	}
+
+	proc->heap_ndx = host->heap_used++;
+	host->heap[proc->heap_ndx] = proc;
+
+	fcgi_proc_heap_up(host, proc->heap_ndx);
+}
+
+static void fcgi_proc_heap_remove(fcgi_extension_host *host, fcgi_proc *proc) {
+	size_t ndx = proc->heap_ndx;
+
+	if (!fcgi_proc_heap_contains(host, proc)) return;
+
+	if (ndx != --host->heap_used) {
+		fcgi_proc_heap_swap(host, ndx, host->heap_used);
+		fcgi_proc_heap_up(host, ndx);
+		fcgi_proc_heap_down(host, ndx);
+	}
+}
+
+/* the load or the state of proc changed */
+static void fcgi_proc_heap_update(fcgi_extension_host *host, fcgi_proc *proc) {
+	if (!fcgi_proc_heap_contains(host, proc)) return;
+
+	fcgi_proc_heap_up(host, proc->heap_ndx);
+	fcgi_proc_heap_down(host, proc->heap_ndx);
+}
+
+/* after the state of several procs changed */
+static void fcgi_proc_heap_build(fcgi_extension_host *host) {
+	size_t i;
+
+	for (i = host->heap_used / 2; i-- > 0; ) {
+		fcgi_proc_heap_down(host, i);
+	}
+}
+
+/* a running proc with the lowest load, NULL if none is running */
+static fcgi_proc *fcgi_proc_heap_select(fcgi_extension_host *host) {
+	fcgi_proc *proc, *a, *b;
+
+	if (host->heap_used == 0) return NULL;
+
+	proc = host->heap[0];
+	if (proc->state != PROC_STATE_RUNNING) return NULL;
+
+	switch (host->balance) {
+	case FCGI_BALANCE_POWER_OF_TWO:
+		if (host->heap_used < 3) return proc;
+
+		a = host->heap[rand() % host->heap_used];
+		b = host->heap[rand() % host->heap_used];
+
+		if (a->state != PROC_STATE_RUNNING) a = proc;
+		if (b->state != PROC_STATE_RUNNING) b = proc;
+
+		return (b->load < a->load) ? b : a;
+	case FCGI_BALANCE_PEAK_EWMA: {
+		size_t i, j;
+		double now;
+
+		if (host->heap_used < 2) return proc;
+
+		/* two different procs, the top stands in for one which is not running */
+		i = rand() % host->heap_used;
+		j = rand() % (host->heap_used - 1);
+		if (j >= i) j++;
+
+		a = host->heap[i];
+		b = host->heap[j];
+
+		if (a->state != PROC_STATE_RUNNING) a = proc;
+		if (b->state != PROC_STATE_RUNNING) b = proc;
+
+		if (a == b) return a;
+
+		now = ewma_now();
+
+		return (ewma_cost(&b->ewma, now, b->load) < ewma_cost(&a->ewma, now, a->load)) ? b : a;
+	}
+	default:
+		return proc;
+	}
+}
+
 static void fcgi_proc_load_inc(server *srv, handler_ctx *hctx) {
 	plugin_data *p = hctx->plugin_data;
 	hctx->proc->load++;
+	fcgi_proc_heap_update(hctx->host, hctx->proc);
 
 	status_counter_inc(srv, CONST_STR_LEN("fastcgi.active-requests"));
 
@@ -410,6 +692,8 @@ static void fcgi_proc_load_inc(server *srv, handler_ctx *hctx) {
 static void fcgi_proc_load_dec(server *srv, handler_ctx *hctx) {
 	plugin_data *p = hctx->plugin_data;
 	hctx->proc->load--;
+	hctx->proc->last_used = srv->cur_ts;
+	fcgi_proc_heap_update(hctx->host, hctx->proc);
 
 	status_counter_dec(srv, CONST_STR_LEN("fastcgi.active-requests"));
 
@@ -419,6 +703,310 @@ static void fcgi_proc_load_dec(server *srv, handler_ctx *hctx) {
 	status_counter_set(srv, CONST_BUF_LEN(p->statuskey), hctx->proc->load);
 }
 
+static void fcgi_proc_idle_status(server *srv, plugin_data *p, fcgi_extension_host *host, fcgi_proc *proc) {
+	fastcgi_status_copy_procname(p->statuskey, host, proc);
+	buffer_append_string_len(p->statuskey, CONST_STR_LEN(".idle"));
+
+	status_counter_set(srv, CONST_BUF_LEN(p->statuskey), proc->idle_used);
+}
+
+static void fcgi_proc_mpx_status(server *srv, plugin_data *p, fcgi_extension_host *host, fcgi_proc *proc) {
+	fastcgi_status_copy_procname(p->statuskey, host, proc);
+	buffer_append_string_len(p->statuskey, CONST_STR_LEN(".shared"));
+
+	status_counter_set(srv, CONST_BUF_LEN(p->statuskey), proc->mpx_used);
+}
+
+static void fcgi_idle_conn_unlink(fcgi_idle_conn *ic) {
+	fcgi_proc *proc = ic->proc;
+
+	if (ic->prev) ic->prev->next = ic->next;
+	else proc->idle = ic->next;
+	if (ic->next) ic->next->prev = ic->prev;
+
+	proc->idle_used--;
+}
+
+static void fcgi_idle_conn_close(server *srv, fcgi_idle_conn *ic) {
+	fcgi_idle_conn_unlink(ic);
+
+	fdevent_event_del(srv->ev, &(ic->fde_ndx), ic->fd);
+	fdevent_unregister(srv->ev, ic->fd);
+	close(ic->fd);
+	srv->cur_fds--;
+
+	free(ic);
+}
+
+/* an unused connection got readable: the backend closed it or sent garbage */
+static handler_t fcgi_idle_conn_handle_fdevent(server *srv, void *ctx, int revents) {
+	fcgi_idle_conn *ic = ctx;
+
+	UNUSED(revents);
+
+	fcgi_idle_conn_close(srv, ic);
+
+	return HANDLER_FINISHED;
+}
+
+static void fcgi_proc_idle_flush(server *srv, plugin_data *p, fcgi_extension_host *host, fcgi_proc *proc) {
+	if (NULL == proc->idle) return;
+
+	while (proc->idle) fcgi_idle_conn_close(srv, proc->idle);
+
+	fcgi_proc_idle_status(srv, p, host, proc);
+}
+
+/* close the connections which were unused for too long */
+static void fcgi_proc_idle_timeout(server *srv, plugin_data *p, fcgi_extension_host *host, fcgi_proc *proc) {
+	fcgi_idle_conn *ic, *next;
+	size_t used = proc->idle_used;
+
+	for (ic = proc->idle; ic; ic = next) {
+		next = ic->next;
+
+		if (srv->cur_ts - ic->idle_since < host->keep_alive_idle_timeout) continue;
+
+		fcgi_idle_conn_close(srv, ic);
+	}
+
+	if (used != proc->idle_used) fcgi_proc_idle_status(srv, p, host, proc);
+}
+
+/* take over an unused connection to hctx->proc
+ *
+ * returns 0 if there was none
+ */
+static int fcgi_proc_idle_get(server *srv, handler_ctx *hctx) {
+	fcgi_proc *proc = hctx->proc;
+	fcgi_idle_conn *ic;
+
+	/* after a failed attempt always open a new connection */
+	if (hctx->reconnects) return 0;
+
+	while (NULL != (ic = proc->idle)) {
+		char c;
+		ssize_t r;
+
+		/* the backend might have closed it after the last event-loop */
+		r = recv(ic->fd, &c, 1, MSG_PEEK);
+
+		if (-1 == r && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+		fcgi_idle_conn_close(srv, ic);
+	}
+
+	if (NULL == ic) {
+		fcgi_proc_idle_status(srv, hctx->plugin_data, hctx->host, proc);
+
+		return 0;
+	}
+
+	fcgi_idle_conn_unlink(ic);
+
+	fdevent_event_del(srv->ev, &(ic->fde_ndx), ic->fd);
+	fdevent_unregister(srv->ev, ic->fd);
+
+	hctx->fd = ic->fd;
+	hctx->fde_ndx = -1;
+	hctx->reused = 1;
+
+	fdevent_register(srv->ev, hctx->fd, fcgi_handle_fdevent, hctx);
+
+	free(ic);
+
+	fcgi_proc_idle_status(srv, hctx->plugin_data, hctx->host, proc);
+
+	return 1;
+}
+
+/* keep the connection of a finished request for the next one
+ *
+ * returns 0 if the connection has to be closed instead
+ */
+static int fcgi_proc_idle_put(server *srv, handler_ctx *hctx) {
+	fcgi_extension_host *host = hctx->host;
+	fcgi_proc *proc = hctx->proc;
+	fcgi_idle_conn *ic;
+
+	if (!host->keep_alive || !hctx->keep_conn) return 0;
+
+	/* overloaded procs still serve the connections they accepted */
+	if (proc->state != PROC_STATE_RUNNING &&
+	    proc->state != PROC_STATE_OVERLOADED) return 0;
+
+	if (proc->idle_used >= host->keep_alive_max_idle) return 0;
+
+	ic = calloc(1, sizeof(*ic));
+	assert(ic);
+
+	ic->fd = hctx->fd;
+	ic->fde_ndx = -1;
+	ic->idle_since = srv->cur_ts;
+	ic->proc = proc;
+
+	ic->next = proc->idle;
+	if (proc->idle) proc->idle->prev = ic;
+	proc->idle = ic;
+	proc->idle_used++;
+
+	fdevent_register(srv->ev, ic->fd, fcgi_idle_conn_handle_fdevent, ic);
+	fdevent_event_set(srv->ev, &(ic->fde_ndx), ic->fd, FDEVENT_IN);
+
+	fcgi_proc_idle_status(srv, hctx->plugin_data, host, proc);
+
+	return 1;
+}
+
+static void fcgi_mpx_conn_free(fcgi_mpx_conn *c) {
+	chunkqueue_free(c->rb);
+	chunkqueue_free(c->wb);
+	if (c->orphan) chunkqueue_free(c->orphan);
+
+	free(c->reqs);
+	free(c->orphaned);
+	free(c);
+}
+
+static void fcgi_mpx_conn_close(server *srv, fcgi_mpx_conn *c) {
+	fcgi_proc *proc = c->proc;
+
+	if (c->prev) c->prev->next = c->next;
+	else proc->mpx = c->next;
+	if (c->next) c->next->prev = c->prev;
+
+	proc->mpx_used--;
+
+	fdevent_event_del(srv->ev, &(c->fde_ndx), c->fd);
+	fdevent_unregister(srv->ev, c->fd);
+	close(c->fd);
+	srv->cur_fds--;
+
+	fcgi_proc_mpx_status(srv, c->p, c->host, proc);
+
+	fcgi_mpx_conn_free(c);
+}
+
+static void fcgi_mpx_attach(fcgi_mpx_conn *c, handler_ctx *hctx) {
+	size_t id;
+
+	/* active < max_reqs < reqs_size, there is a free id */
+	for (id = 1; c->reqs[id] || c->orphaned[id]; id++);
+
+	c->reqs[id] = hctx;
+	c->active++;
+
+	hctx->mpx = c;
+	hctx->request_id = id;
+}
+
+/* hctx doesn't use its shared connection anymore
+ *
+ * if the backend didn't finish the request yet the request-id stays
+ * reserved until its FCGI_END_REQUEST arrives.
+ */
+static void fcgi_mpx_detach(server *srv, handler_ctx *hctx, int finished) {
+	fcgi_mpx_conn *c = hctx->mpx;
+	handler_ctx *h, *prev = NULL;
+
+	if (NULL == c) return;
+
+	hctx->mpx = NULL;
+
+	for (h = c->wq_first; h && h != hctx; h = h->mpx_wnext) prev = h;
+
+	if (h) {
+		/* the backend never saw this request */
+		if (prev) prev->mpx_wnext = hctx->mpx_wnext;
+		else c->wq_first = hctx->mpx_wnext;
+		if (c->wq_last == hctx) c->wq_last = prev;
+		hctx->mpx_wnext = NULL;
+
+		finished = 1;
+	} else if (c->whctx == hctx) {
+		/* the records are half written, the rest has to follow */
+		c->orphan = hctx->wb;
+		c->orphan_con = hctx->remote_conn;
+		c->wcur = c->orphan;
+		c->whctx = NULL;
+
+		hctx->wb = chunkqueue_init();
+	} else if (hctx->state != FCGI_STATE_READ) {
+		/* the records were never queued, e.g. the env didn't fit */
+		finished = 1;
+	}
+
+	c->reqs[hctx->request_id] = NULL;
+
+	if (finished) {
+		c->active--;
+	} else {
+		c->orphaned[hctx->request_id] = 1;
+	}
+
+	if (0 == c->active) c->idle_since = srv->cur_ts;
+}
+
+/* find a connection to hctx->proc with a free request-id
+ *
+ * returns 0 if there is none
+ */
+static int fcgi_proc_mpx_get(server *srv, handler_ctx *hctx) {
+	fcgi_mpx_conn *c, *next;
+
+	for (c = hctx->proc->mpx; c; c = next) {
+		next = c->next;
+
+		if (c->active >= c->max_reqs) continue;
+
+		if (0 == c->active) {
+			char ch;
+			ssize_t r;
+
+			/* the backend might have closed it after the last event-loop */
+			r = recv(c->fd, &ch, 1, MSG_PEEK);
+
+			if (0 == r || (-1 == r && errno != EAGAIN && errno != EWOULDBLOCK)) {
+				fcgi_mpx_conn_close(srv, c);
+				continue;
+			}
+		}
+
+		fcgi_mpx_attach(c, hctx);
+
+		return 1;
+	}
+
+	return 0;
+}
+
+static void fcgi_proc_mpx_flush(server *srv, fcgi_proc *proc) {
+	fcgi_mpx_conn *c, *next;
+
+	for (c = proc->mpx; c; c = next) {
+		next = c->next;
+
+		if (0 == c->active) fcgi_mpx_conn_close(srv, c);
+	}
+}
+
+/* close the connections which were unused for too long or are too many */
+static void fcgi_proc_mpx_timeout(server *srv, fcgi_extension_host *host, fcgi_proc *proc) {
+	fcgi_mpx_conn *c, *next;
+	size_t idle = 0;
+
+	for (c = proc->mpx; c; c = next) {
+		next = c->next;
+
+		if (c->active) continue;
+
+		if (++idle <= host->keep_alive_max_idle &&
+		    srv->cur_ts - c->idle_since < host->keep_alive_idle_timeout) continue;
+
+		fcgi_mpx_conn_close(srv, c);
+	}
+}
+
 static void fcgi_host_assign(server *srv, handler_ctx *hctx, fcgi_extension_host *host) {
 	plugin_data *p = hctx->plugin_data;
 	hctx->host = host;
@@ -445,10 +1033,17 @@ static void fcgi_host_reset(server *srv, handler_ctx *hctx) {
 static void fcgi_host_disable(server *srv, handler_ctx *hctx) {
 	plugin_data *p    = hctx->plugin_data;
 
+	/* reaped while we were connecting */
+	if (hctx->proc->state == PROC_STATE_KILLED) return;
+
 	if (hctx->host->disable_time || hctx->proc->is_local) {
 		if (hctx->proc->state == PROC_STATE_RUNNING) hctx->host->active_procs--;
 		hctx->proc->disabled_until = srv->cur_ts + hctx->host->disable_time;
 		hctx->proc->state = hctx->proc->is_local ? PROC_STATE_DIED_WAIT_FOR_PID : PROC_STATE_DIED;
+		fcgi_proc_heap_update(hctx->host, hctx->proc);
+
+		fcgi_proc_idle_flush(srv, p, hctx->host, hctx->proc);
+		fcgi_proc_mpx_flush(srv, hctx->proc);
 
 		if (p->conf.debug) {
 			log_error_write(srv, __FILE__, __LINE__, "sds",
@@ -457,6 +1052,13 @@ static void fcgi_host_disable(server *srv, handler_ctx *hctx) {
 	}
 }
 
+static void fcgi_host_procs_status(server *srv, plugin_data *p, fcgi_extension_host *host) {
+	fastcgi_status_copy_procname(p->statuskey, host, NULL);
+	buffer_append_string_len(p->statuskey, CONST_STR_LEN(".procs"));
+
+	status_counter_set(srv, CONST_BUF_LEN(p->statuskey), host->num_procs);
+}
+
 static int fastcgi_status_init(server *srv, buffer *b, fcgi_extension_host *host, fcgi_proc *proc) {
 #define CLEAN(x) \
 	fastcgi_status_copy_procname(b, host, proc); \
@@ -468,6 +1070,8 @@ static int fastcgi_status_init(server *srv, buffer *b, fcgi_extension_host *host
 	CLEAN(".overloaded");
 	CLEAN(".connected");
 	CLEAN(".load");
+	CLEAN(".idle");
+	CLEAN(".shared");
 
 #undef CLEAN
 
@@ -535,10 +1139,26 @@ static fcgi_proc *fastcgi_process_init(void) {
 }
 
 static void fastcgi_process_free(fcgi_proc *f) {
+	fcgi_idle_conn *ic;
+	fcgi_mpx_conn *c;
+
 	if (!f) return;
 
 	fastcgi_process_free(f->next);
 
+	/* the fd-events are gone with the server */
+	while (NULL != (ic = f->idle)) {
+		f->idle = ic->next;
+		close(ic->fd);
+		free(ic);
+	}
+
+	while (NULL != (c = f->mpx)) {
+		f->mpx = c->next;
+		close(c->fd);
+		fcgi_mpx_conn_free(c);
+	}
+
 	buffer_free(f->unixsocket);
 	buffer_free(f->connection_name);
 
@@ -576,6 +1196,14 @@ static void fastcgi_host_free(fcgi_extension_host *h) {
 
 	fastcgi_process_free(h->first);
 	fastcgi_process_free(h->unused_procs);
+	free(h->heap);
+
+	while (h->env_tpl) {
+		fcgi_env_tpl *t = h->env_tpl;
+		h->env_tpl = t->next;
+		buffer_free(t->env);
+		free(t);
+	}
 
 	free(h);
 
@@ -610,6 +1238,7 @@ static void fastcgi_extensions_free(fcgi_exts *f) {
 
 		buffer_free(fe->key);
 		free(fe->hosts);
+		ketama_free(fe->ring);
 
 		free(fe);
 	}
@@ -683,6 +1312,9 @@ INIT_FUNC(mod_fastcgi_init) {
 
 	p->statuskey = buffer_init();
 
+	p->collapse = collapse_init();
+	p->collapse_key = buffer_init();
+
 	return p;
 }
 
@@ -697,6 +1329,9 @@ FREE_FUNC(mod_fastcgi_free) {
 	buffer_free(p->parse_response);
 	buffer_free(p->statuskey);
 
+	collapse_free(p->collapse);
+	buffer_free(p->collapse_key);
+
 	if (p->config_storage) {
 		size_t i, j, n;
 		for (i = 0; i < srv->config_context->used; i++) {
@@ -743,6 +1378,7 @@ FREE_FUNC(mod_fastcgi_free) {
 
 			fastcgi_extensions_free(s->exts);
 			array_free(s->ext_mapping);
+			buffer_free(s->hash_cookie);
 
 			free(s);
 		}
@@ -1161,11 +1797,18 @@ SETDEFAULTS_FUNC(mod_fastcgi_set_defaults) {
 	data_unset *du;
 	size_t i = 0;
 	buffer *fcgi_mode = buffer_init();
+	buffer *fcgi_balance = buffer_init();
 
 	config_values_t cv[] = {
 		{ "fastcgi.server",              NULL, T_CONFIG_LOCAL, T_CONFIG_SCOPE_CONNECTION },       /* 0 */
 		{ "fastcgi.debug",               NULL, T_CONFIG_INT  , T_CONFIG_SCOPE_CONNECTION },       /* 1 */
 		{ "fastcgi.map-extensions",      NULL, T_CONFIG_ARRAY, T_CONFIG_SCOPE_CONNECTION },       /* 2 */
+		{ "fastcgi.balance",             NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },      /* 3 */
+		{ "fastcgi.hash-key",            NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },      /* 4 */
+		{ "fastcgi.collapse",            NULL, T_CONFIG_BOOLEAN, T_CONFIG_SCOPE_CONNECTION },     /* 5 */
+		{ "fastcgi.collapse-timeout",    NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },       /* 6 */
+		{ "fastcgi.response-buffer",     NULL, T_CONFIG_INT, T_CONFIG_SCOPE_CONNECTION },         /* 7 */
+		{ "fastcgi.response-spool",      NULL, T_CONFIG_INT, T_CONFIG_SCOPE_CONNECTION },         /* 8 */
 		{ NULL,                          NULL, T_CONFIG_UNSET, T_CONFIG_SCOPE_UNSET }
 	};
 
@@ -1179,10 +1822,24 @@ SETDEFAULTS_FUNC(mod_fastcgi_set_defaults) {
 		s->exts          = fastcgi_extensions_init();
 		s->debug         = 0;
 		s->ext_mapping   = array_init();
+		s->hash_cookie   = buffer_init();
+		s->collapse      = 0;
+		s->collapse_timeout = 5;
+		s->response_buffer = 256;
+		s->response_spool = 0;
 
 		cv[0].destination = s->exts;
 		cv[1].destination = &(s->debug);
 		cv[2].destination = s->ext_mapping;
+		cv[3].destination = fcgi_balance;
+		cv[4].destination = p->parse_response;
+		cv[5].destination = &(s->collapse);
+		cv[6].destination = &(s->collapse_timeout);
+		cv[7].destination = &(s->response_buffer);
+		cv[8].destination = &(s->response_spool);
+
+		buffer_reset(fcgi_balance);
+		buffer_reset(p->parse_response);
 
 		p->config_storage[i] = s;
 		ca = ((data_config *)srv->config_context->data[i])->value;
@@ -1191,6 +1848,23 @@ SETDEFAULTS_FUNC(mod_fastcgi_set_defaults) {
 			return HANDLER_ERROR;
 		}
 
+		if (buffer_is_empty(fcgi_balance) ||
+		    buffer_is_equal_string(fcgi_balance, CONST_STR_LEN("fair"))) {
+			s->balance = FCGI_HOST_BALANCE_FAIR;
+		} else if (buffer_is_equal_string(fcgi_balance, CONST_STR_LEN("hash"))) {
+			s->balance = FCGI_HOST_BALANCE_HASH;
+		} else {
+			log_error_write(srv, __FILE__, __LINE__, "sb",
+					"fastcgi.balance has to be one of: fair, hash, but not:", fcgi_balance);
+			return HANDLER_ERROR;
+		}
+
+		if (0 != ketama_key_parse(p->parse_response, &(s->hash_key), s->hash_cookie)) {
+			log_error_write(srv, __FILE__, __LINE__, "sb",
+					"fastcgi.hash-key has to be one of: uri, host, ip, cookie:<name>, but not:", p->parse_response);
+			return HANDLER_ERROR;
+		}
+
 		/*
 		 * <key> = ( ... )
 		 */
@@ -1261,6 +1935,15 @@ SETDEFAULTS_FUNC(mod_fastcgi_set_defaults) {
 						{ "strip-request-uri",  NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },      /* 13 */
 						{ "kill-signal",        NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },       /* 14 */
 						{ "fix-root-scriptname",   NULL, T_CONFIG_BOOLEAN, T_CONFIG_SCOPE_CONNECTION },  /* 15 */
+						{ "keep-alive",         NULL, T_CONFIG_BOOLEAN, T_CONFIG_SCOPE_CONNECTION },     /* 16 */
+						{ "keep-alive-max-idle", NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },      /* 17 */
+						{ "keep-alive-idle-timeout", NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },  /* 18 */
+						{ "multiplex",          NULL, T_CONFIG_BOOLEAN, T_CONFIG_SCOPE_CONNECTION },     /* 19 */
+						{ "multiplex-max-requests", NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },   /* 20 */
+						{ "min-procs",          NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },       /* 21 */
+						{ "max-load-per-proc",  NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },       /* 22 */
+						{ "idle-timeout",       NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },       /* 23 */
+						{ "balance",            NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },      /* 24 */
 
 						{ NULL,                NULL, T_CONFIG_UNSET, T_CONFIG_SCOPE_UNSET }
 					};
@@ -1276,17 +1959,26 @@ SETDEFAULTS_FUNC(mod_fastcgi_set_defaults) {
 
 					host = fastcgi_host_init();
 					buffer_reset(fcgi_mode);
+					buffer_reset(fcgi_balance);
 
 					buffer_copy_string_buffer(host->id, da_host->key);
 
 					host->check_local  = 1;
+					host->min_procs    = 0; /* same as max_procs */
 					host->max_procs    = 4;
+					host->max_load_per_proc = 1;
+					host->idle_timeout = 60;
 					host->mode = FCGI_RESPONDER;
 					host->disable_time = 1;
 					host->break_scriptfilename_for_php = 0;
 					host->allow_xsendfile = 0; /* handle X-LIGHTTPD-send-file */
 					host->kill_signal = SIGTERM;
 					host->fix_root_path_name = 0;
+					host->keep_alive = 0;
+					host->keep_alive_max_idle = 8;
+					host->keep_alive_idle_timeout = 30;
+					host->multiplex = 0;
+					host->multiplex_max_requests = 16;
 
 					fcv[0].destination = host->host;
 					fcv[1].destination = host->docroot;
@@ -1306,11 +1998,23 @@ SETDEFAULTS_FUNC(mod_fastcgi_set_defaults) {
 					fcv[13].destination = host->strip_request_uri;
 					fcv[14].destination = &(host->kill_signal);
 					fcv[15].destination = &(host->fix_root_path_name);
+					fcv[16].destination = &(host->keep_alive);
+					fcv[17].destination = &(host->keep_alive_max_idle);
+					fcv[18].destination = &(host->keep_alive_idle_timeout);
+					fcv[19].destination = &(host->multiplex);
+					fcv[20].destination = &(host->multiplex_max_requests);
+					fcv[21].destination = &(host->min_procs);
+					fcv[22].destination = &(host->max_load_per_proc);
+					fcv[23].destination = &(host->idle_timeout);
+					fcv[24].destination = fcgi_balance;
 
 					if (0 != config_insert_values_internal(srv, da_host->value, fcv)) {
 						return HANDLER_ERROR;
 					}
 
+					if (host->multiplex_max_requests == 0) host->multiplex_max_requests = 1;
+					if (host->max_load_per_proc == 0) host->max_load_per_proc = 1;
+
 					if ((!buffer_is_empty(host->host) || host->port) &&
 					    !buffer_is_empty(host->unixsocket)) {
 						log_error_write(srv, __FILE__, __LINE__, "sbsbsbs",
@@ -1362,16 +2066,21 @@ SETDEFAULTS_FUNC(mod_fastcgi_set_defaults) {
 						/* a local socket + self spawning */
 						size_t pno;
 
+						if (host->min_procs == 0 || host->min_procs > host->max_procs) {
+							host->min_procs = host->max_procs;
+						}
+
 						if (s->debug) {
-							log_error_write(srv, __FILE__, __LINE__, "ssbsdsbsd",
+							log_error_write(srv, __FILE__, __LINE__, "ssbsdsbsdsd",
 									"--- fastcgi spawning local",
 									"\n\tproc:", host->bin_path,
 									"\n\tport:", host->port,
 									"\n\tsocket", host->unixsocket,
+									"\n\tmin-procs:", host->min_procs,
 									"\n\tmax-procs:", host->max_procs);
 						}
 
-						for (pno = 0; pno < host->max_procs; pno++) {
+						for (pno = 0; pno < host->min_procs; pno++) {
 							fcgi_proc *proc;
 
 							proc = fastcgi_process_init();
@@ -1402,11 +2111,16 @@ SETDEFAULTS_FUNC(mod_fastcgi_set_defaults) {
 
 							fastcgi_status_init(srv, p->statuskey, host, proc);
 
+							proc->last_used = srv->cur_ts;
 							proc->next = host->first;
 							if (host->first) 	host->first->prev = proc;
 
 							host->first = proc;
+
+							fcgi_proc_heap_insert(host, proc);
 						}
+
+						fcgi_host_procs_status(srv, p, host);
 					} else {
 						fcgi_proc *proc;
 
@@ -1426,6 +2140,9 @@ SETDEFAULTS_FUNC(mod_fastcgi_set_defaults) {
 
 						host->first = proc;
 
+						fcgi_proc_heap_insert(host, proc);
+
+						host->min_procs = 1;
 						host->max_procs = 1;
 					}
 
@@ -1446,14 +2163,29 @@ SETDEFAULTS_FUNC(mod_fastcgi_set_defaults) {
 						}
 					}
 
-					/* if extension already exists, take it */
-					fastcgi_extension_insert(s->exts, da_ext->key, host);
-				}
-			}
+					if (!buffer_is_empty(fcgi_balance)) {
+						if (strcmp(fcgi_balance->ptr, "least-loaded") == 0) {
+							host->balance = FCGI_BALANCE_LEAST_LOADED;
+						} else if (strcmp(fcgi_balance->ptr, "power-of-two") == 0) {
+							host->balance = FCGI_BALANCE_POWER_OF_TWO;
+						} else if (strcmp(fcgi_balance->ptr, "peak-ewma") == 0) {
+							host->balance = FCGI_BALANCE_PEAK_EWMA;
+						} else {
+							log_error_write(srv, __FILE__, __LINE__, "sbs",
+									"WARNING: unknown fastcgi balance:",
+									fcgi_balance, "(ignored, balance set to least-loaded)");
+						}
+					}
+
+					/* if extension already exists, take it */
+					fastcgi_extension_insert(s->exts, da_ext->key, host);
+				}
+			}
 		}
 	}
 
 	buffer_free(fcgi_mode);
+	buffer_free(fcgi_balance);
 
 	return HANDLER_GO_ON;
 }
@@ -1475,11 +2207,21 @@ static void fcgi_connection_close(server *srv, handler_ctx *hctx) {
 	p    = hctx->plugin_data;
 	con  = hctx->remote_conn;
 
+	fcgi_mpx_detach(srv, hctx, 0);
+
+	if (hctx->collapse) {
+		collapse_leave(srv, p->collapse, hctx->collapse, con);
+		hctx->collapse = NULL;
+	}
+
 	if (hctx->fd != -1) {
 		fdevent_event_del(srv->ev, &(hctx->fde_ndx), hctx->fd);
 		fdevent_unregister(srv->ev, hctx->fd);
-		close(hctx->fd);
-		srv->cur_fds--;
+
+		if (!hctx->host || !hctx->proc || !fcgi_proc_idle_put(srv, hctx)) {
+			close(hctx->fd);
+			srv->cur_fds--;
+		}
 	}
 
 	if (hctx->host && hctx->proc) {
@@ -1524,6 +2266,8 @@ static int fcgi_reconnect(server *srv, handler_ctx *hctx) {
 	 *
 	 */
 
+	fcgi_mpx_detach(srv, hctx, 0);
+
 	if (hctx->fd != -1) {
 		fdevent_event_del(srv->ev, &(hctx->fde_ndx), hctx->fd);
 		fdevent_unregister(srv->ev, hctx->fd);
@@ -1536,6 +2280,8 @@ static int fcgi_reconnect(server *srv, handler_ctx *hctx) {
 
 	hctx->request_id = 0;
 	hctx->reconnects++;
+	hctx->reused = 0;
+	hctx->keep_conn = 0;
 
 	if (p->conf.debug > 2) {
 		if (hctx->proc) {
@@ -1551,6 +2297,7 @@ static int fcgi_reconnect(server *srv, handler_ctx *hctx) {
 
 	if (hctx->proc && hctx->got_proc) {
 		fcgi_proc_load_dec(srv, hctx);
+		hctx->got_proc = 0;
 	}
 
 	/* perhaps another host gives us more luck */
@@ -1560,6 +2307,21 @@ static int fcgi_reconnect(server *srv, handler_ctx *hctx) {
 }
 
 
+/* the backend closed a kept-alive connection before it answered
+ *
+ * requests without a body can be sent again on a new connection,
+ * the body is consumed by fcgi_create_env() */
+static int fcgi_reused_conn_failed(handler_ctx *hctx) {
+	connection *con = hctx->remote_conn;
+
+	return hctx->reused &&
+		hctx->reconnects < 5 &&
+		0 == con->request.content_length &&
+		0 == con->file_started &&
+		buffer_is_empty(hctx->response_header) &&
+		chunkqueue_is_empty(hctx->rb);
+}
+
 static handler_t fcgi_connection_reset(server *srv, connection *con, void *p_d) {
 	plugin_data *p = p_d;
 
@@ -1622,6 +2384,50 @@ static int fcgi_env_add(buffer *env, const char *key, size_t key_len, const char
 	return 0;
 }
 
+static fcgi_env_tpl *fcgi_env_tpl_get(fcgi_extension_host *host, connection *con) {
+	fcgi_env_tpl *t;
+	server_socket *srv_sock = con->srv_socket;
+	char buf[32];
+
+	for (t = host->env_tpl; t; t = t->next) {
+		if (t->srv_sock == srv_sock && t->server_tag == con->conf.server_tag) return t;
+	}
+
+	t = calloc(1, sizeof(*t));
+	t->srv_sock = srv_sock;
+	t->server_tag = con->conf.server_tag;
+	t->env = buffer_init();
+
+	if (buffer_is_empty(con->conf.server_tag)) {
+		fcgi_env_add(t->env, CONST_STR_LEN("SERVER_SOFTWARE"), CONST_STR_LEN(PACKAGE_DESC));
+	} else {
+		fcgi_env_add(t->env, CONST_STR_LEN("SERVER_SOFTWARE"), CONST_BUF_LEN(con->conf.server_tag));
+	}
+
+	fcgi_env_add(t->env, CONST_STR_LEN("GATEWAY_INTERFACE"), CONST_STR_LEN("CGI/1.1"));
+
+	LI_ltostr(buf,
+#ifdef HAVE_IPV6
+	       ntohs(srv_sock->addr.plain.sa_family ? srv_sock->addr.ipv6.sin6_port : srv_sock->addr.ipv4.sin_port)
+#else
+	       ntohs(srv_sock->addr.ipv4.sin_port)
+#endif
+	       );
+
+	fcgi_env_add(t->env, CONST_STR_LEN("SERVER_PORT"), buf, strlen(buf));
+
+	fcgi_env_add(t->env, CONST_STR_LEN("REDIRECT_STATUS"), CONST_STR_LEN("200")); /* if php is compiled with --force-redirect */
+
+	if (!buffer_is_empty(host->docroot)) {
+		fcgi_env_add(t->env, CONST_STR_LEN("DOCUMENT_ROOT"), CONST_BUF_LEN(host->docroot));
+	}
+
+	t->next = host->env_tpl;
+	host->env_tpl = t;
+
+	return t;
+}
+
 static int fcgi_header(FCGI_Header * header, unsigned char type, size_t request_id, int contentLength, unsigned char paddingLength) {
 	assert(contentLength <= FCGI_MAX_LENGTH);
 	
@@ -1757,29 +2563,9 @@ static int fcgi_env_add_request_headers(server *srv, connection *con, plugin_dat
 		ds = (data_string *)con->request.headers->data[i];
 
 		if (ds->value->used && ds->key->used) {
-			size_t j;
-			buffer_reset(srv->tmp_buf);
-
-			if (0 != strcasecmp(ds->key->ptr, "CONTENT-TYPE")) {
-				buffer_copy_string_len(srv->tmp_buf, CONST_STR_LEN("HTTP_"));
-				srv->tmp_buf->used--;
-			}
-
-			buffer_prepare_append(srv->tmp_buf, ds->key->used + 2);
-			for (j = 0; j < ds->key->used - 1; j++) {
-				char c = '_';
-				if (light_isalpha(ds->key->ptr[j])) {
-					/* upper-case */
-					c = ds->key->ptr[j] & ~32;
-				} else if (light_isdigit(ds->key->ptr[j])) {
-					/* copy */
-					c = ds->key->ptr[j];
-				}
-				srv->tmp_buf->ptr[srv->tmp_buf->used++] = c;
-			}
-			srv->tmp_buf->ptr[srv->tmp_buf->used++] = '\0';
+			buffer *key = http_cgi_header_key(srv, ds->key);
 
-			FCGI_ENV_ADD_CHECK(fcgi_env_add(p->fcgi_env, CONST_BUF_LEN(srv->tmp_buf), CONST_BUF_LEN(ds->value)),con);
+			FCGI_ENV_ADD_CHECK(fcgi_env_add(p->fcgi_env, CONST_BUF_LEN(key), CONST_BUF_LEN(ds->value)),con);
 		}
 	}
 
@@ -1789,24 +2575,9 @@ static int fcgi_env_add_request_headers(server *srv, connection *con, plugin_dat
 		ds = (data_string *)con->environment->data[i];
 
 		if (ds->value->used && ds->key->used) {
-			size_t j;
-			buffer_reset(srv->tmp_buf);
-
-			buffer_prepare_append(srv->tmp_buf, ds->key->used + 2);
-			for (j = 0; j < ds->key->used - 1; j++) {
-				char c = '_';
-				if (light_isalpha(ds->key->ptr[j])) {
-					/* upper-case */
-					c = ds->key->ptr[j] & ~32;
-				} else if (light_isdigit(ds->key->ptr[j])) {
-					/* copy */
-					c = ds->key->ptr[j];
-				}
-				srv->tmp_buf->ptr[srv->tmp_buf->used++] = c;
-			}
-			srv->tmp_buf->ptr[srv->tmp_buf->used++] = '\0';
+			buffer *key = http_cgi_env_key(srv, ds->key);
 
-			FCGI_ENV_ADD_CHECK(fcgi_env_add(p->fcgi_env, CONST_BUF_LEN(srv->tmp_buf), CONST_BUF_LEN(ds->value)), con);
+			FCGI_ENV_ADD_CHECK(fcgi_env_add(p->fcgi_env, CONST_BUF_LEN(key), CONST_BUF_LEN(ds->value)), con);
 		}
 	}
 
@@ -1818,6 +2589,7 @@ static int fcgi_create_env(server *srv, handler_ctx *hctx, size_t request_id) {
 	FCGI_BeginRequestRecord beginRecord;
 	FCGI_Header header;
 	buffer *b;
+	fcgi_env_tpl *tpl;
 
 	char buf[32];
 	const char *s;
@@ -1839,22 +2611,17 @@ static int fcgi_create_env(server *srv, handler_ctx *hctx, size_t request_id) {
 	fcgi_header(&(beginRecord.header), FCGI_BEGIN_REQUEST, request_id, sizeof(beginRecord.body), 0);
 	beginRecord.body.roleB0 = host->mode;
 	beginRecord.body.roleB1 = 0;
-	beginRecord.body.flags = 0;
+	beginRecord.body.flags = (host->keep_alive || host->multiplex) ? FCGI_KEEP_CONN : 0;
 	memset(beginRecord.body.reserved, 0, sizeof(beginRecord.body.reserved));
 
 	b = chunkqueue_get_append_buffer(hctx->wb);
 
 	buffer_copy_memory(b, (const char *)&beginRecord, sizeof(beginRecord));
 
-	/* send FCGI_PARAMS */
+	/* send FCGI_PARAMS, starting with the static part */
 	buffer_prepare_copy(p->fcgi_env, 1024);
-
-
-	if (buffer_is_empty(con->conf.server_tag)) {
-		FCGI_ENV_ADD_CHECK(fcgi_env_add(p->fcgi_env, CONST_STR_LEN("SERVER_SOFTWARE"), CONST_STR_LEN(PACKAGE_DESC)),con)
-	} else {
-		FCGI_ENV_ADD_CHECK(fcgi_env_add(p->fcgi_env, CONST_STR_LEN("SERVER_SOFTWARE"), CONST_BUF_LEN(con->conf.server_tag)),con)
-	}
+	tpl = fcgi_env_tpl_get(host, con);
+	buffer_copy_memory(p->fcgi_env, tpl->env->ptr, tpl->env->used);
 
 	if (con->server_name->used) {
 		size_t len = con->server_name->used - 1;
@@ -1881,18 +2648,6 @@ static int fcgi_create_env(server *srv, handler_ctx *hctx, size_t request_id) {
 		FCGI_ENV_ADD_CHECK(fcgi_env_add(p->fcgi_env, CONST_STR_LEN("SERVER_NAME"), s, strlen(s)),con)
 	}
 
-	FCGI_ENV_ADD_CHECK(fcgi_env_add(p->fcgi_env, CONST_STR_LEN("GATEWAY_INTERFACE"), CONST_STR_LEN("CGI/1.1")),con)
-
-	LI_ltostr(buf,
-#ifdef HAVE_IPV6
-	       ntohs(srv_sock->addr.plain.sa_family ? srv_sock->addr.ipv6.sin6_port : srv_sock->addr.ipv4.sin_port)
-#else
-	       ntohs(srv_sock->addr.ipv4.sin_port)
-#endif
-	       );
-
-	FCGI_ENV_ADD_CHECK(fcgi_env_add(p->fcgi_env, CONST_STR_LEN("SERVER_PORT"), buf, strlen(buf)),con)
-
 	/* get the server-side of the connection to the client */
 	our_addr_len = sizeof(our_addr);
 
@@ -1969,7 +2724,6 @@ static int fcgi_create_env(server *srv, handler_ctx *hctx, size_t request_id) {
 		buffer_append_string_buffer(p->path, con->uri.path);
 
 		FCGI_ENV_ADD_CHECK(fcgi_env_add(p->fcgi_env, CONST_STR_LEN("SCRIPT_FILENAME"), CONST_BUF_LEN(p->path)),con)
-		FCGI_ENV_ADD_CHECK(fcgi_env_add(p->fcgi_env, CONST_STR_LEN("DOCUMENT_ROOT"), CONST_BUF_LEN(host->docroot)),con)
 	} else {
 		buffer_copy_string_buffer(p->path, con->physical.path);
 
@@ -2024,7 +2778,6 @@ static int fcgi_create_env(server *srv, handler_ctx *hctx, size_t request_id) {
 
 	s = get_http_method_name(con->request.http_method);
 	FCGI_ENV_ADD_CHECK(fcgi_env_add(p->fcgi_env, CONST_STR_LEN("REQUEST_METHOD"), s, strlen(s)),con)
-	FCGI_ENV_ADD_CHECK(fcgi_env_add(p->fcgi_env, CONST_STR_LEN("REDIRECT_STATUS"), CONST_STR_LEN("200")),con) /* if php is compiled with --force-redirect */
 	s = get_http_version_name(con->request.http_version);
 	FCGI_ENV_ADD_CHECK(fcgi_env_add(p->fcgi_env, CONST_STR_LEN("SERVER_PROTOCOL"), s, strlen(s)),con)
 
@@ -2385,13 +3138,13 @@ typedef struct {
 	size_t   request_id;
 } fastcgi_response_packet;
 
-static int fastcgi_get_packet(server *srv, handler_ctx *hctx, fastcgi_response_packet *packet) {
+static int fastcgi_get_packet(server *srv, plugin_data *p, chunkqueue *rb, fastcgi_response_packet *packet) {
 	chunk *	c;
 	size_t offset;
 	size_t toread;
 	FCGI_Header *header;
 
-	if (!hctx->rb->first) return -1;
+	if (!rb->first) return -1;
 
 	packet->b = buffer_init();
 	packet->len = 0;
@@ -2401,7 +3154,7 @@ static int fastcgi_get_packet(server *srv, handler_ctx *hctx, fastcgi_response_p
 
 	offset = 0; toread = 8;
 	/* get at least the FastCGI header */
-	for (c = hctx->rb->first; c; c = c->next) {
+	for (c = rb->first; c; c = c->next) {
 		size_t weHave = c->mem->used - c->offset - 1;
 
 		if (weHave > toread) weHave = toread;
@@ -2422,7 +3175,7 @@ static int fastcgi_get_packet(server *srv, handler_ctx *hctx, fastcgi_response_p
 		/* no header */
 		buffer_free(packet->b);
 
-		if (hctx->plugin_data->conf.debug) {
+		if (p->conf.debug) {
 			log_error_write(srv, __FILE__, __LINE__, "sdsds", "FastCGI: header too small:", packet->b->used, "bytes <", sizeof(FCGI_Header), "bytes, waiting for more data");
 		}
 		return -1;
@@ -2466,7 +3219,7 @@ static int fastcgi_get_packet(server *srv, handler_ctx *hctx, fastcgi_response_p
 
 	/* tag the chunks as read */
 	toread = packet->len + sizeof(FCGI_Header);
-	for (c = hctx->rb->first; c && toread; c = c->next) {
+	for (c = rb->first; c && toread; c = c->next) {
 		if (c->mem->used - c->offset - 1 <= toread) {
 			/* we read this whole buffer, move it to unused */
 			toread -= c->mem->used - c->offset - 1;
@@ -2477,20 +3230,214 @@ static int fastcgi_get_packet(server *srv, handler_ctx *hctx, fastcgi_response_p
 		}
 	}
 
-	chunkqueue_remove_finished_chunks(hctx->rb);
+	chunkqueue_remove_finished_chunks(rb);
 
 	return 0;
 }
 
+/* process one packet of the response
+ *
+ * returns 1 after FCGI_END_REQUEST
+ */
+/* the body goes into memory up to fastcgi.response-buffer, then into tempfiles */
+static void fcgi_response_append(server *srv, handler_ctx *hctx, const char *s, size_t len) {
+	connection *con = hctx->remote_conn;
+	off_t mem, spooled;
+
+	if (hctx->conf.response_spool > 0) {
+		http_chunk_backlog(con, &mem, &spooled);
+
+		if (mem >= (off_t)hctx->conf.response_buffer * 1024 &&
+		    spooled < (off_t)hctx->conf.response_spool * 1024 &&
+		    0 == http_chunk_append_spool(srv, con, s, len)) return;
+	}
+
+	http_chunk_append_mem(srv, con, s, len + 1);
+}
+
+/* the client is slower than the backend and memory and spool are full,
+ * a shared (multiplexed) connection is never stopped for one request */
+static int fcgi_response_blocked(handler_ctx *hctx) {
+	off_t mem, spooled;
+
+	if (hctx->conf.response_buffer == 0 || hctx->mpx) return 0;
+
+	http_chunk_backlog(hctx->remote_conn, &mem, &spooled);
+
+	return mem >= (off_t)hctx->conf.response_buffer * 1024 &&
+	       spooled >= (off_t)hctx->conf.response_spool * 1024;
+}
+
+static int fcgi_demux_packet(server *srv, handler_ctx *hctx, fastcgi_response_packet *packet) {
+	int fin = 0;
+
+	plugin_data *p    = hctx->plugin_data;
+	connection *con   = hctx->remote_conn;
+	fcgi_extension_host *host= hctx->host;
+
+	switch(packet->type) {
+	case FCGI_STDOUT:
+		if (packet->len == 0) break;
+
+		/* is the header already finished */
+		if (0 == con->file_started) {
+			char *c;
+			size_t blen;
+			data_string *ds;
+
+			/* search for header terminator
+			 *
+			 * if we start with \r\n check if last packet terminated with \r\n
+			 * if we start with \n check if last packet terminated with \n
+			 * search for \r\n\r\n
+			 * search for \n\n
+			 */
+
+			if (hctx->response_header->used == 0) {
+				buffer_copy_string_buffer(hctx->response_header, packet->b);
+			} else {
+				buffer_append_string_buffer(hctx->response_header, packet->b);
+			}
+
+			if (NULL != (c = buffer_search_string_len(hctx->response_header, CONST_STR_LEN("\r\n\r\n")))) {
+				blen = hctx->response_header->used - (c - hctx->response_header->ptr) - 4;
+				hctx->response_header->used = (c - hctx->response_header->ptr) + 3;
+				c += 4; /* point the the start of the response */
+			} else if (NULL != (c = buffer_search_string_len(hctx->response_header, CONST_STR_LEN("\n\n")))) {
+				blen = hctx->response_header->used - (c - hctx->response_header->ptr) - 2;
+				hctx->response_header->used = c - hctx->response_header->ptr + 2;
+				c += 2; /* point the the start of the response */
+			} else {
+				/* no luck, no header found */
+				break;
+			}
+
+			if (hctx->ewma_start > 0) {
+				double now = ewma_now();
+
+				ewma_update(&hctx->proc->ewma, now, now - hctx->ewma_start);
+				hctx->ewma_start = 0;
+			}
+
+			/* parse the response header */
+			if (fcgi_response_parse(srv, con, p, hctx->response_header)) {
+				con->http_status = 502;
+				hctx->send_content_body = 0;
+				con->file_started = 1;
+				break;
+			}
+
+			con->file_started = 1;
+
+			if (host->mode == FCGI_AUTHORIZER &&
+			    (con->http_status == 0 ||
+			     con->http_status == 200)) {
+				/* a authorizer with approved the static request, ignore the content here */
+				hctx->send_content_body = 0;
+			}
+
+			if (host->allow_xsendfile && hctx->send_content_body &&
+			    (NULL != (ds = (data_string *) array_get_element(con->response.headers, "X-LIGHTTPD-send-file"))
+				  || NULL != (ds = (data_string *) array_get_element(con->response.headers, "X-Sendfile")))) {
+				data_string *dcl;
+
+				/* the length is the one of the file */
+				if (NULL != (dcl = (data_string *)array_get_element(con->response.headers, "Content-Length"))) {
+					buffer_reset(dcl->value);
+				}
+				con->parsed_response &= ~HTTP_CONTENT_LENGTH;
+
+				/* Range, If-None-Match and If-Modified-Since as for a static file */
+				if (HANDLER_ERROR != http_response_send_file(srv, con, ds->value, 1)) {
+					hctx->send_content_body = 0; /* ignore the content */
+
+					/* the followers don't get the file */
+					if (hctx->collapse_leader) {
+						collapse_leave(srv, p->collapse, hctx->collapse, con);
+						hctx->collapse = NULL;
+						hctx->collapse_leader = 0;
+					}
+					joblist_append(srv, con);
+				} else {
+					log_error_write(srv, __FILE__, __LINE__, "sb",
+						"send-file error: couldn't get stat_cache entry for:",
+						ds->value);
+					con->http_status = 502;
+					hctx->send_content_body = 0;
+					con->file_started = 1;
+					break;
+				}
+			}
+
+			if (hctx->send_content_body) http_response_body_start(srv, con);
+
+			if (hctx->send_content_body && blen > 1) {
+				/* enable chunked-transfer-encoding */
+				if (con->request.http_version == HTTP_VERSION_1_1 &&
+				    !(con->parsed_response & HTTP_CONTENT_LENGTH)) {
+					con->response.transfer_encoding = HTTP_TRANSFER_ENCODING_CHUNKED;
+				}
+
+				fcgi_response_append(srv, hctx, c, blen - 1);
+				if (hctx->collapse_leader) collapse_append(hctx->collapse, c, blen - 1);
+				joblist_append(srv, con);
+			}
+		} else if (hctx->send_content_body && packet->b->used > 1) {
+			if (con->request.http_version == HTTP_VERSION_1_1 &&
+			    !(con->parsed_response & HTTP_CONTENT_LENGTH)) {
+				/* enable chunked-transfer-encoding */
+				con->response.transfer_encoding = HTTP_TRANSFER_ENCODING_CHUNKED;
+			}
+
+			fcgi_response_append(srv, hctx, packet->b->ptr, packet->b->used - 1);
+			if (hctx->collapse_leader) collapse_append(hctx->collapse, packet->b->ptr, packet->b->used - 1);
+			joblist_append(srv, con);
+		}
+		break;
+	case FCGI_STDERR:
+		if (packet->len == 0) break;
+
+		log_error_write_multiline_buffer(srv, __FILE__, __LINE__, packet->b, "s",
+				"FastCGI-stderr:");
+
+		break;
+	case FCGI_END_REQUEST:
+		con->file_finished = 1;
+
+		if (host->mode != FCGI_AUTHORIZER ||
+		    !(con->http_status == 0 ||
+		      con->http_status == 200)) {
+			/* send chunk-end if necessary */
+			http_chunk_append_mem(srv, con, NULL, 0);
+			joblist_append(srv, con);
+		}
+
+		/* the backend keeps the connection open for the next request */
+		if (host->keep_alive &&
+		    packet->request_id == hctx->request_id &&
+		    packet->b->used > sizeof(FCGI_EndRequestBody) &&
+		    ((FCGI_EndRequestBody *)packet->b->ptr)->protocolStatus == FCGI_REQUEST_COMPLETE) {
+			hctx->keep_conn = 1;
+		}
+
+		fin = 1;
+		break;
+	default:
+		log_error_write(srv, __FILE__, __LINE__, "sd",
+				"FastCGI: header.type not handled: ", packet->type);
+		break;
+	}
+
+	return fin;
+}
+
 static int fcgi_demux_response(server *srv, handler_ctx *hctx) {
 	int fin = 0;
 	int toread;
 	ssize_t r;
 
 	plugin_data *p    = hctx->plugin_data;
-	connection *con   = hctx->remote_conn;
 	int fcgi_fd       = hctx->fd;
-	fcgi_extension_host *host= hctx->host;
 	fcgi_proc *proc   = hctx->proc;
 
 	/*
@@ -2553,148 +3500,19 @@ static int fcgi_demux_response(server *srv, handler_ctx *hctx) {
 		fastcgi_response_packet packet;
 
 		/* check if we have at least one packet */
-		if (0 != fastcgi_get_packet(srv, hctx, &packet)) {
+		if (0 != fastcgi_get_packet(srv, p, hctx->rb, &packet)) {
 			/* no full packet */
 			break;
 		}
 
-		switch(packet.type) {
-		case FCGI_STDOUT:
-			if (packet.len == 0) break;
-
-			/* is the header already finished */
-			if (0 == con->file_started) {
-				char *c;
-				size_t blen;
-				data_string *ds;
-
-				/* search for header terminator
-				 *
-				 * if we start with \r\n check if last packet terminated with \r\n
-				 * if we start with \n check if last packet terminated with \n
-				 * search for \r\n\r\n
-				 * search for \n\n
-				 */
-
-				if (hctx->response_header->used == 0) {
-					buffer_copy_string_buffer(hctx->response_header, packet.b);
-				} else {
-					buffer_append_string_buffer(hctx->response_header, packet.b);
-				}
-
-				if (NULL != (c = buffer_search_string_len(hctx->response_header, CONST_STR_LEN("\r\n\r\n")))) {
-					blen = hctx->response_header->used - (c - hctx->response_header->ptr) - 4;
-					hctx->response_header->used = (c - hctx->response_header->ptr) + 3;
-					c += 4; /* point the the start of the response */
-				} else if (NULL != (c = buffer_search_string_len(hctx->response_header, CONST_STR_LEN("\n\n")))) {
-					blen = hctx->response_header->used - (c - hctx->response_header->ptr) - 2;
-					hctx->response_header->used = c - hctx->response_header->ptr + 2;
-					c += 2; /* point the the start of the response */
-				} else {
-					/* no luck, no header found */
-					break;
-				}
-
-				/* parse the response header */
-				if (fcgi_response_parse(srv, con, p, hctx->response_header)) {
-					con->http_status = 502;
-					hctx->send_content_body = 0;
-					con->file_started = 1;
-					break;
-				}
-
-				con->file_started = 1;
-
-				if (host->mode == FCGI_AUTHORIZER &&
-				    (con->http_status == 0 ||
-				     con->http_status == 200)) {
-					/* a authorizer with approved the static request, ignore the content here */
-					hctx->send_content_body = 0;
-				}
-
-				if (host->allow_xsendfile && hctx->send_content_body &&
-				    (NULL != (ds = (data_string *) array_get_element(con->response.headers, "X-LIGHTTPD-send-file"))
-					  || NULL != (ds = (data_string *) array_get_element(con->response.headers, "X-Sendfile")))) {
-					stat_cache_entry *sce;
-
-					if (HANDLER_ERROR != stat_cache_get_entry(srv, con, ds->value, &sce)) {
-						data_string *dcls;
-						if (NULL == (dcls = (data_string *)array_get_unused_element(con->response.headers, TYPE_STRING))) {
-							dcls = data_response_init();
-						}
-						/* found */
-						http_chunk_append_file(srv, con, ds->value, 0, sce->st.st_size);
-						hctx->send_content_body = 0; /* ignore the content */
-						joblist_append(srv, con);
-
-						buffer_copy_string_len(dcls->key, "Content-Length", sizeof("Content-Length")-1);
-						buffer_copy_off_t(dcls->value, sce->st.st_size);
-						dcls = (data_string*) array_replace(con->response.headers, (data_unset *)dcls);
-						if (dcls) dcls->free((data_unset*)dcls);
-
-						con->parsed_response |= HTTP_CONTENT_LENGTH;
-						con->response.content_length = sce->st.st_size;
-					} else {
-						log_error_write(srv, __FILE__, __LINE__, "sb",
-							"send-file error: couldn't get stat_cache entry for:",
-							ds->value);
-						con->http_status = 502;
-						hctx->send_content_body = 0;
-						con->file_started = 1;
-						break;
-					}
-				}
-
-
-				if (hctx->send_content_body && blen > 1) {
-					/* enable chunked-transfer-encoding */
-					if (con->request.http_version == HTTP_VERSION_1_1 &&
-					    !(con->parsed_response & HTTP_CONTENT_LENGTH)) {
-						con->response.transfer_encoding = HTTP_TRANSFER_ENCODING_CHUNKED;
-					}
-
-					http_chunk_append_mem(srv, con, c, blen);
-					joblist_append(srv, con);
-				}
-			} else if (hctx->send_content_body && packet.b->used > 1) {
-				if (con->request.http_version == HTTP_VERSION_1_1 &&
-				    !(con->parsed_response & HTTP_CONTENT_LENGTH)) {
-					/* enable chunked-transfer-encoding */
-					con->response.transfer_encoding = HTTP_TRANSFER_ENCODING_CHUNKED;
-				}
-
-				http_chunk_append_mem(srv, con, packet.b->ptr, packet.b->used);
-				joblist_append(srv, con);
-			}
-			break;
-		case FCGI_STDERR:
-			if (packet.len == 0) break;
-
-			log_error_write_multiline_buffer(srv, __FILE__, __LINE__, packet.b, "s",
-					"FastCGI-stderr:");
+		fin = fcgi_demux_packet(srv, hctx, &packet);
 
-			break;
-		case FCGI_END_REQUEST:
-			con->file_finished = 1;
-
-			if (host->mode != FCGI_AUTHORIZER ||
-			    !(con->http_status == 0 ||
-			      con->http_status == 200)) {
-				/* send chunk-end if necessary */
-				http_chunk_append_mem(srv, con, NULL, 0);
-				joblist_append(srv, con);
-			}
-
-			fin = 1;
-			break;
-		default:
-			log_error_write(srv, __FILE__, __LINE__, "sd",
-					"FastCGI: header.type not handled: ", packet.type);
-			break;
-		}
 		buffer_free(packet.b);
 	}
 
+	/* left-over data would end up in the next response */
+	if (fin && !chunkqueue_is_empty(hctx->rb)) hctx->keep_conn = 0;
+
 	return fin;
 }
 
@@ -2721,7 +3539,7 @@ static int fcgi_restart_dead_procs(server *srv, plugin_data *p, fcgi_extension_h
 		switch (proc->state) {
 		case PROC_STATE_KILLED:
 		case PROC_STATE_UNSET:
-			/* this should never happen as long as adaptive spawing is disabled */
+			/* killed procs are moved to unused_procs */
 			assert(0);
 
 			break;
@@ -2834,48 +3652,327 @@ static int fcgi_restart_dead_procs(server *srv, plugin_data *p, fcgi_extension_h
 	return 0;
 }
 
-static handler_t fcgi_write_request(server *srv, handler_ctx *hctx) {
-	plugin_data *p    = hctx->plugin_data;
-	fcgi_extension_host *host= hctx->host;
-	connection *con   = hctx->remote_conn;
-	fcgi_proc  *proc;
-
-	int ret;
+/* start another local proc, the slot of a reaped one is taken first */
+static int fcgi_proc_spawn(server *srv, plugin_data *p, fcgi_extension_host *host) {
+	fcgi_proc *proc;
 
-	/* sanity check:
-	 *  - host != NULL
-	 *  - either:
-	 *     - tcp socket (do not check host->host->uses, as it may be not set which means INADDR_LOOPBACK)
-	 *     - unix socket
-	 */
-	if (!host) {
-		log_error_write(srv, __FILE__, __LINE__, "s", "fatal error: host = NULL");
-		return HANDLER_ERROR;
-	}
-	if ((!host->port && !host->unixsocket->used)) {
-		log_error_write(srv, __FILE__, __LINE__, "s", "fatal error: neither host->port nor host->unixsocket is set");
-		return HANDLER_ERROR;
+	for (proc = host->unused_procs; proc; proc = proc->next) {
+		if (proc->state == PROC_STATE_UNSET && proc->pid == 0) break;
 	}
 
-	/* we can't handle this in the switch as we have to fall through in it */
-	if (hctx->state == FCGI_STATE_CONNECT_DELAYED) {
-		int socket_error;
-		socklen_t socket_error_len = sizeof(socket_error);
+	if (proc) {
+		if (proc->prev) proc->prev->next = proc->next;
+		else host->unused_procs = proc->next;
+		if (proc->next) proc->next->prev = proc->prev;
+	} else {
+		fcgi_proc *u;
 
-		/* try to finish the connect() */
-		if (0 != getsockopt(hctx->fd, SOL_SOCKET, SO_ERROR, &socket_error, &socket_error_len)) {
-			log_error_write(srv, __FILE__, __LINE__, "ss",
-					"getsockopt failed:", strerror(errno));
+		proc = fastcgi_process_init();
 
-			fcgi_host_disable(srv, hctx);
+		/* all procs are kept, the ids stay unique */
+		proc->id = host->num_procs;
+		for (u = host->unused_procs; u; u = u->next) proc->id++;
+		host->max_id++;
 
-			return HANDLER_ERROR;
+		if (buffer_is_empty(host->unixsocket)) {
+			proc->port = host->port + proc->id;
+		} else {
+			buffer_copy_string_buffer(proc->unixsocket, host->unixsocket);
+			buffer_append_string_len(proc->unixsocket, CONST_STR_LEN("-"));
+			buffer_append_long(proc->unixsocket, proc->id);
 		}
-		if (socket_error != 0) {
-			if (!hctx->proc->is_local || p->conf.debug) {
-				/* local procs get restarted */
 
-				log_error_write(srv, __FILE__, __LINE__, "sssb",
+		fastcgi_status_init(srv, p->statuskey, host, proc);
+	}
+
+	proc->prev = NULL;
+	proc->next = NULL;
+
+	if (p->conf.debug) {
+		log_error_write(srv, __FILE__, __LINE__, "ssdsdsd",
+				"--- fastcgi spawning on load",
+				"\n\tload:", host->load,
+				"\n\tcurrent:", host->num_procs, "/", host->max_procs);
+	}
+
+	if (fcgi_spawn_connection(srv, p, host, proc)) {
+		log_error_write(srv, __FILE__, __LINE__, "sb",
+				"ERROR: spawning fcgi failed:", host->bin_path);
+
+		proc->state = PROC_STATE_UNSET;
+		proc->pid = 0;
+
+		proc->next = host->unused_procs;
+		if (host->unused_procs) host->unused_procs->prev = proc;
+		host->unused_procs = proc;
+
+		return -1;
+	}
+
+	proc->last_used = srv->cur_ts;
+	proc->next = host->first;
+	if (host->first) host->first->prev = proc;
+	host->first = proc;
+	host->num_procs++;
+
+	fcgi_proc_heap_insert(host, proc);
+
+	fastcgi_status_copy_procname(p->statuskey, host, NULL);
+	buffer_append_string_len(p->statuskey, CONST_STR_LEN(".spawned"));
+	status_counter_inc(srv, CONST_BUF_LEN(p->statuskey));
+
+	fcgi_host_procs_status(srv, p, host);
+
+	return 0;
+}
+
+/* kill a proc which had nothing to do, fastcgi_handle_trigger() collects it */
+static void fcgi_proc_reap(server *srv, plugin_data *p, fcgi_extension_host *host, fcgi_proc *proc) {
+	if (p->conf.debug) {
+		log_error_write(srv, __FILE__, __LINE__, "ssdsbsd",
+				"--- fastcgi killing idle proc",
+				"\n\tpid:", proc->pid,
+				"\n\tsocket:", proc->connection_name,
+				"\n\tcurrent:", host->num_procs);
+	}
+
+	fcgi_proc_idle_flush(srv, p, host, proc);
+	fcgi_proc_mpx_flush(srv, proc);
+
+	fcgi_proc_heap_remove(host, proc);
+
+	if (proc->prev) proc->prev->next = proc->next;
+	else host->first = proc->next;
+	if (proc->next) proc->next->prev = proc->prev;
+
+	proc->prev = NULL;
+	proc->next = host->unused_procs;
+	if (host->unused_procs) host->unused_procs->prev = proc;
+	host->unused_procs = proc;
+
+	kill(proc->pid, host->kill_signal);
+
+	proc->state = PROC_STATE_KILLED;
+	host->active_procs--;
+	host->num_procs--;
+
+	fastcgi_status_copy_procname(p->statuskey, host, NULL);
+	buffer_append_string_len(p->statuskey, CONST_STR_LEN(".reaped"));
+	status_counter_inc(srv, CONST_BUF_LEN(p->statuskey));
+
+	fcgi_host_procs_status(srv, p, host);
+}
+
+/* adapt the number of local procs to the load, called once a second */
+static void fcgi_host_scale(server *srv, plugin_data *p, fcgi_extension_host *host) {
+	fcgi_proc *proc;
+
+	if (buffer_is_empty(host->bin_path) ||
+	    host->min_procs >= host->max_procs) return;
+
+	if (host->num_procs < host->max_procs &&
+	    host->load > 0 &&
+	    (size_t)host->load > host->active_procs * host->max_load_per_proc) {
+		fcgi_proc_spawn(srv, p, host);
+
+		return;
+	}
+
+	if (host->num_procs <= host->min_procs) return;
+
+	/* the procs which are left have to carry the load */
+	if (host->load > 0 &&
+	    (size_t)host->load > (host->active_procs - 1) * host->max_load_per_proc) return;
+
+	/* the youngest idle proc goes first */
+	for (proc = host->first; proc; proc = proc->next) {
+		if (!proc->is_local ||
+		    proc->state != PROC_STATE_RUNNING ||
+		    proc->load != 0 ||
+		    srv->cur_ts - proc->last_used < host->idle_timeout) continue;
+
+		fcgi_proc_reap(srv, p, host, proc);
+
+		break;
+	}
+}
+
+/* ask the backend if it takes several requests per connection */
+static void fcgi_mpx_get_values(fcgi_mpx_conn *c) {
+	static const char values[] = "\015\000" FCGI_MAX_REQS "\017\000" FCGI_MPXS_CONNS;
+	FCGI_Header header;
+	buffer *b;
+
+	b = chunkqueue_get_append_buffer(c->wb);
+
+	fcgi_header(&(header), FCGI_GET_VALUES, FCGI_NULL_REQUEST_ID, sizeof(values) - 1, 0);
+	buffer_copy_memory(b, (const char *)&header, sizeof(header));
+	buffer_append_memory(b, values, sizeof(values) - 1);
+	b->used++; /* add virtual \0 */
+
+	c->wb->bytes_in += sizeof(header) + sizeof(values) - 1;
+}
+
+/* share a new connection to hctx->proc with the next requests */
+static void fcgi_mpx_conn_open(server *srv, handler_ctx *hctx) {
+	fcgi_extension_host *host = hctx->host;
+	fcgi_proc *proc = hctx->proc;
+	fcgi_mpx_conn *c;
+
+	c = calloc(1, sizeof(*c));
+	assert(c);
+
+	c->rb = chunkqueue_init();
+	c->wb = chunkqueue_init();
+
+	/* request-id 0 is used for management records */
+	c->reqs_size = host->multiplex_max_requests + 1;
+	c->reqs = calloc(c->reqs_size, sizeof(*c->reqs));
+	c->orphaned = calloc(c->reqs_size, sizeof(*c->orphaned));
+	assert(c->reqs && c->orphaned);
+	c->max_reqs = 1;
+
+	c->host = host;
+	c->proc = proc;
+	c->p = hctx->plugin_data;
+
+	c->next = proc->mpx;
+	if (proc->mpx) proc->mpx->prev = c;
+	proc->mpx = c;
+	proc->mpx_used++;
+
+	fcgi_proc_mpx_status(srv, c->p, host, proc);
+
+	/* take over the fd */
+	fdevent_event_del(srv->ev, &(hctx->fde_ndx), hctx->fd);
+	fdevent_unregister(srv->ev, hctx->fd);
+
+	c->fd = hctx->fd;
+	c->fde_ndx = -1;
+	hctx->fd = -1;
+
+	fdevent_register(srv->ev, c->fd, fcgi_mpx_handle_fdevent, c);
+	fdevent_event_set(srv->ev, &(c->fde_ndx), c->fd, FDEVENT_IN);
+
+	if (host->multiplex_max_requests > 1) fcgi_mpx_get_values(c);
+
+	fcgi_mpx_attach(c, hctx);
+}
+
+static void fcgi_mpx_queue(server *srv, handler_ctx *hctx) {
+	fcgi_mpx_conn *c = hctx->mpx;
+
+	if (c->wq_last) c->wq_last->mpx_wnext = hctx;
+	else c->wq_first = hctx;
+	c->wq_last = hctx;
+
+	fdevent_event_set(srv->ev, &(c->fde_ndx), c->fd, FDEVENT_IN | FDEVENT_OUT);
+}
+
+/* write the queued records to the shared connection
+ *
+ * the records of one request are not interleaved with the ones of another
+ */
+static int fcgi_mpx_write(server *srv, fcgi_mpx_conn *c) {
+	for (;;) {
+		connection *con;
+		int ret;
+
+		if (NULL == c->wcur) {
+			if (!chunkqueue_is_empty(c->wb)) {
+				c->wcur = c->wb;
+			} else if (c->wq_first) {
+				c->whctx = c->wq_first;
+				c->wq_first = c->whctx->mpx_wnext;
+				if (NULL == c->wq_first) c->wq_last = NULL;
+				c->whctx->mpx_wnext = NULL;
+
+				c->wcur = c->whctx->wb;
+			} else {
+				break;
+			}
+		}
+
+		/* only needed for file-chunks */
+		con = c->whctx ? c->whctx->remote_conn : c->orphan_con;
+
+		ret = srv->network_backend_write(srv, con, c->fd, c->wcur, MAX_WRITE_LIMIT);
+
+		chunkqueue_remove_finished_chunks(c->wcur);
+
+		if (ret < 0) {
+			log_error_write(srv, __FILE__, __LINE__, "ssdsb",
+					"write failed:", strerror(errno), errno,
+					"socket:", c->proc->connection_name);
+
+			return -1;
+		}
+
+		if (!chunkqueue_is_empty(c->wcur)) {
+			fdevent_event_set(srv->ev, &(c->fde_ndx), c->fd, FDEVENT_IN | FDEVENT_OUT);
+
+			return 0;
+		}
+
+		if (c->whctx) {
+			fcgi_set_state(srv, c->whctx, FCGI_STATE_READ);
+			c->whctx = NULL;
+		} else if (c->wcur == c->orphan) {
+			chunkqueue_free(c->orphan);
+			c->orphan = NULL;
+			c->orphan_con = NULL;
+		}
+
+		c->wcur = NULL;
+	}
+
+	fdevent_event_set(srv->ev, &(c->fde_ndx), c->fd, FDEVENT_IN);
+
+	return 0;
+}
+
+static handler_t fcgi_write_request(server *srv, handler_ctx *hctx) {
+	plugin_data *p    = hctx->plugin_data;
+	fcgi_extension_host *host= hctx->host;
+	connection *con   = hctx->remote_conn;
+	fcgi_proc  *proc;
+
+	int ret;
+
+	/* sanity check:
+	 *  - host != NULL
+	 *  - either:
+	 *     - tcp socket (do not check host->host->uses, as it may be not set which means INADDR_LOOPBACK)
+	 *     - unix socket
+	 */
+	if (!host) {
+		log_error_write(srv, __FILE__, __LINE__, "s", "fatal error: host = NULL");
+		return HANDLER_ERROR;
+	}
+	if ((!host->port && !host->unixsocket->used)) {
+		log_error_write(srv, __FILE__, __LINE__, "s", "fatal error: neither host->port nor host->unixsocket is set");
+		return HANDLER_ERROR;
+	}
+
+	/* we can't handle this in the switch as we have to fall through in it */
+	if (hctx->state == FCGI_STATE_CONNECT_DELAYED) {
+		int socket_error;
+		socklen_t socket_error_len = sizeof(socket_error);
+
+		/* try to finish the connect() */
+		if (0 != getsockopt(hctx->fd, SOL_SOCKET, SO_ERROR, &socket_error, &socket_error_len)) {
+			log_error_write(srv, __FILE__, __LINE__, "ss",
+					"getsockopt failed:", strerror(errno));
+
+			fcgi_host_disable(srv, hctx);
+
+			return HANDLER_ERROR;
+		}
+		if (socket_error != 0) {
+			if (!hctx->proc->is_local || p->conf.debug) {
+				/* local procs get restarted */
+
+				log_error_write(srv, __FILE__, __LINE__, "sssb",
 						"establishing connection failed:", strerror(socket_error),
 						"socket:", hctx->proc->connection_name);
 			}
@@ -2906,9 +4003,14 @@ static handler_t fcgi_write_request(server *srv, handler_ctx *hctx) {
 		/* do we have a running process for this host (max-procs) ? */
 		hctx->proc = NULL;
 
-		for (proc = hctx->host->first;
-		     proc && proc->state != PROC_STATE_RUNNING;
-		     proc = proc->next);
+		proc = fcgi_proc_heap_select(hctx->host);
+
+		/* overloaded children can still take requests on kept-alive connections */
+		if (proc == NULL) {
+			for (proc = hctx->host->first;
+			     proc && (proc->state != PROC_STATE_OVERLOADED || (NULL == proc->idle && NULL == proc->mpx));
+			     proc = proc->next);
+		}
 
 		/* all children are dead */
 		if (proc == NULL) {
@@ -2919,101 +4021,120 @@ static handler_t fcgi_write_request(server *srv, handler_ctx *hctx) {
 
 		hctx->proc = proc;
 
-		/* check the other procs if they have a lower load */
-		for (proc = proc->next; proc; proc = proc->next) {
-			if (proc->state != PROC_STATE_RUNNING) continue;
-			if (proc->load < hctx->proc->load) hctx->proc = proc;
-		}
+		hctx->ewma_start = (host->balance == FCGI_BALANCE_PEAK_EWMA) ? ewma_now() : 0;
 
-		ret = host->unixsocket->used ? AF_UNIX : AF_INET;
+		if (hctx->proc->is_local) {
+			hctx->pid = hctx->proc->pid;
+		}
 
-		if (-1 == (hctx->fd = socket(ret, SOCK_STREAM, 0))) {
-			if (errno == EMFILE ||
-			    errno == EINTR) {
-				log_error_write(srv, __FILE__, __LINE__, "sd",
-						"wait for fd at connection:", con->fd);
+		if (host->multiplex && fcgi_proc_mpx_get(srv, hctx)) {
+			if (p->conf.debug > 1) {
+				log_error_write(srv, __FILE__, __LINE__, "sdsb",
+						"multiplexing request:", hctx->request_id,
+						"socket:", hctx->proc->connection_name);
+			}
 
-				return HANDLER_WAIT_FOR_FD;
+			fcgi_set_state(srv, hctx, FCGI_STATE_PREPARE_WRITE);
+		} else if (fcgi_proc_idle_get(srv, hctx)) {
+			if (p->conf.debug > 1) {
+				log_error_write(srv, __FILE__, __LINE__, "sdsb",
+						"reusing connection:", hctx->fd,
+						"socket:", hctx->proc->connection_name);
 			}
 
-			log_error_write(srv, __FILE__, __LINE__, "ssdd",
-					"socket failed:", strerror(errno), srv->cur_fds, srv->max_fds);
+			fcgi_set_state(srv, hctx, FCGI_STATE_PREPARE_WRITE);
+		} else if (hctx->proc->state != PROC_STATE_RUNNING) {
+			/* overloaded and the kept-alive connections are gone */
 			return HANDLER_ERROR;
-		}
-		hctx->fde_ndx = -1;
+		} else {
+			ret = host->unixsocket->used ? AF_UNIX : AF_INET;
 
-		srv->cur_fds++;
+			if (-1 == (hctx->fd = socket(ret, SOCK_STREAM, 0))) {
+				if (errno == EMFILE ||
+				    errno == EINTR) {
+					log_error_write(srv, __FILE__, __LINE__, "sd",
+							"wait for fd at connection:", con->fd);
 
-		fdevent_register(srv->ev, hctx->fd, fcgi_handle_fdevent, hctx);
+					return HANDLER_WAIT_FOR_FD;
+				}
 
-		if (-1 == fdevent_fcntl_set(srv->ev, hctx->fd)) {
-			log_error_write(srv, __FILE__, __LINE__, "ss",
-					"fcntl failed:", strerror(errno));
+				log_error_write(srv, __FILE__, __LINE__, "ssdd",
+						"socket failed:", strerror(errno), srv->cur_fds, srv->max_fds);
+				return HANDLER_ERROR;
+			}
+			hctx->fde_ndx = -1;
 
-			return HANDLER_ERROR;
-		}
+			srv->cur_fds++;
 
-		if (hctx->proc->is_local) {
-			hctx->pid = hctx->proc->pid;
-		}
+			fdevent_register(srv->ev, hctx->fd, fcgi_handle_fdevent, hctx);
 
-		switch (fcgi_establish_connection(srv, hctx)) {
-		case CONNECTION_DELAYED:
-			/* connection is in progress, wait for an event and call getsockopt() below */
+			if (-1 == fdevent_fcntl_set(srv->ev, hctx->fd)) {
+				log_error_write(srv, __FILE__, __LINE__, "ss",
+						"fcntl failed:", strerror(errno));
 
-			fdevent_event_set(srv->ev, &(hctx->fde_ndx), hctx->fd, FDEVENT_OUT);
+				return HANDLER_ERROR;
+			}
 
-			fcgi_set_state(srv, hctx, FCGI_STATE_CONNECT_DELAYED);
-			return HANDLER_WAIT_FOR_EVENT;
-		case CONNECTION_OVERLOADED:
-			/* cool down the backend, it is overloaded
-			 * -> EAGAIN */
+			switch (fcgi_establish_connection(srv, hctx)) {
+			case CONNECTION_DELAYED:
+				/* connection is in progress, wait for an event and call getsockopt() below */
 
-			if (hctx->host->disable_time) {
-				log_error_write(srv, __FILE__, __LINE__, "sdssdsd",
-					"backend is overloaded; we'll disable it for", hctx->host->disable_time, "seconds and send the request to another backend instead:",
-					"reconnects:", hctx->reconnects,
-					"load:", host->load);
+				fdevent_event_set(srv->ev, &(hctx->fde_ndx), hctx->fd, FDEVENT_OUT);
 
-				hctx->proc->disabled_until = srv->cur_ts + hctx->host->disable_time;
-				if (hctx->proc->state == PROC_STATE_RUNNING) hctx->host->active_procs--;
-				hctx->proc->state = PROC_STATE_OVERLOADED;
-			}
+				fcgi_set_state(srv, hctx, FCGI_STATE_CONNECT_DELAYED);
+				return HANDLER_WAIT_FOR_EVENT;
+			case CONNECTION_OVERLOADED:
+				/* cool down the backend, it is overloaded
+				 * -> EAGAIN */
 
-			fastcgi_status_copy_procname(p->statuskey, hctx->host, hctx->proc);
-			buffer_append_string_len(p->statuskey, CONST_STR_LEN(".overloaded"));
+				if (hctx->host->disable_time) {
+					log_error_write(srv, __FILE__, __LINE__, "sdssdsd",
+						"backend is overloaded; we'll disable it for", hctx->host->disable_time, "seconds and send the request to another backend instead:",
+						"reconnects:", hctx->reconnects,
+						"load:", host->load);
 
-			status_counter_inc(srv, CONST_BUF_LEN(p->statuskey));
+					hctx->proc->disabled_until = srv->cur_ts + hctx->host->disable_time;
+					if (hctx->proc->state == PROC_STATE_RUNNING) hctx->host->active_procs--;
+					hctx->proc->state = PROC_STATE_OVERLOADED;
+					fcgi_proc_heap_update(hctx->host, hctx->proc);
+				}
 
-			return HANDLER_ERROR;
-		case CONNECTION_DEAD:
-			/* we got a hard error from the backend like
-			 * - ECONNREFUSED for tcp-ip sockets
-			 * - ENOENT for unix-domain-sockets
-			 *
-			 * for check if the host is back in hctx->host->disable_time seconds
-			 *  */
+				fastcgi_status_copy_procname(p->statuskey, hctx->host, hctx->proc);
+				buffer_append_string_len(p->statuskey, CONST_STR_LEN(".overloaded"));
 
-			fcgi_host_disable(srv, hctx);
+				status_counter_inc(srv, CONST_BUF_LEN(p->statuskey));
 
-			log_error_write(srv, __FILE__, __LINE__, "sdssdsd",
-				"backend died; we'll disable it for", hctx->host->disable_time, "seconds and send the request to another backend instead:",
-				"reconnects:", hctx->reconnects,
-				"load:", host->load);
+				return HANDLER_ERROR;
+			case CONNECTION_DEAD:
+				/* we got a hard error from the backend like
+				 * - ECONNREFUSED for tcp-ip sockets
+				 * - ENOENT for unix-domain-sockets
+				 *
+				 * for check if the host is back in hctx->host->disable_time seconds
+				 *  */
 
-			fastcgi_status_copy_procname(p->statuskey, hctx->host, hctx->proc);
-			buffer_append_string_len(p->statuskey, CONST_STR_LEN(".died"));
+				fcgi_host_disable(srv, hctx);
 
-			status_counter_inc(srv, CONST_BUF_LEN(p->statuskey));
+				log_error_write(srv, __FILE__, __LINE__, "sdssdsd",
+					"backend died; we'll disable it for", hctx->host->disable_time, "seconds and send the request to another backend instead:",
+					"reconnects:", hctx->reconnects,
+					"load:", host->load);
 
-			return HANDLER_ERROR;
-		case CONNECTION_OK:
-			/* everything is ok, go on */
+				fastcgi_status_copy_procname(p->statuskey, hctx->host, hctx->proc);
+				buffer_append_string_len(p->statuskey, CONST_STR_LEN(".died"));
 
-			fcgi_set_state(srv, hctx, FCGI_STATE_PREPARE_WRITE);
+				status_counter_inc(srv, CONST_BUF_LEN(p->statuskey));
 
-			break;
+				return HANDLER_ERROR;
+			case CONNECTION_OK:
+				/* everything is ok, go on */
+
+				fcgi_set_state(srv, hctx, FCGI_STATE_PREPARE_WRITE);
+
+				break;
+			}
 		}
+		/* fall through */
 
 	case FCGI_STATE_PREPARE_WRITE:
 		/* ok, we have the connection */
@@ -3036,9 +4157,16 @@ static handler_t fcgi_write_request(server *srv, handler_ctx *hctx) {
 				"load:", hctx->proc->load);
 		}
 
+		if (host->multiplex && NULL == hctx->mpx) {
+			/* a new connection, the next requests can use it too */
+			fcgi_mpx_conn_open(srv, hctx);
+		}
+
 		/* move the proc-list entry down the list */
-		if (hctx->request_id == 0) {
-			hctx->request_id = 1; /* always use id 1 as we don't use multiplexing */
+		if (hctx->mpx) {
+			/* the request-id belongs to the shared connection */
+		} else if (hctx->request_id == 0) {
+			hctx->request_id = 1; /* always use id 1 on a connection of our own */
 		} else {
 			log_error_write(srv, __FILE__, __LINE__, "sd",
 					"fcgi-request is already in use:", hctx->request_id);
@@ -3047,8 +4175,17 @@ static handler_t fcgi_write_request(server *srv, handler_ctx *hctx) {
 		/* fall through */
 		if (-1 == fcgi_create_env(srv, hctx, hctx->request_id)) return HANDLER_ERROR;
 		fcgi_set_state(srv, hctx, FCGI_STATE_WRITE);
+
+		if (hctx->mpx) {
+			/* the shared connection writes it as soon as it can */
+			fcgi_mpx_queue(srv, hctx);
+
+			return HANDLER_WAIT_FOR_EVENT;
+		}
 		/* fall through */
 	case FCGI_STATE_WRITE:
+		if (hctx->mpx) break;
+
 		ret = srv->network_backend_write(srv, con, hctx->fd, hctx->wb, MAX_WRITE_LIMIT);
 
 		chunkqueue_remove_finished_chunks(hctx->wb);
@@ -3058,6 +4195,20 @@ static handler_t fcgi_write_request(server *srv, handler_ctx *hctx) {
 			case EPIPE:
 			case ENOTCONN:
 			case ECONNRESET:
+				if (fcgi_reused_conn_failed(hctx)) {
+					if (p->conf.debug) {
+						log_error_write(srv, __FILE__, __LINE__, "sb",
+								"kept-alive connection was closed, reconnecting:",
+								hctx->proc->connection_name);
+					}
+
+					chunkqueue_reset(hctx->wb);
+					fcgi_reconnect(srv, hctx);
+					joblist_append(srv, con);
+
+					return HANDLER_WAIT_FOR_FD;
+				}
+
 				/* the connection got dropped after accept()
 				 * we don't care about that - if you accept() it, you have to handle it.
 				 */
@@ -3100,8 +4251,83 @@ static handler_t fcgi_write_request(server *srv, handler_ctx *hctx) {
 }
 
 
+static ketama_ring *fcgi_extension_ring(fcgi_extension *ext) {
+	size_t k;
+
+	if (ext->ring) return ext->ring;
+
+	ext->ring = ketama_init();
+
+	for (k = 0; k < ext->used; k++) {
+		fcgi_extension_host *host = ext->hosts[k];
+		char name[256];
+		int len;
+
+		if (!buffer_is_empty(host->unixsocket)) {
+			len = snprintf(name, sizeof(name), "%s", host->unixsocket->ptr);
+		} else {
+			len = snprintf(name, sizeof(name), "%s:%u", host->host->used ? host->host->ptr : "", host->port);
+		}
+		if (len >= (int)sizeof(name)) len = sizeof(name) - 1;
+
+		ketama_add(ext->ring, name, len, k);
+	}
+	ketama_sort(ext->ring);
+
+	return ext->ring;
+}
+
+static int fcgi_ring_host_is_up(void *ctx, size_t ndx) {
+	fcgi_extension *ext = ctx;
+
+	return ext->hosts[ndx]->active_procs > 0;
+}
+
 /* might be called on fdevent after a connect() is delay too
  * */
+/* join the requests for the same uri, a follower waits for the response of the leader */
+static handler_t fcgi_collapse(server *srv, handler_ctx *hctx) {
+	plugin_data *p = hctx->plugin_data;
+	connection *con = hctx->remote_conn;
+
+	if (hctx->collapse == NULL) {
+		if (!hctx->conf.collapse || hctx->collapse_tried) return HANDLER_GO_ON;
+		hctx->collapse_tried = 1;
+
+		/* the authorizer decides per request */
+		if (hctx->ext->used == 0 || hctx->ext->hosts[0]->mode == FCGI_AUTHORIZER) return HANDLER_GO_ON;
+
+		if (0 != collapse_key(con, p->collapse_key)) return HANDLER_GO_ON;
+
+		hctx->collapse = collapse_join(srv, p->collapse, con, p->collapse_key,
+					       hctx->conf.collapse_timeout, &(hctx->collapse_leader));
+
+		if (hctx->collapse == NULL || hctx->collapse_leader) return HANDLER_GO_ON;
+
+		if (p->conf.debug) {
+			log_error_write(srv, __FILE__, __LINE__, "sb",
+					"waiting for the response of another request:", p->collapse_key);
+		}
+	}
+
+	if (hctx->collapse_leader) return HANDLER_GO_ON;
+
+	switch (hctx->collapse->state) {
+	case COLLAPSE_RUNNING:
+		return HANDLER_WAIT_FOR_EVENT;
+	case COLLAPSE_DONE:
+		collapse_serve(srv, con, hctx->collapse);
+
+		return HANDLER_FINISHED;
+	default:
+		/* ask the backend ourself */
+		collapse_leave(srv, p->collapse, hctx->collapse, con);
+		hctx->collapse = NULL;
+
+		return HANDLER_GO_ON;
+	}
+}
+
 SUBREQUEST_FUNC(mod_fastcgi_handle_subrequest) {
 	plugin_data *p = p_d;
 
@@ -3113,6 +4339,18 @@ SUBREQUEST_FUNC(mod_fastcgi_handle_subrequest) {
 	/* not my job */
 	if (con->mode != p->id) return HANDLER_GO_ON;
 
+	switch (fcgi_collapse(srv, hctx)) {
+	case HANDLER_WAIT_FOR_EVENT:
+		return HANDLER_WAIT_FOR_EVENT;
+	case HANDLER_FINISHED:
+		/* served from the response of another request */
+		fcgi_connection_close(srv, hctx);
+
+		return HANDLER_FINISHED;
+	default:
+		break;
+	}
+
 	/* we don't have a host yet, choose one
 	 * -> this happens in the first round
 	 *    and when the host died and we have to select a new one */
@@ -3120,11 +4358,19 @@ SUBREQUEST_FUNC(mod_fastcgi_handle_subrequest) {
 		size_t k;
 		int ndx, used = -1;
 
-		/* check if the next server has no load. */
-		ndx = hctx->ext->last_used_ndx + 1;
-		if(ndx >= (int) hctx->ext->used || ndx < 0) ndx = 0;
-		host = hctx->ext->hosts[ndx];
-		if (host->load > 0) {
+		if (hctx->conf.balance == FCGI_HOST_BALANCE_HASH) {
+			/* the same key always goes to the same host as long as it is up */
+			ndx = ketama_get(fcgi_extension_ring(hctx->ext),
+					 ketama_hash_request(con, hctx->conf.hash_key, hctx->conf.hash_cookie),
+					 fcgi_ring_host_is_up, hctx->ext);
+		} else {
+			/* check if the next server has no load. */
+			ndx = hctx->ext->last_used_ndx + 1;
+			if(ndx >= (int) hctx->ext->used || ndx < 0) ndx = 0;
+			host = hctx->ext->hosts[ndx];
+		}
+
+		if (hctx->conf.balance != FCGI_HOST_BALANCE_HASH && host->load > 0) {
 			/* get backend with the least load. */
 			for (k = 0, ndx = -1; k < hctx->ext->used; k++) {
 				host = hctx->ext->hosts[k];
@@ -3177,6 +4423,7 @@ SUBREQUEST_FUNC(mod_fastcgi_handle_subrequest) {
 		if (hctx->state == FCGI_STATE_INIT ||
 		    hctx->state == FCGI_STATE_CONNECT_DELAYED) {
 			fcgi_restart_dead_procs(srv, p, host);
+			fcgi_proc_heap_build(host);
 
 			/* cleanup this request and let the request handler start this request again */
 			if (hctx->reconnects < 5) {
@@ -3218,6 +4465,247 @@ SUBREQUEST_FUNC(mod_fastcgi_handle_subrequest) {
 	}
 }
 
+/* the backend sent FCGI_END_REQUEST */
+static void fcgi_response_finished(server *srv, handler_ctx *hctx) {
+	connection  *con  = hctx->remote_conn;
+	fcgi_extension_host *host= hctx->host;
+
+	if (host->mode == FCGI_AUTHORIZER &&
+	    (con->http_status == 200 ||
+	     con->http_status == 0)) {
+		/*
+		 * If we are here in AUTHORIZER mode then a request for authorizer
+		 * was processed already, and status 200 has been returned. We need
+		 * now to handle authorized request.
+		 */
+
+		buffer_copy_string_buffer(con->physical.doc_root, host->docroot);
+		buffer_copy_string_buffer(con->physical.basedir, host->docroot);
+
+		buffer_copy_string_buffer(con->physical.path, host->docroot);
+		buffer_append_string_buffer(con->physical.path, con->uri.path);
+		fcgi_connection_close(srv, hctx);
+
+		con->mode = DIRECT;
+		con->http_status = 0;
+		con->file_started = 1; /* fcgi_extension won't touch the request afterwards */
+	} else {
+		/* we are done */
+		if (hctx->collapse_leader) collapse_done(srv, hctx->plugin_data->collapse, hctx->collapse, con);
+
+		fcgi_connection_close(srv, hctx);
+	}
+
+	joblist_append(srv, con);
+}
+
+/* the shared connection of hctx broke down */
+static void fcgi_mpx_request_failed(server *srv, handler_ctx *hctx) {
+	connection  *con  = hctx->remote_conn;
+	fcgi_proc   *proc = hctx->proc;
+
+	if (0 == con->file_started &&
+	    0 == hctx->wb->bytes_out &&
+	    hctx->reconnects < 5) {
+		/* the backend never saw the request, send it again */
+		chunkqueue_reset(hctx->wb);
+		fcgi_reconnect(srv, hctx);
+	} else if (0 == con->file_started) {
+		log_error_write(srv, __FILE__, __LINE__, "ssbsBSBs",
+				"response not received",
+				"on socket:", proc->connection_name,
+				"for", con->uri.path, "?", con->uri.query, ", closing connection");
+
+		fcgi_connection_close(srv, hctx);
+
+		connection_set_state(srv, con, CON_STATE_HANDLE_REQUEST);
+		buffer_reset(con->physical.path);
+		con->http_status = 500;
+		con->mode = DIRECT;
+	} else {
+		log_error_write(srv, __FILE__, __LINE__, "ssbsBSBs",
+				"response already sent out, but backend returned error",
+				"on socket:", proc->connection_name,
+				"for", con->uri.path, "?", con->uri.query, ", terminating connection");
+
+		fcgi_connection_close(srv, hctx);
+
+		connection_set_state(srv, con, CON_STATE_ERROR);
+	}
+
+	joblist_append(srv, con);
+}
+
+static void fcgi_mpx_conn_fail(server *srv, fcgi_mpx_conn *c) {
+	size_t id;
+
+	c->wq_first = c->wq_last = NULL;
+	c->whctx = NULL;
+
+	for (id = 1; id < c->reqs_size; id++) {
+		handler_ctx *hctx = c->reqs[id];
+
+		if (NULL == hctx) continue;
+
+		c->reqs[id] = NULL;
+		hctx->mpx = NULL;
+		hctx->mpx_wnext = NULL;
+
+		fcgi_mpx_request_failed(srv, hctx);
+	}
+
+	fcgi_mpx_conn_close(srv, c);
+}
+
+static int fcgi_get_nv_len(const unsigned char *s, size_t len, size_t *i, size_t *l) {
+	if (*i >= len) return -1;
+
+	if (s[*i] & 0x80) {
+		if (*i + 4 > len) return -1;
+
+		*l = ((s[*i] & 0x7f) << 24) | (s[*i + 1] << 16) | (s[*i + 2] << 8) | s[*i + 3];
+		*i += 4;
+	} else {
+		*l = s[(*i)++];
+	}
+
+	return 0;
+}
+
+static void fcgi_mpx_get_values_result(server *srv, fcgi_mpx_conn *c, buffer *b) {
+	const unsigned char *s = (const unsigned char *)b->ptr;
+	size_t len = b->used ? b->used - 1 : 0;
+	size_t i = 0, max_reqs = 0;
+	int mpxs_conns = 0;
+
+	while (i < len) {
+		size_t klen, vlen, j;
+		const char *key, *val;
+
+		if (-1 == fcgi_get_nv_len(s, len, &i, &klen) ||
+		    -1 == fcgi_get_nv_len(s, len, &i, &vlen) ||
+		    klen + vlen > len - i) break;
+
+		key = (const char *)s + i;
+		val = key + klen;
+		i += klen + vlen;
+
+		if (klen == sizeof(FCGI_MPXS_CONNS) - 1 &&
+		    0 == memcmp(key, CONST_STR_LEN(FCGI_MPXS_CONNS))) {
+			mpxs_conns = (vlen == 1 && val[0] == '1');
+		} else if (klen == sizeof(FCGI_MAX_REQS) - 1 &&
+			   0 == memcmp(key, CONST_STR_LEN(FCGI_MAX_REQS))) {
+			for (j = 0, max_reqs = 0; j < vlen && val[j] >= '0' && val[j] <= '9' && max_reqs < 65536; j++) {
+				max_reqs = max_reqs * 10 + (val[j] - '0');
+			}
+		}
+	}
+
+	if (!mpxs_conns) return;
+
+	c->max_reqs = c->reqs_size - 1;
+	if (max_reqs > 0 && max_reqs < c->max_reqs) c->max_reqs = max_reqs;
+
+	if (c->p->conf.debug) {
+		log_error_write(srv, __FILE__, __LINE__, "sbsd",
+				"backend multiplexes connections:", c->proc->connection_name,
+				"requests per connection:", c->max_reqs);
+	}
+}
+
+/* read from the shared connection and pass the packets to their requests
+ *
+ * returns -1 if the connection is gone
+ */
+static int fcgi_mpx_read(server *srv, fcgi_mpx_conn *c) {
+	fastcgi_response_packet packet;
+	int toread;
+	ssize_t r;
+	buffer *b;
+
+	if (ioctl(c->fd, FIONREAD, &toread)) {
+		if (errno == EAGAIN) return 0;
+
+		return -1;
+	}
+
+	/* end-of-file */
+	if (toread <= 0) return -1;
+
+	b = chunkqueue_get_append_buffer(c->rb);
+	buffer_prepare_copy(b, toread + 1);
+
+	if (-1 == (r = read(c->fd, b->ptr, toread))) {
+		b->used = 1;
+		b->ptr[0] = '\0';
+
+		if (errno == EAGAIN) return 0;
+
+		return -1;
+	}
+
+	b->used = r + 1; /* one extra for the fake \0 */
+	b->ptr[b->used - 1] = '\0';
+
+	while (0 == fastcgi_get_packet(srv, c->p, c->rb, &packet)) {
+		handler_ctx *hctx = NULL;
+		size_t id = packet.request_id;
+
+		if (id == FCGI_NULL_REQUEST_ID) {
+			if (packet.type == FCGI_GET_VALUES_RESULT) fcgi_mpx_get_values_result(srv, c, packet.b);
+		} else if (id >= c->reqs_size) {
+			log_error_write(srv, __FILE__, __LINE__, "sdsb",
+					"FastCGI: unknown request-id:", id,
+					"socket:", c->proc->connection_name);
+		} else if (NULL != (hctx = c->reqs[id])) {
+			if (fcgi_demux_packet(srv, hctx, &packet)) {
+				fcgi_mpx_detach(srv, hctx, 1);
+				fcgi_response_finished(srv, hctx);
+			}
+		} else if (c->orphaned[id] && packet.type == FCGI_END_REQUEST) {
+			/* a closed request is finished, reuse its id */
+			c->orphaned[id] = 0;
+			if (0 == --c->active) c->idle_since = srv->cur_ts;
+		}
+
+		buffer_free(packet.b);
+	}
+
+	return 0;
+}
+
+static handler_t fcgi_mpx_handle_fdevent(server *srv, void *ctx, int revents) {
+	fcgi_mpx_conn *c = ctx;
+
+	if (revents & FDEVENT_IN) {
+		if (-1 == fcgi_mpx_read(srv, c)) {
+			if (c->active && c->p->conf.debug) {
+				log_error_write(srv, __FILE__, __LINE__, "sbsd",
+						"unexpected end-of-file on shared connection:", c->proc->connection_name,
+						"requests:", c->active);
+			}
+
+			fcgi_mpx_conn_fail(srv, c);
+
+			return HANDLER_FINISHED;
+		}
+	}
+
+	if (revents & FDEVENT_OUT) {
+		if (-1 == fcgi_mpx_write(srv, c)) {
+			fcgi_mpx_conn_fail(srv, c);
+
+			return HANDLER_FINISHED;
+		}
+	}
+
+	if (revents & (FDEVENT_HUP | FDEVENT_ERR)) {
+		fcgi_mpx_conn_fail(srv, c);
+	}
+
+	return HANDLER_FINISHED;
+}
+
 static handler_t fcgi_handle_fdevent(server *srv, void *ctx, int revents) {
 	handler_ctx *hctx = ctx;
 	connection  *con  = hctx->remote_conn;
@@ -3230,34 +4718,20 @@ static handler_t fcgi_handle_fdevent(server *srv, void *ctx, int revents) {
 	    hctx->state == FCGI_STATE_READ) {
 		switch (fcgi_demux_response(srv, hctx)) {
 		case 0:
-			break;
-		case 1:
+			if (fcgi_response_blocked(hctx)) {
+				/* mod_fastcgi_handle_joblist() continues when the client took some of it */
+				fdevent_event_del(srv->ev, &(hctx->fde_ndx), hctx->fd);
+				hctx->blocked = 1;
 
-			if (host->mode == FCGI_AUTHORIZER &&
-		   	    (con->http_status == 200 ||
-			     con->http_status == 0)) {
-				/*
-				 * If we are here in AUTHORIZER mode then a request for authorizer
-				 * was processed already, and status 200 has been returned. We need
-				 * now to handle authorized request.
-				 */
-
-				buffer_copy_string_buffer(con->physical.doc_root, host->docroot);
-				buffer_copy_string_buffer(con->physical.basedir, host->docroot);
-
-				buffer_copy_string_buffer(con->physical.path, host->docroot);
-				buffer_append_string_buffer(con->physical.path, con->uri.path);
-				fcgi_connection_close(srv, hctx);
-
-				con->mode = DIRECT;
-				con->http_status = 0;
-				con->file_started = 1; /* fcgi_extension won't touch the request afterwards */
-			} else {
-				/* we are done */
-				fcgi_connection_close(srv, hctx);
+				if (p->conf.debug) {
+					log_error_write(srv, __FILE__, __LINE__, "sd",
+							"client is slow, stop reading from the backend:", hctx->fd);
+				}
 			}
+			break;
+		case 1:
+			fcgi_response_finished(srv, hctx);
 
-			joblist_append(srv, con);
 			return HANDLER_FINISHED;
 		case -1:
 			if (proc->pid && proc->state != PROC_STATE_DIED) {
@@ -3302,10 +4776,26 @@ static handler_t fcgi_handle_fdevent(server *srv, void *ctx, int revents) {
 								"respawning failed, will retry later");
 					}
 
+					fcgi_proc_heap_update(host, proc);
+
 					break;
 				}
 			}
 
+			if (fcgi_reused_conn_failed(hctx)) {
+				if (p->conf.debug) {
+					log_error_write(srv, __FILE__, __LINE__, "sb",
+							"kept-alive connection was closed, reconnecting:",
+							proc->connection_name);
+				}
+
+				chunkqueue_reset(hctx->wb);
+				fcgi_reconnect(srv, hctx);
+				joblist_append(srv, con);
+
+				return HANDLER_FINISHED;
+			}
+
 			if (con->file_started == 0) {
 				/* nothing has been sent out yet, try to use another child */
 
@@ -3388,6 +4878,10 @@ static handler_t fcgi_handle_fdevent(server *srv, void *ctx, int revents) {
 			 * ioctl says 8192 bytes to read from PHP and we receive directly a HUP for the socket
 			 * even if the FCGI_FIN packet is not received yet
 			 */
+		} else if (fcgi_reused_conn_failed(hctx)) {
+			chunkqueue_reset(hctx->wb);
+			fcgi_reconnect(srv, hctx);
+			joblist_append(srv, con);
 		} else {
 			log_error_write(srv, __FILE__, __LINE__, "sBSbsbsd",
 					"error: unexpected close of fastcgi connection for",
@@ -3418,9 +4912,18 @@ static int fcgi_patch_connection(server *srv, connection *con, plugin_data *p) {
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(exts);
 	PATCH(debug);
 	PATCH(ext_mapping);
+	PATCH(balance);
+	PATCH(hash_key);
+	PATCH(hash_cookie);
+	PATCH(collapse);
+	PATCH(collapse_timeout);
+	PATCH(response_buffer);
+	PATCH(response_spool);
 
 	/* skip the first, the global context */
 	for (i = 1; i < srv->config_context->used; i++) {
@@ -3440,10 +4943,25 @@ static int fcgi_patch_connection(server *srv, connection *con, plugin_data *p) {
 				PATCH(debug);
 			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("fastcgi.map-extensions"))) {
 				PATCH(ext_mapping);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("fastcgi.balance"))) {
+				PATCH(balance);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("fastcgi.hash-key"))) {
+				PATCH(hash_key);
+				PATCH(hash_cookie);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("fastcgi.collapse"))) {
+				PATCH(collapse);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("fastcgi.collapse-timeout"))) {
+				PATCH(collapse_timeout);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("fastcgi.response-buffer"))) {
+				PATCH(response_buffer);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("fastcgi.response-spool"))) {
+				PATCH(response_spool);
 			}
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
@@ -3595,6 +5113,13 @@ static handler_t fcgi_check_extension(server *srv, connection *con, void *p_d, i
 
 			hctx->conf.exts        = p->conf.exts;
 			hctx->conf.debug       = p->conf.debug;
+			hctx->conf.balance     = p->conf.balance;
+			hctx->conf.hash_key    = p->conf.hash_key;
+			hctx->conf.hash_cookie = p->conf.hash_cookie;
+			hctx->conf.collapse    = p->conf.collapse;
+			hctx->conf.collapse_timeout = p->conf.collapse_timeout;
+			hctx->conf.response_buffer = p->conf.response_buffer;
+			hctx->conf.response_spool = p->conf.response_spool;
 
 			con->plugin_ctx[p->id] = hctx;
 
@@ -3662,6 +5187,13 @@ static handler_t fcgi_check_extension(server *srv, connection *con, void *p_d, i
 
 		hctx->conf.exts        = p->conf.exts;
 		hctx->conf.debug       = p->conf.debug;
+		hctx->conf.balance     = p->conf.balance;
+		hctx->conf.hash_key    = p->conf.hash_key;
+		hctx->conf.hash_cookie = p->conf.hash_cookie;
+		hctx->conf.collapse    = p->conf.collapse;
+		hctx->conf.collapse_timeout = p->conf.collapse_timeout;
+		hctx->conf.response_buffer = p->conf.response_buffer;
+		hctx->conf.response_spool = p->conf.response_spool;
 
 		con->plugin_ctx[p->id] = hctx;
 
@@ -3694,6 +5226,10 @@ JOBLIST_FUNC(mod_fastcgi_handle_joblist) {
 	if (hctx->fd != -1) {
 		switch (hctx->state) {
 		case FCGI_STATE_READ:
+			/* the client took enough of the response, read the rest */
+			if (hctx->blocked && fcgi_response_blocked(hctx)) break;
+
+			hctx->blocked = 0;
 			fdevent_event_set(srv->ev, &(hctx->fde_ndx), hctx->fd, FDEVENT_IN);
 
 			break;
@@ -3727,6 +5263,9 @@ TRIGGER_FUNC(mod_fastcgi_handle_trigger) {
 	plugin_data *p = p_d;
 	size_t i, j, n;
 
+	/* the followers of slow requests ask the backend themselves */
+	collapse_timeout(srv, p->collapse);
+
 
 	/* perhaps we should kill a connect attempt after 10-15 seconds
 	 *
@@ -3759,6 +5298,13 @@ TRIGGER_FUNC(mod_fastcgi_handle_trigger) {
 				host = ex->hosts[n];
 
 				fcgi_restart_dead_procs(srv, p, host);
+				fcgi_host_scale(srv, p, host);
+				fcgi_proc_heap_build(host);
+
+				for (proc = host->first; proc; proc = proc->next) {
+					fcgi_proc_idle_timeout(srv, p, host, proc);
+					fcgi_proc_mpx_timeout(srv, host, proc);
+				}
 
 				for (proc = host->unused_procs; proc; proc = proc->next) {
 					int status;
@@ -110,6 +110,8 @@ static int mod_flv_streaming_patch_connection(server *srv, connection *con, plug
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(extensions);
 
 	/* skip the first, the global context */
@@ -130,6 +132,8 @@ static int mod_flv_streaming_patch_connection(server *srv, connection *con, plug
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
@@ -108,6 +108,8 @@ static int mod_indexfile_patch_connection(server *srv, connection *con, plugin_d
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(indexfiles);
 
 	/* skip the first, the global context */
@@ -130,6 +132,8 @@ static int mod_indexfile_patch_connection(server *srv, connection *con, plugin_d
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
@@ -131,6 +131,8 @@ static int mod_magnet_patch_connection(server *srv, connection *con, plugin_data
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(url_raw);
 	PATCH(physical_path);
 
@@ -154,6 +156,8 @@ static int mod_magnet_patch_connection(server *srv, connection *con, plugin_data
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
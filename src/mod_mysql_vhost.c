@@ -301,6 +301,8 @@ static int mod_mysql_vhost_patch_connection(server *srv, connection *con, plugin
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(mysql_pre);
 	PATCH(mysql_post);
 #ifdef HAVE_MYSQL
@@ -330,6 +332,8 @@ static int mod_mysql_vhost_patch_connection(server *srv, connection *con, plugin
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
@@ -4,6 +4,7 @@
 #include "log.h"
 
 #include "http_chunk.h"
+#include "network_backends.h"
 #include "fdevent.h"
 #include "connections.h"
 #include "response.h"
@@ -13,6 +14,8 @@
 
 #include "inet_ntop_cache.h"
 #include "crc32.h"
+#include "etag.h"
+#include "splaytree.h"
 
 #include <sys/types.h>
 
@@ -25,18 +28,25 @@
 #include <assert.h>
 
 #include <stdio.h>
+#include <time.h>
 
 #ifdef HAVE_SYS_FILIO_H
 # include <sys/filio.h>
 #endif
 
 #include "sys-socket.h"
+#include "ketama.h"
+#include "collapse.h"
 
 #define data_proxy data_fastcgi
 #define data_proxy_init data_fastcgi_init
 
 #define PROXY_RETRY_TIMEOUT 60
 
+#if defined(HAVE_SPLICE) && defined(USE_LINUX_SENDFILE)
+# define PROXY_SPLICE
+#endif
+
 /**
  *
  * the proxy module is based on the fastcgi module
@@ -48,17 +58,29 @@
  *            - correctly transfer upstream http_response_status;
  *            - some unused structures removed.
  *
- * TODO:      - delay upstream read if write_queue is too large
- *              (to prevent memory eating, like in apache). Shoud be
- *              configurable).
- *            - persistent connection with upstream servers
- *            - HTTP/1.1
+ * with proxy.keep-alive the requests are sent as HTTP/1.1, the response
+ * is framed by Content-Length or chunked encoding and the connection is
+ * kept in a pool per backend (host:port) for the next request.
+ *
+ * with proxy.cache the cacheable responses to GET are kept, small ones
+ * in memory, large ones as files in proxy.cache-dir (sent by sendfile),
+ * and served without asking the backend until they expire. stale ones
+ * are revalidated with If-None-Match/If-Modified-Since.
+ *
+ * the response goes into the write-queue up to proxy.response-buffer,
+ * then into tempfiles up to proxy.response-spool. beyond that we stop
+ * reading from the backend until the client took some of it.
+ *
+ * with proxy.splice a body with a Content-Length (or one which ends with
+ * the connection) goes from the backend through a pipe to the client
+ * without being copied into userspace.
  */
 typedef enum {
 	PROXY_BALANCE_UNSET,
 	PROXY_BALANCE_FAIR,
 	PROXY_BALANCE_HASH,
-	PROXY_BALANCE_RR
+	PROXY_BALANCE_RR,
+	PROXY_BALANCE_EWMA
 } proxy_balance_t;
 
 typedef struct {
@@ -66,14 +88,119 @@ typedef struct {
 	unsigned short debug;
 
 	proxy_balance_t balance;
+
+	unsigned short keep_alive;
+	unsigned short keep_alive_max_idle;
+	unsigned short keep_alive_idle_timeout;
+	unsigned short max_connections;
+
+	ketama_key_t hash_key;
+	buffer *hash_cookie;
+
+	unsigned short cache;
+	unsigned int cache_max_memory;        /* kbyte, all objects in memory */
+	unsigned int cache_max_memory_object; /* kbyte, larger ones go to disk */
+	unsigned int cache_max_disk;          /* kbyte, all objects on disk */
+	buffer *cache_dir;
+
+	unsigned short collapse;
+	unsigned short collapse_timeout;
+
+	unsigned int response_buffer; /* kbyte, in memory before we spool or stop reading */
+	unsigned int response_spool;  /* kbyte, in tempfiles before we stop reading */
+
+	unsigned short splice;
+
+	unsigned short allow_xsendfile;
 } plugin_config;
 
+/* a cached response */
+typedef struct proxy_cache_entry {
+	buffer *key;      /* host + uri */
+	int hash;
+
+	int status;
+	array *headers;   /* response headers, without the hop-by-hop ones */
+	buffer *vary;     /* only a marker: the names in Vary, the responses are
+	                   * stored under the key + the values of the headers */
+	buffer *etag;
+	buffer *last_modified;
+
+	time_t stored;
+	time_t expires;
+
+	buffer *body;     /* in memory */
+	buffer *file;     /* or in a file of proxy.cache-dir */
+	off_t size;
+	off_t cost;       /* counted in mem_used or disk_used */
+
+	int refs;         /* requests revalidating it */
+	int dead;         /* removed from the cache, free it with the last ref */
+
+	struct proxy_cache_entry *prev, *next; /* LRU, head is the newest */
+} proxy_cache_entry;
+
+typedef struct {
+	splay_tree *index; /* hash of the key -> entry */
+
+	proxy_cache_entry *head, *tail;
+
+	off_t mem_used;
+	off_t disk_used;
+
+	off_t max_memory;
+	off_t max_memory_object;
+	off_t max_disk;
+	buffer *dir;
+
+	unsigned int file_id;
+
+	buffer *vary_key;
+	buffer *tmp;
+} proxy_cache;
+
+/* an unused connection to a backend */
+typedef struct proxy_idle_conn {
+	int fd;
+	time_t expire;
+
+	struct proxy_idle_conn *next;
+} proxy_idle_conn;
+
+/* all connections to one host:port, shared by all proxy.server entries */
+typedef struct proxy_pool {
+	buffer *host;
+	unsigned short port;
+
+	proxy_idle_conn *idle;
+	size_t idle_used;
+
+	size_t active; /* requests on this backend, see proxy.max-connections */
+
+	struct proxy_pool *next;
+} proxy_pool;
+
+/* the ketama ring of a proxy.server extension, for proxy.balance = "hash" */
+typedef struct proxy_ring {
+	data_array *extension;
+	ketama_ring *ring;
+
+	struct proxy_ring *next;
+} proxy_ring;
+
 typedef struct {
 	PLUGIN_DATA;
 
 	buffer *parse_response;
 	buffer *balance_buf;
 
+	proxy_pool *pools;
+	proxy_ring *rings;
+	proxy_cache *cache;
+
+	collapse_table *collapse;
+	buffer *collapse_key;
+
 	plugin_config **config_storage;
 
 	plugin_config conf;
@@ -90,11 +217,23 @@ typedef enum {
 
 enum { PROXY_STDOUT, PROXY_END_REQUEST };
 
+/* how the end of the response body is found */
+typedef enum {
+	PROXY_BODY_EOF,         /* HTTP/1.0: the backend closes the connection */
+	PROXY_BODY_NONE,        /* HEAD, 1xx, 204, 304 */
+	PROXY_BODY_LENGTH,      /* Content-Length */
+	PROXY_BODY_CHUNK_SIZE,  /* chunked: */
+	PROXY_BODY_CHUNK_DATA,
+	PROXY_BODY_CHUNK_END,   /* CRLF after the data */
+	PROXY_BODY_TRAILER
+} proxy_body_state_t;
+
 typedef struct {
 	proxy_connection_state_t state;
 	time_t state_timestamp;
 
 	data_proxy *host;
+	data_array *extension;
 
 	buffer *response;
 	buffer *response_header;
@@ -106,6 +245,43 @@ typedef struct {
 
 	size_t path_info_offset; /* start of path_info in uri.path */
 
+	proxy_pool *pool;
+	unsigned short keep_alive;      /* proxy.keep-alive of the request */
+	unsigned short keep_alive_max_idle;
+	unsigned short keep_alive_idle_timeout;
+
+	int reused;        /* the connection came from the pool */
+	int backend_keep_alive; /* the backend doesn't close the connection */
+	int reusable;      /* the response is complete, the connection can go back to the pool */
+
+	proxy_body_state_t body_state;
+	off_t body_left;   /* of the Content-Length or the current chunk */
+	int body_done;
+
+	buffer *cache_key;          /* the request may be cached, see proxy.cache */
+	proxy_cache_entry *cache_stale; /* revalidated by this request */
+	int cache_revalidate;       /* we sent our own validators */
+	int cache_store;            /* the response is captured for the cache */
+	buffer *cache_body;
+	int cache_fd;               /* or it is too large and goes into cache_file */
+	buffer *cache_file;
+	off_t cache_size;
+
+	double ewma_start;          /* request started, 0 if the latency isn't measured */
+
+	collapse_group *collapse;   /* the request shares the response with others */
+	int collapse_leader;        /* it is the one which asks the backend */
+
+	off_t response_buffer;      /* see proxy.response-buffer */
+	off_t response_spool;
+	int blocked;                /* we don't read from the backend until the client catches up */
+
+	unsigned short splice;      /* proxy.splice of the request */
+	int splice_pipe[2];         /* the body goes through it, -1 if it doesn't */
+	int splice_full;            /* the pipe is full, wait until the client took all of it */
+
+	unsigned short allow_xsendfile; /* proxy.allow-x-send-file of the request */
+
 	connection *remote_conn;  /* dump pointer */
 	plugin_data *plugin_data; /* dump pointer */
 } handler_ctx;
@@ -131,6 +307,13 @@ static handler_ctx * handler_ctx_init(void) {
 	hctx->fd = -1;
 	hctx->fde_ndx = -1;
 
+	hctx->body_state = PROXY_BODY_EOF;
+
+	hctx->cache_fd = -1;
+
+	hctx->splice_pipe[0] = -1;
+	hctx->splice_pipe[1] = -1;
+
 	return hctx;
 }
 
@@ -139,9 +322,670 @@ static void handler_ctx_free(handler_ctx *hctx) {
 	buffer_free(hctx->response_header);
 	chunkqueue_free(hctx->wb);
 
+	buffer_free(hctx->cache_key);
+	buffer_free(hctx->cache_body);
+	buffer_free(hctx->cache_file);
+
+	/* the chunks in the write-queue have their own fds of the pipe */
+	if (hctx->splice_pipe[0] != -1) close(hctx->splice_pipe[0]);
+	if (hctx->splice_pipe[1] != -1) close(hctx->splice_pipe[1]);
+
 	free(hctx);
 }
 
+static proxy_pool *proxy_pool_get(plugin_data *p, data_proxy *host) {
+	proxy_pool *pool;
+
+	for (pool = p->pools; pool; pool = pool->next) {
+		if (pool->port == host->port && buffer_is_equal(pool->host, host->host)) return pool;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	pool->host = buffer_init_buffer(host->host);
+	pool->port = host->port;
+
+	pool->next = p->pools;
+	p->pools = pool;
+
+	return pool;
+}
+
+static void proxy_pool_close_idle(server *srv, proxy_pool *pool, proxy_idle_conn **icp) {
+	proxy_idle_conn *ic = *icp;
+
+	*icp = ic->next;
+	pool->idle_used--;
+
+	close(ic->fd);
+	srv->cur_fds--;
+
+	free(ic);
+}
+
+/* the backend is disabled, its connections are most likely dead */
+static void proxy_pool_flush(server *srv, proxy_pool *pool) {
+	while (pool->idle) proxy_pool_close_idle(srv, pool, &pool->idle);
+}
+
+static void proxy_pool_timeout(server *srv, proxy_pool *pool) {
+	proxy_idle_conn **icp = &pool->idle;
+
+	while (*icp) {
+		if ((*icp)->expire < srv->cur_ts) {
+			proxy_pool_close_idle(srv, pool, icp);
+		} else {
+			icp = &(*icp)->next;
+		}
+	}
+}
+
+/* take an unused connection, returns -1 if there is none */
+static int proxy_pool_idle_get(server *srv, proxy_pool *pool) {
+	while (pool->idle) {
+		char c;
+		ssize_t r;
+		int fd;
+
+		/* the backend might have closed it in the meantime */
+		r = recv(pool->idle->fd, &c, 1, MSG_PEEK);
+
+		if (-1 == r && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			proxy_idle_conn *ic = pool->idle;
+
+			pool->idle = ic->next;
+			pool->idle_used--;
+
+			fd = ic->fd;
+			free(ic);
+
+			return fd;
+		}
+
+		proxy_pool_close_idle(srv, pool, &pool->idle);
+	}
+
+	return -1;
+}
+
+/* keep the connection of a finished request, returns 0 if it has to be closed */
+static int proxy_pool_idle_put(server *srv, handler_ctx *hctx) {
+	proxy_pool *pool = hctx->pool;
+	proxy_idle_conn *ic;
+
+	if (!hctx->reusable ||
+	    pool->idle_used >= hctx->keep_alive_max_idle) return 0;
+
+	ic = calloc(1, sizeof(*ic));
+	ic->fd = hctx->fd;
+	ic->expire = srv->cur_ts + hctx->keep_alive_idle_timeout;
+
+	ic->next = pool->idle;
+	pool->idle = ic;
+	pool->idle_used++;
+
+	return 1;
+}
+
+/* the response cache, see proxy.cache */
+
+static proxy_cache *proxy_cache_init(void) {
+	proxy_cache *cache = calloc(1, sizeof(*cache));
+
+	cache->dir = buffer_init();
+	cache->vary_key = buffer_init();
+	cache->tmp = buffer_init();
+
+	return cache;
+}
+
+static void proxy_cache_entry_free(proxy_cache_entry *e) {
+	if (!buffer_is_empty(e->file)) unlink(e->file->ptr);
+
+	buffer_free(e->key);
+	array_free(e->headers);
+	buffer_free(e->vary);
+	buffer_free(e->etag);
+	buffer_free(e->last_modified);
+	buffer_free(e->body);
+	buffer_free(e->file);
+
+	free(e);
+}
+
+static void proxy_cache_remove(proxy_cache *cache, proxy_cache_entry *e) {
+	cache->index = splaytree_splay(cache->index, e->hash);
+	if (cache->index && cache->index->key == e->hash && cache->index->data == e) {
+		cache->index = splaytree_delete(cache->index, e->hash);
+	}
+
+	if (e->prev) e->prev->next = e->next; else cache->head = e->next;
+	if (e->next) e->next->prev = e->prev; else cache->tail = e->prev;
+	e->prev = e->next = NULL;
+
+	if (e->file) {
+		cache->disk_used -= e->cost;
+	} else {
+		cache->mem_used -= e->cost;
+	}
+
+	/* a request is still waiting for the revalidation */
+	if (e->refs > 0) {
+		e->dead = 1;
+	} else {
+		proxy_cache_entry_free(e);
+	}
+}
+
+static void proxy_cache_unref(proxy_cache_entry *e) {
+	if (--e->refs == 0 && e->dead) proxy_cache_entry_free(e);
+}
+
+static void proxy_cache_free(proxy_cache *cache) {
+	while (cache->head) proxy_cache_remove(cache, cache->head);
+
+	buffer_free(cache->dir);
+	buffer_free(cache->vary_key);
+	buffer_free(cache->tmp);
+	free(cache);
+}
+
+/* drop the oldest entries until the new one fits */
+static void proxy_cache_evict(proxy_cache *cache) {
+	proxy_cache_entry *e, *prev;
+
+	for (e = cache->tail; e && (cache->mem_used > cache->max_memory || cache->disk_used > cache->max_disk); e = prev) {
+		prev = e->prev;
+
+		/* still needed by a revalidation */
+		if (e->refs > 0) continue;
+
+		if (e->file ? cache->disk_used > cache->max_disk : cache->mem_used > cache->max_memory) {
+			proxy_cache_remove(cache, e);
+		}
+	}
+}
+
+static proxy_cache_entry *proxy_cache_find(proxy_cache *cache, buffer *key) {
+	proxy_cache_entry *e;
+	int hash = generate_crc32c(CONST_BUF_LEN(key));
+
+	cache->index = splaytree_splay(cache->index, hash);
+	if (!cache->index || cache->index->key != hash) return NULL;
+
+	e = cache->index->data;
+
+	if (!buffer_is_equal(e->key, key)) return NULL;
+
+	/* most recently used */
+	if (e != cache->head) {
+		e->prev->next = e->next;
+		if (e->next) e->next->prev = e->prev; else cache->tail = e->prev;
+
+		e->prev = NULL;
+		e->next = cache->head;
+		cache->head->prev = e;
+		cache->head = e;
+	}
+
+	return e;
+}
+
+/* key + the values of the request headers named in the ", " separated names */
+static void proxy_cache_vary_key(proxy_cache *cache, connection *con, buffer *names, buffer *key) {
+	const char *s, *e;
+
+	buffer_copy_string_buffer(cache->vary_key, key);
+
+	for (s = names->ptr; *s; s = *e ? e + 2 : e) {
+		data_string *ds;
+
+		if (NULL == (e = strstr(s, ", "))) e = s + strlen(s);
+
+		buffer_copy_string_len(cache->tmp, s, e - s);
+
+		buffer_append_string_len(cache->vary_key, CONST_STR_LEN("\n"));
+		if (NULL != (ds = (data_string *)array_get_element(con->request.headers, cache->tmp->ptr))) {
+			buffer_append_string_buffer(cache->vary_key, ds->value);
+		}
+	}
+}
+
+static proxy_cache_entry *proxy_cache_lookup(proxy_cache *cache, connection *con, buffer *key) {
+	proxy_cache_entry *e = proxy_cache_find(cache, key);
+
+	/* the response depends on request headers */
+	if (e && e->vary) {
+		proxy_cache_vary_key(cache, con, e->vary, key);
+		e = proxy_cache_find(cache, cache->vary_key);
+	}
+
+	return e;
+}
+
+/* replaces the old version and everything else with the same hash */
+static void proxy_cache_insert(proxy_cache *cache, proxy_cache_entry *e) {
+	e->hash = generate_crc32c(CONST_BUF_LEN(e->key));
+
+	cache->index = splaytree_splay(cache->index, e->hash);
+	if (cache->index && cache->index->key == e->hash) {
+		proxy_cache_remove(cache, cache->index->data);
+	}
+
+	cache->index = splaytree_insert(cache->index, e->hash, e);
+
+	e->next = cache->head;
+	if (cache->head) cache->head->prev = e;
+	cache->head = e;
+	if (!cache->tail) cache->tail = e;
+
+	if (e->file) {
+		cache->disk_used += e->cost;
+	} else {
+		cache->mem_used += e->cost;
+	}
+}
+
+/* has a token of a comma separated header value */
+static int proxy_cache_has_token(const char *value, const char *token, const char **arg) {
+	size_t len = strlen(token);
+	const char *s;
+
+	for (s = value; s && *s; ) {
+		while (*s == ' ' || *s == '\t' || *s == ',') s++;
+
+		if (0 == strncasecmp(s, token, len) &&
+		    (s[len] == '\0' || s[len] == ',' || s[len] == ' ' || s[len] == '=')) {
+			if (arg) *arg = (s[len] == '=') ? s + len + 1 : NULL;
+			return 1;
+		}
+
+		s = strchr(s, ',');
+	}
+
+	return 0;
+}
+
+static time_t proxy_cache_parse_date(const char *s) {
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+
+	if (NULL == strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm)) return (time_t)-1;
+
+	/* the timezone offset of mktime() cancels out as we only compare */
+	tm.tm_isdst = 0;
+	return mktime(&tm);
+}
+
+/* seconds the response of the backend is fresh, -1 if it can't be cached */
+static time_t proxy_cache_freshness(server *srv, connection *con) {
+	data_string *ds;
+	const char *arg;
+	time_t ttl = -1;
+
+	if (NULL != array_get_element(con->response.headers, "Set-Cookie")) return -1;
+
+	if (NULL != (ds = (data_string *)array_get_element(con->response.headers, "Vary")) &&
+	    proxy_cache_has_token(ds->value->ptr, "*", NULL)) return -1;
+
+	if (NULL != (ds = (data_string *)array_get_element(con->response.headers, "Cache-Control"))) {
+		const char *cc = ds->value->ptr;
+
+		if (proxy_cache_has_token(cc, "no-store", NULL) ||
+		    proxy_cache_has_token(cc, "private", NULL)) return -1;
+
+		if (proxy_cache_has_token(cc, "no-cache", NULL)) {
+			/* keep it, but revalidate it every time */
+			ttl = 0;
+		} else if (proxy_cache_has_token(cc, "s-maxage", &arg) && arg) {
+			ttl = strtol(arg, NULL, 10);
+		} else if (proxy_cache_has_token(cc, "max-age", &arg) && arg) {
+			ttl = strtol(arg, NULL, 10);
+		}
+	}
+
+	if (ttl == -1 && NULL != (ds = (data_string *)array_get_element(con->response.headers, "Expires"))) {
+		time_t expires = proxy_cache_parse_date(ds->value->ptr), now;
+
+		if (NULL != (ds = (data_string *)array_get_element(con->response.headers, "Date"))) {
+			now = proxy_cache_parse_date(ds->value->ptr);
+		} else {
+			struct tm tm;
+#ifdef HAVE_GMTIME_R
+			gmtime_r(&(srv->cur_ts), &tm);
+#else
+			tm = *gmtime(&(srv->cur_ts));
+#endif
+			tm.tm_isdst = 0;
+			now = mktime(&tm);
+		}
+
+		/* an invalid date means already expired */
+		ttl = (expires == (time_t)-1 || now == (time_t)-1 || expires < now) ? 0 : expires - now;
+	}
+
+	if (ttl < 0) ttl = 0;
+
+	/* it spent some time in other caches already */
+	if (ttl > 0 && NULL != (ds = (data_string *)array_get_element(con->response.headers, "Age"))) {
+		ttl -= strtol(ds->value->ptr, NULL, 10);
+		if (ttl < 0) ttl = 0;
+	}
+
+	/* without a validator a stale entry is useless */
+	if (ttl == 0 &&
+	    NULL == array_get_element(con->response.headers, "ETag") &&
+	    NULL == array_get_element(con->response.headers, "Last-Modified")) return -1;
+
+	return ttl;
+}
+
+/* send a cached response to the client */
+static void proxy_cache_serve(server *srv, connection *con, proxy_cache_entry *e) {
+	char buf[32];
+	size_t i;
+	int not_modified = 0;
+
+	for (i = 0; i < e->headers->used; i++) {
+		data_string *ds = (data_string *)e->headers->data[i];
+
+		response_header_insert(srv, con, CONST_BUF_LEN(ds->key), CONST_BUF_LEN(ds->value));
+	}
+
+	LI_ltostr(buf, srv->cur_ts - e->stored);
+	response_header_overwrite(srv, con, CONST_STR_LEN("Age"), buf, strlen(buf));
+
+	/* the client has it already */
+	if (e->status == 200) {
+		if (con->request.http_if_none_match) {
+			not_modified = e->etag && etag_is_equal(e->etag, con->request.http_if_none_match);
+		} else if (con->request.http_if_modified_since && e->last_modified) {
+			not_modified = 0 == strcmp(con->request.http_if_modified_since, e->last_modified->ptr);
+		}
+	}
+
+	if (not_modified) {
+		con->http_status = 304;
+		con->file_finished = 1;
+		return;
+	}
+
+	con->http_status = e->status;
+
+	LI_ltostr(buf, e->size);
+	response_header_overwrite(srv, con, CONST_STR_LEN("Content-Length"), buf, strlen(buf));
+	con->parsed_response |= HTTP_CONTENT_LENGTH;
+	con->response.content_length = e->size;
+
+	if (e->body) {
+		if (e->size) http_chunk_append_mem(srv, con, e->body->ptr, e->size + 1);
+	} else if (e->size) {
+		chunk *c;
+
+		http_chunk_append_file(srv, con, e->file, 0, e->size);
+
+		/* open it now, the entry might be evicted before it is sent */
+		if (NULL != (c = con->write_queue->last) && c->type == FILE_CHUNK && c->file.fd == -1) {
+			c->file.fd = open(e->file->ptr, O_RDONLY);
+			if (c->file.fd != -1) fcntl(c->file.fd, F_SETFD, FD_CLOEXEC);
+		}
+	}
+
+	con->file_started = 1;
+	con->file_finished = 1;
+}
+
+/* the backend sent the headers, decide if the body is captured */
+static void proxy_cache_store_begin(server *srv, handler_ctx *hctx) {
+	connection *con = hctx->remote_conn;
+
+	if (!hctx->cache_key || con->request.http_method != HTTP_METHOD_GET) return;
+
+	if (con->http_status != 200 && con->http_status != 203 &&
+	    con->http_status != 301 && con->http_status != 410) return;
+
+	if (-1 == proxy_cache_freshness(srv, con)) return;
+
+	hctx->cache_store = 1;
+	hctx->cache_size = 0;
+
+	if (!hctx->cache_body) hctx->cache_body = buffer_init();
+	buffer_reset(hctx->cache_body);
+}
+
+static void proxy_cache_store_abort(handler_ctx *hctx) {
+	if (hctx->cache_fd != -1) {
+		close(hctx->cache_fd);
+		hctx->cache_fd = -1;
+
+		unlink(hctx->cache_file->ptr);
+	}
+
+	hctx->cache_store = 0;
+}
+
+/* a part of the body the client gets */
+static void proxy_cache_capture(server *srv, handler_ctx *hctx, const char *s, size_t len) {
+	proxy_cache *cache = hctx->plugin_data->cache;
+
+	if (!hctx->cache_store || len == 0) return;
+
+	hctx->cache_size += len;
+
+	if (hctx->cache_fd == -1 && hctx->cache_size > cache->max_memory_object) {
+		/* too large for memory, continue on disk */
+		if (buffer_is_empty(cache->dir) || hctx->cache_size > cache->max_disk) {
+			proxy_cache_store_abort(hctx);
+			return;
+		}
+
+		if (!hctx->cache_file) hctx->cache_file = buffer_init();
+		buffer_copy_string_buffer(hctx->cache_file, cache->dir);
+		buffer_append_string_len(hctx->cache_file, CONST_STR_LEN("/proxy-"));
+		buffer_append_long(hctx->cache_file, getpid());
+		buffer_append_string_len(hctx->cache_file, CONST_STR_LEN("-"));
+		buffer_append_long(hctx->cache_file, cache->file_id++);
+
+		if (-1 == (hctx->cache_fd = open(hctx->cache_file->ptr, O_WRONLY | O_CREAT | O_TRUNC, 0600))) {
+			log_error_write(srv, __FILE__, __LINE__, "sbs",
+					"proxy - opening cache file failed:", hctx->cache_file, strerror(errno));
+
+			proxy_cache_store_abort(hctx);
+			return;
+		}
+
+		/* buffer_append_memory() doesn't add a \0, used is the length */
+		if (hctx->cache_body->used &&
+		    (ssize_t)hctx->cache_body->used != write(hctx->cache_fd, hctx->cache_body->ptr, hctx->cache_body->used)) {
+			proxy_cache_store_abort(hctx);
+			return;
+		}
+
+		buffer_reset(hctx->cache_body);
+	}
+
+	if (hctx->cache_fd != -1) {
+		if (hctx->cache_size > cache->max_disk ||
+		    (ssize_t)len != write(hctx->cache_fd, s, len)) {
+			proxy_cache_store_abort(hctx);
+		}
+	} else {
+		buffer_append_memory(hctx->cache_body, s, len);
+	}
+}
+
+/* the response is complete, put it into the cache */
+static void proxy_cache_store_end(server *srv, handler_ctx *hctx) {
+	proxy_cache *cache = hctx->plugin_data->cache;
+	connection *con = hctx->remote_conn;
+	proxy_cache_entry *e;
+	data_string *ds;
+	time_t ttl;
+	size_t i;
+
+	if (!hctx->cache_store) return;
+	hctx->cache_store = 0;
+
+	ttl = proxy_cache_freshness(srv, con);
+
+	e = calloc(1, sizeof(*e));
+	e->status = con->http_status;
+	e->headers = array_init();
+	e->stored = srv->cur_ts;
+	e->expires = srv->cur_ts + ttl;
+	e->size = hctx->cache_size;
+	e->cost = e->size;
+
+	for (i = 0; i < con->response.headers->used; i++) {
+		data_string *dh = (data_string *)con->response.headers->data[i];
+
+		if (buffer_is_empty(dh->value)) continue;
+
+		/* set again when it is served, the core adds its own framing */
+		if (buffer_is_equal_string(dh->key, CONST_STR_LEN("Content-Length")) ||
+		    buffer_is_equal_string(dh->key, CONST_STR_LEN("Transfer-Encoding")) ||
+		    buffer_is_equal_string(dh->key, CONST_STR_LEN("Connection")) ||
+		    buffer_is_equal_string(dh->key, CONST_STR_LEN("Date")) ||
+		    buffer_is_equal_string(dh->key, CONST_STR_LEN("Age"))) continue;
+
+		array_insert_unique(e->headers, dh->copy((data_unset *)dh));
+		if (hctx->cache_fd == -1) e->cost += dh->key->used + dh->value->used;
+	}
+
+	if (NULL != (ds = (data_string *)array_get_element(con->response.headers, "ETag"))) {
+		e->etag = buffer_init_buffer(ds->value);
+	}
+	if (NULL != (ds = (data_string *)array_get_element(con->response.headers, "Last-Modified"))) {
+		e->last_modified = buffer_init_buffer(ds->value);
+	}
+
+	if (hctx->cache_fd != -1) {
+		close(hctx->cache_fd);
+		hctx->cache_fd = -1;
+
+		e->file = hctx->cache_file;
+		hctx->cache_file = NULL;
+	} else {
+		e->body = hctx->cache_body;
+		hctx->cache_body = NULL;
+		if (!e->body) e->body = buffer_init();
+	}
+
+	if (NULL != (ds = (data_string *)array_get_element(con->response.headers, "Vary"))) {
+		/* a marker with the names, the response goes under the key of the variant */
+		buffer *names = buffer_init();
+		proxy_cache_entry *marker;
+		const char *tok, *end;
+
+		for (tok = ds->value->ptr; *tok; tok = *end ? end + 1 : end) {
+			const char *t = tok, *te;
+
+			if (NULL == (end = strchr(tok, ','))) end = tok + strlen(tok);
+
+			for (te = end; t < te && (*t == ' ' || *t == '\t'); t++);
+			for (; te > t && (te[-1] == ' ' || te[-1] == '\t'); te--);
+
+			if (t < te) {
+				if (names->used) buffer_append_string_len(names, CONST_STR_LEN(", "));
+				buffer_append_string_len(names, t, te - t);
+			}
+		}
+
+		if (NULL == (marker = proxy_cache_find(cache, hctx->cache_key)) ||
+		    !marker->vary || !buffer_is_equal(marker->vary, names)) {
+			marker = calloc(1, sizeof(*marker));
+			marker->key = buffer_init_buffer(hctx->cache_key);
+			marker->headers = array_init();
+			marker->vary = names;
+			marker->cost = marker->key->used + names->used;
+
+			proxy_cache_insert(cache, marker);
+		} else {
+			buffer_free(names);
+		}
+
+		proxy_cache_vary_key(cache, con, marker->vary, hctx->cache_key);
+		e->key = buffer_init_buffer(cache->vary_key);
+	} else {
+		e->key = buffer_init_buffer(hctx->cache_key);
+	}
+
+	if (!e->file) e->cost += e->key->used;
+
+	proxy_cache_insert(cache, e);
+
+	if (hctx->plugin_data->conf.debug) {
+		log_error_write(srv, __FILE__, __LINE__, "sbsdsd",
+				"proxy - cached", hctx->cache_key, "for", (int)ttl, "size:", (int)e->size);
+	}
+
+	proxy_cache_evict(cache);
+}
+
+/* build the cache key if the request can use the cache
+ *
+ * returns 1 if a cached response may be used, 0 if the response may only be stored, -1 if neither
+ */
+static int proxy_cache_request(connection *con, buffer *key) {
+	data_string *ds;
+	int lookup = 1;
+
+	if (con->request.http_method != HTTP_METHOD_GET &&
+	    con->request.http_method != HTTP_METHOD_HEAD) return -1;
+
+	/* personal or partial responses */
+	if (NULL != array_get_element(con->request.headers, "Authorization") ||
+	    con->request.http_range) return -1;
+
+	if (NULL != (ds = (data_string *)array_get_element(con->request.headers, "Cache-Control"))) {
+		if (proxy_cache_has_token(ds->value->ptr, "no-store", NULL)) return -1;
+
+		/* fetch it again, but keep the new response */
+		if (proxy_cache_has_token(ds->value->ptr, "no-cache", NULL)) lookup = 0;
+	}
+
+	if (NULL != (ds = (data_string *)array_get_element(con->request.headers, "Pragma")) &&
+	    proxy_cache_has_token(ds->value->ptr, "no-cache", NULL)) lookup = 0;
+
+	buffer_copy_string_buffer(key, con->uri.authority);
+	buffer_append_string_buffer(key, con->request.uri);
+
+	return lookup;
+}
+
+/* the backend answered our revalidation with 304, send the cached copy */
+static int proxy_cache_refresh(server *srv, handler_ctx *hctx) {
+	proxy_cache *cache = hctx->plugin_data->cache;
+	connection *con = hctx->remote_conn;
+	proxy_cache_entry *e = hctx->cache_stale;
+	time_t ttl;
+
+	/* replaced in the meantime, take the new one */
+	if (e->dead && NULL == (e = proxy_cache_lookup(cache, con, hctx->cache_key))) {
+		log_error_write(srv, __FILE__, __LINE__, "sb",
+				"proxy - revalidated cache entry is gone:", hctx->cache_key);
+		return -1;
+	}
+
+	if (e == hctx->cache_stale && -1 != (ttl = proxy_cache_freshness(srv, con))) {
+		e->stored = srv->cur_ts;
+		e->expires = srv->cur_ts + ttl;
+	}
+
+	/* the 304 headers are replaced by the cached ones */
+	array_reset(con->response.headers);
+	con->parsed_response = 0;
+
+	proxy_cache_serve(srv, con, e);
+
+	if (hctx->plugin_data->conf.debug) {
+		log_error_write(srv, __FILE__, __LINE__, "sb",
+				"proxy - cache revalidated:", hctx->cache_key);
+	}
+
+	return 0;
+}
+
 INIT_FUNC(mod_proxy_init) {
 	plugin_data *p;
 
@@ -150,6 +994,9 @@ INIT_FUNC(mod_proxy_init) {
 	p->parse_response = buffer_init();
 	p->balance_buf = buffer_init();
 
+	p->collapse = collapse_init();
+	p->collapse_key = buffer_init();
+
 	return p;
 }
 
@@ -162,6 +1009,30 @@ FREE_FUNC(mod_proxy_free) {
 	buffer_free(p->parse_response);
 	buffer_free(p->balance_buf);
 
+	collapse_free(p->collapse);
+	buffer_free(p->collapse_key);
+
+	while (p->pools) {
+		proxy_pool *pool = p->pools;
+
+		p->pools = pool->next;
+
+		proxy_pool_flush(srv, pool);
+		buffer_free(pool->host);
+		free(pool);
+	}
+
+	if (p->cache) proxy_cache_free(p->cache);
+
+	while (p->rings) {
+		proxy_ring *r = p->rings;
+
+		p->rings = r->next;
+
+		ketama_free(r->ring);
+		free(r);
+	}
+
 	if (p->config_storage) {
 		size_t i;
 		for (i = 0; i < srv->config_context->used; i++) {
@@ -170,6 +1041,8 @@ FREE_FUNC(mod_proxy_free) {
 			if (s) {
 
 				array_free(s->extensions);
+				buffer_free(s->hash_cookie);
+				buffer_free(s->cache_dir);
 
 				free(s);
 			}
@@ -191,6 +1064,22 @@ SETDEFAULTS_FUNC(mod_proxy_set_defaults) {
 		{ "proxy.server",              NULL, T_CONFIG_LOCAL, T_CONFIG_SCOPE_CONNECTION },       /* 0 */
 		{ "proxy.debug",               NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },       /* 1 */
 		{ "proxy.balance",             NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },      /* 2 */
+		{ "proxy.keep-alive",          NULL, T_CONFIG_BOOLEAN, T_CONFIG_SCOPE_CONNECTION },     /* 3 */
+		{ "proxy.keep-alive-max-idle", NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },       /* 4 */
+		{ "proxy.keep-alive-idle-timeout", NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },   /* 5 */
+		{ "proxy.max-connections",     NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },       /* 6 */
+		{ "proxy.hash-key",            NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },      /* 7 */
+		{ "proxy.cache",               NULL, T_CONFIG_BOOLEAN, T_CONFIG_SCOPE_CONNECTION },     /* 8 */
+		{ "proxy.cache-max-memory",    NULL, T_CONFIG_INT, T_CONFIG_SCOPE_SERVER },             /* 9 */
+		{ "proxy.cache-max-memory-object", NULL, T_CONFIG_INT, T_CONFIG_SCOPE_SERVER },         /* 10 */
+		{ "proxy.cache-max-disk",      NULL, T_CONFIG_INT, T_CONFIG_SCOPE_SERVER },             /* 11 */
+		{ "proxy.cache-dir",           NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER },          /* 12 */
+		{ "proxy.collapse",            NULL, T_CONFIG_BOOLEAN, T_CONFIG_SCOPE_CONNECTION },     /* 13 */
+		{ "proxy.collapse-timeout",    NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },       /* 14 */
+		{ "proxy.response-buffer",     NULL, T_CONFIG_INT, T_CONFIG_SCOPE_CONNECTION },         /* 15 */
+		{ "proxy.response-spool",      NULL, T_CONFIG_INT, T_CONFIG_SCOPE_CONNECTION },         /* 16 */
+		{ "proxy.splice",              NULL, T_CONFIG_BOOLEAN, T_CONFIG_SCOPE_CONNECTION },     /* 17 */
+		{ "proxy.allow-x-send-file",   NULL, T_CONFIG_BOOLEAN, T_CONFIG_SCOPE_CONNECTION },     /* 18 */
 		{ NULL,                        NULL, T_CONFIG_UNSET, T_CONFIG_SCOPE_UNSET }
 	};
 
@@ -203,12 +1092,45 @@ SETDEFAULTS_FUNC(mod_proxy_set_defaults) {
 		s = malloc(sizeof(plugin_config));
 		s->extensions    = array_init();
 		s->debug         = 0;
+		s->keep_alive    = 0;
+		s->keep_alive_max_idle = 8;
+		s->keep_alive_idle_timeout = 30;
+		s->max_connections = 0;
+		s->hash_cookie   = buffer_init();
+		s->cache         = 0;
+		s->cache_max_memory = 16 * 1024;
+		s->cache_max_memory_object = 64;
+		s->cache_max_disk = 1024 * 1024;
+		s->cache_dir     = buffer_init();
+		s->collapse      = 0;
+		s->collapse_timeout = 5;
+		s->response_buffer = 256;
+		s->response_spool = 0;
+		s->splice        = 0;
+		s->allow_xsendfile = 0;
 
 		cv[0].destination = s->extensions;
 		cv[1].destination = &(s->debug);
 		cv[2].destination = p->balance_buf;
+		cv[3].destination = &(s->keep_alive);
+		cv[4].destination = &(s->keep_alive_max_idle);
+		cv[5].destination = &(s->keep_alive_idle_timeout);
+		cv[6].destination = &(s->max_connections);
+		cv[7].destination = p->parse_response;
+		cv[8].destination = &(s->cache);
+		cv[9].destination = &(s->cache_max_memory);
+		cv[10].destination = &(s->cache_max_memory_object);
+		cv[11].destination = &(s->cache_max_disk);
+		cv[12].destination = s->cache_dir;
+		cv[13].destination = &(s->collapse);
+		cv[14].destination = &(s->collapse_timeout);
+		cv[15].destination = &(s->response_buffer);
+		cv[16].destination = &(s->response_spool);
+		cv[17].destination = &(s->splice);
+		cv[18].destination = &(s->allow_xsendfile);
 
 		buffer_reset(p->balance_buf);
+		buffer_reset(p->parse_response);
 
 		p->config_storage[i] = s;
 		ca = ((data_config *)srv->config_context->data[i])->value;
@@ -225,9 +1147,17 @@ SETDEFAULTS_FUNC(mod_proxy_set_defaults) {
 			s->balance = PROXY_BALANCE_RR;
 		} else if (buffer_is_equal_string(p->balance_buf, CONST_STR_LEN("hash"))) {
 			s->balance = PROXY_BALANCE_HASH;
+		} else if (buffer_is_equal_string(p->balance_buf, CONST_STR_LEN("peak-ewma"))) {
+			s->balance = PROXY_BALANCE_EWMA;
 		} else {
 			log_error_write(srv, __FILE__, __LINE__, "sb",
-				        "proxy.balance has to be one of: fair, round-robin, hash, but not:", p->balance_buf);
+				        "proxy.balance has to be one of: fair, round-robin, hash, peak-ewma, but not:", p->balance_buf);
+			return HANDLER_ERROR;
+		}
+
+		if (0 != ketama_key_parse(p->parse_response, &(s->hash_key), s->hash_cookie)) {
+			log_error_write(srv, __FILE__, __LINE__, "sb",
+				        "proxy.hash-key has to be one of: uri, host, ip, cookie:<name>, but not:", p->parse_response);
 			return HANDLER_ERROR;
 		}
 
@@ -329,6 +1259,17 @@ SETDEFAULTS_FUNC(mod_proxy_set_defaults) {
 		}
 	}
 
+	/* one cache for all contexts, the limits come from the global one */
+	{
+		plugin_config *s = p->config_storage[0];
+
+		p->cache = proxy_cache_init();
+		p->cache->max_memory = (off_t)s->cache_max_memory * 1024;
+		p->cache->max_memory_object = (off_t)s->cache_max_memory_object * 1024;
+		p->cache->max_disk = (off_t)s->cache_max_disk * 1024;
+		buffer_copy_string_buffer(p->cache->dir, s->cache_dir);
+	}
+
 	return HANDLER_GO_ON;
 }
 
@@ -345,14 +1286,25 @@ static void proxy_connection_close(server *srv, handler_ctx *hctx) {
 		fdevent_event_del(srv->ev, &(hctx->fde_ndx), hctx->fd);
 		fdevent_unregister(srv->ev, hctx->fd);
 
-		close(hctx->fd);
-		srv->cur_fds--;
+		if (!proxy_pool_idle_put(srv, hctx)) {
+			close(hctx->fd);
+			srv->cur_fds--;
+		} else if (p->conf.debug) {
+			log_error_write(srv, __FILE__, __LINE__, "sbd",
+					"proxy - keeping connection to", hctx->pool->host, hctx->pool->port);
+		}
 	}
 
 	if (hctx->host) {
 		hctx->host->usage--;
+		hctx->pool->active--;
 	}
 
+	proxy_cache_store_abort(hctx);
+	if (hctx->cache_stale) proxy_cache_unref(hctx->cache_stale);
+
+	if (hctx->collapse) collapse_leave(srv, p->collapse, hctx->collapse, con);
+
 	handler_ctx_free(hctx);
 	con->plugin_ctx[p->id] = NULL;
 }
@@ -454,7 +1406,18 @@ static int proxy_create_env(server *srv, handler_ctx *hctx) {
 	buffer_append_string_len(b, CONST_STR_LEN(" "));
 
 	buffer_append_string_buffer(b, con->request.uri);
-	buffer_append_string_len(b, CONST_STR_LEN(" HTTP/1.0\r\n"));
+	if (hctx->keep_alive) {
+		buffer_append_string_len(b, CONST_STR_LEN(" HTTP/1.1\r\n"));
+
+		/* HTTP/1.1 requires a Host header, HTTP/1.0 clients might not send one */
+		if (!con->request.http_host || buffer_is_empty(con->request.http_host)) {
+			buffer_append_string_len(b, CONST_STR_LEN("Host: "));
+			buffer_append_string_buffer(b, hctx->host->host);
+			buffer_append_string_len(b, CONST_STR_LEN("\r\n"));
+		}
+	} else {
+		buffer_append_string_len(b, CONST_STR_LEN(" HTTP/1.0\r\n"));
+	}
 
 	proxy_append_header(con, "X-Forwarded-For", (char *)inet_ntop_cache_get_ip(srv, &(con->dst_addr)));
 	/* http_host is NOT is just a pointer to a buffer
@@ -474,6 +1437,7 @@ static int proxy_create_env(server *srv, handler_ctx *hctx) {
 		if (ds->value->used && ds->key->used) {
 			if (buffer_is_equal_string(ds->key, CONST_STR_LEN("Connection"))) continue;
 			if (buffer_is_equal_string(ds->key, CONST_STR_LEN("Proxy-Connection"))) continue;
+			if (buffer_is_equal_string(ds->key, CONST_STR_LEN("Keep-Alive"))) continue;
 
 			buffer_append_string_buffer(b, ds->key);
 			buffer_append_string_len(b, CONST_STR_LEN(": "));
@@ -482,6 +1446,20 @@ static int proxy_create_env(server *srv, handler_ctx *hctx) {
 		}
 	}
 
+	/* revalidate the stale copy in the cache */
+	if (hctx->cache_revalidate) {
+		if (hctx->cache_stale->etag) {
+			buffer_append_string_len(b, CONST_STR_LEN("If-None-Match: "));
+			buffer_append_string_buffer(b, hctx->cache_stale->etag);
+			buffer_append_string_len(b, CONST_STR_LEN("\r\n"));
+		}
+		if (hctx->cache_stale->last_modified) {
+			buffer_append_string_len(b, CONST_STR_LEN("If-Modified-Since: "));
+			buffer_append_string_buffer(b, hctx->cache_stale->last_modified);
+			buffer_append_string_len(b, CONST_STR_LEN("\r\n"));
+		}
+	}
+
 	buffer_append_string_len(b, CONST_STR_LEN("\r\n"));
 
 	hctx->wb->bytes_in += b->used - 1;
@@ -551,9 +1529,12 @@ static int proxy_set_state(server *srv, handler_ctx *hctx, proxy_connection_stat
 }
 
 
-static int proxy_response_parse(server *srv, connection *con, plugin_data *p, buffer *in) {
+static int proxy_response_parse(server *srv, handler_ctx *hctx, buffer *in) {
 	char *s, *ns;
 	int http_response_status = -1;
+	connection *con = hctx->remote_conn;
+	plugin_data *p = hctx->plugin_data;
+	int chunked = 0;
 
 	UNUSED(srv);
 
@@ -582,6 +1563,9 @@ static int proxy_response_parse(server *srv, connection *con, plugin_data *p, bu
 				http_response_status = 502;
 			}
 
+			/* HTTP/1.1 connections stay open unless "Connection: close" */
+			hctx->backend_keep_alive = (0 == strncmp(s, "HTTP/1.1 ", sizeof("HTTP/1.1 ") - 1));
+
 			con->http_status = http_response_status;
 			con->parsed_response |= HTTP_STATUS;
 			continue;
@@ -615,6 +1599,20 @@ static int proxy_response_parse(server *srv, connection *con, plugin_data *p, bu
 			break;
 		case 10:
 			if (0 == strncasecmp(key, "Connection", key_len)) {
+				if (0 == strcasecmp(value, "close")) {
+					hctx->backend_keep_alive = 0;
+				} else if (0 == strcasecmp(value, "keep-alive")) {
+					hctx->backend_keep_alive = 1;
+				}
+				copy_header = 0;
+			} else if (0 == strncasecmp(key, "Keep-Alive", key_len)) {
+				copy_header = 0;
+			}
+			break;
+		case 17:
+			/* we decode it, the client gets our own chunks */
+			if (hctx->keep_alive && 0 == strncasecmp(key, "Transfer-Encoding", key_len)) {
+				if (NULL != strstr(value, "chunked")) chunked = 1;
 				copy_header = 0;
 			}
 			break;
@@ -639,8 +1637,279 @@ static int proxy_response_parse(server *srv, connection *con, plugin_data *p, bu
 		}
 	}
 
+	if (!hctx->keep_alive) {
+		/* HTTP/1.0, read until the backend closes the connection */
+		hctx->body_state = PROXY_BODY_EOF;
+		hctx->backend_keep_alive = 0;
+	} else if (con->request.http_method == HTTP_METHOD_HEAD ||
+		   (http_response_status >= 100 && http_response_status < 200) ||
+		   http_response_status == 204 ||
+		   http_response_status == 304) {
+		hctx->body_state = PROXY_BODY_NONE;
+	} else if (chunked) {
+		hctx->body_state = PROXY_BODY_CHUNK_SIZE;
+	} else if (con->parsed_response & HTTP_CONTENT_LENGTH) {
+		hctx->body_state = PROXY_BODY_LENGTH;
+		hctx->body_left = con->response.content_length;
+	} else {
+		hctx->body_state = PROXY_BODY_EOF;
+		hctx->backend_keep_alive = 0;
+	}
+
+	hctx->body_done = (hctx->body_state == PROXY_BODY_NONE ||
+			   (hctx->body_state == PROXY_BODY_LENGTH && hctx->body_left <= 0));
+
+	return 0;
+}
+
+/* the body goes into memory up to proxy.response-buffer, then into tempfiles */
+static void proxy_response_append(server *srv, handler_ctx *hctx, const char *s, size_t len) {
+	connection *con = hctx->remote_conn;
+	off_t mem, spooled;
+
+	if (hctx->response_spool > 0) {
+		http_chunk_backlog(con, &mem, &spooled);
+
+		if (mem >= hctx->response_buffer && spooled < hctx->response_spool &&
+		    0 == http_chunk_append_spool(srv, con, s, len)) return;
+	}
+
+	http_chunk_append_mem(srv, con, s, len + 1);
+}
+
+/* the client is slower than the backend and memory and spool are full */
+static int proxy_response_blocked(handler_ctx *hctx) {
+	off_t mem, spooled;
+
+	if (hctx->response_buffer == 0 && !hctx->splice_full) return 0;
+
+	http_chunk_backlog(hctx->remote_conn, &mem, &spooled);
+
+	if (hctx->splice_full) {
+		if (mem > 0) return 1;
+		hctx->splice_full = 0;
+	}
+
+	return hctx->response_buffer > 0 && mem >= hctx->response_buffer && spooled >= hctx->response_spool;
+}
+
+#ifdef PROXY_SPLICE
+/* not if we have to look at the body or change it */
+static void proxy_splice_begin(server *srv, handler_ctx *hctx) {
+	connection *con = hctx->remote_conn;
+
+	if (!hctx->splice || hctx->body_done) return;
+	if (hctx->body_state != PROXY_BODY_LENGTH && hctx->body_state != PROXY_BODY_EOF) return;
+	if (con->response.transfer_encoding & HTTP_TRANSFER_ENCODING_CHUNKED) return;
+	if (hctx->cache_store || hctx->collapse_leader) return;
+	if (con->response_filter) return;
+
+	/* only this backend knows pipe-chunks */
+	if (con->srv_socket->is_ssl ||
+	    srv->network_backend_write != network_write_chunkqueue_linuxsendfile) return;
+
+	if (-1 == pipe(hctx->splice_pipe)) {
+		log_error_write(srv, __FILE__, __LINE__, "ss", "pipe failed:", strerror(errno));
+
+		hctx->splice_pipe[0] = -1;
+		hctx->splice_pipe[1] = -1;
+		return;
+	}
+
+	fcntl(hctx->splice_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(hctx->splice_pipe[1], F_SETFD, FD_CLOEXEC);
+	fcntl(hctx->splice_pipe[0], F_SETFL, O_NONBLOCK | O_RDWR);
+	fcntl(hctx->splice_pipe[1], F_SETFL, O_NONBLOCK | O_RDWR);
+
+	if (hctx->plugin_data->conf.debug) {
+		log_error_write(srv, __FILE__, __LINE__, "sd",
+				"proxy - splicing the body from", hctx->fd);
+	}
+}
+
+/* move up to b octets of the body from the backend into the pipe,
+ * returns like proxy_demux_response() */
+static int proxy_splice_body(server *srv, handler_ctx *hctx, int b) {
+	connection *con = hctx->remote_conn;
+	size_t n = b;
+	ssize_t r;
+
+	if (hctx->body_state == PROXY_BODY_LENGTH && (off_t)n > hctx->body_left) n = hctx->body_left;
+
+	if (-1 == (r = splice(hctx->fd, NULL, hctx->splice_pipe[1], NULL, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK))) {
+		if (errno == EAGAIN) {
+			hctx->splice_full = 1;
+			return 0;
+		}
+
+		log_error_write(srv, __FILE__, __LINE__, "ssd",
+				"splice failed:", strerror(errno), hctx->fd);
+		return -1;
+	}
+
+	if (0 != http_chunk_append_pipe(srv, con, hctx->splice_pipe[0], r)) return -1;
+
+	if (hctx->body_state == PROXY_BODY_LENGTH) {
+		hctx->body_left -= r;
+
+		if (hctx->body_left == 0) {
+			hctx->body_done = 1;
+			/* anything after the response means we are out of sync */
+			hctx->reusable = hctx->backend_keep_alive && r == b;
+
+			con->file_finished = 1;
+
+			http_chunk_append_mem(srv, con, NULL, 0);
+			joblist_append(srv, con);
+
+			return 1;
+		}
+	}
+
+	joblist_append(srv, con);
+
 	return 0;
 }
+#endif
+
+/* X-Sendfile: the backend names a file which is sent instead of its body
+ *
+ * returns 1 if the response is complete, 0 if there is no such header
+ */
+static int proxy_send_file(server *srv, handler_ctx *hctx, size_t blen) {
+	connection *con = hctx->remote_conn;
+	plugin_data *p = hctx->plugin_data;
+	data_string *ds, *dcl;
+
+	if (!hctx->allow_xsendfile) return 0;
+
+	if (NULL == (ds = (data_string *)array_get_element(con->response.headers, "X-LIGHTTPD-send-file")) &&
+	    NULL == (ds = (data_string *)array_get_element(con->response.headers, "X-Sendfile"))) return 0;
+
+	/* the followers don't get the file */
+	if (hctx->collapse_leader) {
+		collapse_leave(srv, p->collapse, hctx->collapse, con);
+		hctx->collapse = NULL;
+		hctx->collapse_leader = 0;
+	}
+
+	/* the length is the one of the file */
+	if (NULL != (dcl = (data_string *)array_get_element(con->response.headers, "Content-Length"))) {
+		buffer_reset(dcl->value);
+	}
+	con->parsed_response &= ~HTTP_CONTENT_LENGTH;
+
+	if (HANDLER_ERROR == http_response_send_file(srv, con, ds->value, 1)) {
+		log_error_write(srv, __FILE__, __LINE__, "sb",
+				"send-file error: couldn't get stat_cache entry for:",
+				ds->value);
+		con->http_status = 502;
+	}
+
+	/* the body of the backend is dropped, only an empty one keeps the connection in sync */
+	hctx->reusable = hctx->backend_keep_alive && hctx->body_done && blen == 0;
+
+	con->file_started = 1;
+	con->file_finished = 1;
+
+	return 1;
+}
+
+/* pass the response body to the client
+ *
+ * returns the number of bytes taken from s (the rest is an incomplete
+ * chunk header), -1 if the chunked encoding is broken
+ */
+static ssize_t proxy_response_body(server *srv, handler_ctx *hctx, const char *s, size_t len) {
+	size_t used = 0;
+
+	while (used < len && !hctx->body_done) {
+		const char *lf;
+		size_t n;
+
+		switch (hctx->body_state) {
+		case PROXY_BODY_EOF:
+			proxy_response_append(srv, hctx, s + used, len - used);
+			proxy_cache_capture(srv, hctx, s + used, len - used);
+			if (hctx->collapse_leader) collapse_append(hctx->collapse, s + used, len - used);
+			used = len;
+			break;
+		case PROXY_BODY_LENGTH:
+		case PROXY_BODY_CHUNK_DATA:
+			n = len - used;
+			if ((off_t)n > hctx->body_left) n = hctx->body_left;
+
+			proxy_response_append(srv, hctx, s + used, n);
+			proxy_cache_capture(srv, hctx, s + used, n);
+			if (hctx->collapse_leader) collapse_append(hctx->collapse, s + used, n);
+			used += n;
+			hctx->body_left -= n;
+
+			if (hctx->body_left == 0) {
+				if (hctx->body_state == PROXY_BODY_LENGTH) {
+					hctx->body_done = 1;
+				} else {
+					hctx->body_state = PROXY_BODY_CHUNK_END;
+				}
+			}
+			break;
+		case PROXY_BODY_CHUNK_SIZE:
+		case PROXY_BODY_CHUNK_END:
+		case PROXY_BODY_TRAILER:
+			if (NULL == (lf = memchr(s + used, '\n', len - used))) {
+				/* wait for the rest of the line */
+				if (len - used > 1024) return -1;
+
+				return used;
+			}
+
+			n = lf - (s + used) + 1;
+
+			if (hctx->body_state == PROXY_BODY_CHUNK_SIZE) {
+				off_t chunk_len = 0;
+				size_t i;
+
+				for (i = 0; i < n; i++) {
+					char c = s[used + i];
+					int d;
+
+					if (c >= '0' && c <= '9') d = c - '0';
+					else if (c >= 'a' && c <= 'f') d = c - 'a' + 10;
+					else if (c >= 'A' && c <= 'F') d = c - 'A' + 10;
+					else break;
+
+					if (chunk_len > (((off_t)1 << (sizeof(off_t) * 8 - 6)))) return -1;
+					chunk_len = chunk_len * 16 + d;
+				}
+
+				/* no size at all */
+				if (i == 0) return -1;
+
+				if (chunk_len == 0) {
+					hctx->body_state = PROXY_BODY_TRAILER;
+				} else {
+					hctx->body_state = PROXY_BODY_CHUNK_DATA;
+					hctx->body_left = chunk_len;
+				}
+			} else if (hctx->body_state == PROXY_BODY_CHUNK_END) {
+				if (n > 2) return -1;
+
+				hctx->body_state = PROXY_BODY_CHUNK_SIZE;
+			} else if (n <= 2) {
+				/* empty line after the trailers */
+				hctx->body_done = 1;
+			}
+
+			used += n;
+			break;
+		case PROXY_BODY_NONE:
+			hctx->body_done = 1;
+			break;
+		}
+	}
+
+	return used;
+}
 
 
 static int proxy_demux_response(server *srv, handler_ctx *hctx) {
@@ -667,6 +1936,10 @@ static int proxy_demux_response(server *srv, handler_ctx *hctx) {
 	}
 
 	if (b > 0) {
+#ifdef PROXY_SPLICE
+		if (hctx->splice_pipe[1] != -1) return proxy_splice_body(srv, hctx, b);
+#endif
+
 		if (hctx->response->used == 0) {
 			/* avoid too small buffer */
 			buffer_prepare_append(hctx->response, b + 1);
@@ -712,8 +1985,32 @@ static int proxy_demux_response(server *srv, handler_ctx *hctx) {
 #if 0
 				log_error_write(srv, __FILE__, __LINE__, "sb", "Header:", hctx->response_header);
 #endif
+				if (hctx->ewma_start > 0) {
+					double now = ewma_now();
+
+					ewma_update(&hctx->host->ewma, now, now - hctx->ewma_start);
+					hctx->ewma_start = 0;
+				}
+
 				/* parse the response header */
-				proxy_response_parse(srv, con, p, hctx->response_header);
+				proxy_response_parse(srv, hctx, hctx->response_header);
+
+				if (hctx->cache_revalidate && con->http_status == 304) {
+					/* our copy is still good, the followers find it in the cache */
+					if (hctx->collapse_leader) {
+						collapse_leave(srv, p->collapse, hctx->collapse, con);
+						hctx->collapse = NULL;
+						hctx->collapse_leader = 0;
+					}
+
+					if (-1 == proxy_cache_refresh(srv, hctx)) return -1;
+				} else if (proxy_send_file(srv, hctx, blen)) {
+					joblist_append(srv, con);
+					return 1;
+				} else {
+					proxy_cache_store_begin(srv, hctx);
+					http_response_body_start(srv, con);
+				}
 
 				/* enable chunked-transfer-encoding */
 				if (con->request.http_version == HTTP_VERSION_1_1 &&
@@ -721,21 +2018,75 @@ static int proxy_demux_response(server *srv, handler_ctx *hctx) {
 					con->response.transfer_encoding = HTTP_TRANSFER_ENCODING_CHUNKED;
 				}
 
+#ifdef PROXY_SPLICE
+				proxy_splice_begin(srv, hctx);
+#endif
+
 				con->file_started = 1;
-				if (blen) {
-					http_chunk_append_mem(srv, con, c + 4, blen + 1);
-				}
-				hctx->response->used = 0;
+
+				/* keep the body in the buffer */
+				memmove(hctx->response->ptr, c + 4, blen + 1);
+				hctx->response->used = blen + 1;
 				joblist_append(srv, con);
 			}
-		} else {
-			http_chunk_append_mem(srv, con, hctx->response->ptr, hctx->response->used);
+		}
+
+		if (con->file_started) {
+			size_t blen = hctx->response->used - 1;
+			ssize_t used = 0;
+
+			if (blen && -1 == (used = proxy_response_body(srv, hctx, hctx->response->ptr, blen))) {
+				log_error_write(srv, __FILE__, __LINE__, "sbd",
+						"proxy - invalid chunked encoding from", hctx->host->host, hctx->host->port);
+				return -1;
+			}
+
+			if (hctx->body_done) {
+				/* anything after the response means we are out of sync */
+				hctx->reusable = hctx->backend_keep_alive && (size_t)used == blen;
+
+				proxy_cache_store_end(srv, hctx);
+				if (hctx->collapse_leader) collapse_done(srv, p->collapse, hctx->collapse, con);
+
+				con->file_finished = 1;
+
+				http_chunk_append_mem(srv, con, NULL, 0);
+				fin = 1;
+			} else if ((size_t)used < blen) {
+				/* an incomplete chunk header */
+				memmove(hctx->response->ptr, hctx->response->ptr + used, blen - used + 1);
+				hctx->response->used = blen - used + 1;
+			} else {
+				hctx->response->used = 0;
+			}
+
 			joblist_append(srv, con);
-			hctx->response->used = 0;
 		}
+	} else if (0 == con->file_started) {
+		/* closed before the response header */
+		if (hctx->reused && 0 == con->got_response && 0 == con->request.content_length) {
+			/* a keep-alive connection the backend closed while we sent the request */
+			return 2;
+		}
+
+		log_error_write(srv, __FILE__, __LINE__, "sbd",
+				"proxy - no response header, connection closed by", hctx->host->host, hctx->host->port);
+
+		con->http_status = 502;
+		return -1;
+	} else if (hctx->body_state != PROXY_BODY_EOF && !hctx->body_done) {
+		/* the backend closed the connection in the middle of the response */
+		log_error_write(srv, __FILE__, __LINE__, "sbd",
+				"proxy - response incomplete, connection closed by", hctx->host->host, hctx->host->port);
 
+		return -1;
 	} else {
 		/* reading from upstream done */
+		if (hctx->body_state == PROXY_BODY_EOF) {
+			proxy_cache_store_end(srv, hctx);
+			if (hctx->collapse_leader) collapse_done(srv, p->collapse, hctx->collapse, con);
+		}
+
 		con->file_finished = 1;
 
 		http_chunk_append_mem(srv, con, NULL, 0);
@@ -748,9 +2099,23 @@ static int proxy_demux_response(server *srv, handler_ctx *hctx) {
 }
 
 
+/* drop a stale keep-alive connection, the request goes out on a new one */
+static void proxy_reconnect(server *srv, handler_ctx *hctx) {
+	fdevent_event_del(srv->ev, &(hctx->fde_ndx), hctx->fd);
+	fdevent_unregister(srv->ev, hctx->fd);
+	close(hctx->fd);
+	srv->cur_fds--;
+
+	hctx->fd = -1;
+	hctx->reused = 0;
+
+	proxy_set_state(srv, hctx, PROXY_STATE_INIT);
+}
+
 static handler_t proxy_write_request(server *srv, handler_ctx *hctx) {
 	data_proxy *host= hctx->host;
 	connection *con   = hctx->remote_conn;
+	plugin_data *p    = hctx->plugin_data;
 
 	int ret;
 
@@ -764,12 +2129,28 @@ static handler_t proxy_write_request(server *srv, handler_ctx *hctx) {
 		/* connect failed ? */
 		if (-1 == hctx->fde_ndx) return HANDLER_ERROR;
 
-		/* wait */
-		return HANDLER_WAIT_FOR_EVENT;
+		/* wait */
+		return HANDLER_WAIT_FOR_EVENT;
+
+		break;
+
+	case PROXY_STATE_INIT:
+		if (hctx->keep_alive && -1 != (hctx->fd = proxy_pool_idle_get(srv, hctx->pool))) {
+			/* an idle connection, already counted in cur_fds */
+			hctx->fde_ndx = -1;
+			hctx->reused = 1;
+
+			fdevent_register(srv->ev, hctx->fd, proxy_handle_fdevent, hctx);
+
+			if (p->conf.debug) {
+				log_error_write(srv, __FILE__, __LINE__, "sbdd",
+						"proxy - reusing connection to", host->host, host->port, hctx->fd);
+			}
 
-		break;
+			proxy_set_state(srv, hctx, PROXY_STATE_PREPARE_WRITE);
+			return proxy_write_request(srv, hctx);
+		}
 
-	case PROXY_STATE_INIT:
 #if defined(HAVE_IPV6) && defined(HAVE_INET_PTON)
 		if (strstr(host->host->ptr,":")) {
 		    if (-1 == (hctx->fd = socket(AF_INET6, SOCK_STREAM, 0))) {
@@ -819,7 +2200,8 @@ static handler_t proxy_write_request(server *srv, handler_ctx *hctx) {
 		/* fall through */
 
 	case PROXY_STATE_PREPARE_WRITE:
-		proxy_create_env(srv, hctx);
+		/* a retry after a stale keep-alive connection still has the request */
+		if (0 == hctx->wb->bytes_in) proxy_create_env(srv, hctx);
 
 		proxy_set_state(srv, hctx, PROXY_STATE_WRITE);
 
@@ -829,6 +2211,13 @@ static handler_t proxy_write_request(server *srv, handler_ctx *hctx) {
 
 		chunkqueue_remove_finished_chunks(hctx->wb);
 
+		if (ret < 0 && hctx->reused && hctx->wb->bytes_out == 0) {
+			/* the backend closed the idle connection, nothing is lost yet */
+			proxy_reconnect(srv, hctx);
+
+			return proxy_write_request(srv, hctx);
+		}
+
 		if (-1 == ret) { /* error on our side */
 			log_error_write(srv, __FILE__, __LINE__, "ssd", "write failed:", strerror(errno), errno);
 
@@ -868,9 +2257,24 @@ static int mod_proxy_patch_connection(server *srv, connection *con, plugin_data
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(extensions);
 	PATCH(debug);
 	PATCH(balance);
+	PATCH(keep_alive);
+	PATCH(keep_alive_max_idle);
+	PATCH(keep_alive_idle_timeout);
+	PATCH(max_connections);
+	PATCH(hash_key);
+	PATCH(hash_cookie);
+	PATCH(cache);
+	PATCH(collapse);
+	PATCH(collapse_timeout);
+	PATCH(response_buffer);
+	PATCH(response_spool);
+	PATCH(splice);
+	PATCH(allow_xsendfile);
 
 	/* skip the first, the global context */
 	for (i = 1; i < srv->config_context->used; i++) {
@@ -890,14 +2294,43 @@ static int mod_proxy_patch_connection(server *srv, connection *con, plugin_data
 				PATCH(debug);
 			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("proxy.balance"))) {
 				PATCH(balance);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("proxy.keep-alive"))) {
+				PATCH(keep_alive);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("proxy.keep-alive-max-idle"))) {
+				PATCH(keep_alive_max_idle);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("proxy.keep-alive-idle-timeout"))) {
+				PATCH(keep_alive_idle_timeout);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("proxy.max-connections"))) {
+				PATCH(max_connections);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("proxy.hash-key"))) {
+				PATCH(hash_key);
+				PATCH(hash_cookie);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("proxy.cache"))) {
+				PATCH(cache);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("proxy.collapse"))) {
+				PATCH(collapse);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("proxy.collapse-timeout"))) {
+				PATCH(collapse_timeout);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("proxy.response-buffer"))) {
+				PATCH(response_buffer);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("proxy.response-spool"))) {
+				PATCH(response_spool);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("proxy.splice"))) {
+				PATCH(splice);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("proxy.allow-x-send-file"))) {
+				PATCH(allow_xsendfile);
 			}
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
 
+static handler_t proxy_collapse_follow(server *srv, plugin_data *p, handler_ctx *hctx);
+
 SUBREQUEST_FUNC(mod_proxy_handle_subrequest) {
 	plugin_data *p = p_d;
 
@@ -913,6 +2346,20 @@ SUBREQUEST_FUNC(mod_proxy_handle_subrequest) {
 	/* not my job */
 	if (con->mode != p->id) return HANDLER_GO_ON;
 
+	if (hctx->collapse && !hctx->collapse_leader) {
+		switch (proxy_collapse_follow(srv, p, hctx)) {
+		case HANDLER_WAIT_FOR_EVENT:
+			return HANDLER_WAIT_FOR_EVENT;
+		case HANDLER_FINISHED:
+			proxy_connection_close(srv, hctx);
+			return HANDLER_FINISHED;
+		default:
+			break;
+		}
+
+		host = hctx->host;
+	}
+
 	/* ok, create the request */
 	switch(proxy_write_request(srv, hctx)) {
 	case HANDLER_ERROR:
@@ -925,6 +2372,7 @@ SUBREQUEST_FUNC(mod_proxy_handle_subrequest) {
 		host->is_disabled = 1;
 		host->disable_ts = srv->cur_ts;
 
+		proxy_pool_flush(srv, hctx->pool);
 		proxy_connection_close(srv, hctx);
 
 		/* reset the enviroment and restart the sub-request */
@@ -960,165 +2408,479 @@ static handler_t proxy_handle_fdevent(server *srv, void *ctx, int revents) {
 	plugin_data *p    = hctx->plugin_data;
 
 
-	if ((revents & FDEVENT_IN) &&
-	    hctx->state == PROXY_STATE_READ) {
+	if ((revents & FDEVENT_IN) &&
+	    hctx->state == PROXY_STATE_READ) {
+
+		if (p->conf.debug) {
+			log_error_write(srv, __FILE__, __LINE__, "sd",
+					"proxy: fdevent-in", hctx->state);
+		}
+
+		switch (proxy_demux_response(srv, hctx)) {
+		case 0:
+			if (proxy_response_blocked(hctx)) {
+				/* mod_proxy_handle_joblist() continues when the client took some of it */
+				fdevent_event_del(srv->ev, &(hctx->fde_ndx), hctx->fd);
+				hctx->blocked = 1;
+
+				if (p->conf.debug) {
+					log_error_write(srv, __FILE__, __LINE__, "sd",
+							"proxy - client is slow, stop reading from the backend:", hctx->fd);
+				}
+			}
+			break;
+		case 1:
+			/* we are done */
+			proxy_connection_close(srv, hctx);
+
+			joblist_append(srv, con);
+			return HANDLER_FINISHED;
+		case 2:
+			/* the request has no body, send it again on a new connection */
+			if (p->conf.debug) {
+				log_error_write(srv, __FILE__, __LINE__, "sbd",
+						"proxy - reused connection closed, retrying", hctx->host->host, hctx->host->port);
+			}
+
+			proxy_reconnect(srv, hctx);
+			chunkqueue_reset(hctx->wb);
+
+			return mod_proxy_handle_subrequest(srv, con, p);
+		case -1:
+			if (con->file_started == 0) {
+				/* nothing has been send out yet, send a 500 (or what the parser found) */
+				connection_set_state(srv, con, CON_STATE_HANDLE_REQUEST);
+				if (0 == con->http_status) con->http_status = 500;
+				con->mode = DIRECT;
+			} else {
+				/* response might have been already started, kill the connection */
+				connection_set_state(srv, con, CON_STATE_ERROR);
+			}
+
+			joblist_append(srv, con);
+			return HANDLER_FINISHED;
+		}
+	}
+
+	if (revents & FDEVENT_OUT) {
+		if (p->conf.debug) {
+			log_error_write(srv, __FILE__, __LINE__, "sd",
+					"proxy: fdevent-out", hctx->state);
+		}
+
+		if (hctx->state == PROXY_STATE_CONNECT) {
+			int socket_error;
+			socklen_t socket_error_len = sizeof(socket_error);
+
+			/* we don't need it anymore */
+			fdevent_event_del(srv->ev, &(hctx->fde_ndx), hctx->fd);
+			hctx->fde_ndx = -1;
+
+			/* try to finish the connect() */
+			if (0 != getsockopt(hctx->fd, SOL_SOCKET, SO_ERROR, &socket_error, &socket_error_len)) {
+				log_error_write(srv, __FILE__, __LINE__, "ss",
+					"getsockopt failed:", strerror(errno));
+
+				joblist_append(srv, con);
+				return HANDLER_FINISHED;
+			}
+			if (socket_error != 0) {
+				log_error_write(srv, __FILE__, __LINE__, "ss",
+					"establishing connection failed:", strerror(socket_error),
+					"port:", hctx->host->port);
+
+				joblist_append(srv, con);
+				return HANDLER_FINISHED;
+			}
+			if (p->conf.debug) {
+				log_error_write(srv, __FILE__, __LINE__,  "s", "proxy - connect - delayed success");
+			}
+
+			proxy_set_state(srv, hctx, PROXY_STATE_PREPARE_WRITE);
+		}
+
+		if (hctx->state == PROXY_STATE_PREPARE_WRITE ||
+		    hctx->state == PROXY_STATE_WRITE) {
+			/* we are allowed to send something out
+			 *
+			 * 1. after a just finished connect() call
+			 * 2. in a unfinished write() call (long POST request)
+			 */
+			return mod_proxy_handle_subrequest(srv, con, p);
+		} else {
+			log_error_write(srv, __FILE__, __LINE__, "sd",
+					"proxy: out", hctx->state);
+		}
+	}
+
+	/* perhaps this issue is already handled */
+	if (revents & FDEVENT_HUP) {
+		if (p->conf.debug) {
+			log_error_write(srv, __FILE__, __LINE__, "sd",
+					"proxy: fdevent-hup", hctx->state);
+		}
+
+		if (hctx->state == PROXY_STATE_CONNECT) {
+			/* connect() -> EINPROGRESS -> HUP */
+
+			/**
+			 * what is proxy is doing if it can't reach the next hop ?
+			 *
+			 */
+
+			if (hctx->host) {
+				hctx->host->is_disabled = 1;
+				hctx->host->disable_ts = srv->cur_ts;
+				log_error_write(srv, __FILE__, __LINE__,  "sbdd", "proxy-server disabled:",
+						hctx->host->host,
+						hctx->host->port,
+						hctx->fd);
+
+				/* disable this server */
+				hctx->host->is_disabled = 1;
+				hctx->host->disable_ts = srv->cur_ts;
+
+				proxy_pool_flush(srv, hctx->pool);
+				proxy_connection_close(srv, hctx);
+
+				/* reset the enviroment and restart the sub-request */
+				buffer_reset(con->physical.path);
+				con->mode = DIRECT;
+
+				joblist_append(srv, con);
+			} else {
+				proxy_connection_close(srv, hctx);
+				joblist_append(srv, con);
+
+				con->mode = DIRECT;
+				con->http_status = 503;
+			}
+
+			return HANDLER_FINISHED;
+		}
+
+		if (!con->file_started) {
+			/* hangup before the response header, there is nothing to send */
+			log_error_write(srv, __FILE__, __LINE__, "sbd",
+					"proxy - no response header, connection closed by", hctx->host->host, hctx->host->port);
+
+			proxy_connection_close(srv, hctx);
+			connection_set_state(srv, con, CON_STATE_HANDLE_REQUEST);
+			con->http_status = 502;
+			con->mode = DIRECT;
+			joblist_append(srv, con);
+
+			return HANDLER_FINISHED;
+		}
+
+		if (con->file_started && !con->file_finished &&
+		    hctx->body_state != PROXY_BODY_EOF && !hctx->body_done) {
+			/* the response was cut short, don't pretend it is complete */
+			log_error_write(srv, __FILE__, __LINE__, "sbd",
+					"proxy - response incomplete, connection closed by", hctx->host->host, hctx->host->port);
+
+			proxy_connection_close(srv, hctx);
+			connection_set_state(srv, con, CON_STATE_ERROR);
+			joblist_append(srv, con);
+
+			return HANDLER_FINISHED;
+		}
+
+		if (!con->file_finished) {
+			http_chunk_append_mem(srv, con, NULL, 0);
+		}
+
+		con->file_finished = 1;
+		proxy_connection_close(srv, hctx);
+		joblist_append(srv, con);
+	} else if (revents & FDEVENT_ERR) {
+		/* kill all connections to the proxy process */
+
+		log_error_write(srv, __FILE__, __LINE__, "sd", "proxy-FDEVENT_ERR, but no HUP", revents);
+
+		con->file_finished = 1;
+		joblist_append(srv, con);
+		proxy_connection_close(srv, hctx);
+	}
+
+	return HANDLER_FINISHED;
+}
+
+static ketama_ring *proxy_ring_get(plugin_data *p, data_array *extension) {
+	proxy_ring *r;
+	size_t k;
+
+	for (r = p->rings; r; r = r->next) {
+		if (r->extension == extension) return r->ring;
+	}
+
+	r = calloc(1, sizeof(*r));
+	r->extension = extension;
+	r->ring = ketama_init();
+
+	for (k = 0; k < extension->value->used; k++) {
+		data_proxy *host = (data_proxy *)extension->value->data[k];
+		char name[256];
+		int len;
+
+		len = snprintf(name, sizeof(name), "%s:%u", host->host->used ? host->host->ptr : "", host->port);
+		if (len >= (int)sizeof(name)) len = sizeof(name) - 1;
+
+		ketama_add(r->ring, name, len, k);
+	}
+	ketama_sort(r->ring);
+
+	r->next = p->rings;
+	p->rings = r;
+
+	return r->ring;
+}
+
+typedef struct {
+	plugin_data *p;
+	data_array *extension;
+} proxy_ring_ctx;
+
+static int proxy_host_is_available(plugin_data *p, data_proxy *host);
+
+static int proxy_ring_host_is_up(void *ctx, size_t ndx) {
+	proxy_ring_ctx *rc = ctx;
+
+	return proxy_host_is_available(rc->p, (data_proxy *)rc->extension->value->data[ndx]);
+}
+
+static int proxy_host_is_available(plugin_data *p, data_proxy *host) {
+	if (host->is_disabled) return 0;
+
+	if (p->conf.max_connections > 0 &&
+	    proxy_pool_get(p, host)->active >= p->conf.max_connections) return 0;
+
+	return 1;
+}
+
+/* some host is up, but all of them are at the connection limit */
+static int proxy_extension_is_busy(data_array *extension) {
+	size_t k;
+
+	for (k = 0; k < extension->value->used; k++) {
+		if (!((data_proxy *)extension->value->data[k])->is_disabled) return 1;
+	}
+
+	return 0;
+}
+
+/* the index of a host of extension which takes the request, -1 if none is available */
+static int proxy_select_host(server *srv, plugin_data *p, connection *con, data_array *extension) {
+	int max_usage = INT_MAX;
+	int ndx = -1;
+	size_t k;
+
+	if (extension->value->used == 1) {
+		if (!proxy_host_is_available(p, (data_proxy *)extension->value->data[0])) {
+			ndx = -1;
+		} else {
+			ndx = 0;
+		}
+	} else if (extension->value->used != 0) switch(p->conf.balance) {
+	case PROXY_BALANCE_HASH: {
+		/* consistent hashing, the keys of a host which is down move to the next one on the ring */
+		proxy_ring_ctx rc;
+		uint32_t hash;
+
+		rc.p = p;
+		rc.extension = extension;
+
+		hash = ketama_hash_request(con, p->conf.hash_key, p->conf.hash_cookie);
+		ndx = ketama_get(proxy_ring_get(p, extension), hash, proxy_ring_host_is_up, &rc);
+
+		if (p->conf.debug) {
+			log_error_write(srv, __FILE__, __LINE__,  "sbsdsd",
+					"proxy - used hash balancing for", con->uri.path,
+					"hash:", hash, "host:", ndx);
+		}
+
+		break;
+	}
+	case PROXY_BALANCE_FAIR:
+		/* fair balancing */
+		if (p->conf.debug) {
+			log_error_write(srv, __FILE__, __LINE__,  "s",
+					"proxy - used fair balancing");
+		}
+
+		for (k = 0, ndx = -1, max_usage = INT_MAX; k < extension->value->used; k++) {
+			data_proxy *host = (data_proxy *)extension->value->data[k];
+
+			if (!proxy_host_is_available(p, host)) continue;
+
+			if (host->usage < max_usage) {
+				max_usage = host->usage;
+
+				ndx = k;
+			}
+		}
+
+		break;
+	case PROXY_BALANCE_RR: {
+		data_proxy *host;
 
+		/* round robin */
 		if (p->conf.debug) {
-			log_error_write(srv, __FILE__, __LINE__, "sd",
-					"proxy: fdevent-in", hctx->state);
+			log_error_write(srv, __FILE__, __LINE__,  "s",
+					"proxy - used round-robin balancing");
 		}
 
-		switch (proxy_demux_response(srv, hctx)) {
-		case 0:
-			break;
-		case 1:
-			/* we are done */
-			proxy_connection_close(srv, hctx);
+		/* just to be sure */
+		assert(extension->value->used < INT_MAX);
 
-			joblist_append(srv, con);
-			return HANDLER_FINISHED;
-		case -1:
-			if (con->file_started == 0) {
-				/* nothing has been send out yet, send a 500 */
-				connection_set_state(srv, con, CON_STATE_HANDLE_REQUEST);
-				con->http_status = 500;
-				con->mode = DIRECT;
-			} else {
-				/* response might have been already started, kill the connection */
-				connection_set_state(srv, con, CON_STATE_ERROR);
+		host = (data_proxy *)extension->value->data[0];
+
+		/* Use last_used_ndx from first host in list */
+		k = host->last_used_ndx;
+		ndx = k + 1; /* use next host after the last one */
+		if (ndx < 0) ndx = 0;
+
+		/* Search first active host after last_used_ndx */
+		while ( ndx < (int) extension->value->used
+				&& !proxy_host_is_available(p, host = (data_proxy *)extension->value->data[ndx])) ndx++;
+
+		if (ndx >= (int) extension->value->used) {
+			/* didn't found a higher id, wrap to the start */
+			for (ndx = 0; ndx <= (int) k; ndx++) {
+				host = (data_proxy *)extension->value->data[ndx];
+				if (proxy_host_is_available(p, host)) break;
 			}
 
-			joblist_append(srv, con);
-			return HANDLER_FINISHED;
+			/* No active host found */
+			if (!proxy_host_is_available(p, host)) ndx = -1;
 		}
+
+		/* Save new index for next round */
+		((data_proxy *)extension->value->data[0])->last_used_ndx = ndx;
+
+		break;
 	}
+	case PROXY_BALANCE_EWMA: {
+		/* power of two choices on load times latency */
+		int n, a, b;
+		double now;
 
-	if (revents & FDEVENT_OUT) {
-		if (p->conf.debug) {
-			log_error_write(srv, __FILE__, __LINE__, "sd",
-					"proxy: fdevent-out", hctx->state);
+		for (k = 0, n = 0; k < extension->value->used; k++) {
+			if (proxy_host_is_available(p, (data_proxy *)extension->value->data[k])) n++;
 		}
 
-		if (hctx->state == PROXY_STATE_CONNECT) {
-			int socket_error;
-			socklen_t socket_error_len = sizeof(socket_error);
+		ndx = -1;
+		if (n == 0) break;
 
-			/* we don't need it anymore */
-			fdevent_event_del(srv->ev, &(hctx->fde_ndx), hctx->fd);
-			hctx->fde_ndx = -1;
+		/* the a-th and the b-th available host */
+		a = rand() % n;
+		b = (n > 1) ? rand() % (n - 1) : a;
+		if (n > 1 && b >= a) b++;
 
-			/* try to finish the connect() */
-			if (0 != getsockopt(hctx->fd, SOL_SOCKET, SO_ERROR, &socket_error, &socket_error_len)) {
-				log_error_write(srv, __FILE__, __LINE__, "ss",
-					"getsockopt failed:", strerror(errno));
+		now = ewma_now();
 
-				joblist_append(srv, con);
-				return HANDLER_FINISHED;
-			}
-			if (socket_error != 0) {
-				log_error_write(srv, __FILE__, __LINE__, "ss",
-					"establishing connection failed:", strerror(socket_error),
-					"port:", hctx->host->port);
+		for (k = 0, n = 0; k < extension->value->used; k++) {
+			data_proxy *host = (data_proxy *)extension->value->data[k];
 
-				joblist_append(srv, con);
-				return HANDLER_FINISHED;
-			}
-			if (p->conf.debug) {
-				log_error_write(srv, __FILE__, __LINE__,  "s", "proxy - connect - delayed success");
-			}
+			if (!proxy_host_is_available(p, host)) continue;
 
-			proxy_set_state(srv, hctx, PROXY_STATE_PREPARE_WRITE);
-		}
+			if (n == a || n == b) {
+				data_proxy *other = (ndx == -1) ? NULL : (data_proxy *)extension->value->data[ndx];
 
-		if (hctx->state == PROXY_STATE_PREPARE_WRITE ||
-		    hctx->state == PROXY_STATE_WRITE) {
-			/* we are allowed to send something out
-			 *
-			 * 1. after a just finished connect() call
-			 * 2. in a unfinished write() call (long POST request)
-			 */
-			return mod_proxy_handle_subrequest(srv, con, p);
-		} else {
-			log_error_write(srv, __FILE__, __LINE__, "sd",
-					"proxy: out", hctx->state);
+				if (other == NULL ||
+				    ewma_cost(&host->ewma, now, host->usage) < ewma_cost(&other->ewma, now, other->usage)) {
+					ndx = k;
+				}
+			}
+
+			n++;
 		}
-	}
 
-	/* perhaps this issue is already handled */
-	if (revents & FDEVENT_HUP) {
 		if (p->conf.debug) {
-			log_error_write(srv, __FILE__, __LINE__, "sd",
-					"proxy: fdevent-hup", hctx->state);
+			log_error_write(srv, __FILE__, __LINE__,  "sd",
+					"proxy - used peak-ewma balancing, host:", ndx);
 		}
 
-		if (hctx->state == PROXY_STATE_CONNECT) {
-			/* connect() -> EINPROGRESS -> HUP */
+		break;
+	}
+	default:
+		break;
+	}
 
-			/**
-			 * what is proxy is doing if it can't reach the next hop ?
-			 *
-			 */
+	return ndx;
+}
 
-			if (hctx->host) {
-				hctx->host->is_disabled = 1;
-				hctx->host->disable_ts = srv->cur_ts;
-				log_error_write(srv, __FILE__, __LINE__,  "sbdd", "proxy-server disabled:",
-						hctx->host->host,
-						hctx->host->port,
-						hctx->fd);
+static void proxy_host_assign(plugin_data *p, handler_ctx *hctx, data_proxy *host) {
+	hctx->host = host;
+	host->usage++;
 
-				/* disable this server */
-				hctx->host->is_disabled = 1;
-				hctx->host->disable_ts = srv->cur_ts;
+	hctx->pool = proxy_pool_get(p, host);
+	hctx->pool->active++;
 
-				proxy_connection_close(srv, hctx);
+	if (p->conf.balance == PROXY_BALANCE_EWMA) hctx->ewma_start = ewma_now();
 
-				/* reset the enviroment and restart the sub-request */
-				buffer_reset(con->physical.path);
-				con->mode = DIRECT;
+	hctx->keep_alive = p->conf.keep_alive;
+	hctx->keep_alive_max_idle = p->conf.keep_alive_max_idle;
+	hctx->keep_alive_idle_timeout = p->conf.keep_alive_idle_timeout;
 
-				joblist_append(srv, con);
-			} else {
-				proxy_connection_close(srv, hctx);
-				joblist_append(srv, con);
+	hctx->response_buffer = (off_t)p->conf.response_buffer * 1024;
+	hctx->response_spool = (off_t)p->conf.response_spool * 1024;
 
-				con->mode = DIRECT;
-				con->http_status = 503;
-			}
+	hctx->splice = p->conf.splice;
+	hctx->allow_xsendfile = p->conf.allow_xsendfile;
+}
 
-			return HANDLER_FINISHED;
-		}
+/* a follower: wait for the leader, use its response or send the request ourself */
+static handler_t proxy_collapse_follow(server *srv, plugin_data *p, handler_ctx *hctx) {
+	connection *con = hctx->remote_conn;
+	proxy_cache_entry *e;
+	int ndx;
 
-		if (!con->file_finished) {
-			http_chunk_append_mem(srv, con, NULL, 0);
-		}
+	switch (hctx->collapse->state) {
+	case COLLAPSE_RUNNING:
+		return HANDLER_WAIT_FOR_EVENT;
+	case COLLAPSE_DONE:
+		collapse_serve(srv, con, hctx->collapse);
+		return HANDLER_FINISHED;
+	default:
+		break;
+	}
 
-		con->file_finished = 1;
-		proxy_connection_close(srv, hctx);
-		joblist_append(srv, con);
-	} else if (revents & FDEVENT_ERR) {
-		/* kill all connections to the proxy process */
+	collapse_leave(srv, p->collapse, hctx->collapse, con);
+	hctx->collapse = NULL;
 
-		log_error_write(srv, __FILE__, __LINE__, "sd", "proxy-FDEVENT_ERR, but no HUP", revents);
+	/* the leader revalidated the cached response */
+	if (p->conf.cache && 1 == proxy_cache_request(con, p->parse_response) &&
+	    NULL != (e = proxy_cache_lookup(p->cache, con, p->parse_response)) &&
+	    e->expires > srv->cur_ts) {
+		proxy_cache_serve(srv, con, e);
+		return HANDLER_FINISHED;
+	}
 
-		con->file_finished = 1;
-		joblist_append(srv, con);
-		proxy_connection_close(srv, hctx);
+	if (-1 == (ndx = proxy_select_host(srv, p, con, hctx->extension))) {
+		con->http_status = (p->conf.max_connections > 0 && proxy_extension_is_busy(hctx->extension)) ? 503 : 500;
+		/* the core sends the error page */
+		con->mode = DIRECT;
+		return HANDLER_FINISHED;
 	}
 
-	return HANDLER_FINISHED;
+	proxy_host_assign(p, hctx, (data_proxy *)hctx->extension->value->data[ndx]);
+
+	return HANDLER_GO_ON;
 }
 
 static handler_t mod_proxy_check_extension(server *srv, connection *con, void *p_d) {
 	plugin_data *p = p_d;
 	size_t s_len;
-	unsigned long last_max = ULONG_MAX;
-	int max_usage = INT_MAX;
 	int ndx = -1;
 	size_t k;
 	buffer *fn;
 	data_array *extension = NULL;
 	size_t path_info_offset;
+	int cache_use;
+	buffer *cache_key = NULL;
+	proxy_cache_entry *cache_stale = NULL;
+	collapse_group *collapse = NULL;
 
 	if (con->mode != DIRECT) return HANDLER_GO_ON;
 
@@ -1183,112 +2945,59 @@ static handler_t mod_proxy_check_extension(server *srv, connection *con, void *p
 		log_error_write(srv, __FILE__, __LINE__,  "s", "proxy - ext found");
 	}
 
-	if (extension->value->used == 1) {
-		if ( ((data_proxy *)extension->value->data[0])->is_disabled ) {
-			ndx = -1;
-		} else {
-			ndx = 0;
-		}
-	} else if (extension->value->used != 0) switch(p->conf.balance) {
-	case PROXY_BALANCE_HASH:
-		/* hash balancing */
-
-		if (p->conf.debug) {
-			log_error_write(srv, __FILE__, __LINE__,  "sd",
-					"proxy - used hash balancing, hosts:", extension->value->used);
-		}
-
-		for (k = 0, ndx = -1, last_max = ULONG_MAX; k < extension->value->used; k++) {
-			data_proxy *host = (data_proxy *)extension->value->data[k];
-			unsigned long cur_max;
-
-			if (host->is_disabled) continue;
-
-			cur_max = generate_crc32c(CONST_BUF_LEN(con->uri.path)) +
-				generate_crc32c(CONST_BUF_LEN(host->host)) + /* we can cache this */
-				generate_crc32c(CONST_BUF_LEN(con->uri.authority));
+	if (p->conf.cache && -1 != (cache_use = proxy_cache_request(con, p->parse_response))) {
+		proxy_cache_entry *e = cache_use ? proxy_cache_lookup(p->cache, con, p->parse_response) : NULL;
 
+		if (e && e->expires > srv->cur_ts) {
+			/* fresh, the backend isn't needed */
 			if (p->conf.debug) {
-				log_error_write(srv, __FILE__, __LINE__,  "sbbbd",
-						"proxy - election:",
-						con->uri.path,
-						host->host,
-						con->uri.authority,
-						cur_max);
+				log_error_write(srv, __FILE__, __LINE__,  "sb",
+						"proxy - cache hit:", p->parse_response);
 			}
 
-			if ((last_max == ULONG_MAX) || /* first round */
-		   	    (cur_max > last_max)) {
-				last_max = cur_max;
-
-				ndx = k;
-			}
-		}
+			proxy_cache_serve(srv, con, e);
 
-		break;
-	case PROXY_BALANCE_FAIR:
-		/* fair balancing */
-		if (p->conf.debug) {
-			log_error_write(srv, __FILE__, __LINE__,  "s",
-					"proxy - used fair balancing");
+			return HANDLER_FINISHED;
 		}
 
-		for (k = 0, ndx = -1, max_usage = INT_MAX; k < extension->value->used; k++) {
-			data_proxy *host = (data_proxy *)extension->value->data[k];
-
-			if (host->is_disabled) continue;
-
-			if (host->usage < max_usage) {
-				max_usage = host->usage;
-
-				ndx = k;
-			}
+		/* stale, ask the backend if it changed unless the client asks itself */
+		if (e && (e->etag || e->last_modified) &&
+		    !con->request.http_if_none_match && !con->request.http_if_modified_since) {
+			cache_stale = e;
 		}
 
-		break;
-	case PROXY_BALANCE_RR: {
-		data_proxy *host;
+		cache_key = p->parse_response;
+	}
 
-		/* round robin */
-		if (p->conf.debug) {
-			log_error_write(srv, __FILE__, __LINE__,  "s",
-					"proxy - used round-robin balancing");
-		}
+	if (p->conf.collapse && 0 == collapse_key(con, p->collapse_key)) {
+		int leader;
 
-		/* just to be sure */
-		assert(extension->value->used < INT_MAX);
+		collapse = collapse_join(srv, p->collapse, con, p->collapse_key, p->conf.collapse_timeout, &leader);
 
-		host = (data_proxy *)extension->value->data[0];
+		if (collapse && !leader) {
+			/* wait for the response of the leader, the host is picked if it fails */
+			handler_ctx *hctx = handler_ctx_init();
 
-		/* Use last_used_ndx from first host in list */
-		k = host->last_used_ndx;
-		ndx = k + 1; /* use next host after the last one */
-		if (ndx < 0) ndx = 0;
+			hctx->path_info_offset = path_info_offset;
+			hctx->remote_conn      = con;
+			hctx->plugin_data      = p;
+			hctx->extension        = extension;
+			hctx->collapse         = collapse;
 
-		/* Search first active host after last_used_ndx */
-		while ( ndx < (int) extension->value->used
-				&& (host = (data_proxy *)extension->value->data[ndx])->is_disabled ) ndx++;
+			con->plugin_ctx[p->id] = hctx;
+			con->mode = p->id;
 
-		if (ndx >= (int) extension->value->used) {
-			/* didn't found a higher id, wrap to the start */
-			for (ndx = 0; ndx <= (int) k; ndx++) {
-				host = (data_proxy *)extension->value->data[ndx];
-				if (!host->is_disabled) break;
+			if (p->conf.debug) {
+				log_error_write(srv, __FILE__, __LINE__,  "sb",
+						"proxy - waiting for the response of another request:", p->collapse_key);
 			}
 
-			/* No active host found */
-			if (host->is_disabled) ndx = -1;
+			return HANDLER_GO_ON;
 		}
-
-		/* Save new index for next round */
-		((data_proxy *)extension->value->data[0])->last_used_ndx = ndx;
-
-		break;
-	}
-	default:
-		break;
 	}
 
+	ndx = proxy_select_host(srv, p, con, extension);
+
 	/* found a server */
 	if (ndx != -1) {
 		data_proxy *host = (data_proxy *)extension->value->data[ndx];
@@ -1305,11 +3014,26 @@ static handler_t mod_proxy_check_extension(server *srv, connection *con, void *p
 		hctx->path_info_offset = path_info_offset;
 		hctx->remote_conn      = con;
 		hctx->plugin_data      = p;
-		hctx->host             = host;
+		hctx->extension        = extension;
 
 		con->plugin_ctx[p->id] = hctx;
 
-		host->usage++;
+		proxy_host_assign(p, hctx, host);
+
+		if (collapse) {
+			hctx->collapse = collapse;
+			hctx->collapse_leader = 1;
+		}
+
+		if (cache_key) {
+			hctx->cache_key = buffer_init_buffer(cache_key);
+
+			if (cache_stale) {
+				hctx->cache_stale = cache_stale;
+				hctx->cache_revalidate = 1;
+				cache_stale->refs++;
+			}
+		}
 
 		con->mode = p->id;
 
@@ -1320,6 +3044,21 @@ static handler_t mod_proxy_check_extension(server *srv, connection *con, void *p
 		}
 
 		return HANDLER_GO_ON;
+	}
+
+	if (collapse) collapse_leave(srv, p->collapse, collapse, con);
+
+	if (p->conf.max_connections > 0 && proxy_extension_is_busy(extension)) {
+		/* all working hosts are at proxy.max-connections */
+		con->http_status = 503;
+
+		if (p->conf.debug) {
+			log_error_write(srv, __FILE__, __LINE__,  "sb",
+					"proxy - all hosts busy for:",
+					fn);
+		}
+
+		return HANDLER_FINISHED;
 	} else {
 		/* no handler found */
 		con->http_status = 500;
@@ -1379,9 +3118,35 @@ TRIGGER_FUNC(mod_proxy_trigger) {
 		}
 	}
 
+	/* the followers of slow requests ask the backend themselves */
+	collapse_timeout(srv, p->collapse);
+
+	/* close keep-alive connections nobody wanted for a while */
+	{
+		proxy_pool *pool;
+
+		for (pool = p->pools; pool; pool = pool->next) {
+			proxy_pool_timeout(srv, pool);
+		}
+	}
+
 	return HANDLER_GO_ON;
 }
 
+JOBLIST_FUNC(mod_proxy_handle_joblist) {
+	plugin_data *p = p_d;
+	handler_ctx *hctx = con->plugin_ctx[p->id];
+
+	if (hctx == NULL || !hctx->blocked) return HANDLER_GO_ON;
+
+	/* the client took enough of the response, read the rest */
+	if (hctx->fd != -1 && hctx->state == PROXY_STATE_READ && !proxy_response_blocked(hctx)) {
+		fdevent_event_set(srv->ev, &(hctx->fde_ndx), hctx->fd, FDEVENT_IN);
+		hctx->blocked = 0;
+	}
+
+	return HANDLER_GO_ON;
+}
 
 int mod_proxy_plugin_init(plugin *p);
 int mod_proxy_plugin_init(plugin *p) {
@@ -1396,6 +3161,7 @@ int mod_proxy_plugin_init(plugin *p) {
 	p->handle_uri_clean        = mod_proxy_check_extension;
 	p->handle_subrequest       = mod_proxy_handle_subrequest;
 	p->handle_trigger          = mod_proxy_trigger;
+	p->handle_joblist          = mod_proxy_handle_joblist;
 
 	p->data         = NULL;
 
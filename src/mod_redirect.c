@@ -140,6 +140,8 @@ static int mod_redirect_patch_connection(server *srv, connection *con, plugin_da
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	p->conf.redirect = s->redirect;
 	p->conf.redirect_code = s->redirect_code;
 	p->conf.context = NULL;
@@ -165,6 +167,8 @@ static int mod_redirect_patch_connection(server *srv, connection *con, plugin_da
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #endif
@@ -184,7 +188,11 @@ static handler_t mod_redirect_uri_handler(server *srv, connection *con, void *p_
 
 	buffer_copy_string_buffer(p->match_buf, con->request.uri);
 
-	for (i = 0; i < p->conf.redirect->used; i++) {
+	li_pcre_prefilter_match(p->conf.redirect->prefilter, CONST_BUF_LEN(p->match_buf));
+
+	for (i = li_pcre_prefilter_next(p->conf.redirect->prefilter, 0);
+	     i < p->conf.redirect->used;
+	     i = li_pcre_prefilter_next(p->conf.redirect->prefilter, i + 1)) {
 		pcre *match;
 		pcre_extra *extra;
 		const char *pattern;
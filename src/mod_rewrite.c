@@ -12,6 +12,7 @@
 #ifdef HAVE_PCRE_H
 typedef struct {
 	pcre *key;
+	pcre_extra *key_extra;
 
 	buffer *value;
 
@@ -23,6 +24,8 @@ typedef struct {
 
 	size_t used;
 	size_t size;
+
+	li_pcre_prefilter *prefilter;
 } rewrite_rule_buffer;
 
 typedef struct {
@@ -64,6 +67,7 @@ static rewrite_rule_buffer *rewrite_rule_buffer_init(void) {
 	rewrite_rule_buffer *kvb;
 
 	kvb = calloc(1, sizeof(*kvb));
+	kvb->prefilter = li_pcre_prefilter_init();
 
 	return kvb;
 }
@@ -100,10 +104,17 @@ static int rewrite_rule_buffer_append(rewrite_rule_buffer *kvb, buffer *key, buf
 		return -1;
 	}
 
+	if (NULL == (kvb->ptr[kvb->used]->key_extra = li_pcre_study(kvb->ptr[kvb->used]->key, &errptr)) &&
+			errptr != NULL) {
+		return -1;
+	}
+
 	kvb->ptr[kvb->used]->value = buffer_init();
 	buffer_copy_string_buffer(kvb->ptr[kvb->used]->value, value);
 	kvb->ptr[kvb->used]->once = once;
 
+	li_pcre_prefilter_append(kvb->prefilter, kvb->used, key->ptr);
+
 	kvb->used++;
 
 	return 0;
@@ -114,12 +125,15 @@ static void rewrite_rule_buffer_free(rewrite_rule_buffer *kvb) {
 
 	for (i = 0; i < kvb->size; i++) {
 		if (kvb->ptr[i]->key) pcre_free(kvb->ptr[i]->key);
+		if (kvb->ptr[i]->key_extra) li_pcre_study_free(kvb->ptr[i]->key_extra);
 		if (kvb->ptr[i]->value) buffer_free(kvb->ptr[i]->value);
 		free(kvb->ptr[i]);
 	}
 
 	if (kvb->ptr) free(kvb->ptr);
 
+	li_pcre_prefilter_free(kvb->prefilter);
+
 	free(kvb);
 }
 
@@ -286,6 +300,8 @@ static int mod_rewrite_patch_connection(server *srv, connection *con, plugin_dat
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(rewrite);
 	PATCH(rewrite_NF);
 	p->conf.context = NULL;
@@ -327,6 +343,8 @@ static int mod_rewrite_patch_connection(server *srv, connection *con, plugin_dat
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 
@@ -362,8 +380,13 @@ static int process_rewrite_rules(server *srv, connection *con, plugin_data *p, r
 
 	buffer_copy_string_buffer(p->match_buf, con->request.uri);
 
-	for (i = 0; i < kvb->used; i++) {
+	li_pcre_prefilter_match(kvb->prefilter, CONST_BUF_LEN(p->match_buf));
+
+	for (i = li_pcre_prefilter_next(kvb->prefilter, 0);
+	     i < kvb->used;
+	     i = li_pcre_prefilter_next(kvb->prefilter, i + 1)) {
 		pcre *match;
+		pcre_extra *extra;
 		const char *pattern;
 		size_t pattern_len;
 		int n;
@@ -372,10 +395,11 @@ static int process_rewrite_rules(server *srv, connection *con, plugin_data *p, r
 		int ovec[N * 3];
 
 		match       = rule->key;
+		extra       = rule->key_extra;
 		pattern     = rule->value->ptr;
 		pattern_len = rule->value->used - 1;
 
-		if ((n = pcre_exec(match, NULL, p->match_buf->ptr, p->match_buf->used - 1, 0, 0, ovec, 3 * N)) < 0) {
+		if ((n = pcre_exec(match, extra, p->match_buf->ptr, p->match_buf->used - 1, 0, 0, ovec, 3 * N)) < 0) {
 			if (n != PCRE_ERROR_NOMATCH) {
 				log_error_write(srv, __FILE__, __LINE__, "sd",
 						"execution error while matching: ", n);
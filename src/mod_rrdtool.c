@@ -300,6 +300,8 @@ static int mod_rrd_patch_connection(server *srv, connection *con, plugin_data *p
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(path_rrdtool_bin);
 	PATCH(path_rrd);
 
@@ -330,6 +332,8 @@ static int mod_rrd_patch_connection(server *srv, connection *con, plugin_data *p
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
@@ -12,6 +12,7 @@
 #include "plugin.h"
 
 #include "inet_ntop_cache.h"
+#include "http_cgi.h"
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -22,6 +23,7 @@
 #include <ctype.h>
 #include <assert.h>
 #include <signal.h>
+#include <limits.h>
 
 #include <stdio.h>
 
@@ -30,6 +32,7 @@
 #endif
 
 #include "sys-socket.h"
+#include "ketama.h"
 
 #ifdef HAVE_SYS_UIO_H
 # include <sys/uio.h>
@@ -43,6 +46,15 @@
 
 enum {EOL_UNSET, EOL_N, EOL_RN};
 
+#define SCGI_ENV_ADD_CHECK(ret, srv, con) \
+	if (ret == -1) { \
+		log_error_write(srv, __FILE__, __LINE__, "s", \
+				"scgi: a key or value of the request is too large for the protocol of the backend"); \
+		con->http_status = 400; \
+		con->file_finished = 1; \
+		return -1; \
+	};
+
 /*
  *
  * TODO:
@@ -79,6 +91,19 @@ typedef struct scgi_proc {
 	} state;
 } scgi_proc;
 
+/*
+ * the variables which are the same for every request of a host,
+ * encoded once per server socket and server.tag
+ */
+typedef struct scgi_env_tpl {
+	server_socket *srv_sock;
+	buffer *server_tag;
+
+	buffer *env;
+
+	struct scgi_env_tpl *next;
+} scgi_env_tpl;
+
 typedef struct {
 	/* list of processes handling this extension
 	 * sorted by lowest load
@@ -214,6 +239,22 @@ typedef struct {
 	 */
 
 	unsigned short fix_root_path_name;
+
+	/*
+	 * If the backend includes X-LIGHTTPD-send-file in the response
+	 * we use the value as filename and ignore the content.
+	 *
+	 */
+	unsigned short allow_xsendfile;
+
+	/*
+	 * the protocol to the backend: SCGI or the binary packets of
+	 * uwsgi, modifier1 tells uWSGI which plugin handles the request
+	 *
+	 */
+	enum { SCGI_PROTOCOL_SCGI, SCGI_PROTOCOL_UWSGI } protocol;
+	unsigned short uwsgi_modifier1;
+
 	ssize_t load; /* replace by host->load */
 
 	size_t max_id; /* corresponds most of the time to
@@ -221,6 +262,8 @@ typedef struct {
 
 	only if a process is killed max_id waits for the process itself
 	to die and decrements its afterwards */
+
+	scgi_env_tpl *env_tpl;
 } scgi_extension_host;
 
 /*
@@ -246,6 +289,9 @@ typedef struct {
 	buffer *key; /* like .php */
 
 	int note_is_sent;
+
+	ketama_ring *ring; /* scgi.balance = "hash", built on first use */
+
 	scgi_extension_host **hosts;
 
 	size_t used;
@@ -264,6 +310,11 @@ typedef struct {
 	scgi_exts *exts;
 
 	int debug;
+
+	/* how a host of an extension is picked */
+	enum { SCGI_HOST_BALANCE_FAIR, SCGI_HOST_BALANCE_HASH } balance;
+	ketama_key_t hash_key;
+	buffer *hash_cookie;
 } plugin_config;
 
 typedef struct {
@@ -438,6 +489,13 @@ static void scgi_host_free(scgi_extension_host *h) {
 	scgi_process_free(h->first);
 	scgi_process_free(h->unused_procs);
 
+	while (h->env_tpl) {
+		scgi_env_tpl *t = h->env_tpl;
+		h->env_tpl = t->next;
+		buffer_free(t->env);
+		free(t);
+	}
+
 	free(h);
 
 }
@@ -470,6 +528,7 @@ static void scgi_extensions_free(scgi_exts *f) {
 		}
 
 		buffer_free(fe->key);
+		ketama_free(fe->ring);
 		free(fe->hosts);
 
 		free(fe);
@@ -596,6 +655,7 @@ FREE_FUNC(mod_scgi_free) {
 			}
 
 			scgi_extensions_free(s->exts);
+			buffer_free(s->hash_cookie);
 
 			free(s);
 		}
@@ -918,15 +978,22 @@ SETDEFAULTS_FUNC(mod_scgi_set_defaults) {
 	plugin_data *p = p_d;
 	data_unset *du;
 	size_t i = 0;
+	buffer *scgi_balance;
+	buffer *scgi_protocol;
 
 	config_values_t cv[] = {
 		{ "scgi.server",              NULL, T_CONFIG_LOCAL, T_CONFIG_SCOPE_CONNECTION },       /* 0 */
 		{ "scgi.debug",               NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },       /* 1 */
+		{ "scgi.balance",             NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },      /* 2 */
+		{ "scgi.hash-key",            NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },      /* 3 */
 		{ NULL,                          NULL, T_CONFIG_UNSET, T_CONFIG_SCOPE_UNSET }
 	};
 
 	p->config_storage = calloc(1, srv->config_context->used * sizeof(plugin_config *));
 
+	scgi_balance = buffer_init();
+	scgi_protocol = buffer_init();
+
 	for (i = 0; i < srv->config_context->used; i++) {
 		plugin_config *s;
 		array *ca;
@@ -934,14 +1001,43 @@ SETDEFAULTS_FUNC(mod_scgi_set_defaults) {
 		s = malloc(sizeof(plugin_config));
 		s->exts          = scgi_extensions_init();
 		s->debug         = 0;
+		s->hash_cookie   = buffer_init();
 
 		cv[0].destination = s->exts;
 		cv[1].destination = &(s->debug);
+		cv[2].destination = scgi_balance;
+		cv[3].destination = p->parse_response;
+
+		buffer_reset(scgi_balance);
+		buffer_reset(p->parse_response);
 
 		p->config_storage[i] = s;
 		ca = ((data_config *)srv->config_context->data[i])->value;
 
 		if (0 != config_insert_values_global(srv, ca, cv)) {
+			buffer_free(scgi_balance);
+			buffer_free(scgi_protocol);
+			return HANDLER_ERROR;
+		}
+
+		if (buffer_is_empty(scgi_balance) ||
+		    buffer_is_equal_string(scgi_balance, CONST_STR_LEN("fair"))) {
+			s->balance = SCGI_HOST_BALANCE_FAIR;
+		} else if (buffer_is_equal_string(scgi_balance, CONST_STR_LEN("hash"))) {
+			s->balance = SCGI_HOST_BALANCE_HASH;
+		} else {
+			log_error_write(srv, __FILE__, __LINE__, "sb",
+					"scgi.balance has to be one of: fair, hash, but not:", scgi_balance);
+			buffer_free(scgi_balance);
+			buffer_free(scgi_protocol);
+			return HANDLER_ERROR;
+		}
+
+		if (0 != ketama_key_parse(p->parse_response, &(s->hash_key), s->hash_cookie)) {
+			log_error_write(srv, __FILE__, __LINE__, "sb",
+					"scgi.hash-key has to be one of: uri, host, ip, cookie:<name>, but not:", p->parse_response);
+			buffer_free(scgi_balance);
+			buffer_free(scgi_protocol);
 			return HANDLER_ERROR;
 		}
 
@@ -1012,6 +1108,9 @@ SETDEFAULTS_FUNC(mod_scgi_set_defaults) {
 						{ "bin-environment",   NULL, T_CONFIG_ARRAY, T_CONFIG_SCOPE_CONNECTION },        /* 11 */
 						{ "bin-copy-environment", NULL, T_CONFIG_ARRAY, T_CONFIG_SCOPE_CONNECTION },     /* 12 */
 						{ "fix-root-scriptname",  NULL, T_CONFIG_BOOLEAN, T_CONFIG_SCOPE_CONNECTION },   /* 13 */
+						{ "allow-x-send-file", NULL, T_CONFIG_BOOLEAN, T_CONFIG_SCOPE_CONNECTION },      /* 14 */
+						{ "protocol",          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },       /* 15 */
+						{ "uwsgi-modifier1",   NULL, T_CONFIG_SHORT, T_CONFIG_SCOPE_CONNECTION },        /* 16 */
 
 
 						{ NULL,                NULL, T_CONFIG_UNSET, T_CONFIG_SCOPE_UNSET }
@@ -1035,6 +1134,10 @@ SETDEFAULTS_FUNC(mod_scgi_set_defaults) {
 					df->idle_timeout = 60;
 					df->disable_time = 60;
 					df->fix_root_path_name = 0;
+					df->allow_xsendfile = 0; /* handle X-LIGHTTPD-send-file */
+					df->protocol = SCGI_PROTOCOL_SCGI;
+					df->uwsgi_modifier1 = 0; /* WSGI */
+					buffer_reset(scgi_protocol);
 
 					fcv[0].destination = df->host;
 					fcv[1].destination = df->docroot;
@@ -1052,12 +1155,32 @@ SETDEFAULTS_FUNC(mod_scgi_set_defaults) {
 					fcv[11].destination = df->bin_env;
 					fcv[12].destination = df->bin_env_copy;
 					fcv[13].destination = &(df->fix_root_path_name);
+					fcv[14].destination = &(df->allow_xsendfile);
+					fcv[15].destination = scgi_protocol;
+					fcv[16].destination = &(df->uwsgi_modifier1);
 
 
 					if (0 != config_insert_values_internal(srv, da_host->value, fcv)) {
 						return HANDLER_ERROR;
 					}
 
+					if (buffer_is_empty(scgi_protocol) ||
+					    buffer_is_equal_string(scgi_protocol, CONST_STR_LEN("scgi"))) {
+						df->protocol = SCGI_PROTOCOL_SCGI;
+					} else if (buffer_is_equal_string(scgi_protocol, CONST_STR_LEN("uwsgi"))) {
+						df->protocol = SCGI_PROTOCOL_UWSGI;
+					} else {
+						log_error_write(srv, __FILE__, __LINE__, "sb",
+								"protocol has to be one of: scgi, uwsgi, but not:", scgi_protocol);
+						return HANDLER_ERROR;
+					}
+
+					if (df->uwsgi_modifier1 > 255) {
+						log_error_write(srv, __FILE__, __LINE__, "sd",
+								"uwsgi-modifier1 has to be between 0 and 255, not:", df->uwsgi_modifier1);
+						return HANDLER_ERROR;
+					}
+
 					if ((!buffer_is_empty(df->host) || df->port) &&
 					    !buffer_is_empty(df->unixsocket)) {
 						log_error_write(srv, __FILE__, __LINE__, "s",
@@ -1181,6 +1304,9 @@ SETDEFAULTS_FUNC(mod_scgi_set_defaults) {
 		}
 	}
 
+	buffer_free(scgi_balance);
+	buffer_free(scgi_protocol);
+
 	return HANDLER_GO_ON;
 }
 
@@ -1286,7 +1412,10 @@ static handler_t scgi_connection_reset(server *srv, connection *con, void *p_d)
 }
 
 
-static int scgi_env_add(buffer *env, const char *key, size_t key_len, const char *val, size_t val_len) {
+typedef int (*scgi_env_add_t)(buffer *env, const char *key, size_t key_len, const char *val, size_t val_len);
+
+/* SCGI: "<key>\0<value>\0" */
+static int scgi_env_add_scgi(buffer *env, const char *key, size_t key_len, const char *val, size_t val_len) {
 	size_t len;
 
 	if (!key || !val) return -1;
@@ -1305,6 +1434,78 @@ static int scgi_env_add(buffer *env, const char *key, size_t key_len, const char
 	return 0;
 }
 
+/* uwsgi: the length of the key as 16 bit little endian, the key, the same for the value */
+static int scgi_env_add_uwsgi(buffer *env, const char *key, size_t key_len, const char *val, size_t val_len) {
+	if (!key || !val) return -1;
+
+	if (key_len > USHRT_MAX || val_len > USHRT_MAX) return -1;
+
+	buffer_prepare_append(env, key_len + val_len + 4);
+
+	env->ptr[env->used++] = key_len & 0xff;
+	env->ptr[env->used++] = (key_len >> 8) & 0xff;
+	memcpy(env->ptr + env->used, key, key_len);
+	env->used += key_len;
+	env->ptr[env->used++] = val_len & 0xff;
+	env->ptr[env->used++] = (val_len >> 8) & 0xff;
+	memcpy(env->ptr + env->used, val, val_len);
+	env->used += val_len;
+
+	return 0;
+}
+
+static scgi_env_add_t scgi_env_add_func(scgi_extension_host *host) {
+	return host->protocol == SCGI_PROTOCOL_UWSGI ? scgi_env_add_uwsgi : scgi_env_add_scgi;
+}
+
+static scgi_env_tpl *scgi_env_tpl_get(scgi_extension_host *host, connection *con) {
+	scgi_env_tpl *t;
+	server_socket *srv_sock = con->srv_socket;
+	char buf[32];
+	scgi_env_add_t env_add_fn = scgi_env_add_func(host);
+
+	for (t = host->env_tpl; t; t = t->next) {
+		if (t->srv_sock == srv_sock && t->server_tag == con->conf.server_tag) return t;
+	}
+
+	t = calloc(1, sizeof(*t));
+	t->srv_sock = srv_sock;
+	t->server_tag = con->conf.server_tag;
+	t->env = buffer_init();
+
+	if (host->protocol == SCGI_PROTOCOL_SCGI) {
+		env_add_fn(t->env, CONST_STR_LEN("SCGI"), CONST_STR_LEN("1"));
+	}
+
+	if (buffer_is_empty(con->conf.server_tag)) {
+		env_add_fn(t->env, CONST_STR_LEN("SERVER_SOFTWARE"), CONST_STR_LEN(PACKAGE_DESC));
+	} else {
+		env_add_fn(t->env, CONST_STR_LEN("SERVER_SOFTWARE"), CONST_BUF_LEN(con->conf.server_tag));
+	}
+
+	env_add_fn(t->env, CONST_STR_LEN("GATEWAY_INTERFACE"), CONST_STR_LEN("CGI/1.1"));
+
+	LI_ltostr(buf,
+#ifdef HAVE_IPV6
+	       ntohs(srv_sock->addr.plain.sa_family ? srv_sock->addr.ipv6.sin6_port : srv_sock->addr.ipv4.sin_port)
+#else
+	       ntohs(srv_sock->addr.ipv4.sin_port)
+#endif
+	       );
+
+	env_add_fn(t->env, CONST_STR_LEN("SERVER_PORT"), buf, strlen(buf));
+
+	env_add_fn(t->env, CONST_STR_LEN("REDIRECT_STATUS"), CONST_STR_LEN("200")); /* if php is compiled with --force-redirect */
+
+	if (!buffer_is_empty(host->docroot)) {
+		env_add_fn(t->env, CONST_STR_LEN("DOCUMENT_ROOT"), CONST_BUF_LEN(host->docroot));
+	}
+
+	t->next = host->env_tpl;
+	host->env_tpl = t;
+
+	return t;
+}
 
 /**
  *
@@ -1395,7 +1596,7 @@ static int scgi_establish_connection(server *srv, handler_ctx *hctx) {
 	return 0;
 }
 
-static int scgi_env_add_request_headers(server *srv, connection *con, plugin_data *p) {
+static int scgi_env_add_request_headers(server *srv, connection *con, plugin_data *p, scgi_env_add_t env_add_fn) {
 	size_t i;
 
 	for (i = 0; i < con->request.headers->used; i++) {
@@ -1404,23 +1605,9 @@ static int scgi_env_add_request_headers(server *srv, connection *con, plugin_dat
 		ds = (data_string *)con->request.headers->data[i];
 
 		if (ds->value->used && ds->key->used) {
-			size_t j;
-			buffer_reset(srv->tmp_buf);
-
-			if (0 != strcasecmp(ds->key->ptr, "CONTENT-TYPE")) {
-				buffer_copy_string_len(srv->tmp_buf, CONST_STR_LEN("HTTP_"));
-				srv->tmp_buf->used--;
-			}
+			buffer *key = http_cgi_header_key(srv, ds->key);
 
-			buffer_prepare_append(srv->tmp_buf, ds->key->used + 2);
-			for (j = 0; j < ds->key->used - 1; j++) {
-				srv->tmp_buf->ptr[srv->tmp_buf->used++] =
-					light_isalpha(ds->key->ptr[j]) ?
-					ds->key->ptr[j] & ~32 : '_';
-			}
-			srv->tmp_buf->ptr[srv->tmp_buf->used++] = '\0';
-
-			scgi_env_add(p->scgi_env, CONST_BUF_LEN(srv->tmp_buf), CONST_BUF_LEN(ds->value));
+			SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_BUF_LEN(key), CONST_BUF_LEN(ds->value)), srv, con)
 		}
 	}
 
@@ -1430,18 +1617,9 @@ static int scgi_env_add_request_headers(server *srv, connection *con, plugin_dat
 		ds = (data_string *)con->environment->data[i];
 
 		if (ds->value->used && ds->key->used) {
-			size_t j;
-			buffer_reset(srv->tmp_buf);
-
-			buffer_prepare_append(srv->tmp_buf, ds->key->used + 2);
-			for (j = 0; j < ds->key->used - 1; j++) {
-				srv->tmp_buf->ptr[srv->tmp_buf->used++] =
-					light_isalnum((unsigned char)ds->key->ptr[j]) ?
-					toupper((unsigned char)ds->key->ptr[j]) : '_';
-			}
-			srv->tmp_buf->ptr[srv->tmp_buf->used++] = '\0';
+			buffer *key = http_cgi_env_key(srv, ds->key);
 
-			scgi_env_add(p->scgi_env, CONST_BUF_LEN(srv->tmp_buf), CONST_BUF_LEN(ds->value));
+			SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_BUF_LEN(key), CONST_BUF_LEN(ds->value)), srv, con)
 		}
 	}
 
@@ -1456,12 +1634,14 @@ static int scgi_create_env(server *srv, handler_ctx *hctx) {
 	char b2[INET6_ADDRSTRLEN + 1];
 #endif
 	buffer *b;
+	scgi_env_tpl *tpl;
 
 	plugin_data *p    = hctx->plugin_data;
 	scgi_extension_host *host= hctx->host;
 
 	connection *con   = hctx->remote_conn;
 	server_socket *srv_sock = con->srv_socket;
+	scgi_env_add_t env_add_fn = scgi_env_add_func(host);
 
 	sock_addr our_addr;
 	socklen_t our_addr_len;
@@ -1472,15 +1652,11 @@ static int scgi_create_env(server *srv, handler_ctx *hctx) {
 
 	/* request.content_length < SSIZE_MAX, see request.c */
 	LI_ltostr(buf, con->request.content_length);
-	scgi_env_add(p->scgi_env, CONST_STR_LEN("CONTENT_LENGTH"), buf, strlen(buf));
-	scgi_env_add(p->scgi_env, CONST_STR_LEN("SCGI"), CONST_STR_LEN("1"));
-
+	SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("CONTENT_LENGTH"), buf, strlen(buf)), srv, con)
 
-	if (buffer_is_empty(con->conf.server_tag)) {
-		scgi_env_add(p->scgi_env, CONST_STR_LEN("SERVER_SOFTWARE"), CONST_STR_LEN(PACKAGE_DESC));
-	} else {
-		scgi_env_add(p->scgi_env, CONST_STR_LEN("SERVER_SOFTWARE"), CONST_BUF_LEN(con->conf.server_tag));
-	}
+	/* the static part */
+	tpl = scgi_env_tpl_get(host, con);
+	buffer_append_memory(p->scgi_env, tpl->env->ptr, tpl->env->used);
 
 	if (con->server_name->used) {
 		size_t len = con->server_name->used - 1;
@@ -1493,7 +1669,7 @@ static int scgi_create_env(server *srv, handler_ctx *hctx) {
 			if (colon) len = colon - con->server_name->ptr;
 		}
 
-		scgi_env_add(p->scgi_env, CONST_STR_LEN("SERVER_NAME"), con->server_name->ptr, len);
+		SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("SERVER_NAME"), con->server_name->ptr, len), srv, con)
 	} else {
 #ifdef HAVE_IPV6
 		s = inet_ntop(srv_sock->addr.plain.sa_family,
@@ -1504,20 +1680,9 @@ static int scgi_create_env(server *srv, handler_ctx *hctx) {
 #else
 		s = inet_ntoa(srv_sock->addr.ipv4.sin_addr);
 #endif
-		scgi_env_add(p->scgi_env, CONST_STR_LEN("SERVER_NAME"), s, strlen(s));
+		SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("SERVER_NAME"), s, strlen(s)), srv, con)
 	}
 
-	scgi_env_add(p->scgi_env, CONST_STR_LEN("GATEWAY_INTERFACE"), CONST_STR_LEN("CGI/1.1"));
-
-	LI_ltostr(buf,
-#ifdef HAVE_IPV6
-	       ntohs(srv_sock->addr.plain.sa_family ? srv_sock->addr.ipv6.sin6_port : srv_sock->addr.ipv4.sin_port)
-#else
-	       ntohs(srv_sock->addr.ipv4.sin_port)
-#endif
-	       );
-
-	scgi_env_add(p->scgi_env, CONST_STR_LEN("SERVER_PORT"), buf, strlen(buf));
 
 	/* get the server-side of the connection to the client */
 	our_addr_len = sizeof(our_addr);
@@ -1527,7 +1692,7 @@ static int scgi_create_env(server *srv, handler_ctx *hctx) {
 	} else {
 		s = inet_ntop_cache_get_ip(srv, &(our_addr));
 	}
-	scgi_env_add(p->scgi_env, CONST_STR_LEN("SERVER_ADDR"), s, strlen(s));
+	SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("SERVER_ADDR"), s, strlen(s)), srv, con)
 
 	LI_ltostr(buf,
 #ifdef HAVE_IPV6
@@ -1537,10 +1702,10 @@ static int scgi_create_env(server *srv, handler_ctx *hctx) {
 #endif
 	       );
 
-	scgi_env_add(p->scgi_env, CONST_STR_LEN("REMOTE_PORT"), buf, strlen(buf));
+	SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("REMOTE_PORT"), buf, strlen(buf)), srv, con)
 
 	s = inet_ntop_cache_get_ip(srv, &(con->dst_addr));
-	scgi_env_add(p->scgi_env, CONST_STR_LEN("REMOTE_ADDR"), s, strlen(s));
+	SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("REMOTE_ADDR"), s, strlen(s)), srv, con)
 
 	/*
 	 * SCRIPT_NAME, PATH_INFO and PATH_TRANSLATED according to
@@ -1548,10 +1713,10 @@ static int scgi_create_env(server *srv, handler_ctx *hctx) {
 	 * (6.1.14, 6.1.6, 6.1.7)
 	 */
 
-	scgi_env_add(p->scgi_env, CONST_STR_LEN("SCRIPT_NAME"), CONST_BUF_LEN(con->uri.path));
+	SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("SCRIPT_NAME"), CONST_BUF_LEN(con->uri.path)), srv, con)
 
 	if (!buffer_is_empty(con->request.pathinfo)) {
-		scgi_env_add(p->scgi_env, CONST_STR_LEN("PATH_INFO"), CONST_BUF_LEN(con->request.pathinfo));
+		SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("PATH_INFO"), CONST_BUF_LEN(con->request.pathinfo)), srv, con)
 
 		/* PATH_TRANSLATED is only defined if PATH_INFO is set */
 
@@ -1561,9 +1726,9 @@ static int scgi_create_env(server *srv, handler_ctx *hctx) {
 			buffer_copy_string_buffer(p->path, con->physical.basedir);
 		}
 		buffer_append_string_buffer(p->path, con->request.pathinfo);
-		scgi_env_add(p->scgi_env, CONST_STR_LEN("PATH_TRANSLATED"), CONST_BUF_LEN(p->path));
+		SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("PATH_TRANSLATED"), CONST_BUF_LEN(p->path)), srv, con)
 	} else {
-		scgi_env_add(p->scgi_env, CONST_STR_LEN("PATH_INFO"), CONST_STR_LEN(""));
+		SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("PATH_INFO"), CONST_STR_LEN("")), srv, con)
 	}
 
 	/*
@@ -1583,44 +1748,64 @@ static int scgi_create_env(server *srv, handler_ctx *hctx) {
 		buffer_copy_string_buffer(p->path, host->docroot);
 		buffer_append_string_buffer(p->path, con->uri.path);
 
-		scgi_env_add(p->scgi_env, CONST_STR_LEN("SCRIPT_FILENAME"), CONST_BUF_LEN(p->path));
-		scgi_env_add(p->scgi_env, CONST_STR_LEN("DOCUMENT_ROOT"), CONST_BUF_LEN(host->docroot));
+		SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("SCRIPT_FILENAME"), CONST_BUF_LEN(p->path)), srv, con)
 	} else {
 		buffer_copy_string_buffer(p->path, con->physical.path);
 
-		scgi_env_add(p->scgi_env, CONST_STR_LEN("SCRIPT_FILENAME"), CONST_BUF_LEN(p->path));
-		scgi_env_add(p->scgi_env, CONST_STR_LEN("DOCUMENT_ROOT"), CONST_BUF_LEN(con->physical.basedir));
+		SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("SCRIPT_FILENAME"), CONST_BUF_LEN(p->path)), srv, con)
+		SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("DOCUMENT_ROOT"), CONST_BUF_LEN(con->physical.basedir)), srv, con)
 	}
-	scgi_env_add(p->scgi_env, CONST_STR_LEN("REQUEST_URI"), CONST_BUF_LEN(con->request.orig_uri));
+	SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("REQUEST_URI"), CONST_BUF_LEN(con->request.orig_uri)), srv, con)
 	if (!buffer_is_equal(con->request.uri, con->request.orig_uri)) {
-		scgi_env_add(p->scgi_env, CONST_STR_LEN("REDIRECT_URI"), CONST_BUF_LEN(con->request.uri));
+		SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("REDIRECT_URI"), CONST_BUF_LEN(con->request.uri)), srv, con)
 	}
 	if (!buffer_is_empty(con->uri.query)) {
-		scgi_env_add(p->scgi_env, CONST_STR_LEN("QUERY_STRING"), CONST_BUF_LEN(con->uri.query));
+		SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("QUERY_STRING"), CONST_BUF_LEN(con->uri.query)), srv, con)
 	} else {
-		scgi_env_add(p->scgi_env, CONST_STR_LEN("QUERY_STRING"), CONST_STR_LEN(""));
+		SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("QUERY_STRING"), CONST_STR_LEN("")), srv, con)
 	}
 
 	s = get_http_method_name(con->request.http_method);
-	scgi_env_add(p->scgi_env, CONST_STR_LEN("REQUEST_METHOD"), s, strlen(s));
-	scgi_env_add(p->scgi_env, CONST_STR_LEN("REDIRECT_STATUS"), CONST_STR_LEN("200")); /* if php is compiled with --force-redirect */
+	SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("REQUEST_METHOD"), s, strlen(s)), srv, con)
 	s = get_http_version_name(con->request.http_version);
-	scgi_env_add(p->scgi_env, CONST_STR_LEN("SERVER_PROTOCOL"), s, strlen(s));
+	SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("SERVER_PROTOCOL"), s, strlen(s)), srv, con)
 
 #ifdef USE_OPENSSL
 	if (buffer_is_equal_caseless_string(con->uri.scheme, CONST_STR_LEN("https"))) {
-		scgi_env_add(p->scgi_env, CONST_STR_LEN("HTTPS"), CONST_STR_LEN("on"));
+		SCGI_ENV_ADD_CHECK(env_add_fn(p->scgi_env, CONST_STR_LEN("HTTPS"), CONST_STR_LEN("on")), srv, con)
 	}
 #endif
 
-	scgi_env_add_request_headers(srv, con, p);
+	if (-1 == scgi_env_add_request_headers(srv, con, p, env_add_fn)) return -1;
 
 	b = chunkqueue_get_append_buffer(hctx->wb);
 
-	buffer_append_long(b, p->scgi_env->used);
-	buffer_append_string_len(b, CONST_STR_LEN(":"));
-	buffer_append_string_len(b, (const char *)p->scgi_env->ptr, p->scgi_env->used);
-	buffer_append_string_len(b, CONST_STR_LEN(","));
+	if (host->protocol == SCGI_PROTOCOL_UWSGI) {
+		/* modifier1, the size of the vars as 16 bit little endian, modifier2 */
+		char header[4];
+
+		if (p->scgi_env->used > USHRT_MAX) {
+			log_error_write(srv, __FILE__, __LINE__, "so",
+					"uwsgi: the vars of the request are too large:", (off_t)p->scgi_env->used);
+			con->http_status = 400;
+			con->file_finished = 1;
+			return -1;
+		}
+
+		header[0] = host->uwsgi_modifier1;
+		header[1] = p->scgi_env->used & 0xff;
+		header[2] = (p->scgi_env->used >> 8) & 0xff;
+		header[3] = 0;
+
+		buffer_append_memory(b, header, sizeof(header));
+		buffer_append_memory(b, p->scgi_env->ptr, p->scgi_env->used);
+		b->used++; /* add virtual \0 */
+	} else {
+		buffer_append_long(b, p->scgi_env->used);
+		buffer_append_string_len(b, CONST_STR_LEN(":"));
+		buffer_append_string_len(b, (const char *)p->scgi_env->ptr, p->scgi_env->used);
+		buffer_append_string_len(b, CONST_STR_LEN(","));
+	}
 
 	hctx->wb->bytes_in += b->used - 1;
 
@@ -1782,6 +1967,41 @@ static int scgi_response_parse(server *srv, connection *con, plugin_data *p, buf
 }
 
 
+/* X-Sendfile: the backend names a file which is sent instead of its body
+ *
+ * returns 1 if the response is complete, 0 if there is no such header
+ */
+static int scgi_send_file(server *srv, handler_ctx *hctx) {
+	connection *con = hctx->remote_conn;
+	data_string *ds, *dcl;
+
+	if (!hctx->host->allow_xsendfile) return 0;
+
+	if (NULL == (ds = (data_string *)array_get_element(con->response.headers, "X-LIGHTTPD-send-file")) &&
+	    NULL == (ds = (data_string *)array_get_element(con->response.headers, "X-Sendfile"))) return 0;
+
+	/* the length is the one of the file */
+	if (NULL != (dcl = (data_string *)array_get_element(con->response.headers, "Content-Length"))) {
+		buffer_reset(dcl->value);
+	}
+	con->parsed_response &= ~HTTP_CONTENT_LENGTH;
+
+	/* Range, If-None-Match and If-Modified-Since as for a static file */
+	if (HANDLER_ERROR == http_response_send_file(srv, con, ds->value, 1)) {
+		log_error_write(srv, __FILE__, __LINE__, "sb",
+				"send-file error: couldn't get stat_cache entry for:",
+				ds->value);
+		con->http_status = 502;
+	}
+
+	/* the rest of the body is ignored */
+	con->file_started = 1;
+	con->file_finished = 1;
+	joblist_append(srv, con);
+
+	return 1;
+}
+
 static int scgi_demux_response(server *srv, handler_ctx *hctx) {
 	plugin_data *p    = hctx->plugin_data;
 	connection  *con  = hctx->remote_conn;
@@ -1896,6 +2116,10 @@ static int scgi_demux_response(server *srv, handler_ctx *hctx) {
 					/* parse the response header */
 					scgi_response_parse(srv, con, p, hctx->response_header, eol);
 
+					if (scgi_send_file(srv, hctx)) return 1;
+
+					http_response_body_start(srv, con);
+
 					/* enable chunked-transfer-encoding */
 					if (con->request.http_version == HTTP_VERSION_1_1 &&
 					    !(con->parsed_response & HTTP_CONTENT_LENGTH)) {
@@ -2290,7 +2514,7 @@ static handler_t scgi_write_request(server *srv, handler_ctx *hctx) {
 		scgi_set_state(srv, hctx, FCGI_STATE_PREPARE_WRITE);
 		/* fall through */
 	case FCGI_STATE_PREPARE_WRITE:
-		scgi_create_env(srv, hctx);
+		if (-1 == scgi_create_env(srv, hctx)) return HANDLER_ERROR;
 
 		scgi_set_state(srv, hctx, FCGI_STATE_WRITE);
 
@@ -2383,8 +2607,10 @@ SUBREQUEST_FUNC(mod_scgi_handle_subrequest) {
 
 		if (proc &&
 		    0 == proc->is_local &&
-		    proc->state != PROC_STATE_DISABLED) {
-			/* only disable remote servers as we don't manage them*/
+		    proc->state != PROC_STATE_DISABLED &&
+		    con->http_status != 400) {
+			/* only disable remote servers as we don't manage them,
+			 * a request which can't be sent isn't their fault */
 
 			log_error_write(srv, __FILE__, __LINE__,  "sbdb", "fcgi-server disabled:",
 					host->host,
@@ -2444,7 +2670,8 @@ SUBREQUEST_FUNC(mod_scgi_handle_subrequest) {
 
 			buffer_reset(con->physical.path);
 			con->mode = DIRECT;
-			con->http_status = 503;
+			if (con->http_status != 400) con->http_status = 503;
+			joblist_append(srv, con); /* in case we come from the event-handler */
 
 			return HANDLER_FINISHED;
 		}
@@ -2662,8 +2889,13 @@ static int scgi_patch_connection(server *srv, connection *con, plugin_data *p) {
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(exts);
 	PATCH(debug);
+	PATCH(balance);
+	PATCH(hash_key);
+	PATCH(hash_cookie);
 
 	/* skip the first, the global context */
 	for (i = 1; i < srv->config_context->used; i++) {
@@ -2681,15 +2913,54 @@ static int scgi_patch_connection(server *srv, connection *con, plugin_data *p) {
 				PATCH(exts);
 			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("scgi.debug"))) {
 				PATCH(debug);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("scgi.balance"))) {
+				PATCH(balance);
+			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("scgi.hash-key"))) {
+				PATCH(hash_key);
+				PATCH(hash_cookie);
 			}
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
 
 
+static ketama_ring *scgi_extension_ring(scgi_extension *ext) {
+	size_t k;
+
+	if (ext->ring) return ext->ring;
+
+	ext->ring = ketama_init();
+
+	for (k = 0; k < ext->used; k++) {
+		scgi_extension_host *host = ext->hosts[k];
+		char name[256];
+		int len;
+
+		if (!buffer_is_empty(host->unixsocket)) {
+			len = snprintf(name, sizeof(name), "%s", host->unixsocket->ptr);
+		} else {
+			len = snprintf(name, sizeof(name), "%s:%u", host->host->used ? host->host->ptr : "", host->port);
+		}
+		if (len >= (int)sizeof(name)) len = sizeof(name) - 1;
+
+		ketama_add(ext->ring, name, len, k);
+	}
+	ketama_sort(ext->ring);
+
+	return ext->ring;
+}
+
+static int scgi_ring_host_is_up(void *ctx, size_t ndx) {
+	scgi_extension *ext = ctx;
+
+	return ext->hosts[ndx]->active_procs > 0;
+}
+
 static handler_t scgi_check_extension(server *srv, connection *con, void *p_d, int uri_path_handler) {
 	plugin_data *p = p_d;
 	size_t s_len;
@@ -2742,7 +3013,16 @@ static handler_t scgi_check_extension(server *srv, connection *con, void *p_d, i
 	}
 
 	/* get best server */
-	for (k = 0; k < extension->used; k++) {
+	if (p->conf.balance == SCGI_HOST_BALANCE_HASH) {
+		int ndx;
+
+		/* the same key always goes to the same host as long as it is up */
+		ndx = ketama_get(scgi_extension_ring(extension),
+				 ketama_hash_request(con, p->conf.hash_key, p->conf.hash_cookie),
+				 scgi_ring_host_is_up, extension);
+
+		if (ndx != -1) host = extension->hosts[ndx];
+	} else for (k = 0; k < extension->used; k++) {
 		scgi_extension_host *h = extension->hosts[k];
 
 		/* we should have at least one proc that can do something */
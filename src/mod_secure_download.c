@@ -154,6 +154,8 @@ static int mod_secdownload_patch_connection(server *srv, connection *con, plugin
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(secret);
 	PATCH(doc_root);
 	PATCH(uri_prefix);
@@ -183,6 +185,8 @@ static int mod_secdownload_patch_connection(server *srv, connection *con, plugin
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
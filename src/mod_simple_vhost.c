@@ -172,6 +172,8 @@ static int mod_simple_vhost_patch_connection(server *srv, connection *con, plugi
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(server_root);
 	PATCH(default_host);
 	PATCH(document_root);
@@ -209,6 +211,8 @@ static int mod_simple_vhost_patch_connection(server *srv, connection *con, plugi
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
@@ -134,6 +134,8 @@ static int mod_skeleton_patch_connection(server *srv, connection *con, plugin_da
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(match);
 
 	/* skip the first, the global context */
@@ -154,6 +156,8 @@ static int mod_skeleton_patch_connection(server *srv, connection *con, plugin_da
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
@@ -81,6 +81,7 @@ FREE_FUNC(mod_ssi_free) {
 	array_free(p->ssi_cgi_env);
 #ifdef HAVE_PCRE_H
 	pcre_free(p->ssi_regex);
+	if (p->ssi_regex_extra) li_pcre_study_free(p->ssi_regex_extra);
 #endif
 	buffer_free(p->timefmt);
 	buffer_free(p->stat_fn);
@@ -135,6 +136,13 @@ SETDEFAULTS_FUNC(mod_ssi_set_defaults) {
 				erroff, errptr);
 		return HANDLER_ERROR;
 	}
+
+	if (NULL == (p->ssi_regex_extra = li_pcre_study(p->ssi_regex, &errptr)) &&
+			errptr != NULL) {
+		log_error_write(srv, __FILE__, __LINE__, "ss",
+				"ssi: pcre_study failed: ", errptr);
+		return HANDLER_ERROR;
+	}
 #else
 	log_error_write(srv, __FILE__, __LINE__, "s",
 			"mod_ssi: pcre support is missing, please recompile with pcre support or remove mod_ssi from the list of modules");
@@ -1036,7 +1044,7 @@ static int mod_ssi_handle_request(server *srv, connection *con, plugin_data *p)
 	 *
 	 */
 #ifdef HAVE_PCRE_H
-	for (i = 0; (n = pcre_exec(p->ssi_regex, NULL, s.start, s.size, i, 0, ovec, N * 3)) > 0; i = ovec[1]) {
+	for (i = 0; (n = pcre_exec(p->ssi_regex, p->ssi_regex_extra, s.start, s.size, i, 0, ovec, N * 3)) > 0; i = ovec[1]) {
 		const char **l;
 		/* take everything from last offset to current match pos */
 
@@ -1109,6 +1117,8 @@ static int mod_ssi_patch_connection(server *srv, connection *con, plugin_data *p
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(ssi_extension);
 	PATCH(content_type);
 
@@ -1132,6 +1142,8 @@ static int mod_ssi_patch_connection(server *srv, connection *con, plugin_data *p
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
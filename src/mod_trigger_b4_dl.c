@@ -41,7 +41,9 @@ typedef struct {
 	buffer *mc_namespace;
 #if defined(HAVE_PCRE_H)
 	pcre *trigger_regex;
+	pcre_extra *trigger_regex_extra;
 	pcre *download_regex;
+	pcre_extra *download_regex_extra;
 #endif
 #if defined(HAVE_GDBM_H)
 	GDBM_FILE db;
@@ -102,6 +104,8 @@ FREE_FUNC(mod_trigger_b4_dl_free) {
 #if defined(HAVE_PCRE_H)
 			if (s->trigger_regex) pcre_free(s->trigger_regex);
 			if (s->download_regex) pcre_free(s->download_regex);
+			if (s->trigger_regex_extra) li_pcre_study_free(s->trigger_regex_extra);
+			if (s->download_regex_extra) li_pcre_study_free(s->download_regex_extra);
 #endif
 #if defined(HAVE_GDBM_H)
 			if (s->db) gdbm_close(s->db);
@@ -196,6 +200,14 @@ SETDEFAULTS_FUNC(mod_trigger_b4_dl_set_defaults) {
 						s->download_url, "pos:", erroff);
 				return HANDLER_ERROR;
 			}
+
+			if (NULL == (s->download_regex_extra = li_pcre_study(s->download_regex, &errptr)) &&
+					errptr != NULL) {
+				log_error_write(srv, __FILE__, __LINE__, "sbss",
+						"studying regex for download-url failed:",
+						s->download_url, ":", errptr);
+				return HANDLER_ERROR;
+			}
 		}
 
 		if (!buffer_is_empty(s->trigger_url)) {
@@ -208,6 +220,14 @@ SETDEFAULTS_FUNC(mod_trigger_b4_dl_set_defaults) {
 
 				return HANDLER_ERROR;
 			}
+
+			if (NULL == (s->trigger_regex_extra = li_pcre_study(s->trigger_regex, &errptr)) &&
+					errptr != NULL) {
+				log_error_write(srv, __FILE__, __LINE__, "sbss",
+						"studying regex for trigger-url failed:",
+						s->trigger_url, ":", errptr);
+				return HANDLER_ERROR;
+			}
 		}
 #endif
 
@@ -251,12 +271,16 @@ static int mod_trigger_b4_dl_patch_connection(server *srv, connection *con, plug
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 #if defined(HAVE_GDBM)
 	PATCH(db);
 #endif
 #if defined(HAVE_PCRE_H)
 	PATCH(download_regex);
+	PATCH(download_regex_extra);
 	PATCH(trigger_regex);
+	PATCH(trigger_regex_extra);
 #endif
 	PATCH(trigger_timeout);
 	PATCH(deny_url);
@@ -281,10 +305,12 @@ static int mod_trigger_b4_dl_patch_connection(server *srv, connection *con, plug
 			if (buffer_is_equal_string(du->key, CONST_STR_LEN("trigger-before-download.download-url"))) {
 #if defined(HAVE_PCRE_H)
 				PATCH(download_regex);
+				PATCH(download_regex_extra);
 #endif
 			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("trigger-before-download.trigger-url"))) {
 # if defined(HAVE_PCRE_H)
 				PATCH(trigger_regex);
+				PATCH(trigger_regex_extra);
 # endif
 			} else if (buffer_is_equal_string(du->key, CONST_STR_LEN("trigger-before-download.gdbm-filename"))) {
 #if defined(HAVE_GDBM_H)
@@ -306,6 +332,8 @@ static int mod_trigger_b4_dl_patch_connection(server *srv, connection *con, plug
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
@@ -358,7 +386,7 @@ URIHANDLER_FUNC(mod_trigger_b4_dl_uri_handler) {
 	}
 
 	/* check if URL is a trigger -> insert IP into DB */
-	if ((n = pcre_exec(p->conf.trigger_regex, NULL, con->uri.path->ptr, con->uri.path->used - 1, 0, 0, ovec, 3 * N)) < 0) {
+	if ((n = pcre_exec(p->conf.trigger_regex, p->conf.trigger_regex_extra, con->uri.path->ptr, con->uri.path->used - 1, 0, 0, ovec, 3 * N)) < 0) {
 		if (n != PCRE_ERROR_NOMATCH) {
 			log_error_write(srv, __FILE__, __LINE__, "sd",
 					"execution error while matching:", n);
@@ -409,7 +437,7 @@ URIHANDLER_FUNC(mod_trigger_b4_dl_uri_handler) {
 	}
 
 	/* check if URL is a download -> check IP in DB, update timestamp */
-	if ((n = pcre_exec(p->conf.download_regex, NULL, con->uri.path->ptr, con->uri.path->used - 1, 0, 0, ovec, 3 * N)) < 0) {
+	if ((n = pcre_exec(p->conf.download_regex, p->conf.download_regex_extra, con->uri.path->ptr, con->uri.path->used - 1, 0, 0, ovec, 3 * N)) < 0) {
 		if (n != PCRE_ERROR_NOMATCH) {
 			log_error_write(srv, __FILE__, __LINE__, "sd",
 					"execution error while matching: ", n);
@@ -227,6 +227,8 @@ static int mod_uploadprogress_patch_connection(server *srv, connection *con, plu
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(progress_url);
 
 	/* skip the first, the global context */
@@ -247,6 +249,8 @@ static int mod_uploadprogress_patch_connection(server *srv, connection *con, plu
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
@@ -134,6 +134,8 @@ static int mod_userdir_patch_connection(server *srv, connection *con, plugin_dat
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(path);
 	PATCH(exclude_user);
 	PATCH(include_user);
@@ -169,6 +171,8 @@ static int mod_userdir_patch_connection(server *srv, connection *con, plugin_dat
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
@@ -138,6 +138,8 @@ static int mod_usertrack_patch_connection(server *srv, connection *con, plugin_d
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH(cookie_name);
 	PATCH(cookie_domain);
 	PATCH(cookie_max_age);
@@ -164,6 +166,8 @@ static int mod_usertrack_patch_connection(server *srv, connection *con, plugin_d
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 #undef PATCH
@@ -419,6 +419,8 @@ static int mod_webdav_patch_connection(server *srv, connection *con, plugin_data
 	size_t i, j;
 	plugin_config *s = p->config_storage[0];
 
+	if (config_patch_cache_get(srv, con, p->id, &p->conf, sizeof(p->conf))) return 0;
+
 	PATCH_OPTION(enabled);
 	PATCH_OPTION(is_readonly);
 	PATCH_OPTION(log_xml);
@@ -480,6 +482,8 @@ static int mod_webdav_patch_connection(server *srv, connection *con, plugin_data
 		}
 	}
 
+	config_patch_cache_set(srv, con, p->id, &p->conf, sizeof(p->conf));
+
 	return 0;
 }
 
@@ -878,7 +882,6 @@ static int webdav_get_live_property(server *srv, connection *con, plugin_data *p
 	if (HANDLER_ERROR != (stat_cache_get_entry(srv, con, dst->path, &sce))) {
 		char ctime_buf[] = "2005-08-18T07:27:16Z";
 		char mtime_buf[] = "Thu, 18 Aug 2005 07:27:16 GMT";
-		size_t k;
 
 		if (0 == strcmp(prop_name, "resourcetype")) {
 			if (S_ISDIR(sce->st.st_mode)) {
@@ -890,19 +893,11 @@ static int webdav_get_live_property(server *srv, connection *con, plugin_data *p
 				buffer_append_string_len(b, CONST_STR_LEN("<D:getcontenttype>httpd/unix-directory</D:getcontenttype>"));
 				found = 1;
 			} else if(S_ISREG(sce->st.st_mode)) {
-				for (k = 0; k < con->conf.mimetypes->used; k++) {
-					data_string *ds = (data_string *)con->conf.mimetypes->data[k];
-
-					if (ds->key->used == 0) continue;
-
-					if (buffer_is_equal_right_len(dst->path, ds->key, ds->key->used - 1)) {
-						buffer_append_string_len(b,CONST_STR_LEN("<D:getcontenttype>"));
-						buffer_append_string_buffer(b, ds->value);
-						buffer_append_string_len(b, CONST_STR_LEN("</D:getcontenttype>"));
-						found = 1;
-
-						break;
-					}
+				if (!buffer_is_empty(sce->content_type)) {
+					buffer_append_string_len(b,CONST_STR_LEN("<D:getcontenttype>"));
+					buffer_append_string_buffer(b, sce->content_type);
+					buffer_append_string_len(b, CONST_STR_LEN("</D:getcontenttype>"));
+					found = 1;
 				}
 			}
 		} else if (0 == strcmp(prop_name, "creationdate")) {
@@ -1806,6 +1801,7 @@ URIHANDLER_FUNC(mod_webdav_subrequest_handler) {
 				}
 				break;
 			case UNUSED_CHUNK:
+			case PIPE_CHUNK: /* only in responses */
 				break;
 			}
 
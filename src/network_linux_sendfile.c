@@ -226,6 +226,47 @@ int network_write_chunkqueue_linuxsendfile(server *srv, connection *con, int fd,
 
 			break;
 		}
+#ifdef HAVE_SPLICE
+		case PIPE_CHUNK: {
+			ssize_t r;
+			off_t toSend;
+
+			toSend = c->file.length - c->offset;
+			if (toSend > max_bytes) toSend = max_bytes;
+
+			/* from the pipe to the socket without a copy in userspace */
+			if (-1 == (r = splice(c->file.fd, NULL, fd, NULL, toSend, SPLICE_F_MOVE | SPLICE_F_NONBLOCK))) {
+				switch (errno) {
+				case EAGAIN:
+				case EINTR:
+					r = 0;
+					break;
+				case EPIPE:
+				case ECONNRESET:
+					return -2;
+				default:
+					log_error_write(srv, __FILE__, __LINE__, "ssd",
+							"splice failed:", strerror(errno), fd);
+					return -1;
+				}
+			} else if (r == 0) {
+				/* the pipe has less than the chunk says */
+				log_error_write(srv, __FILE__, __LINE__, "sd",
+						"pipe is empty, can't send the rest of the chunk:", fd);
+				return -1;
+			}
+
+			c->offset += r;
+			cq->bytes_out += r;
+			max_bytes -= r;
+
+			if (c->offset == c->file.length) {
+				chunk_finished = 1;
+			}
+
+			break;
+		}
+#endif
 		default:
 
 			log_error_write(srv, __FILE__, __LINE__, "ds", c, "type not known");
@@ -45,6 +45,7 @@ typedef struct {
 	handler_t (* handle_request_done)    (server *srv, connection *con, void *p_d);    /* at the end of a request */
 	handler_t (* handle_connection_close)(server *srv, connection *con, void *p_d);    /* at the end of a connection */
 	handler_t (* handle_joblist)         (server *srv, connection *con, void *p_d);    /* after all events are handled */
+	handler_t (* handle_response_start)  (server *srv, connection *con, void *p_d);    /* before the first octet of the response body */
 
 
 
@@ -73,6 +74,7 @@ handler_t plugins_call_handle_docroot(server *srv, connection *con);
 handler_t plugins_call_handle_physical(server *srv, connection *con);
 handler_t plugins_call_handle_connection_close(server *srv, connection *con);
 handler_t plugins_call_handle_joblist(server *srv, connection *con);
+handler_t plugins_call_handle_response_start(server *srv, connection *con);
 handler_t plugins_call_connection_reset(server *srv, connection *con);
 
 handler_t plugins_call_handle_trigger(server *srv);
@@ -87,6 +89,8 @@ int config_insert_values_internal(server *srv, array *ca, const config_values_t
 int config_setup_connection(server *srv, connection *con);
 int config_patch_connection(server *srv, connection *con, comp_key_t comp);
 int config_check_cond(server *srv, connection *con, data_config *dc);
+int config_patch_cache_get(server *srv, connection *con, size_t id, void *conf, size_t conf_size);
+void config_patch_cache_set(server *srv, connection *con, size_t id, const void *conf, size_t conf_size);
 int config_append_cond_match_buffer(connection *con, data_config *dc, buffer *buf, int n);
 
 #endif
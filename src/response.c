@@ -242,7 +242,7 @@ handler_t http_response_prepare(server *srv, connection *con) {
 		 *
 		 *  */
 
-		config_cond_cache_reset(srv, con);
+		config_cond_cache_reset_request(srv, con);
 		config_setup_connection(srv, con); /* Perhaps this could be removed at other places. */
 
 		if (con->conf.log_condition_handling) {
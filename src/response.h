@@ -15,6 +15,12 @@ int response_header_append(server *srv, connection *con, const char *key, size_t
 handler_t http_response_prepare(server *srv, connection *con);
 int http_response_redirect_to_directory(server *srv, connection *con);
 int http_response_handle_cachable(server *srv, connection *con, buffer * mtime);
+/* the file as the body, like a static file: Content-Type, ETag, Last-Modified,
+ * conditional requests and Range. HANDLER_ERROR if it isn't a regular file */
+handler_t http_response_send_file(server *srv, connection *con, buffer *path, int use_etag);
+/* the response headers are complete, handle_response_start might install
+ * a filter for the body (con->response_filter). only once per response */
+void http_response_body_start(server *srv, connection *con);
 
 buffer * strftime_cache_get(server *srv, time_t last_mod);
 #endif
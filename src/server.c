@@ -11,6 +11,7 @@
 #include "connections.h"
 #include "stat_cache.h"
 #include "plugin.h"
+#include "configfile.h"
 #include "joblist.h"
 #include "network_backends.h"
 #include "version.h"
@@ -250,6 +251,9 @@ static server *server_init(void) {
 
 	srv->split_vals = array_init();
 
+	srv->cgi_header_keys = array_init();
+	srv->cgi_env_keys = array_init();
+
 	return srv;
 }
 
@@ -294,6 +298,9 @@ static void server_free(server *srv) {
 
 	free(srv->conns);
 
+	config_patch_caches_free(srv);
+	config_cond_index_free(srv);
+
 	if (srv->config_storage) {
 		for (i = 0; i < srv->config_context->used; i++) {
 			specific_config *s = srv->config_storage[i];
@@ -311,6 +318,7 @@ static void server_free(server *srv) {
 			buffer_free(s->error_handler);
 			buffer_free(s->errorfile_prefix);
 			array_free(s->mimetypes);
+			stat_cache_mimetype_index_free(s->mimetype_index);
 			buffer_free(s->ssl_verifyclient_username);
 #ifdef USE_OPENSSL
 			SSL_CTX_free(s->ssl_ctx);
@@ -342,6 +350,12 @@ static void server_free(server *srv) {
 
 	array_free(srv->srvconf.modules);
 	array_free(srv->split_vals);
+	array_free(srv->cgi_header_keys);
+	array_free(srv->cgi_env_keys);
+
+#ifdef HAVE_PCRE_H
+	li_pcre_jit_stack_free();
+#endif
 
 #ifdef USE_OPENSSL
 	if (srv->ssl_is_init) {
@@ -454,6 +468,16 @@ static void show_features (void) {
 #else
       "\t- bzip2 support\n"
 #endif
+#if defined HAVE_BROTLI_ENCODE_H && defined HAVE_LIBBROTLIENC
+      "\t+ brotli support\n"
+#else
+      "\t- brotli support\n"
+#endif
+#if defined HAVE_ZSTD_H && defined HAVE_LIBZSTD
+      "\t+ zstd support\n"
+#else
+      "\t- zstd support\n"
+#endif
 #ifdef HAVE_LIBCRYPT
       "\t+ crypt support\n"
 #else
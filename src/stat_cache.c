@@ -107,6 +107,7 @@ stat_cache *stat_cache_init(void) {
 
 	sc->dir_name = buffer_init();
 	sc->hash_key = buffer_init();
+	sc->empty_content_type = buffer_init();
 
 #ifdef HAVE_FAM_H
 	sc->fam_fcce_ndx = -1;
@@ -126,7 +127,9 @@ static stat_cache_entry * stat_cache_entry_init(void) {
 
 	sce->name = buffer_init();
 	sce->etag = buffer_init();
-	sce->content_type = buffer_init();
+#ifdef HAVE_XATTR
+	sce->xattr_content_type = buffer_init();
+#endif
 
 	return sce;
 }
@@ -137,7 +140,9 @@ static void stat_cache_entry_free(void *data) {
 
 	buffer_free(sce->etag);
 	buffer_free(sce->name);
-	buffer_free(sce->content_type);
+#ifdef HAVE_XATTR
+	buffer_free(sce->xattr_content_type);
+#endif
 
 	free(sce);
 }
@@ -182,6 +187,7 @@ void stat_cache_free(stat_cache *sc) {
 
 	buffer_free(sc->dir_name);
 	buffer_free(sc->hash_key);
+	buffer_free(sc->empty_content_type);
 
 #ifdef HAVE_FAM_H
 	while (sc->dirs) {
@@ -239,6 +245,119 @@ static uint32_t hashme(buffer *str) {
 	return hash;
 }
 
+/* DJB hash over the lower-cased string, as the mimetype suffixes are matched caseless */
+static uint32_t hashme_caseless(const char *s, size_t len) {
+	uint32_t hash = 5381;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		unsigned char c = s[i];
+		if (c >= 'A' && c <= 'Z') c |= 32;
+		hash = ((hash << 5) + hash) + c;
+	}
+
+	return hash;
+}
+
+/**
+ * build the suffix index for a mimetype.assign array
+ *
+ * the keys are stored in a hash-table and we remember the distinct
+ * key-lengths. A lookup only has to hash the last n chars of the
+ * filename for each of the lengths instead of comparing against all
+ * the keys.
+ */
+mimetype_index *stat_cache_mimetype_index_init(array *mimetypes) {
+	mimetype_index *mi;
+	size_t i, j;
+
+	mi = calloc(1, sizeof(*mi));
+	assert(mi);
+
+	for (mi->size = 16; mi->size < 2 * mimetypes->used; mi->size <<= 1);
+
+	mi->ptr = calloc(mi->size, sizeof(*mi->ptr));
+	mi->key_lens = calloc(mimetypes->used + 1, sizeof(*mi->key_lens));
+	assert(mi->ptr);
+	assert(mi->key_lens);
+
+	for (i = 0; i < mimetypes->used; i++) {
+		data_string *ds = (data_string *)mimetypes->data[i];
+		size_t klen, ndx;
+
+		if (ds->type != TYPE_STRING) continue;
+		if (ds->key->used == 0) continue;
+
+		klen = ds->key->used - 1;
+
+		for (ndx = hashme_caseless(ds->key->ptr, klen) & (mi->size - 1);
+		     mi->ptr[ndx];
+		     ndx = (ndx + 1) & (mi->size - 1)) {
+			/* first one wins */
+			if (mi->ptr[ndx]->key->used == ds->key->used &&
+			    0 == strncasecmp(mi->ptr[ndx]->key->ptr, ds->key->ptr, klen)) break;
+		}
+
+		if (mi->ptr[ndx]) continue;
+
+		mi->ptr[ndx] = ds;
+
+		/* keep the lengths sorted, longest first */
+		for (j = 0; j < mi->key_lens_used && mi->key_lens[j] > klen; j++);
+
+		if (j < mi->key_lens_used && mi->key_lens[j] == klen) continue;
+
+		memmove(mi->key_lens + j + 1, mi->key_lens + j, (mi->key_lens_used - j) * sizeof(*mi->key_lens));
+		mi->key_lens[j] = klen;
+		mi->key_lens_used++;
+	}
+
+	return mi;
+}
+
+void stat_cache_mimetype_index_free(mimetype_index *mi) {
+	if (!mi) return;
+
+	free(mi->ptr);
+	free(mi->key_lens);
+	free(mi);
+}
+
+/**
+ * find the content-type for a filename
+ *
+ * the longest matching suffix wins: "foo.tar.gz" prefers ".tar.gz" over ".gz"
+ *
+ * returns NULL if no suffix matches
+ */
+buffer *stat_cache_mimetype_by_ext(mimetype_index *mi, const char *name, size_t nlen) {
+	size_t i;
+
+	if (!mi) return NULL;
+
+	for (i = 0; i < mi->key_lens_used; i++) {
+		size_t klen = mi->key_lens[i];
+		const char *suffix;
+		size_t ndx;
+
+		if (klen > nlen) continue;
+
+		suffix = name + nlen - klen;
+
+		for (ndx = hashme_caseless(suffix, klen) & (mi->size - 1);
+		     mi->ptr[ndx];
+		     ndx = (ndx + 1) & (mi->size - 1)) {
+			data_string *ds = mi->ptr[ndx];
+
+			if (ds->key->used - 1 == klen &&
+			    0 == strncasecmp(suffix, ds->key->ptr, klen)) {
+				return ds->value;
+			}
+		}
+	}
+
+	return NULL;
+}
+
 #ifdef HAVE_FAM_H
 handler_t stat_cache_handle_fdevent(server *srv, void *_fce, int revent) {
 	size_t i;
@@ -359,7 +478,6 @@ handler_t stat_cache_get_entry(server *srv, connection *con, buffer *name, stat_
 	stat_cache_entry *sce = NULL;
 	stat_cache *sc;
 	struct stat st;
-	size_t k;
 	int fd;
 	struct stat lst;
 #ifdef DEBUG_STAT_CACHE
@@ -589,30 +707,24 @@ handler_t stat_cache_get_entry(server *srv, connection *con, buffer *name, stat_
 	};
 #endif
 
+	sce->content_type = sc->empty_content_type;
+
 	if (S_ISREG(st.st_mode)) {
 		/* determine mimetype */
-		buffer_reset(sce->content_type);
 #ifdef HAVE_XATTR
 		if (con->conf.use_xattr) {
-			stat_cache_attr_get(sce->content_type, name->ptr);
+			buffer_reset(sce->xattr_content_type);
+			stat_cache_attr_get(sce->xattr_content_type, name->ptr);
+			if (!buffer_is_empty(sce->xattr_content_type)) {
+				sce->content_type = sce->xattr_content_type;
+			}
 		}
 #endif
 		/* xattr did not set a content-type. ask the config */
 		if (buffer_is_empty(sce->content_type)) {
-			for (k = 0; k < con->conf.mimetypes->used; k++) {
-				data_string *ds = (data_string *)con->conf.mimetypes->data[k];
-				buffer *type = ds->key;
-
-				if (type->used == 0) continue;
-
-				/* check if the right side is the same */
-				if (type->used > name->used) continue;
+			buffer *type = stat_cache_mimetype_by_ext(con->conf.mimetype_index, name->ptr, name->used - 1);
 
-				if (0 == strncasecmp(name->ptr + name->used - type->used, type->ptr, type->used - 1)) {
-					buffer_copy_string_buffer(sce->content_type, ds->value);
-					break;
-				}
-			}
+			if (NULL != type) sce->content_type = type;
 		}
 		etag_create(sce->etag, &(sce->st), con->etag_flags);
 	} else if (S_ISDIR(st.st_mode)) {
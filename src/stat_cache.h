@@ -10,4 +10,8 @@ handler_t stat_cache_get_entry(server *srv, connection *con, buffer *name, stat_
 handler_t stat_cache_handle_fdevent(server *srv, void *_fce, int revent);
 
 int stat_cache_trigger_cleanup(server *srv);
+
+mimetype_index *stat_cache_mimetype_index_init(array *mimetypes);
+void stat_cache_mimetype_index_free(mimetype_index *mi);
+buffer *stat_cache_mimetype_by_ext(mimetype_index *mi, const char *name, size_t nlen);
 #endif
@@ -8,7 +8,7 @@ BEGIN {
 
 use strict;
 use IO::Socket;
-use Test::More tests => 19;
+use Test::More tests => 22;
 use LightyTest;
 
 my $tf = LightyTest->new();
@@ -65,6 +65,82 @@ EOF
 $t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 301, 'Location' => "/match_6" } ];
 ok($tf->handle_http($t) == 0, 'url subdir with path traversal');
 
+$t->{REQUEST}  = ( <<EOF
+GET /index.html HTTP/1.1
+Host: index1.example.org
+
+GET /index.html HTTP/1.1
+Host: index2.example.org:2048
+
+GET /index.html HTTP/1.1
+Host: index1.example.org
+Connection: close
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.1', 'HTTP-Status' => 301, 'Location' => "/index_1" }, { 'HTTP-Protocol' => 'HTTP/1.1', 'HTTP-Status' => 301, 'Location' => "/index_2" }, { 'HTTP-Protocol' => 'HTTP/1.1', 'HTTP-Status' => 301, 'Location' => "/index_1" } ];
+ok($tf->handle_http($t) == 0, 'indexed host conditions on keep-alive');
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.html HTTP/1.1
+Host: domain.example.org
+
+GET /index.html HTTP/1.1
+Host: a.b.domain.example.org
+
+GET /index.html HTTP/1.1
+Host: exact.example.org
+
+GET /index.html HTTP/1.1
+Host: x.exact.example.org
+
+GET /index.html HTTP/1.1
+Host: a.suffix.example.org
+
+GET /index.html HTTP/1.1
+Host: suffix.example.org
+Connection: close
+EOF
+ );
+$t->{RESPONSE} = [
+	{ 'HTTP-Protocol' => 'HTTP/1.1', 'HTTP-Status' => 301, 'Location' => "/domain_" },
+	{ 'HTTP-Protocol' => 'HTTP/1.1', 'HTTP-Status' => 301, 'Location' => "/domain_." },
+	{ 'HTTP-Protocol' => 'HTTP/1.1', 'HTTP-Status' => 301, 'Location' => "/exact" },
+	{ 'HTTP-Protocol' => 'HTTP/1.1', 'HTTP-Status' => 301, 'Location' => "/default" },
+	{ 'HTTP-Protocol' => 'HTTP/1.1', 'HTTP-Status' => 301, 'Location' => "/suffix" },
+	{ 'HTTP-Protocol' => 'HTTP/1.1', 'HTTP-Status' => 301, 'Location' => "/default" } ];
+ok($tf->handle_http($t) == 0, 'indexed host regex conditions');
+
+# count the conditions which are checked, the 16 remoteip netmasks only
+# have to be checked once per connection
+sub checked_conditions {
+	my ($requests) = @_;
+	my $log = $ENV{'SRCDIR'}.'/tmp/lighttpd/logs/lighttpd.error.log';
+	my $before = 0;
+	my $after = 0;
+
+	open(my $fh, '<', $log) or return -1;
+	$before++ while (<$fh>);
+	close($fh);
+
+	$t->{REQUEST} = join("\n", ("GET /index.html HTTP/1.1\nHost: index1.example.org\n") x ($requests - 1))
+		. "\nGET /index.html HTTP/1.1\nHost: index1.example.org\nConnection: close\n";
+	$t->{REQUEST} =~ s/^\n//;
+	$t->{RESPONSE} = [ ({ 'HTTP-Protocol' => 'HTTP/1.1', 'HTTP-Status' => 301, 'Location' => "/index_1" }) x $requests ];
+	return -1 if $tf->handle_http($t) != 0;
+
+	open($fh, '<', $log) or return -1;
+	while (<$fh>) {
+		$after++ if ($. > $before && /\(uncached\) result:/);
+	}
+	close($fh);
+
+	return $after;
+}
+
+my $first = checked_conditions(1);
+my $more = checked_conditions(3);
+ok($first > 0 && $more > $first && ($more - $first) / 2 < 16, 'keep-alive requests only re-check the conditions of their components');
+
 ok($tf->stop_proc == 0, "Stopping lighttpd");
 
 $tf->{CONFIGFILE} = 'lighttpd.conf';
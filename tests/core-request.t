@@ -8,7 +8,7 @@ BEGIN {
 
 use strict;
 use IO::Socket;
-use Test::More tests => 36;
+use Test::More tests => 37;
 use LightyTest;
 
 my $tf = LightyTest->new();
@@ -252,6 +252,13 @@ EOF
 $t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'Content-Type' => 'image/jpeg' } ];
 ok($tf->handle_http($t) == 0, 'Content-Type - image/jpeg (upper case)');
 
+$t->{REQUEST}  = ( <<EOF
+GET /archive.tar.gz HTTP/1.0
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'Content-Type' => 'application/x-tgz' } ];
+ok($tf->handle_http($t) == 0, 'Content-Type - longest suffix wins');
+
 $t->{REQUEST}  = ( <<EOF
 GET /a HTTP/1.0
 EOF
@@ -30,6 +30,10 @@ int main (void) {
 				printf("Status: 200 OK\r\n");
 				fflush(stdout);
 				printf("\r\n");
+			} else if (0 == strcmp(p, "sleep")) {
+				/* keep the proc busy */
+				sleep(2);
+				printf("Status: 200 OK\r\n\r\n");
 			} else if (0 == strcmp(p, "die-at-end")) {
 				printf("Status: 200 OK\r\n\r\n");
 				num_requests--;
@@ -8,7 +8,7 @@ BEGIN {
 
 use strict;
 use IO::Socket;
-use Test::More tests => 18;
+use Test::More tests => 19;
 use LightyTest;
 
 my $tf = LightyTest->new();
@@ -138,5 +138,26 @@ EOF
 $t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 302, 'Location' => 'http://www.example.org/' } ];
 ok($tf->handle_http($t) == 0, 'broken header via perl cgi');
 
+# the pipes of the cgi get fds above the ones which are closed by number
+my @idle;
+for (1 .. 300) {
+	my $c = IO::Socket::INET->new(PeerAddr => '127.0.0.1', PeerPort => $tf->{PORT}) or last;
+	push @idle, $c;
+}
+select(undef, undef, undef, .5);
+
+$t->{REQUEST}  = ( <<EOF
+POST /get-post-len.pl HTTP/1.0
+Host: www.example.org
+Content-Length: 5
+
+hello
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'HTTP-Content' => '5' } ];
+ok($tf->handle_http($t) == 0, 'cgi gets EOF on stdin with many fds open');
+
+close $_ for @idle;
+
 ok($tf->stop_proc == 0, "Stopping lighttpd");
 
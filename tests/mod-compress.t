@@ -8,7 +8,7 @@ BEGIN {
 
 use strict;
 use IO::Socket;
-use Test::More tests => 11;
+use Test::More tests => 33;
 use LightyTest;
 
 my $tf = LightyTest->new();
@@ -90,6 +90,50 @@ EOF
 $t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', 'Content-Type' => "text/plain; charset=utf-8" } ];
 ok($tf->handle_http($t) == 0, 'Empty Accept-Encoding');
 
+$t->{REQUEST}  = ( <<EOF
+GET /index.txt HTTP/1.0
+Accept-Encoding: gzip;q=0.5, deflate
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', 'Content-Encoding' => 'deflate' } ];
+ok($tf->handle_http($t) == 0, 'q-value - the higher q-value wins');
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.txt HTTP/1.0
+Accept-Encoding: deflate, gzip
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', 'Content-Encoding' => 'gzip' } ];
+ok($tf->handle_http($t) == 0, 'q-value - the order of the server breaks ties');
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.txt HTTP/1.0
+Accept-Encoding: gzip;q=0.2, identity;q=0.5
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', '-Content-Encoding' => '' } ];
+ok($tf->handle_http($t) == 0, 'q-value - identity is preferred');
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.txt HTTP/1.0
+Accept-Encoding: deflate;q=0, identity;q=0, *
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', 'Content-Encoding' => 'gzip' } ];
+ok($tf->handle_http($t) == 0, 'q-value - * matches the encodings which are not listed');
+
+# br if it is compiled in, the next one in the list otherwise
+my $br = (`$tf->{LIGHTTPD_PATH} -V` =~ /\+ brotli support/) ? 'br' : 'gzip';
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.txt HTTP/1.0
+Accept-Encoding: gzip, br
+Host: brotli.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', 'Content-Encoding' => $br } ];
+ok($tf->handle_http($t) == 0, 'brotli - preferred by the server');
+
 $t->{REQUEST}  = ( <<EOF
 GET /index.txt HTTP/1.0
 Accept-Encoding: bzip2, gzip, deflate
@@ -99,5 +143,143 @@ EOF
 $t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', 'Content-Encoding' => 'gzip', 'Content-Type' => "text/plain; charset=utf-8" } ];
 ok($tf->handle_http($t) == 0, 'bzip2 requested but disabled');
 
+$t->{REQUEST}  = ( <<EOF
+GET /cgi.pl HTTP/1.0
+Accept-Encoding: gzip, deflate
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '-Content-Encoding' => '', 'HTTP-Content' => '/cgi.pl' } ];
+ok($tf->handle_http($t) == 0, 'dynamic responses are not compressed by default');
+
+$t->{REQUEST}  = ( <<EOF
+GET /cgi.pl HTTP/1.0
+Accept-Encoding: gzip, deflate
+Host: dynamic.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', 'Content-Encoding' => 'gzip' } ];
+ok($tf->handle_http($t) == 0, 'cgi - compressed while it is sent');
+
+$t->{REQUEST}  = ( <<EOF
+GET /cgi.pl HTTP/1.0
+Host: dynamic.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', '-Content-Encoding' => '', 'HTTP-Content' => '/cgi.pl' } ];
+ok($tf->handle_http($t) == 0, 'cgi - no Accept-Encoding');
+
+$t->{REQUEST}  = ( <<EOF
+GET /ssi.shtml HTTP/1.0
+Accept-Encoding: deflate
+Host: dynamic.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', '-Content-Encoding' => '', 'HTTP-Content' => "/ssi.shtml\n" } ];
+ok($tf->handle_http($t) == 0, 'ssi - smaller than compress.dynamic-min-size');
+
+$t->{REQUEST}  = ( <<EOF
+GET /ssi.shtml HTTP/1.0
+Accept-Encoding: deflate
+Host: small.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', 'Content-Encoding' => 'deflate', '+Content-Length' => '' } ];
+ok($tf->handle_http($t) == 0, 'ssi - complete body compressed, Content-Length set');
+
+my $pages = $ENV{'SRCDIR'}.'/tmp/lighttpd/servers/www.example.org/pages';
+open(my $fh, '>', "$pages/index.txt.br") or die;
+print $fh "precompressed\n";
+close($fh);
+open($fh, '>', "$pages/index.html.gz") or die;
+print $fh "outdated\n";
+close($fh);
+utime(1, 1, "$pages/index.html.gz");
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.txt HTTP/1.0
+Accept-Encoding: gzip, br
+Host: precompressed.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', 'Content-Encoding' => 'br', 'Content-Type' => "text/plain; charset=utf-8", 'HTTP-Content' => "precompressed\n" } ];
+ok($tf->handle_http($t) == 0, 'precompressed - sidecar is sent');
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.txt HTTP/1.0
+Host: precompressed.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', '-Content-Encoding' => '' } ];
+ok($tf->handle_http($t) == 0, 'precompressed - not accepted by the client');
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.txt HTTP/1.0
+Accept-Encoding: gzip
+Host: precompressed.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', 'Content-Encoding' => 'gzip' } ];
+ok($tf->handle_http($t) == 0, 'precompressed - no sidecar for the encoding, compressed on demand');
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.html HTTP/1.0
+Accept-Encoding: gzip
+Host: precompressed.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', 'Content-Encoding' => 'gzip', 'Content-Length' => '1306' } ];
+ok($tf->handle_http($t) == 0, 'precompressed - older sidecar is ignored');
+
+
+my $lru = $ENV{'SRCDIR'}.'/tmp/lighttpd/cache/lru';
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.html HTTP/1.0
+Accept-Encoding: gzip
+Host: lru.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', 'Content-Encoding' => 'gzip' } ];
+ok($tf->handle_http($t) == 0, 'cache-max-entries - the first file is cached');
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.txt HTTP/1.0
+Accept-Encoding: gzip
+Host: lru.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', 'Content-Encoding' => 'gzip' } ];
+ok($tf->handle_http($t) == 0, 'cache-max-entries - the second file is cached');
+
+ok(!glob("$lru/index.html-gzip-*") && glob("$lru/index.txt-gzip-*"), 'cache-max-entries - the least recently used file is removed');
+
+ok($tf->stop_proc == 0, "Stopping lighttpd");
+
+my $manifest = '';
+if (open(my $fh, '<', "$lru/.manifest")) {
+	local $/;
+	$manifest = <$fh>;
+	close($fh);
+}
+ok($manifest =~ m#^\d+ \d+ \d+ /?index\.txt-gzip-\S+\n\z#, 'cache-max-entries - the index is saved in the manifest');
+
+$tf->{CONFIGFILE} = 'compress-background.conf';
+
+ok($tf->start_proc == 0, "Starting lighttpd with compress.cache-workers") or die();
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.txt HTTP/1.0
+Accept-Encoding: deflate
+Host: cache.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', '-Content-Encoding' => '' } ];
+ok($tf->handle_http($t) == 0, 'cache-workers - a cache miss is sent uncompressed');
+
+# the job writes the cache file meanwhile
+select(undef, undef, undef, 1);
+
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Vary' => '', 'Content-Encoding' => 'deflate' } ];
+ok($tf->handle_http($t) == 0, 'cache-workers - the cache file is sent when it is there');
 
 ok($tf->stop_proc == 0, "Stopping lighttpd");
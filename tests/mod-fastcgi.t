@@ -7,7 +7,9 @@ BEGIN {
 }
 
 use strict;
-use Test::More tests => 58;
+use IO::Socket;
+use Time::HiRes qw(time);
+use Test::More tests => 72;
 use LightyTest;
 
 my $tf = LightyTest->new();
@@ -15,6 +17,19 @@ my $tf = LightyTest->new();
 my $t;
 my $php_child = -1;
 
+# a counter of mod_status' statistics page, -1 if it is missing
+sub statistic {
+	my ($tf, $key) = @_;
+	my $remote = IO::Socket::INET->new(PeerAddr => '127.0.0.1', PeerPort => $tf->{PORT})
+		or return -1;
+
+	print $remote "GET /server-statistics HTTP/1.0\r\nHost: www.example.org\r\n\r\n";
+	my $stats = join('', <$remote>);
+	close $remote;
+
+	return ($stats =~ /^\Q$key\E: (\d+)$/m) ? $1 : -1;
+}
+
 my $phpbin = (defined $ENV{'PHP'} ? $ENV{'PHP'} : '/usr/bin/php-cgi');
 $ENV{'PHP'} = $phpbin;
 
@@ -330,7 +345,7 @@ EOF
 
 
 SKIP: {
-	skip "no fcgi-responder found", 11 unless -x $tf->{BASEDIR}."/tests/fcgi-responder" || -x $tf->{BASEDIR}."/tests/fcgi-responder.exe";
+	skip "no fcgi-responder found", 25 unless -x $tf->{BASEDIR}."/tests/fcgi-responder" || -x $tf->{BASEDIR}."/tests/fcgi-responder.exe";
 	
 	$tf->{CONFIGFILE} = 'fastcgi-responder.conf';
 	ok($tf->start_proc == 0, "Starting lighttpd with $tf->{CONFIGFILE}") or die();
@@ -382,6 +397,103 @@ EOF
 	$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'HTTP-Content' => '' } ];
 	ok($tf->handle_http($t) == 0, 'SCRIPT_NAME (wsgi)');
 
+	$t->{REQUEST}  = ( <<EOF
+GET /index.fcgi HTTP/1.0
+Host: keepalive.example.org
+EOF
+ );
+	$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'HTTP-Content' => 'test123' } ];
+	ok($tf->handle_http($t) == 0, 'keep-alive backend connection');
+
+	$t->{REQUEST}  = ( <<EOF
+GET /index.fcgi HTTP/1.0
+Host: keepalive.example.org
+EOF
+ );
+	$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'HTTP-Content' => 'test123' } ];
+	ok($tf->handle_http($t) == 0, 'keep-alive backend connection reused');
+	ok(statistic($tf, 'fastcgi.backend.keepalive.0.connected') == 2 &&
+	   statistic($tf, 'fastcgi.backend.keepalive.0.idle') == 1, 'both requests used one kept-alive connection');
+
+	$t->{REQUEST}  = ( <<EOF
+GET /index.fcgi HTTP/1.0
+Host: multiplex.example.org
+EOF
+ );
+	$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'HTTP-Content' => 'test123' } ];
+	ok($tf->handle_http($t) == 0, 'multiplexed backend connection');
+
+	$t->{REQUEST}  = ( <<EOF
+GET /index.fcgi HTTP/1.0
+Host: multiplex.example.org
+EOF
+ );
+	$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'HTTP-Content' => 'test123' } ];
+	ok($tf->handle_http($t) == 0, 'multiplexed backend connection reused');
+	ok(statistic($tf, 'fastcgi.backend.multiplex.0.connected') == 2 &&
+	   statistic($tf, 'fastcgi.backend.multiplex.0.shared') == 1, 'both requests used one shared connection');
+
+	# the env doesn't fit into one FCGI_PARAMS record
+	my $headers = join('', map { sprintf("X-Header-%04d: 0123456789\n", $_) } (1 .. 2500));
+	$t->{REQUEST}  = ( <<EOF
+GET /index.fcgi HTTP/1.0
+Host: multiplex.example.org
+$headers
+EOF
+ );
+	$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 400 } ];
+	ok($tf->handle_http($t) == 0, 'env too large for the multiplexed backend');
+
+	$t->{REQUEST}  = ( <<EOF
+GET /index.fcgi HTTP/1.0
+Host: multiplex.example.org
+EOF
+ );
+	$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'HTTP-Content' => 'test123' } ];
+	ok($tf->handle_http($t) == 0, 'multiplexed backend connection after an env error');
+	ok(statistic($tf, 'fastcgi.backend.multiplex.0.shared') == 1, 'the env error released its request-id');
+
+	$t->{REQUEST}  = ( <<EOF
+GET /index.fcgi HTTP/1.0
+Host: autoscale.example.org
+EOF
+ );
+	$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'HTTP-Content' => 'test123' } ];
+	ok($tf->handle_http($t) == 0, 'min-procs backend');
+
+	# two requests at once are more than max-load-per-proc of one proc
+	my @busy;
+	for (1 .. 2) {
+		my $remote = IO::Socket::INET->new(PeerAddr => '127.0.0.1', PeerPort => $tf->{PORT});
+		print $remote "GET /index.fcgi?sleep HTTP/1.0\r\nHost: autoscale.example.org\r\n\r\n" if $remote;
+		push @busy, $remote;
+	}
+	select(undef, undef, undef, 2.5);
+	ok(statistic($tf, 'fastcgi.backend.autoscale.procs') == 2, 'second proc spawned under load');
+	ok(2 == grep({ defined $_ && join('', <$_>) =~ /^HTTP\/1\.0 200 .*test123$/s } @busy), 'requests under load answered');
+
+	# neither proc has a latency yet, the busy one still costs more
+	my $slow = IO::Socket::INET->new(PeerAddr => '127.0.0.1', PeerPort => $tf->{PORT});
+	print $slow "GET /index.fcgi?sleep HTTP/1.0\r\nHost: ewma.example.org\r\n\r\n" if $slow;
+	select(undef, undef, undef, .2);
+	my $start = time();
+	$t->{REQUEST}  = ( <<EOF
+GET /index.fcgi HTTP/1.0
+Host: ewma.example.org
+EOF
+ );
+	$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'HTTP-Content' => 'test123' } ];
+	ok($tf->handle_http($t) == 0 && time() - $start < 1.5, 'peak-ewma passes the busy proc');
+	close $slow if $slow;
+
+	$t->{REQUEST}  = ( <<EOF
+GET /index.fcgi HTTP/1.0
+Host: hash.example.org
+EOF
+ );
+	$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'HTTP-Content' => 'test123' } ];
+	ok($tf->handle_http($t) == 0, 'hash balancing');
+
 
 	$t->{REQUEST}  = ( <<EOF
 GET /index.fcgi?die-at-end HTTP/1.0
@@ -8,7 +8,7 @@ BEGIN {
 
 use strict;
 use IO::Socket;
-use Test::More tests => 9;
+use Test::More tests => 28;
 use LightyTest;
 
 my $tf_real = LightyTest->new();
@@ -16,6 +16,9 @@ my $tf_proxy = LightyTest->new();
 
 my $t;
 my $php_child = -1;
+my $sendfile_child = -1;
+my $slow_child = -1;
+my $stale_child = -1;
 
 my $phpbin = (defined $ENV{'PHP'} ? $ENV{'PHP'} : '/usr/bin/php-cgi');
 $ENV{'PHP'} = $phpbin;
@@ -38,6 +41,63 @@ $tf_proxy->{CONFIGFILE} = 'proxy.conf';
 
 ok($tf_real->start_proc == 0, "Starting lighttpd") or goto cleanup;
 
+## 3. a backend which answers every request with X-Sendfile,
+##    lighttpd itself never sends the header to its clients
+my $sendfile_server = IO::Socket::INET->new(LocalAddr => '127.0.0.1', LocalPort => 2052, Listen => 5, ReuseAddr => 1)
+	or goto cleanup;
+
+if (0 == ($sendfile_child = fork())) {
+	while (my $c = $sendfile_server->accept()) {
+		while (<$c>) { last if /^\r?\n$/; }
+		print $c "HTTP/1.0 200 OK\r\nX-Sendfile: $ENV{'SRCDIR'}/tmp/lighttpd/servers/www.example.org/pages/range.pdf\r\nContent-Length: 0\r\n\r\n";
+		close $c;
+	}
+	exit 0;
+}
+close $sendfile_server;
+
+## 4. a backend which takes 4 seconds for every request
+my $slow_server = IO::Socket::INET->new(LocalAddr => '127.0.0.1', LocalPort => 2053, Listen => 5, ReuseAddr => 1)
+	or goto cleanup;
+
+if (0 == ($slow_child = fork())) {
+	$SIG{CHLD} = 'IGNORE';
+	while (my $c = $slow_server->accept()) {
+		if (0 == fork()) {
+			while (<$c>) { last if /^\r?\n$/; }
+			sleep(4);
+			print $c "HTTP/1.0 200 OK\r\nContent-Length: 4\r\n\r\nslow";
+			close $c;
+			exit 0;
+		}
+		close $c;
+	}
+	exit 0;
+}
+close $slow_server;
+
+## 5. a keep-alive backend which answers one request per connection,
+##    the next one is read and the connection closed without a response
+my $stale_server = IO::Socket::INET->new(LocalAddr => '127.0.0.1', LocalPort => 2054, Listen => 5, ReuseAddr => 1)
+	or goto cleanup;
+
+if (0 == ($stale_child = fork())) {
+	while (my $c = $stale_server->accept()) {
+		for my $answer (1, 0) {
+			my $len = 0;
+			while (<$c>) {
+				$len = $1 if /^Content-Length: (\d+)/i;
+				last if /^\r?\n$/;
+			}
+			read($c, my $body, $len) if $len;
+			print $c "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nfresh" if $answer;
+		}
+		close $c;
+	}
+	exit 0;
+}
+close $stale_server;
+
 ok($tf_proxy->start_proc == 0, "Starting lighttpd as proxy") or goto cleanup;
 
 $t->{REQUEST}  = ( <<EOF
@@ -56,6 +116,169 @@ EOF
 $t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'Server' => 'Apache 1.3.29' } ];
 ok($tf_proxy->handle_http($t) == 0, 'drop Server from real server');
 
+$t->{REQUEST}  = ( <<EOF
+GET /index.html HTTP/1.0
+Host: keepalive.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'Content-Length' => 4348 } ];
+ok($tf_proxy->handle_http($t) == 0, 'keep-alive to the backend, Content-Length response');
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.html HTTP/1.0
+Host: keepalive.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'Content-Length' => 4348 } ];
+ok($tf_proxy->handle_http($t) == 0, 'keep-alive to the backend, reused connection');
+
+$t->{REQUEST}  = ( <<EOF
+GET /cgi.pl HTTP/1.0
+Host: keepalive.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'HTTP-Content' => '/cgi.pl' } ];
+ok($tf_proxy->handle_http($t) == 0, 'keep-alive to the backend, chunked response');
+
+# nothing listens on 2049, the keys of that host have to move to 2048
+$t->{REQUEST}  = ( <<EOF
+GET /index.html HTTP/1.0
+Host: hash.example.org
+Cookie: foo=bar; sid=1
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200 } ];
+ok($tf_proxy->handle_http($t) == 0, 'hash balancing on a cookie');
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.html HTTP/1.0
+Host: hash.example.org
+Cookie: sid=2
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200 } ];
+ok($tf_proxy->handle_http($t) == 0, 'hash balancing skips a host which is down');
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.html HTTP/1.0
+Host: ewma.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200 } ];
+ok($tf_proxy->handle_http($t) == 0, 'peak-ewma balancing');
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.html HTTP/1.0
+Host: collapse.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'Content-Length' => 4348 } ];
+ok($tf_proxy->handle_http($t) == 0, 'collapsed request without followers');
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.html HTTP/1.0
+Host: spool.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'Content-Length' => 4348 } ];
+ok($tf_proxy->handle_http($t) == 0, 'small response buffer, the rest is spooled');
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.html HTTP/1.0
+Host: splice.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'Content-Length' => 4348 } ];
+ok($tf_proxy->handle_http($t) == 0, 'body spliced from the backend');
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.html HTTP/1.0
+Host: xsendfile.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'Content-Length' => 6, '-X-Sendfile' => '' } ];
+ok($tf_proxy->handle_http($t) == 0, 'X-Sendfile from the backend');
+
+$t->{REQUEST}  = ( <<EOF
+GET /index.html HTTP/1.0
+Host: xsendfile.example.org
+Range: bytes=0-2
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 206, 'HTTP-Content' => '123', 'Content-Range' => 'bytes 0-2/6' } ];
+ok($tf_proxy->handle_http($t) == 0, 'X-Sendfile with a range');
+
+$t->{REQUEST}  = ( <<EOF
+GET /expire/access.txt HTTP/1.0
+Host: cache.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '-Age' => '' } ];
+ok($tf_proxy->handle_http($t) == 0, 'cache miss, stored');
+
+$t->{REQUEST}  = ( <<EOF
+GET /expire/access.txt HTTP/1.0
+Host: cache.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '+Age' => '', 'Cache-Control' => 'max-age=7200' } ];
+ok($tf_proxy->handle_http($t) == 0, 'cache hit');
+
+$t->{REQUEST}  = ( <<EOF
+GET /expire/access.txt HTTP/1.0
+Host: cache.example.org
+Cache-Control: no-cache
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, '-Age' => '' } ];
+ok($tf_proxy->handle_http($t) == 0, 'cache bypassed on no-cache');
+
+# the leader keeps the only connection to the backend longer than
+# proxy.collapse-timeout, the follower can't send its own request
+my $leader = IO::Socket::INET->new(PeerAddr => 'localhost', PeerPort => $tf_proxy->{PORT}, Proto => 'tcp')
+	or goto cleanup;
+print $leader "GET /slow HTTP/1.0\r\nHost: collapse-busy.example.org\r\n\r\n";
+select(undef, undef, undef, 0.5);
+
+$t->{REQUEST}  = ( <<EOF
+GET /slow HTTP/1.0
+Host: collapse-busy.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 503, '+Content-Length' => '' } ];
+ok($tf_proxy->handle_http($t) == 0, 'collapsed follower gets an error page when the backend is busy');
+
+my $leader_response = join('', <$leader>);
+close $leader;
+ok($leader_response =~ /^HTTP\/1\.0 200 .*\r\n\r\nslow$/s, 'collapsed leader gets the response of the backend');
+
+$t->{REQUEST}  = ( <<EOF
+GET /stale HTTP/1.0
+Host: stale.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'HTTP-Content' => 'fresh' } ];
+ok($tf_proxy->handle_http($t) == 0, 'keep-alive to the backend, first request');
+
+$t->{REQUEST}  = ( <<EOF
+GET /stale HTTP/1.0
+Host: stale.example.org
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'HTTP-Content' => 'fresh' } ];
+ok($tf_proxy->handle_http($t) == 0, 'reused connection closed before the response, retried');
+
+$t->{REQUEST}  = ( <<EOF
+POST /stale HTTP/1.0
+Host: stale.example.org
+Content-Length: 4
+
+post
+EOF
+ );
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 502 } ];
+ok($tf_proxy->handle_http($t) == 0, 'reused connection closed before the response, request body not sent twice');
+
 SKIP: {
 	skip "no PHP running on port 1026", 1 unless $tf_real->listening_on(1026);
 	$t->{REQUEST}  = ( <<EOF
@@ -71,6 +294,13 @@ ok($tf_proxy->stop_proc == 0, "Stopping lighttpd proxy");
 
 ok($tf_real->stop_proc == 0, "Stopping lighttpd");
 
+kill('TERM', $sendfile_child);
+waitpid($sendfile_child, 0);
+kill('TERM', $slow_child);
+waitpid($slow_child, 0);
+kill('TERM', $stale_child);
+waitpid($stale_child, 0);
+
 SKIP: {
 	skip "PHP not started, cannot stop it", 1 unless $php_child != -1;
 	ok(0 == $tf_real->endspawnfcgi($php_child), "Stopping php");
@@ -82,6 +312,9 @@ exit 0;
 cleanup:
 
 $tf_real->endspawnfcgi($php_child) if $php_child != -1;
+kill('TERM', $sendfile_child) if $sendfile_child > 0;
+kill('TERM', $slow_child) if $slow_child > 0;
+kill('TERM', $stale_child) if $stale_child > 0;
 $tf_real->stop_proc;
 $tf_proxy->stop_proc;
 
@@ -8,7 +8,7 @@ BEGIN {
 
 use strict;
 use IO::Socket;
-use Test::More tests => 7;
+use Test::More tests => 8;
 use LightyTest;
 
 my $tf = LightyTest->new();
@@ -56,4 +56,34 @@ EOF
 $t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 301, 'Location' => 'http://localhost:'.$tf->{PORT}.'/remoteip2' } ];
 ok($tf->handle_http($t) == 0, 'external redirect with cond regsub on remoteip2');
 
+$t->{REQUEST} = ( <<EOF
+GET /redirect/aaa HTTP/1.1
+Host: redirect-list.example.org
+
+GET /redirect/abc HTTP/1.1
+Host: redirect-list.example.org
+
+GET /redirect/abd HTTP/1.1
+Host: redirect-list.example.org
+
+GET /other HTTP/1.1
+Host: redirect-list.example.org
+
+GET /some/unanchored HTTP/1.1
+Host: redirect-list.example.org
+
+GET /redirect/zzz HTTP/1.1
+Host: redirect-list.example.org
+Connection: close
+EOF
+ );
+$t->{RESPONSE} = [
+	{ 'HTTP-Protocol' => 'HTTP/1.1', 'HTTP-Status' => 301, 'Location' => 'http://localhost:'.$tf->{PORT}.'/plus' },
+	{ 'HTTP-Protocol' => 'HTTP/1.1', 'HTTP-Status' => 301, 'Location' => 'http://localhost:'.$tf->{PORT}.'/alternative' },
+	{ 'HTTP-Protocol' => 'HTTP/1.1', 'HTTP-Status' => 301, 'Location' => 'http://localhost:'.$tf->{PORT}.'/ab' },
+	{ 'HTTP-Protocol' => 'HTTP/1.1', 'HTTP-Status' => 301, 'Location' => 'http://localhost:'.$tf->{PORT}.'/alternative' },
+	{ 'HTTP-Protocol' => 'HTTP/1.1', 'HTTP-Status' => 301, 'Location' => 'http://localhost:'.$tf->{PORT}.'/unanchored' },
+	{ 'HTTP-Protocol' => 'HTTP/1.1', 'HTTP-Status' => 301, 'Location' => 'http://localhost:'.$tf->{PORT}.'/fallback' } ];
+ok($tf->handle_http($t) == 0, 'external redirect takes the first matching rule of a list');
+
 ok($tf->stop_proc == 0, "Stopping lighttpd");
@@ -0,0 +1,102 @@
+#!/usr/bin/env perl
+BEGIN {
+	# add current source dir to the include-path
+	# we need this for make distcheck
+	(my $srcdir = $0) =~ s,/[^/]+$,/,;
+	unshift @INC, $srcdir;
+}
+
+use strict;
+use IO::Socket;
+use Test::More tests => 6;
+use LightyTest;
+
+my $tf = LightyTest->new();
+my $t;
+my $uwsgi_child = -1;
+
+## a uwsgi backend: it checks the framing of the packet and answers with
+## modifier1, the var named by the query-string and the request body
+my $uwsgi_server = IO::Socket::INET->new(LocalAddr => '127.0.0.1', LocalPort => 2060, Listen => 5, ReuseAddr => 1)
+	or die("can't listen on port 2060");
+
+if (0 == ($uwsgi_child = fork())) {
+	while (my $c = $uwsgi_server->accept()) {
+		my (%vars, $header, $packet, $body);
+		my $pos = 0;
+
+		read($c, $header, 4) == 4 or next;
+		my ($modifier1, $size, $modifier2) = unpack('C v C', $header);
+		read($c, $packet, $size) == $size or next;
+
+		while ($pos + 4 <= $size) {
+			my $key_len = unpack('v', substr($packet, $pos, 2));
+			my $key = substr($packet, $pos + 2, $key_len);
+			my $val_len = unpack('v', substr($packet, $pos + 2 + $key_len, 2));
+
+			$vars{$key} = substr($packet, $pos + 4 + $key_len, $val_len);
+			$pos += 4 + $key_len + $val_len;
+		}
+
+		read($c, $body, $vars{'CONTENT_LENGTH'}) if $vars{'CONTENT_LENGTH'};
+
+		my $val = $vars{$vars{'QUERY_STRING'}};
+		my $content = ($pos == $size && $modifier2 == 0) ? $modifier1 : 'bad framing';
+		$content .= ':'.(defined $val ? $val : '').':'.(defined $body ? $body : '');
+
+		print $c "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n".$content;
+		close $c;
+	}
+	exit 0;
+}
+close $uwsgi_server;
+
+$tf->{CONFIGFILE} = 'scgi.conf';
+
+ok($tf->start_proc == 0, "Starting lighttpd") or goto cleanup;
+
+$t->{REQUEST} = ( <<EOF
+GET /uwsgi?HTTP_X_TEST HTTP/1.0
+Host: www.example.org
+X-Test: foo
+EOF
+);
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'HTTP-Content' => '5:foo:' } ];
+ok($tf->handle_http($t) == 0, 'uwsgi vars and modifier1');
+
+$t->{REQUEST} = ( <<EOF
+POST /uwsgi?CONTENT_LENGTH HTTP/1.0
+Host: www.example.org
+Content-Length: 5
+
+hello
+EOF
+);
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'HTTP-Content' => '5:5:hello' } ];
+ok($tf->handle_http($t) == 0, 'uwsgi request body after the vars');
+
+$t->{REQUEST} = ( <<EOF
+GET /uwsgi/big?BIG HTTP/1.0
+Host: www.example.org
+EOF
+);
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 400 } ];
+ok($tf->handle_http($t) == 0, 'uwsgi refuses a value over 65535 bytes');
+
+$t->{REQUEST} = ( <<EOF
+GET /uwsgi?HTTP_X_TEST HTTP/1.0
+Host: www.example.org
+X-Test: bar
+EOF
+);
+$t->{RESPONSE} = [ { 'HTTP-Protocol' => 'HTTP/1.0', 'HTTP-Status' => 200, 'HTTP-Content' => '5:bar:' } ];
+ok($tf->handle_http($t) == 0, 'the backend stays enabled after a refused request');
+
+ok($tf->stop_proc == 0, "Stopping lighttpd");
+
+cleanup: ;
+
+if ($uwsgi_child != -1) {
+	kill('TERM', $uwsgi_child);
+	waitpid($uwsgi_child, 0);
+}
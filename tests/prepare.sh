@@ -45,6 +45,7 @@ cp $srcdir/lighttpd.htpasswd $tmpdir/
 cp $srcdir/var-include-sub.conf $tmpdir/../
 touch $tmpdir/servers/www.example.org/pages/image.jpg \
       $tmpdir/servers/www.example.org/pages/image.JPG \
+      $tmpdir/servers/www.example.org/pages/archive.tar.gz \
       $tmpdir/servers/www.example.org/pages/Foo.txt \
       $tmpdir/servers/www.example.org/pages/a \
       $tmpdir/servers/www.example.org/pages/index.html~ \